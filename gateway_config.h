@@ -8,15 +8,158 @@
 #define GW_WIFI_PASSWORD   "AymanSH@2025_**"
 
 // ── MQTT ──────────────────────────────────────
-#define GW_MQTT_BROKER     "broker.hivemq.com"
-#define GW_MQTT_PORT       1883
-#define GW_GATEWAY_ID      "gateway_01"
+// Comma separated; e.g. "mqtt://127.0.0.1:1883,mqtt://127.0.0.1:1884"
+#define GW_MQTT_BROKERS    "mqtt://broker.hivemq.com:1883"
+#define GW_MQTT_MAX_BROKERS    4
+#define GW_MQTT_URL_MAX        96
+#define GW_GATEWAY_ID      "gateway_01"  // also the MQTT client id: the broker keys our session on it
+#define GW_MQTT_CLEAN_SESSION  0        // 0 = broker keeps subs + QoS1 backlog
+#define GW_MQTT_KEEPALIVE      60
+#define GW_MQTT_PING_MS        5000UL   // PINGREQ per broker, RTT sampling
+#define GW_MQTT_PING_LOST_MAX  3        // unanswered pings before a broker is down
+#define GW_MQTT_MIGRATE_MARGIN_US 20000UL // switch only if this much faster...
+#define GW_MQTT_MIGRATE_ROUNDS 6        // ...for this many ping rounds in a row
 
 // ── MQTT Topics ───────────────────────────────
 #define GW_T_GATEWAY_CONNECT    "jrpc/gateway/connect"
 #define GW_T_GATEWAY_RX    "jrpc/gateway/rx"
+#define GW_RX_DEVICE_TOPICS    1        // also accept binary frames on GW_T_GATEWAY_RX/<id>
+
+// ── Cluster (several gateways, one broker) ────
+// Every gateway with the same group and key shares the device registry and
+// each device is owned by exactly one member; see gateway_cluster.h.
+#define GW_CLUSTER_ENABLE      0
+#define GW_CLUSTER_GROUP       "gw"
+#define GW_CLUSTER_KEY         "change-me-cluster-key"  // seals registry records on the broker
+#define GW_CLUSTER_SHARED_SUB  0        // 1 = $share/<group>/ rx subscription, 0 = per-device topics
+#define GW_CLUSTER_MAX_MEMBERS 16
+#define GW_CLUSTER_NONCE_SKIP  1024     // txNonce jump when adopting a device
+#define GW_CLUSTER_SETTLE_MS   1000UL   // collect retained members before rebalancing
+#define GW_CLUSTER_CHECKPOINT_MS 30000UL // republish records of active owned devices
+#define GW_T_CLUSTER           "jrpc/cluster/" GW_CLUSTER_GROUP
+
+// ── Shards (several poll loops in one process) ─
+// Each shard is a GatewayCore on its own thread with its own broker
+// connection, serving the devices whose id hashes to it.
+#define GW_SHARD_MAX           16
+#define GW_SHARD_MAILBOX       64       // admin calls queued for a shard's loop
+
+// ── Device records ────────────────────────────
+// Each core keeps its devices in slabs allocated once in begin(): ids and
+// per-frame state in internal RAM, names and stored connect requests in
+// PSRAM when the board has it.  A new device beyond GW_DEVICE_MAX, or a
+// connect request while GW_DEVICE_PENDING are already waiting for the
+// operator, is refused until a slot frees up.
+#ifndef GW_DEVICE_MAX
+#if defined(ARDUINO)
+#define GW_DEVICE_MAX          256      // records per core
+#else
+#define GW_DEVICE_MAX          16384    // host build: simulated fleets
+#endif
+#endif
+#ifndef GW_DEVICE_PENDING
+#if defined(ARDUINO)
+#define GW_DEVICE_PENDING      16       // connect requests awaiting authorization
+#else
+#define GW_DEVICE_PENDING      1024
+#endif
+#endif
+#define GW_DEVICE_PENDING_SIZE 384      // nonce + ciphertext of one connect request
+#define GW_DEVICE_ID_MAX       47       // longer ids are refused
+#define GW_DEVICE_NAME_MAX     31       // longer names are cut
+#define GW_DEVICE_TYPE_MAX     23
+#define GW_DEVICE_PSRAM        1        // 0 = internal RAM even when there is PSRAM
+
+// ── RPC ───────────────────────────────────────
+#define GW_RPC_MAX_METHODS     32       // capacity of the method table
+#define GW_RPC_MAX_SLOTS       256      // upper bound for the hash slot table
+#define GW_DEFAULT_PERMS       (PERM_PING)  // granted on dashboard authorize
+#define GW_RPC_OUT_SIZE        1024     // preallocated response buffer
+#define GW_RPC_BATCH_MAX       16       // max requests in one batch frame
+#define GW_RPC_DEFER_MAX       8        // deferred responses in flight
+#define GW_RPC_DEFER_TIMEOUT_MS 10000UL // deferred call fails after this
+#define GW_RPC_ID_MAX          40       // longest JSON-RPC id kept for deferral
+#define GW_RPC_MAILBOX         8        // cross-task results awaiting the loop
+#define GW_RPC_MAIL_SIZE       256      // max result JSON posted from a task
+
+// ── Ping (gateway -> device round trip) ──────
+#define GW_PING_TIMEOUT_MS     5000UL   // unanswered ping counts as lost
+#define GW_PING_INTERVAL_MS    0UL      // ping every reachable device this often, 0 = on demand
+
+// ── Outbound queue ────────────────────────────
+#define GW_OUTQ_MAX_MSGS       32       // per priority lane
+#define GW_OUTQ_MAX_BYTES      32768UL  // all queued + inflight messages
+#define GW_OUTQ_INFLIGHT       8        // QoS1 publishes awaiting PUBACK
+#define GW_OUTQ_SEND_HIGHWATER 8192     // pause while c->send is above this
+#define GW_OUTQ_RETRY_MS       5000UL   // retransmit unacked publish after
+#define GW_OUTQ_TICK_MS        100UL
+#define GW_OUTQ_SPARE          GW_OUTQ_INFLIGHT  // sent entries kept for reuse, not freed
+
+// ── Message scratch memory ────────────────────
+// Strings, ciphertext and plaintext of one device frame and the encrypted
+// reply, reset after each message (gateway_arena.h).  Larger messages spill
+// to the heap.
+#define GW_MSG_ARENA_SIZE      (4 * MG_IO_SIZE)
+
+// ── Outbound keystream ────────────────────────
+// Keystream and Poly1305 keys for the next downlinks of recently served
+// devices, computed while the loop is idle (gateway_keystream.h).
+#ifndef GW_KEYSTREAM_DEVICES
+#if defined(ARDUINO)
+#define GW_KEYSTREAM_DEVICES   8        // 0 = always encrypt on demand
+#else
+#define GW_KEYSTREAM_DEVICES   64
+#endif
+#endif
+#define GW_KEYSTREAM_DEPTH     2        // counters ahead per device
+#define GW_KEYSTREAM_BYTES     128      // per counter; longer replies make the rest on demand
+#define GW_KEYSTREAM_TTL_MS    120000   // recomputed when older, slot freed when unused as long
+#define GW_KEYSTREAM_REFILL    4        // entries per idle poll pass
+
+// ── Device sessions ───────────────────────────
+// Session keys come from an X25519 exchange authenticated by the PSK;
+// tickets let a device resume without one (gateway_session.h).
+#define GW_SESSION_TICKET_TTL_S 604800UL // older tickets need a full handshake
+#define GW_SESSION_TICKET_SKEW_S 300UL  // tickets issued further ahead of our clock are refused
+#define GW_SESSION_KEY_FILE    "/ticket_key"  // ticket key outside a cluster, made on first boot
+#define GW_TX_NONCE_RESERVE    256      // gateway counters reserved on flash per device write
+
+// ── Store-and-forward (offline devices) ──────
+#define GW_DEVICE_OFFLINE_MS   120000UL // no authenticated frame for this long
+#define GW_DLQ_DIR             "/dlq"   // spill-over segment files
+#define GW_DLQ_RAM_MSGS        4        // per-device RAM ring before spilling
+#define GW_DLQ_MAX_BYTES       8192UL   // per-device cap, RAM + flash
+#define GW_DLQ_MSG_MAX         GW_RPC_OUT_SIZE
+#define GW_DLQ_TTL_MS          3600000UL
+#define GW_DLQ_SWEEP_MS        60000UL  // drop expired messages of devices that stay away
+#define GW_DLQ_BURST           8        // messages handed to the queue per drain
 
 // ── Timing ────────────────────────────────────
-#define GW_MQTT_RECONNECT_MS   3000UL
+#define GW_MQTT_TICK_MS        250UL    // reconnect timer granularity
+#define GW_MQTT_BACKOFF_MIN_MS 500UL    // first retry after a drop
+#define GW_MQTT_BACKOFF_MAX_MS 60000UL  // exponential backoff ceiling
+
+// ── Poll loop ─────────────────────────────────
+// poll() sleeps in select/epoll until the next mg_timer is due or a socket
+// is ready instead of spinning, so an idle gateway leaves the CPU idle.
+#define GW_POLL_MAX_MS         100      // longest sleep; bounds DNS/HTTP housekeeping
+#define GW_POLL_BURST_MS       0        // busy-poll this long after I/O; needs a spare core
+#define GW_POLL_STATS_MS       1000UL   // window for idle % and wakeups/s
+
+// ── Tracing ───────────────────────────────────
+// Scoped trace points on the RX path, downloadable from the dashboard as
+// Chrome trace JSON.  0 compiles every trace point out.
+#ifndef GW_TRACE
+#define GW_TRACE               0
+#endif
+#define GW_TRACE_EVENTS        2048     // ring of 16-byte records, power of two
+#define GW_TRACE_SEND_LOW      2048     // /trace.json: refill the send buffer below this
+
+// ── Capture (inbound MQTT, for replay on a PC) ─
+#define GW_CAPTURE_FILE        "/capture.bin"  // LittleFS path
+#define GW_CAPTURE_AT_BOOT     0        // 1 = record from begin(), else the dashboard starts it
+#define GW_CAPTURE_MAX_BYTES   1048576UL // recording stops at this file size
+#define GW_CAPTURE_BUF         1024     // records are written in blocks of this
+#define GW_CAPTURE_TOPIC_MAX   96       // longest topic that can be repeated by reference
 
 #endif
\ No newline at end of file
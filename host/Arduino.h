@@ -0,0 +1,98 @@
+#ifndef __HOST_ARDUINO__H_
+#define __HOST_ARDUINO__H_
+
+// Just enough of the Arduino core to run the gateway on a PC; see
+// host_arduino.cpp.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <string>
+
+class String {
+public:
+  String() {}
+  String(const char* s) : m_s(s ? s : "") {}
+  String(const std::string& s) : m_s(s) {}
+  String(int v) : m_s(std::to_string(v)) {}
+  String(unsigned v) : m_s(std::to_string(v)) {}
+  String(long v) : m_s(std::to_string(v)) {}
+  String(unsigned long v) : m_s(std::to_string(v)) {}
+
+  const char* c_str() const { return m_s.c_str(); }
+  unsigned length() const { return (unsigned) m_s.size(); }
+  bool isEmpty() const { return m_s.empty(); }
+  bool reserve(unsigned n) { m_s.reserve(n); return true; }
+  bool startsWith(const char* p) const { return m_s.compare(0, strlen(p), p) == 0; }
+  String substring(unsigned from) const {
+    return from >= m_s.size() ? String() : String(m_s.substr(from));
+  }
+  String substring(unsigned from, unsigned to) const {
+    return from >= m_s.size() || to <= from ? String() : String(m_s.substr(from, to - from));
+  }
+  void replace(const char* from, const char* to) {
+    size_t n = strlen(from), m = strlen(to), pos = 0;
+    if (n == 0) return;
+    while ((pos = m_s.find(from, pos, n)) != std::string::npos) {
+      m_s.replace(pos, n, to, m);
+      pos += m;
+    }
+  }
+
+  String& operator+=(const String& o) { m_s += o.m_s; return *this; }
+  String& operator+=(const char* o) { m_s += o; return *this; }
+  String& operator+=(char c) { m_s += c; return *this; }
+  friend String operator+(const String& a, const String& b) { return String(a.m_s + b.m_s); }
+  friend String operator+(const String& a, const char* b) { return String(a.m_s + b); }
+  friend String operator+(const char* a, const String& b) { return String(a + b.m_s); }
+  bool operator==(const String& o) const { return m_s == o.m_s; }
+  bool operator!=(const String& o) const { return m_s != o.m_s; }
+  bool operator<(const String& o) const { return m_s < o.m_s; }
+
+private:
+  std::string m_s;
+};
+
+class HardwareSerial {
+public:
+  void begin(unsigned long) {}
+  // Drop all output; the per-frame log lines otherwise dominate a benchmark
+  // and serialize every shard thread on the stdout lock.
+  void setQuiet(bool quiet) { m_quiet = quiet; }
+  int printf(const char* fmt, ...) __attribute__((format(printf, 2, 3))) {
+    if (m_quiet) return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+  }
+  size_t print(const char* s) { return m_quiet ? 0 : (size_t) fputs(s, stdout); }
+  size_t println(const char* s = "") { return m_quiet ? 0 : (size_t) ::printf("%s\n", s); }
+
+private:
+  bool m_quiet = false;
+};
+extern HardwareSerial Serial;
+
+// Free heap as the ESP32 core reports it, from glibc's allocator here
+class EspClass {
+public:
+  uint32_t getFreeHeap();
+};
+extern EspClass ESP;
+
+// No PSRAM on the host: ps_malloc() fails as it does on a board without it
+inline bool psramFound() { return false; }
+inline void* ps_malloc(size_t) { return nullptr; }
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+long random(long max);
+long random(long min, long max);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef __HOST_LITTLEFS__H_
+#define __HOST_LITTLEFS__H_
+
+// LittleFS on top of a directory of the host file system.  Every gateway
+// started from one checkout needs its own root (host_main --fs).
+
+#include "Arduino.h"
+#include <stdio.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+
+class File {
+public:
+  File() {}
+  File(FILE* f, const std::string& name)
+      : m_file(f, fclose), m_name(name) {}
+  File(DIR* d, const std::string& path, const std::string& name)
+      : m_dir(d, closedir), m_path(path), m_name(name) {}
+
+  explicit operator bool() const { return m_file || m_dir; }
+  bool isDirectory() const { return (bool) m_dir; }
+  const char* name() const { return m_name.c_str(); }
+
+  File openNextFile() {
+    struct dirent* e;
+    while (m_dir && (e = readdir(m_dir.get())) != nullptr) {
+      if (e->d_name[0] == '.') continue;
+      std::string full = m_path + "/" + e->d_name;
+      struct stat st;
+      if (stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR* d = opendir(full.c_str());
+        if (d) return File(d, full, e->d_name);
+      } else {
+        FILE* f = fopen(full.c_str(), "rb");
+        if (f) return File(f, e->d_name);
+      }
+    }
+    return File();
+  }
+
+  size_t write(const uint8_t* buf, size_t len) {
+    return m_file ? fwrite(buf, 1, len, m_file.get()) : 0;
+  }
+  size_t print(const char* s) { return write((const uint8_t*) s, strlen(s)); }
+  size_t read(uint8_t* buf, size_t len) {
+    return m_file ? fread(buf, 1, len, m_file.get()) : 0;
+  }
+  String readString() {
+    std::string s;
+    char buf[256];
+    size_t n;
+    while (m_file && (n = fread(buf, 1, sizeof(buf), m_file.get())) > 0) s.append(buf, n);
+    return String(s);
+  }
+  bool seek(size_t pos) { return m_file && fseek(m_file.get(), (long) pos, SEEK_SET) == 0; }
+  size_t position() const { return m_file ? (size_t) ftell(m_file.get()) : 0; }
+  size_t size() const {
+    struct stat st;
+    return m_file && fstat(fileno(m_file.get()), &st) == 0 ? (size_t) st.st_size : 0;
+  }
+  int available() { return (int) (size() - position()); }
+  void close() { m_file.reset(); m_dir.reset(); }
+
+private:
+  std::shared_ptr<FILE> m_file;
+  std::shared_ptr<DIR> m_dir;
+  std::string m_path;
+  std::string m_name;
+};
+
+class LittleFSFS {
+public:
+  void setRoot(const char* root) { m_root = root; }
+
+  bool begin(bool formatOnFail = false) {
+    (void) formatOnFail;
+    ::mkdir(m_root.c_str(), 0755);
+    return true;
+  }
+
+  File open(const String& path, const char* mode = "r") { return open(path.c_str(), mode); }
+  File open(const char* path, const char* mode = "r") {
+    std::string full = m_root + path;
+    struct stat st;
+    if (mode[0] == 'r' && stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      DIR* d = opendir(full.c_str());
+      return d ? File(d, full, path) : File();
+    }
+    FILE* f = fopen(full.c_str(), (std::string(mode) + "b").c_str());
+    const char* slash = strrchr(path, '/');
+    return f ? File(f, slash ? slash + 1 : path) : File();
+  }
+
+  bool exists(const String& path) {
+    struct stat st;
+    return stat((m_root + path.c_str()).c_str(), &st) == 0;
+  }
+  bool mkdir(const String& path) { return ::mkdir((m_root + path.c_str()).c_str(), 0755) == 0; }
+  bool remove(const String& path) { return ::remove((m_root + path.c_str()).c_str()) == 0; }
+  bool rename(const String& from, const String& to) {
+    return ::rename((m_root + from.c_str()).c_str(), (m_root + to.c_str()).c_str()) == 0;
+  }
+
+private:
+  std::string m_root = "./fs";
+};
+extern LittleFSFS LittleFS;
+
+#endif
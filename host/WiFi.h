@@ -0,0 +1,23 @@
+#ifndef __HOST_WIFI__H_
+#define __HOST_WIFI__H_
+
+#include "Arduino.h"
+
+// The host is always online; mongoose uses the OS network stack.
+#define WIFI_STA      1
+#define WL_CONNECTED  3
+
+struct IPAddress {
+  String toString() const { return String("127.0.0.1"); }
+};
+
+class WiFiClass {
+public:
+  void mode(int) {}
+  void begin(const char*, const char*) {}
+  int status() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+};
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,190 @@
+// Connection scaling of the host gateway's dashboard server: opens many
+// idle WebSocket clients, then keeps a few active ones busy with get_stats
+// round trips, and reports the gateway's CPU and memory from /proc.
+//
+//   conn_bench --pid PID [--url URL] [--idle N] [--active A] [--seconds S]
+//
+// Prints one line: resident memory before and with the idle clients, CPU
+// while only idle clients are connected and while the active ones run, and
+// the active clients' request rate and latency percentiles.  Linux only.
+//
+// Build from the repository root, with the objects of the host gateway:
+//   g++ -std=gnu++17 -O2 -DMG_ARCH=MG_ARCH_CUSTOM -Isrc -I. host/bench/conn_bench.cpp mongoose.o -o conn_bench
+
+#include "mongoose.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONN_MAX_CONNECTING 256        // connects in flight, below the listen backlog
+#define CONN_IDLE_SAMPLE_MS 3000       // CPU sample with only idle clients
+
+struct ConnBench {
+  std::string url = "ws://127.0.0.1:8000/ws";
+  int pid = 0, idle = 1000, active = 4, seconds = 10;
+
+  struct mg_mgr mgr;
+  int connecting = 0, opened = 0, started = 0, failed = 0;
+  uint64_t endUs = 0;
+  uint64_t replies = 0;
+  std::vector<uint32_t> latencyUs;
+};
+
+struct Client {
+  bool active;
+  uint64_t sentAt;
+};
+
+static uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// utime + stime of pid, in clock ticks
+static long cpuTicks(int pid) {
+  char path[64], buf[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* f = fopen(path, "r");
+  if (f == nullptr) return -1;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  const char* p = strrchr(buf, ')');     // the command name may hold spaces
+  unsigned long utime = 0, stime = 0;
+  if (p == nullptr || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                             &utime, &stime) != 2) {
+    return -1;
+  }
+  return (long) (utime + stime);
+}
+
+static long rssKb(int pid) {
+  char path[64], line[256];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE* f = fopen(path, "r");
+  if (f == nullptr) return -1;
+  long kb = -1;
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb;
+}
+
+static void sendStats(struct mg_connection* c) {
+  Client* cl = (Client*) c->data;
+  cl->sentAt = nowUs();
+  mg_ws_printf(c, WEBSOCKET_OP_TEXT, "{%m:%m}", MG_ESC("cmd"), MG_ESC("get_stats"));
+}
+
+static void handler(struct mg_connection* c, int ev, void* ev_data) {
+  (void) ev_data;
+  ConnBench& b = *(ConnBench*) c->fn_data;
+  Client* cl = (Client*) c->data;
+  if (ev == MG_EV_WS_OPEN) {
+    b.connecting--;
+    b.opened++;
+    if (cl->active) sendStats(c);
+  } else if (ev == MG_EV_WS_MSG) {
+    uint64_t now = nowUs();
+    if (!cl->active || now >= b.endUs) return;
+    b.replies++;
+    b.latencyUs.push_back((uint32_t) (now - cl->sentAt));
+    sendStats(c);
+  } else if (ev == MG_EV_ERROR) {
+    if (!c->is_websocket) b.connecting--;
+    b.failed++;
+  }
+}
+
+static void openClient(ConnBench& b, bool active) {
+  struct mg_connection* c = mg_ws_connect(&b.mgr, b.url.c_str(), handler, &b, NULL);
+  if (c == nullptr) {
+    b.failed++;
+    return;
+  }
+  Client* cl = (Client*) c->data;
+  cl->active = active;
+  b.connecting++;
+  b.started++;
+}
+
+static uint32_t percentile(std::vector<uint32_t>& v, double p) {
+  if (v.empty()) return 0;
+  return v[(size_t) (p * (double) (v.size() - 1))];
+}
+
+static void pollFor(ConnBench& b, uint64_t us) {
+  uint64_t until = nowUs() + us;
+  while (nowUs() < until) mg_mgr_poll(&b.mgr, 10);
+}
+
+int main(int argc, char** argv) {
+  ConnBench b;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) goto usage;
+    std::string arg = argv[i];
+    const char* val = argv[i + 1];
+    if (arg == "--url") b.url = val;
+    else if (arg == "--pid") b.pid = atoi(val);
+    else if (arg == "--idle") b.idle = atoi(val);
+    else if (arg == "--active") b.active = atoi(val);
+    else if (arg == "--seconds") b.seconds = atoi(val);
+    else goto usage;
+  }
+  if (b.pid <= 0 || b.idle < 0 || b.active < 0 || b.seconds < 1) goto usage;
+
+  {
+    // Every client is a socket here as well
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    static_assert(sizeof(Client) <= MG_DATA_SIZE, "Client must fit in c->data");
+    mg_log_set(MG_LL_ERROR);
+    mg_mgr_init(&b.mgr);
+    long hz = sysconf(_SC_CLK_TCK);
+    long rssBase = rssKb(b.pid);
+
+    uint64_t deadline = nowUs() + 60000000ULL;
+    while (b.started < b.idle && nowUs() < deadline) {
+      while (b.started < b.idle && b.connecting < CONN_MAX_CONNECTING) openClient(b, false);
+      mg_mgr_poll(&b.mgr, 10);
+    }
+    while (b.connecting > 0 && nowUs() < deadline) mg_mgr_poll(&b.mgr, 10);
+    pollFor(b, 500000);                     // let the gateway settle
+    long rssIdle = rssKb(b.pid);
+
+    long t0 = cpuTicks(b.pid);
+    pollFor(b, CONN_IDLE_SAMPLE_MS * 1000ULL);
+    long t1 = cpuTicks(b.pid);
+    double idleCpu = 100.0 * (double) (t1 - t0) / hz / (CONN_IDLE_SAMPLE_MS / 1000.0);
+
+    b.endUs = nowUs() + (uint64_t) b.seconds * 1000000ULL;
+    for (int i = 0; i < b.active; i++) openClient(b, true);
+    long t2 = cpuTicks(b.pid);
+    while (nowUs() < b.endUs) mg_mgr_poll(&b.mgr, 1);
+    long t3 = cpuTicks(b.pid);
+    double activeCpu = 100.0 * (double) (t3 - t2) / hz / b.seconds;
+
+    std::sort(b.latencyUs.begin(), b.latencyUs.end());
+    printf("idle=%d active=%d opened=%d failed=%d rss_base_kb=%ld rss_kb=%ld "
+           "idle_cpu=%.1f active_cpu=%.1f rate=%.0f p50_us=%u p99_us=%u\n",
+           b.idle, b.active, b.opened, b.failed, rssBase, rssIdle, idleCpu, activeCpu,
+           (double) b.replies / b.seconds, percentile(b.latencyUs, 0.50),
+           percentile(b.latencyUs, 0.99));
+    mg_mgr_free(&b.mgr);
+    return 0;
+  }
+
+usage:
+  fprintf(stderr,
+          "usage: %s --pid PID [--url URL] [--idle N] [--active A] [--seconds S]\n",
+          argv[0]);
+  return 1;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# CPU and memory of host_gateway as idle dashboard clients pile up, with a
+# few active clients on top.  Run from the directory holding host_gateway
+# and conn_bench:
+#
+#   host/bench/conn_scaling.sh [broker_url]
+#
+# IDLE (default "0 1000 10000"), ACTIVE and DURATION (seconds) are passed
+# on to conn_bench.  Build a second gateway with -DMG_ENABLE_EPOLL=0 and
+# point GATEWAY at it to compare with poll().
+set -e
+BROKER=${1:-mqtt://127.0.0.1:1883}
+GATEWAY=${GATEWAY:-./host_gateway}
+BENCH=${BENCH:-./conn_bench}
+IDLE=${IDLE:-"0 1000 10000"}
+ACTIVE=${ACTIVE:-4}
+DURATION=${DURATION:-10}
+PORT=18080
+
+printf "%-8s %8s %10s %10s %9s %11s %8s %8s %8s\n" idle active rss_base rss_idle \
+    idle_cpu% active_cpu% req/s p50_us p99_us
+for n in $IDLE; do
+  fs=$(mktemp -d)
+  "$GATEWAY" --id "conn$$" --brokers "$BROKER" --fs "$fs" --http "$PORT" --quiet &
+  gw=$!
+  sleep 2
+  line=$("$BENCH" --pid "$gw" --url "ws://127.0.0.1:$PORT/ws" --idle "$n" \
+             --active "$ACTIVE" --seconds "$DURATION")
+  kill "$gw"; wait "$gw" 2>/dev/null || true
+  rm -rf "$fs"
+  field() { echo "$line" | tr ' ' '\n' | sed -n "s/^$1=//p"; }
+  printf "%-8s %8s %10s %10s %9s %11s %8s %8s %8s\n" "$(field idle)" "$ACTIVE" \
+      "$(field rss_base_kb)" "$(field rss_kb)" "$(field idle_cpu)" "$(field active_cpu)" \
+      "$(field rate)" "$(field p50_us)" "$(field p99_us)"
+done
@@ -0,0 +1,770 @@
+// Load generator for the host gateway: simulated devices sending encrypted
+// binary pings on jrpc/gateway/rx/<id> and timing the replies.
+//
+//   shard_bench provision --fs DIR [--devices N] [--prefix P]
+//       Writes N approved devices (PSK "bench") into a gateway's --fs dir.
+//   shard_bench run [--broker URL] [--devices N] [--conns C] [--window W]
+//                   [--rate R] [--payload B] [--seconds S] [--prefix P]
+//                   [--dashboard WS_URL] [--storm resume|full]
+//       Sends pings from N devices over C client connections and prints one
+//       line: rate, latency percentiles, errors and lost pings.
+//       --window keeps W pings in flight per device (closed loop).
+//       --rate sends R pings per second in total, whatever the replies do
+//       (open loop), so queueing in the gateway shows up in the latency.
+//       --payload pads each request's params with B bytes.
+//       --dashboard runs the whole device flow first instead of relying on
+//       provision: each device publishes an encrypted request_connect with
+//       an X25519 key, the bench authorizes it over the dashboard WebSocket
+//       and waits for the approval under the new session key.  The line
+//       then also has the connect latencies.  Unless --prefix is given, ids
+//       are made unique per run so the gateway sees new devices.
+//       --storm has every device connect again before the load, as after a
+//       gateway or broker outage: with its ticket (resume), or with a full
+//       X25519 handshake (full).  The line then also has how long the
+//       reconnects took and how many the gateway resumed.  Provisioned
+//       devices have no ticket yet, so a resume storm without --dashboard
+//       starts with an unmeasured round of full handshakes.
+//
+// Build from the repository root, with the objects of the host gateway:
+//   g++ -std=gnu++17 -O2 -DMG_ARCH=MG_ARCH_CUSTOM -Isrc -I. host/bench/shard_bench.cpp mongoose.o chacha20.o x25519.o -o shard_bench
+
+#include "mongoose.h"
+#include "chacha20.h"
+#include "x25519.h"
+#include "gateway_config.h"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BENCH_PSK           "bench"
+#define BENCH_TIMEOUT_MS    2000       // an unanswered ping or approval counts as lost
+#define BENCH_WARMUP_MS     1000       // not measured
+#define BENCH_CONNECT_MS    30000      // the whole connect flow
+#define BENCH_AUTH_RETRY_MS 50         // authorize again if the connect was not in yet
+// Devices between authorize and approval.  The gateway queues each approval
+// and drops it when its outbound queue is full, so stay at its QoS1 window.
+#define BENCH_AUTH_INFLIGHT GW_OUTQ_INFLIGHT
+// Reconnects in flight during --storm: the replies go through the same
+// control lane, so no more than it holds
+#define BENCH_STORM_INFLIGHT GW_OUTQ_MAX_MSGS
+
+enum DeviceState {
+  DEV_NEW, DEV_CONNECTING, DEV_AUTHORIZED, DEV_READY, DEV_FAILED, DEV_RECONNECTING
+};
+
+struct BenchDevice {
+  std::string id;
+  uint8_t pskKey[32];                  // SHA-256 of the PSK
+  uint8_t key[32];                     // session key
+  char auth[65];                       // HMAC of "<id>:<ts>:ping", ts fixed
+  uint32_t counter;
+  size_t conn;
+  std::deque<uint64_t> sent;           // send time of each ping in flight
+
+  // Session setup, as gateway_session.h
+  uint8_t eph[X25519_BYTES];           // private key of the handshake in flight
+  uint8_t ephPub[X25519_BYTES];
+  uint8_t secret[32];                  // resumption secret of the ticket
+  uint8_t resumeNonce[RFC_8439_NONCE_SIZE];
+  std::string ticket;                  // hex; empty = none
+  long helloTs;                        // timestamp of the last request_connect
+
+  DeviceState state;
+  uint64_t connectAt;                  // first request_connect or resume published
+  uint64_t authAt;                     // last authorize or request sent, or answered
+  bool authPending;                    // authorize awaiting its response
+};
+
+struct Bench {
+  std::string broker = "mqtt://127.0.0.1:1883";
+  std::string prefix = "bench_";
+  std::string fs;
+  std::string dashboard;               // set: run the connect flow first
+  std::string storm;                   // "resume" or "full"; empty = no storm
+  bool prefixSet = false;
+  int devices = 32, conns = 4, window = 1, seconds = 10, payload = 0;
+  double rate = 0;                     // pings/s in total, 0 = closed loop
+  long authTs = 1;
+
+  struct mg_mgr mgr;
+  std::vector<BenchDevice> devs;
+  std::map<std::string, size_t> byId;
+  std::vector<struct mg_connection*> links;
+  struct mg_connection* ws = nullptr;
+  bool wsOpen = false;
+  std::string pad;
+  int subacks = 0, authInflight = 0, ready = 0, connectFail = 0;
+  size_t authNext = 0;                 // first device that may still need an authorize
+  uint64_t connectStart = 0, connectEnd = 0;
+  uint64_t stormStart = 0, stormEnd = 0;
+  size_t stormNext = 0;                // next device to reconnect
+  bool stormPrime = false;             // this round only gets the tickets
+  int stormInflight = 0, stormResumed = 0, stormFull = 0, stormRefused = 0, stormFail = 0;
+  uint64_t startUs = 0, measureUs = 0, endUs = 0;
+  uint64_t paced = 0;                  // pings due so far at --rate
+  size_t next = 0;                     // device the pacer sends from next
+  uint64_t sent = 0, replies = 0, errors = 0, lost = 0;
+  std::vector<uint32_t> latencyUs;
+  std::vector<uint32_t> connectMs;
+  std::vector<uint32_t> stormMs;
+};
+
+static uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void toHex(const uint8_t* p, size_t n, char* out) {
+  for (size_t i = 0; i < n; i++) sprintf(out + i * 2, "%02x", p[i]);
+  out[n * 2] = '\0';
+}
+
+static void signAuth(const BenchDevice& d, const uint8_t key[32], long ts, const char* method,
+                     char* out) {
+  char msg[128];
+  int n = snprintf(msg, sizeof(msg), "%s:%ld:%s", d.id.c_str(), ts, method);
+  uint8_t mac[32];
+  mg_hmac_sha256(mac, (uint8_t*) key, 32, (uint8_t*) msg, (size_t) n);
+  toHex(mac, sizeof(mac), out);
+}
+
+static void initDevice(Bench& b, int i) {
+  BenchDevice d;
+  d.id = b.prefix + std::to_string(i);
+  mg_sha256(d.pskKey, (uint8_t*) BENCH_PSK, strlen(BENCH_PSK));
+  memcpy(d.key, d.pskKey, sizeof(d.key));
+  signAuth(d, d.key, b.authTs, "ping", d.auth);
+  d.counter = 0;
+  d.conn = (size_t) i % (size_t) b.conns;
+  d.helloTs = 0;
+  d.state = DEV_NEW;
+  d.connectAt = d.authAt = 0;
+  d.authPending = false;
+  b.byId[d.id] = b.devs.size();
+  b.devs.push_back(d);
+}
+
+// Nonce as the devices build it: 4-byte counter, 8-byte time, big endian
+static void makeNonce(BenchDevice& d, uint8_t* nonce) {
+  uint32_t ctr = ++d.counter;
+  uint64_t t = (uint64_t) time(NULL);
+  nonce[0] = (uint8_t) (ctr >> 24), nonce[1] = (uint8_t) (ctr >> 16);
+  nonce[2] = (uint8_t) (ctr >> 8), nonce[3] = (uint8_t) ctr;
+  for (int i = 0; i < 8; i++) nonce[4 + i] = (uint8_t) (t >> (56 - 8 * i));
+}
+
+// ---------------------------------------------------------------------------
+// provision
+// ---------------------------------------------------------------------------
+static int provision(Bench& b) {
+  if (b.fs.empty()) return fprintf(stderr, "provision needs --fs\n"), 1;
+  std::string dir = b.fs + "/devices";
+  mkdir(b.fs.c_str(), 0755);
+  mkdir(dir.c_str(), 0755);
+  for (int i = 0; i < b.devices; i++) initDevice(b, i);
+  for (auto& d : b.devs) {
+    char key[65];
+    toHex(d.key, sizeof(d.key), key);
+    std::string path = dir + "/dev_" + d.id;
+    FILE* f = fopen(path.c_str(), "w");
+    if (f == nullptr) return perror(path.c_str()), 1;
+    fprintf(f, "{\"id\":\"%s\",\"name\":\"%s\",\"type\":\"bench\",\"status\":1,"
+               "\"perms\":1,\"key\":\"%s\"}", d.id.c_str(), d.id.c_str(), key);
+    fclose(f);
+  }
+  printf("provisioned %d devices in %s\n", b.devices, dir.c_str());
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Connect flow
+// ---------------------------------------------------------------------------
+static void publishConnect(Bench& b, BenchDevice& d, const char* envelope, int len) {
+  struct mg_connection* c = b.links[d.conn];
+  if (c == nullptr) return;
+  struct mg_mqtt_opts opts = {};
+  opts.topic = mg_str(GW_T_GATEWAY_CONNECT);
+  opts.message = mg_str_n(envelope, (size_t) len);
+  opts.qos = 1;
+  mg_mqtt_pub(c, &opts);
+  d.authAt = nowUs();
+}
+
+// request_connect with a new X25519 key, under the PSK key
+static void sendConnect(Bench& b, BenchDevice& d) {
+  // The gateway takes a known device's request only if it is newer
+  long ts = std::max((long) time(NULL), d.helloTs + 1);
+  d.helloTs = ts;
+  char auth[65], pubHex[X25519_BYTES * 2 + 1];
+  signAuth(d, d.pskKey, ts, "request_connect", auth);
+  mg_random(d.eph, sizeof(d.eph));
+  x25519(d.ephPub, d.eph, X25519_BASE_POINT, 1);
+  toHex(d.ephPub, sizeof(d.ephPub), pubHex);
+
+  char plain[320];
+  int n = snprintf(plain, sizeof(plain),
+                   "{\"device_name\":\"%s\",\"device_type\":\"bench\","
+                   "\"method\":\"request_connect\",\"timestamp\":%ld,\"auth\":\"%s\","
+                   "\"pub\":\"%s\"}",
+                   d.id.c_str(), ts, auth, pubHex);
+  // Random nonce: the counter starts over with every session key
+  uint8_t nonce[RFC_8439_NONCE_SIZE], cipher[sizeof(plain) + RFC_8439_TAG_SIZE];
+  mg_random(nonce, sizeof(nonce));
+  size_t len = chacha20_poly1305_encrypt(cipher, d.pskKey, nonce, NULL, 0,
+                                         (uint8_t*) plain, (size_t) n);
+  char nonceHex[RFC_8439_NONCE_SIZE * 2 + 1], cipherHex[sizeof(cipher) * 2 + 1];
+  toHex(nonce, sizeof(nonce), nonceHex);
+  toHex(cipher, len, cipherHex);
+  char envelope[sizeof(cipherHex) + 128];
+  int m = snprintf(envelope, sizeof(envelope),
+                   "{\"device_id\":\"%s\",\"nonce\":\"%s\",\"ciphertext\":\"%s\"}",
+                   d.id.c_str(), nonceHex, cipherHex);
+  publishConnect(b, d, envelope, m);
+}
+
+// The ticket, and a request under a key from its secret
+static void sendResume(Bench& b, BenchDevice& d) {
+  char plain[96];
+  int n = snprintf(plain, sizeof(plain), "{\"method\":\"request_resume\",\"timestamp\":%ld}",
+                   (long) time(NULL));
+  uint8_t key[32], cipher[sizeof(plain) + RFC_8439_TAG_SIZE];
+  mg_hmac_sha256(key, d.secret, sizeof(d.secret), (uint8_t*) "resume-request", 14);
+  mg_random(d.resumeNonce, sizeof(d.resumeNonce));
+  size_t len = chacha20_poly1305_encrypt(cipher, key, d.resumeNonce, (uint8_t*) d.id.c_str(),
+                                         d.id.size(), (uint8_t*) plain, (size_t) n);
+  char nonceHex[RFC_8439_NONCE_SIZE * 2 + 1], cipherHex[sizeof(cipher) * 2 + 1];
+  toHex(d.resumeNonce, sizeof(d.resumeNonce), nonceHex);
+  toHex(cipher, len, cipherHex);
+  char envelope[sizeof(cipherHex) + 384];
+  int m = snprintf(envelope, sizeof(envelope),
+                   "{\"device_id\":\"%s\",\"ticket\":\"%s\",\"nonce\":\"%s\","
+                   "\"ciphertext\":\"%s\"}",
+                   d.id.c_str(), d.ticket.c_str(), nonceHex, cipherHex);
+  publishConnect(b, d, envelope, m);
+}
+
+// connect.response to a handshake or a resume.  The session key comes from
+// our half and the gateway's "pub" or "random" next to the ciphertext, and
+// is only taken when the response opens under it.
+static bool openSession(Bench& b, BenchDevice& d, struct mg_str data, bool& resumed) {
+  uint8_t msg[10 + 3 * X25519_BYTES], prk[32];
+  int pubLen = 0, randomLen = 0, nonceLen = 0, cipherLen = 0;
+  char* pub = mg_json_get_hex(data, "$.pub", &pubLen);
+  char* random = mg_json_get_hex(data, "$.random", &randomLen);
+  bool ok = false;
+  resumed = random != nullptr;
+  if (pub != nullptr && pubLen == X25519_BYTES) {
+    memcpy(msg, "gw-session", 10);
+    ok = x25519(msg + 10, d.eph, (uint8_t*) pub, 1) == 0;
+    memcpy(msg + 10 + X25519_BYTES, d.ephPub, X25519_BYTES);
+    memcpy(msg + 10 + 2 * X25519_BYTES, pub, X25519_BYTES);
+    mg_hmac_sha256(prk, d.pskKey, sizeof(d.pskKey), msg, sizeof(msg));
+  } else if (random != nullptr && randomLen == 16) {
+    memcpy(msg, "gw-resume", 9);
+    memcpy(msg + 9, d.resumeNonce, sizeof(d.resumeNonce));
+    memcpy(msg + 9 + sizeof(d.resumeNonce), random, 16);
+    mg_hmac_sha256(prk, d.secret, sizeof(d.secret), msg, 9 + sizeof(d.resumeNonce) + 16);
+    ok = true;
+  }
+  free(pub), free(random);
+  char* nonce = mg_json_get_hex(data, "$.nonce", &nonceLen);
+  char* cipher = mg_json_get_hex(data, "$.ciphertext", &cipherLen);
+  ok = ok && nonce != nullptr && cipher != nullptr && nonceLen == RFC_8439_NONCE_SIZE &&
+       cipherLen > RFC_8439_TAG_SIZE;
+
+  uint8_t session[32], secret[32];
+  std::vector<uint8_t> plain;
+  if (ok) {
+    mg_hmac_sha256(session, prk, sizeof(prk), (uint8_t*) "session", 7);
+    mg_hmac_sha256(secret, prk, sizeof(prk), (uint8_t*) "resume", 6);
+    plain.resize((size_t) cipherLen);
+    size_t n = chacha20_poly1305_open(plain.data(), session, (uint8_t*) nonce,
+                                      (uint8_t*) d.id.c_str(), d.id.size(), (uint8_t*) cipher,
+                                      (size_t) cipherLen);
+    ok = n != (size_t) -1;
+    if (ok) plain.resize(n);
+  }
+  free(nonce), free(cipher);
+  char* ticket = ok ? mg_json_get_str(mg_str_n((char*) plain.data(), plain.size()),
+                                      "$.params.ticket")
+                    : nullptr;
+  if (ticket == nullptr) return false;
+  memcpy(d.key, session, sizeof(d.key));
+  memcpy(d.secret, secret, sizeof(d.secret));
+  d.ticket = ticket;
+  free(ticket);
+  d.counter = 0;                          // the gateway starts over with the key
+  signAuth(d, d.key, b.authTs, "ping", d.auth);
+  return true;
+}
+
+static void endAuthorize(Bench& b, BenchDevice& d) {
+  if (d.authPending || d.state == DEV_AUTHORIZED) b.authInflight--;
+  d.authPending = false;
+}
+
+// The authorize can overtake the request_connect it answers, since the two
+// travel on different connections; the gateway then refuses it and it is
+// sent again BENCH_AUTH_RETRY_MS later.
+static void pumpAuthorize(Bench& b) {
+  if (!b.wsOpen) return;
+  uint64_t now = nowUs();
+  while (b.authNext < b.devs.size() && b.devs[b.authNext].state >= DEV_READY) b.authNext++;
+  for (size_t i = b.authNext; i < b.devs.size(); i++) {
+    BenchDevice& d = b.devs[i];
+    if (d.state == DEV_AUTHORIZED && now - d.authAt >= BENCH_TIMEOUT_MS * 1000ULL) {
+      endAuthorize(b, d);                  // approval dropped, the device never learns
+      d.state = DEV_FAILED;
+      b.connectFail++;
+      continue;
+    }
+    if (b.authInflight >= BENCH_AUTH_INFLIGHT) continue;
+    if (d.state != DEV_CONNECTING || d.authPending ||
+        now - d.authAt < BENCH_AUTH_RETRY_MS * 1000ULL) {
+      continue;
+    }
+    char cmd[160];
+    int n = snprintf(cmd, sizeof(cmd),
+                     "{\"cmd\":\"authorize\",\"device_id\":\"%s\",\"psk\":\"%s\"}",
+                     d.id.c_str(), BENCH_PSK);
+    mg_ws_send(b.ws, cmd, (size_t) n, WEBSOCKET_OP_TEXT);
+    d.authPending = true;
+    d.authAt = now;
+    b.authInflight++;
+  }
+}
+
+static void wsHandler(struct mg_connection* c, int ev, void* ev_data) {
+  Bench& b = *(Bench*) c->fn_data;
+  if (ev == MG_EV_WS_OPEN) {
+    b.wsOpen = true;
+  } else if (ev == MG_EV_WS_MSG) {
+    struct mg_ws_message* wm = (struct mg_ws_message*) ev_data;
+    char* cmd = mg_json_get_str(wm->data, "$.cmd");
+    char* status = mg_json_get_str(wm->data, "$.status");
+    char* id = mg_json_get_str(wm->data, "$.device_id");
+    if (cmd && status && id && strcmp(cmd, "authorize") == 0) {
+      auto it = b.byId.find(id);
+      if (it != b.byId.end() && b.devs[it->second].authPending) {
+        BenchDevice& d = b.devs[it->second];
+        d.authAt = nowUs();
+        if (strcmp(status, "ok") == 0) {
+          d.authPending = false;            // still in flight until the approval
+          d.state = DEV_AUTHORIZED;
+        } else {
+          endAuthorize(b, d);
+        }
+      }
+    }
+    free(cmd), free(status), free(id);
+  } else if (ev == MG_EV_ERROR) {
+    fprintf(stderr, "dashboard error: %s\n", (char*) ev_data);
+  } else if (ev == MG_EV_CLOSE) {
+    b.ws = nullptr;
+    b.wsOpen = false;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// run
+// ---------------------------------------------------------------------------
+static void sendPing(Bench& b, BenchDevice& d) {
+  struct mg_connection* c = b.links[d.conn];
+  if (c == nullptr) return;
+  char head[64], tail[128];
+  int h = snprintf(head, sizeof(head), "{\"jsonrpc\":\"2.0\",\"method\":\"ping\",\"params\":{%s",
+                   b.pad.empty() ? "}" : "\"pad\":\"");
+  int t = snprintf(tail, sizeof(tail), "%s,\"id\":%lu,\"timestamp\":%ld,\"auth\":\"%s\"}",
+                   b.pad.empty() ? "" : "\"}", (unsigned long) d.counter + 1, b.authTs, d.auth);
+  std::string plain;
+  plain.reserve((size_t) h + b.pad.size() + (size_t) t);
+  plain.append(head, (size_t) h).append(b.pad).append(tail, (size_t) t);
+
+  std::vector<uint8_t> frame(RFC_8439_NONCE_SIZE + plain.size() + RFC_8439_TAG_SIZE);
+  makeNonce(d, frame.data());
+  size_t len = chacha20_poly1305_encrypt(frame.data() + RFC_8439_NONCE_SIZE, d.key,
+                                         frame.data(), NULL, 0,
+                                         (const uint8_t*) plain.data(), plain.size());
+  char topic[96];
+  snprintf(topic, sizeof(topic), GW_T_GATEWAY_RX "/%s", d.id.c_str());
+  struct mg_mqtt_opts opts = {};
+  opts.topic = mg_str(topic);
+  opts.message = mg_str_n((char*) frame.data(), RFC_8439_NONCE_SIZE + len);
+  opts.qos = 0;
+  mg_mqtt_pub(c, &opts);
+  uint64_t now = nowUs();
+  d.sent.push_back(now);
+  if (now >= b.measureUs && now < b.endUs) b.sent++;
+}
+
+// Decrypts a downlink message in either framing: nonce || ciphertext || tag
+// once the device has sent binary frames, the JSON hex envelope before.
+static bool openMessage(const BenchDevice& d, struct mg_str data, std::vector<uint8_t>& plain) {
+  const uint8_t *nonce, *cipher;
+  size_t cipherLen;
+  char *nonceBuf = nullptr, *cipherBuf = nullptr;
+  if (data.len > 0 && data.buf[0] == '{') {
+    int nonceLen = 0, len = 0;
+    nonceBuf = mg_json_get_hex(data, "$.nonce", &nonceLen);
+    cipherBuf = mg_json_get_hex(data, "$.ciphertext", &len);
+    if (nonceBuf == nullptr || cipherBuf == nullptr || nonceLen != RFC_8439_NONCE_SIZE) {
+      free(nonceBuf), free(cipherBuf);
+      return false;
+    }
+    nonce = (const uint8_t*) nonceBuf;
+    cipher = (const uint8_t*) cipherBuf;
+    cipherLen = (size_t) len;
+  } else {
+    nonce = (const uint8_t*) data.buf;
+    cipher = nonce + RFC_8439_NONCE_SIZE;
+    cipherLen = data.len > RFC_8439_NONCE_SIZE ? data.len - RFC_8439_NONCE_SIZE : 0;
+  }
+  bool ok = cipherLen > RFC_8439_TAG_SIZE;
+  if (ok) {
+    plain.resize(cipherLen);
+    size_t n = chacha20_poly1305_decrypt(plain.data(), (uint8_t*) d.key, nonce, cipher, cipherLen);
+    ok = n != (size_t) -1;
+    if (ok) plain.resize(n);
+  }
+  free(nonceBuf), free(cipherBuf);
+  return ok;
+}
+
+static void onApproved(Bench& b, BenchDevice& d, bool resumed) {
+  if (d.state == DEV_RECONNECTING) {
+    d.state = DEV_READY;
+    b.stormInflight--;
+    (resumed ? b.stormResumed : b.stormFull)++;
+    b.stormMs.push_back((uint32_t) ((nowUs() - d.connectAt) / 1000));
+    return;
+  }
+  if (d.state == DEV_READY || d.state == DEV_FAILED) return;
+  endAuthorize(b, d);
+  d.state = DEV_READY;
+  b.ready++;
+  b.connectMs.push_back((uint32_t) ((nowUs() - d.connectAt) / 1000));
+}
+
+static void onReply(Bench& b, struct mg_str topic, struct mg_str data) {
+  struct mg_str caps[2];
+  if (!mg_match(topic, mg_str("jrpc/devices/*/rx"), caps)) return;
+  auto it = b.byId.find(std::string(caps[0].buf, caps[0].len));
+  if (it == b.byId.end()) return;
+  BenchDevice& d = b.devs[it->second];
+
+  bool resumed = false;
+  if (data.len > 0 && data.buf[0] == '{' &&
+      (mg_json_get(data, "$.pub", NULL) > 0 || mg_json_get(data, "$.random", NULL) > 0)) {
+    if (openSession(b, d, data, resumed)) onApproved(b, d, resumed);
+    return;
+  }
+  if (d.state == DEV_RECONNECTING && data.len > 0 && data.buf[0] == '{' &&
+      mg_json_get(data, "$.error", NULL) > 0) {
+    b.stormRefused++;                     // ticket refused: full handshake
+    d.ticket.clear();
+    sendConnect(b, d);
+    return;
+  }
+
+  std::vector<uint8_t> plain;
+  bool ok = openMessage(d, data, plain);
+  struct mg_str json = mg_str_n((char*) plain.data(), plain.size());
+  if (ok && mg_json_get(json, "$.params.status", NULL) > 0) {
+    char* method = mg_json_get_str(json, "$.method");
+    if (method != nullptr && strcmp(method, "connect.response") == 0) onApproved(b, d, false);
+    free(method);
+    return;
+  }
+
+  if (d.sent.empty()) return;             // answer to a ping given up on
+  uint64_t now = nowUs(), sentAt = d.sent.front();
+  d.sent.pop_front();
+  ok = ok && mg_json_get(json, "$.result.pong", NULL) > 0;
+  if (now >= b.measureUs && now < b.endUs) {
+    if (ok) {
+      b.replies++;
+      b.latencyUs.push_back((uint32_t) (now - sentAt));
+    } else {
+      b.errors++;
+    }
+  }
+  if (b.rate == 0 && now < b.endUs) sendPing(b, d);
+}
+
+// Provisioned devices start out usable, the others once connected
+static bool active(const Bench& b, const BenchDevice& d) {
+  return d.state == DEV_READY || (b.dashboard.empty() && d.state == DEV_NEW);
+}
+
+static void startLoad(Bench& b) {
+  b.startUs = nowUs();
+  b.measureUs = b.startUs + BENCH_WARMUP_MS * 1000ULL;
+  b.endUs = b.measureUs + (uint64_t) b.seconds * 1000000ULL;
+  if (b.rate > 0) return;                 // pace() sends from here on
+  for (auto& d : b.devs) {
+    if (!active(b, d)) continue;
+    for (int i = 0; i < b.window; i++) sendPing(b, d);
+  }
+}
+
+// Sends the pings due by now, taking the devices in turn
+static void pace(Bench& b) {
+  uint64_t due = (uint64_t) ((double) (nowUs() - b.startUs) * b.rate / 1e6);
+  size_t n = b.devs.size();
+  for (; b.paced < due; b.paced++) {
+    for (size_t tries = 0; tries < n; tries++) {
+      BenchDevice& d = b.devs[b.next++ % n];
+      if (!active(b, d)) continue;
+      sendPing(b, d);
+      break;
+    }
+  }
+}
+
+static void handler(struct mg_connection* c, int ev, void* ev_data) {
+  Bench& b = *(Bench*) c->fn_data;
+  if (ev == MG_EV_MQTT_OPEN) {
+    for (auto& d : b.devs) {
+      if (b.links[d.conn] != c) continue;
+      std::string topic = "jrpc/devices/" + d.id + "/rx";
+      struct mg_mqtt_opts opts = {};
+      opts.topic = mg_str(topic.c_str());
+      opts.qos = 1;
+      mg_mqtt_sub(c, &opts);
+    }
+  } else if (ev == MG_EV_MQTT_CMD) {
+    struct mg_mqtt_message* mm = (struct mg_mqtt_message*) ev_data;
+    if (mm->cmd == MQTT_CMD_SUBACK) b.subacks++;
+  } else if (ev == MG_EV_MQTT_MSG) {
+    struct mg_mqtt_message* mm = (struct mg_mqtt_message*) ev_data;
+    onReply(b, mm->topic, mm->data);
+  } else if (ev == MG_EV_ERROR) {
+    fprintf(stderr, "connection error: %s\n", (char*) ev_data);
+  } else if (ev == MG_EV_CLOSE) {
+    for (auto& link : b.links) {
+      if (link == c) link = nullptr;
+    }
+  }
+}
+
+// Pings without an answer for BENCH_TIMEOUT_MS are written off.  In the
+// closed loop they are resent, so a dropped reply does not shrink the
+// window for good.
+static void timeoutFn(void* arg) {
+  Bench& b = *(Bench*) arg;
+  uint64_t now = nowUs();
+  if (b.stormStart != 0 && b.stormEnd == 0) {
+    for (auto& d : b.devs) {
+      if (d.state != DEV_RECONNECTING || now - d.authAt < BENCH_TIMEOUT_MS * 1000ULL) continue;
+      if (b.storm == "resume" && !d.ticket.empty()) sendResume(b, d);
+      else sendConnect(b, d);
+    }
+  }
+  if (b.startUs == 0 || now >= b.endUs) return;
+  for (auto& d : b.devs) {
+    size_t n = 0;
+    while (!d.sent.empty() && now - d.sent.front() >= BENCH_TIMEOUT_MS * 1000ULL) {
+      d.sent.pop_front();
+      n++;
+    }
+    if (n == 0) continue;
+    if (now >= b.measureUs) b.lost += n;
+    if (b.rate > 0) continue;
+    for (size_t i = 0; i < n; i++) sendPing(b, d);
+  }
+}
+
+static uint32_t percentile(std::vector<uint32_t>& v, double p) {
+  if (v.empty()) return 0;
+  size_t i = (size_t) (p * (double) (v.size() - 1));
+  return v[i];
+}
+
+static void startStorm(Bench& b, uint64_t now) {
+  b.stormStart = now;
+  b.stormNext = 0;
+  b.stormInflight = 0;
+  b.stormResumed = b.stormFull = b.stormRefused = b.stormFail = 0;
+  b.stormMs.clear();
+  b.stormPrime = false;
+  if (b.storm != "resume") return;
+  for (auto& d : b.devs) {
+    if (active(b, d) && d.ticket.empty()) b.stormPrime = true;
+  }
+}
+
+// Runs until every device is approved or has failed, then starts the load
+// or the storm
+static void connectStep(Bench& b, uint64_t now) {
+  pumpAuthorize(b);
+  if (b.ready + b.connectFail < b.devices && now < b.connectStart + BENCH_CONNECT_MS * 1000ULL) {
+    return;
+  }
+  for (auto& d : b.devs) {
+    if (d.state == DEV_READY || d.state == DEV_FAILED) continue;
+    d.state = DEV_FAILED;
+    b.connectFail++;
+  }
+  b.connectEnd = now;
+  if (b.ready == 0) return;
+  if (b.storm.empty()) startLoad(b);
+  else startStorm(b, now);
+}
+
+// Every usable device connects again, resuming when it may and holds a
+// ticket, with at most BENCH_STORM_INFLIGHT requests out.  timeoutFn()
+// sends again the ones not answered in BENCH_TIMEOUT_MS.  The load then
+// runs on the new keys.
+static void stormStep(Bench& b, uint64_t now) {
+  while (b.stormInflight < BENCH_STORM_INFLIGHT && b.stormNext < b.devs.size()) {
+    BenchDevice& d = b.devs[b.stormNext++];
+    if (!active(b, d)) continue;
+    d.state = DEV_RECONNECTING;
+    d.connectAt = now;
+    if (b.storm == "resume" && !d.ticket.empty()) sendResume(b, d);
+    else sendConnect(b, d);
+    b.stormInflight++;
+  }
+  if ((b.stormInflight > 0 || b.stormNext < b.devs.size()) &&
+      now < b.stormStart + BENCH_CONNECT_MS * 1000ULL) {
+    return;
+  }
+  for (auto& d : b.devs) {
+    if (d.state != DEV_RECONNECTING) continue;
+    d.state = DEV_FAILED;
+    b.stormFail++;
+  }
+  if (b.stormPrime) {
+    startStorm(b, now);
+    return;
+  }
+  b.stormEnd = now;
+  startLoad(b);
+}
+
+static int run(Bench& b) {
+  mg_log_set(MG_LL_ERROR);
+  mg_mgr_init(&b.mgr);
+  if (!b.dashboard.empty() && !b.prefixSet) b.prefix = "bench" + std::to_string(getpid()) + "_";
+  for (int i = 0; i < b.devices; i++) initDevice(b, i);
+  b.pad.assign((size_t) b.payload, 'x');
+  b.links.resize((size_t) b.conns);
+  for (int i = 0; i < b.conns; i++) {
+    char cid[48];
+    snprintf(cid, sizeof(cid), "%sc%d_%d", b.prefix.c_str(), i, (int) getpid());
+    struct mg_mqtt_opts opts = {};
+    opts.client_id = mg_str(cid);
+    opts.clean = true;
+    opts.keepalive = 60;
+    opts.version = 4;
+    b.links[(size_t) i] = mg_mqtt_connect(&b.mgr, b.broker.c_str(), &opts, handler, &b);
+  }
+  if (!b.dashboard.empty()) b.ws = mg_ws_connect(&b.mgr, b.dashboard.c_str(), wsHandler, &b, NULL);
+  mg_timer_add(&b.mgr, 100, MG_TIMER_REPEAT, timeoutFn, &b);
+
+  uint64_t deadline = nowUs() + 10000000ULL;   // subscriptions must be up by then
+  while (b.startUs == 0 || nowUs() < b.endUs) {
+    uint64_t now = nowUs();
+    if (b.startUs != 0) {
+      if (b.rate > 0) pace(b);
+    } else if (b.stormStart != 0) {
+      stormStep(b, now);
+    } else if (b.connectEnd != 0) {
+      fprintf(stderr, "no device completed the connect flow\n");
+      return 1;
+    } else if (b.connectStart != 0) {
+      connectStep(b, now);
+    } else if (b.subacks == b.devices && (b.dashboard.empty() || b.wsOpen)) {
+      if (!b.dashboard.empty()) {
+        b.connectStart = now;
+        for (auto& d : b.devs) {
+          d.state = DEV_CONNECTING;
+          d.connectAt = now;
+          sendConnect(b, d);
+        }
+      } else if (!b.storm.empty()) {
+        startStorm(b, now);
+      } else {
+        startLoad(b);
+      }
+    } else if (now > deadline) {
+      fprintf(stderr, "no SUBACK from %s%s\n", b.broker.c_str(),
+              b.dashboard.empty() || b.wsOpen ? "" : ", or no dashboard");
+      return 1;
+    }
+    mg_mgr_poll(&b.mgr, b.rate > 0 || b.connectStart != 0 || b.stormStart != 0 ? 1 : 10);
+  }
+
+  std::sort(b.latencyUs.begin(), b.latencyUs.end());
+  printf("devices=%d conns=%d window=%d seconds=%d payload=%d sent=%llu replies=%llu "
+         "rate=%.0f p50_us=%u p90_us=%u p99_us=%u p999_us=%u max_us=%u errors=%llu lost=%llu",
+         b.devices, b.conns, b.rate > 0 ? 0 : b.window, b.seconds, b.payload,
+         (unsigned long long) b.sent, (unsigned long long) b.replies,
+         (double) b.replies / b.seconds, percentile(b.latencyUs, 0.50),
+         percentile(b.latencyUs, 0.90), percentile(b.latencyUs, 0.99),
+         percentile(b.latencyUs, 0.999), b.latencyUs.empty() ? 0 : b.latencyUs.back(),
+         (unsigned long long) b.errors, (unsigned long long) b.lost);
+  if (b.rate > 0) printf(" target_rate=%.0f", b.rate);
+  if (!b.dashboard.empty()) {
+    std::sort(b.connectMs.begin(), b.connectMs.end());
+    double secs = (double) (b.connectEnd - b.connectStart) / 1e6;
+    printf(" connects=%d connect_fail=%d connect_rate=%.0f connect_p50_ms=%u connect_p99_ms=%u",
+           b.ready, b.connectFail, secs > 0 ? b.ready / secs : 0.0,
+           percentile(b.connectMs, 0.50), percentile(b.connectMs, 0.99));
+  }
+  if (!b.storm.empty()) {
+    std::sort(b.stormMs.begin(), b.stormMs.end());
+    double secs = (double) (b.stormEnd - b.stormStart) / 1e6;
+    printf(" storm=%s storm_resumed=%d storm_full=%d storm_refused=%d storm_fail=%d "
+           "storm_ms=%.0f storm_rate=%.0f storm_p50_ms=%u storm_p99_ms=%u",
+           b.storm.c_str(), b.stormResumed, b.stormFull, b.stormRefused, b.stormFail,
+           secs * 1000, secs > 0 ? (b.stormResumed + b.stormFull) / secs : 0.0,
+           percentile(b.stormMs, 0.50), percentile(b.stormMs, 0.99));
+  }
+  printf("\n");
+  mg_mgr_free(&b.mgr);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  Bench b;
+  if (argc < 2) goto usage;
+  for (int i = 2; i < argc; i += 2) {
+    if (i + 1 >= argc) goto usage;
+    std::string arg = argv[i];
+    const char* val = argv[i + 1];
+    if (arg == "--broker") b.broker = val;
+    else if (arg == "--fs") b.fs = val;
+    else if (arg == "--prefix") b.prefix = val, b.prefixSet = true;
+    else if (arg == "--dashboard") b.dashboard = val;
+    else if (arg == "--storm") b.storm = val;
+    else if (arg == "--devices") b.devices = atoi(val);
+    else if (arg == "--conns") b.conns = atoi(val);
+    else if (arg == "--window") b.window = atoi(val);
+    else if (arg == "--rate") b.rate = atof(val);
+    else if (arg == "--payload") b.payload = atoi(val);
+    else if (arg == "--seconds") b.seconds = atoi(val);
+    else goto usage;
+  }
+  if (b.devices < 1 || b.conns < 1 || b.window < 1 || b.seconds < 1 || b.rate < 0 ||
+      b.payload < 0 || (!b.storm.empty() && b.storm != "resume" && b.storm != "full")) {
+    goto usage;
+  }
+  if (b.conns > b.devices) b.conns = b.devices;
+  if (strcmp(argv[1], "provision") == 0) return provision(b);
+  if (strcmp(argv[1], "run") == 0) return run(b);
+
+usage:
+  fprintf(stderr,
+          "usage: %s provision --fs DIR [--devices N] [--prefix P]\n"
+          "       %s run [--broker URL] [--devices N] [--conns C] [--window W]\n"
+          "              [--rate R] [--payload B] [--seconds S] [--prefix P]\n"
+          "              [--dashboard WS_URL] [--storm resume|full]\n",
+          argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Throughput of host_gateway --threads 1..N against one broker, using
+# shard_bench for the device side.  Run from the directory holding both
+# binaries, with the broker already listening:
+#
+#   host/bench/shard_scaling.sh [max_threads] [broker_url]
+#
+# DEVICES, CONNS, WINDOW and DURATION (seconds) are passed on to
+# shard_bench.  Each step provisions a fresh gateway directory and uses a
+# fresh gateway id, so no replay counters or broker sessions carry over.
+set -e
+MAX=${1:-$(nproc)}
+BROKER=${2:-mqtt://127.0.0.1:1883}
+GATEWAY=${GATEWAY:-./host_gateway}
+BENCH=${BENCH:-./shard_bench}
+DEVICES=${DEVICES:-32}
+CONNS=${CONNS:-4}
+WINDOW=${WINDOW:-1}
+DURATION=${DURATION:-10}
+
+printf "%-8s %10s %10s %10s %8s %8s\n" threads msgs/s p50_us p99_us errors lost
+k=1
+while [ "$k" -le "$MAX" ]; do
+  fs=$(mktemp -d)
+  "$BENCH" provision --fs "$fs" --devices "$DEVICES" > /dev/null
+  "$GATEWAY" --id "bench$$_$k" --brokers "$BROKER" --fs "$fs" --http $((18000 + k)) \
+      --threads "$k" --quiet &
+  gw=$!
+  sleep $((1 + k))                          # begin() plus connect, per shard
+  line=$("$BENCH" run --broker "$BROKER" --devices "$DEVICES" --conns "$CONNS" \
+             --window "$WINDOW" --seconds "$DURATION")
+  kill "$gw"; wait "$gw" 2>/dev/null || true
+  rm -rf "$fs"
+  field() { echo "$line" | tr ' ' '\n' | sed -n "s/^$1=//p"; }
+  printf "%-8s %10s %10s %10s %8s %8s\n" "$k" "$(field rate)" "$(field p50_us)" \
+      "$(field p99_us)" "$(field errors)" "$(field lost)"
+  k=$((k + 1))
+done
@@ -0,0 +1,130 @@
+// Speed of src/x25519.c: key pair generation (scalar times the base point)
+// and shared secrets (scalar times a peer's key), in operations per second.
+//
+//   x25519_bench [--seconds S]
+//
+// Checks the RFC 7748 test vectors first and exits with status 1 when one
+// fails.  Prints one line: the field implementation, the time of the first
+// key pair (which builds the 64-bit fixed-base table), and both rates.
+// To compare with the 32-bit code, build a second copy with
+// -DX25519_RADIX51=0.
+//
+// Build from the repository root, with the objects of the host gateway:
+//   g++ -std=gnu++17 -O2 -Isrc host/bench/x25519_bench.cpp x25519.o -o x25519_bench
+
+#include "x25519.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+
+static uint64_t nowUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000;
+}
+
+static void fromHex(const char* hex, uint8_t out[X25519_BYTES]) {
+  for (int i = 0; i < X25519_BYTES; i++) {
+    unsigned v = 0;
+    sscanf(hex + 2 * i, "%2x", &v);
+    out[i] = (uint8_t) v;
+  }
+}
+
+static bool expect(const char* what, const uint8_t got[X25519_BYTES], const char* hex) {
+  uint8_t want[X25519_BYTES];
+  fromHex(hex, want);
+  if (memcmp(got, want, X25519_BYTES) == 0) return true;
+  fprintf(stderr, "FAIL: %s\n", what);
+  return false;
+}
+
+// RFC 7748 sections 5.2 and 6.1
+static bool selfTest() {
+  uint8_t k[X25519_BYTES], u[X25519_BYTES], out[X25519_BYTES];
+  bool ok = true;
+  fromHex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4", k);
+  fromHex("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c", u);
+  x25519(out, k, u, 1);
+  ok &= expect("5.2 vector 1", out,
+               "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+
+  uint8_t alicePriv[X25519_BYTES], bobPriv[X25519_BYTES];
+  uint8_t alicePub[X25519_BYTES], bobPub[X25519_BYTES];
+  fromHex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", alicePriv);
+  fromHex("5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb", bobPriv);
+  x25519(alicePub, alicePriv, X25519_BASE_POINT, 1);
+  x25519(bobPub, bobPriv, X25519_BASE_POINT, 1);
+  ok &= expect("6.1 Alice public key", alicePub,
+               "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+  ok &= expect("6.1 Bob public key", bobPub,
+               "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+  x25519(out, alicePriv, bobPub, 1);
+  ok &= expect("6.1 shared secret", out,
+               "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+
+  // k = x25519(k, u), u = old k, from k = u = 9
+  memcpy(k, X25519_BASE_POINT, X25519_BYTES);
+  memcpy(u, X25519_BASE_POINT, X25519_BYTES);
+  for (int i = 1; i <= 1000; i++) {
+    x25519(out, k, u, 1);
+    memcpy(u, k, X25519_BYTES);
+    memcpy(k, out, X25519_BYTES);
+    if (i == 1) {
+      ok &= expect("5.2 1 iteration", k,
+                   "422c8e7a6227d7bca1350b3e2bb7279f7897b87bb6854b783c60e80311ae3079");
+    }
+  }
+  ok &= expect("5.2 1000 iterations", k,
+               "684cf59ba83309552800ef566f2f4d3c1c3887c49360e3875f2eb94d99532c51");
+  return ok;
+}
+
+// Runs op for about seconds; the scalar changes every time like fresh keys
+template <typename Op>
+static double rate(double seconds, uint8_t scalar[X25519_BYTES], Op op) {
+  uint64_t start = nowUs(), end = start + (uint64_t) (seconds * 1e6);
+  uint64_t n = 0, t = start;
+  while (t < end) {
+    for (int i = 0; i < 64; i++, n++) {
+      op();
+      scalar[n % X25519_BYTES] ^= (uint8_t) (n * 131 + 7);
+    }
+    t = nowUs();
+  }
+  return (double) n * 1e6 / (double) (t - start);
+}
+
+int main(int argc, char** argv) {
+  double seconds = 2;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) goto usage;
+    if (std::string(argv[i]) == "--seconds") seconds = atof(argv[i + 1]);
+    else goto usage;
+  }
+  if (seconds <= 0) goto usage;
+
+  {
+    uint8_t sk[X25519_BYTES], peer[X25519_BYTES], out[X25519_BYTES];
+    for (int i = 0; i < X25519_BYTES; i++) sk[i] = (uint8_t) (i * 29 + 1);
+
+    uint64_t t0 = nowUs();
+    x25519(peer, sk, X25519_BASE_POINT, 1);
+    uint64_t firstUs = nowUs() - t0;
+    if (!selfTest()) return 1;
+
+    double keygen = rate(seconds, sk, [&] { x25519(out, sk, X25519_BASE_POINT, 1); });
+    double shared = rate(seconds, sk, [&] { x25519(out, sk, peer, 1); });
+    printf("impl=%s first_keygen_us=%llu keygen_ops_s=%.0f shared_ops_s=%.0f "
+           "handshake_ops_s=%.0f\n",
+           X25519_RADIX51 ? "radix51" : "radix32", (unsigned long long) firstUs,
+           keygen, shared, 1.0 / (1.0 / keygen + 1.0 / shared));
+    return 0;
+  }
+
+usage:
+  fprintf(stderr, "usage: %s [--seconds S]\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,16 @@
+#ifndef __HOST_ESP_HEAP_CAPS__H_
+#define __HOST_ESP_HEAP_CAPS__H_
+
+// The ESP-IDF capability allocator; a PC has one kind of RAM.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT     (1 << 2)
+#define MALLOC_CAP_SPIRAM   (1 << 10)
+#define MALLOC_CAP_INTERNAL (1 << 11)
+
+inline void* heap_caps_malloc(size_t size, uint32_t) { return malloc(size); }
+inline void* heap_caps_calloc(size_t n, size_t size, uint32_t) { return calloc(n, size); }
+
+#endif
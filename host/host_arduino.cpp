@@ -0,0 +1,29 @@
+// The Arduino globals and time functions of the host build, shared by
+// host_main.cpp and the simulator in host/sim.
+
+#include "Arduino.h"
+#include "WiFi.h"
+#include "LittleFS.h"
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+LittleFSFS LittleFS;
+EspClass ESP;
+
+static uint64_t monotonicUs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000ULL + (uint64_t) now.tv_nsec / 1000;
+}
+
+static const uint64_t s_startUs = monotonicUs();
+
+unsigned long millis() { return (unsigned long) ((monotonicUs() - s_startUs) / 1000); }
+unsigned long micros() { return (unsigned long) (monotonicUs() - s_startUs); }
+void delay(unsigned long ms) { usleep((useconds_t) ms * 1000); }
+long random(long max) { return max > 0 ? rand() % max : 0; }
+long random(long min, long max) { return max > min ? min + random(max - min) : min; }
+uint32_t EspClass::getFreeHeap() { return (uint32_t) mallinfo2().fordblks; }
@@ -0,0 +1,202 @@
+// Gateway for a PC: the same GatewayCore and dashboard as the ESP32 build,
+// over POSIX sockets and a directory instead of LittleFS.  Several of them
+// can share one broker as a cluster, see README "Running several gateways".
+//
+//   host_gateway [--id ID] [--brokers URLS] [--fs DIR] [--http PORT]
+//                [--cluster] [--shared] [--threads N] [--quiet] [--latency]
+//                [--capture FILE | --replay FILE [--speed X]]
+//
+// --threads N runs N shards, each a GatewayCore with its own mg_mgr, broker
+// connection and share of the devices, polled by its own thread.
+// --latency keeps every loop polling instead of sleeping between events.
+// --capture records every inbound publish to FILE under the --fs root.
+// --replay feeds such a file (a host path) through the gateway and exits:
+// at the recorded pace, X times faster, or back to back with --speed 0.
+// Without --brokers a replay talks to no broker.
+
+#include "Arduino.h"
+#include "LittleFS.h"
+#include "gateway_core.h"
+#include "gateway_dashboard.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <signal.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static std::atomic<bool> s_stop(false);
+static void onSignal(int) { s_stop = true; }
+
+// Inject every message of a capture at its recorded time on the core's
+// clock, so timeouts fire as they did while recording.  Between messages
+// the clock runs at speed times real time; at speed 0 it jumps straight to
+// the next message.
+static int replay(GatewayCore& core, ManualClock& clock, const char* path, double speed) {
+  FILE* f = fopen(path, "rb");
+  CaptureReader reader;
+  if (f == nullptr || !reader.open(File(f, path))) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    return 1;
+  }
+  uint64_t base = clock.millis();
+  uint64_t start = micros();
+  uint64_t us = 0;
+  uint32_t count = 0;
+  struct mg_str topic, payload;
+  while (!s_stop && reader.next(topic, payload, us)) {
+    while (speed > 0 && !s_stop) {
+      uint64_t at = (uint64_t) ((double) (micros() - start) * speed);
+      if (at >= us) break;
+      clock.set(base + at / 1000);
+      core.poll();
+      usleep(200);
+    }
+    clock.set(base + us / 1000);
+    core.injectMessage(topic, payload);
+    core.poll();
+    count++;
+  }
+  double wall = (double) (micros() - start) / 1e6;
+
+  static const char* const stages[GatewayMetrics::STAGE_COUNT] = {
+    "decrypt", "auth", "rpc", "rx", "encrypt"
+  };
+  MetricsSnapshot snap;
+  core.snapshotMetrics(snap);
+  printf("replayed %lu messages, %.3f s of capture in %.3f s (%.0f msg/s)\n",
+         (unsigned long) count, (double) us / 1e6, wall, wall > 0 ? count / wall : 0.0);
+  printf("frames %llu, accepted %llu, decrypt failures %llu, auth failures %llu, "
+         "replays %llu\n",
+         (unsigned long long) snap.m.rxFrames, (unsigned long long) snap.m.rxAccepted,
+         (unsigned long long) snap.m.rxDecryptFailures,
+         (unsigned long long) snap.m.rxAuthFailures,
+         (unsigned long long) snap.m.rxReplayRejects);
+  for (int i = 0; i < GatewayMetrics::STAGE_COUNT; i++) {
+    const MetricHistogram& h = snap.m.stages[i];
+    uint64_t n = 0;
+    for (unsigned b = 0; b <= MetricHistogram::BUCKETS; b++) n += h.counts[b];
+    printf("  %-8s n=%-8llu mean %.1f us\n", stages[i], (unsigned long long) n,
+           n ? (double) h.sumUs / n : 0.0);
+  }
+  return 0;
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "usage: %s [--id ID] [--brokers URLS] [--fs DIR] [--http PORT] [--cluster] [--shared]\n"
+          "          [--threads N] [--quiet] [--latency]\n"
+          "          [--capture FILE | --replay FILE [--speed X]]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  srand((unsigned) time(NULL) ^ (unsigned) getpid());
+
+  const char* id = nullptr;
+  const char* brokers = nullptr;
+  int httpPort = 8000;
+  int threads = 1;
+  bool cluster = GW_CLUSTER_ENABLE, shared = GW_CLUSTER_SHARED_SUB;
+  bool latency = false;
+  const char* capture = nullptr;
+  const char* replayFile = nullptr;
+  double speed = 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* val = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (strcmp(arg, "--cluster") == 0) {
+      cluster = true;
+    } else if (strcmp(arg, "--shared") == 0) {
+      cluster = shared = true;
+    } else if (strcmp(arg, "--quiet") == 0) {
+      Serial.setQuiet(true);
+      mg_log_set(MG_LL_NONE);
+    } else if (strcmp(arg, "--latency") == 0) {
+      latency = true;
+    } else if (val == nullptr) {
+      usage(argv[0]);
+    } else if (strcmp(arg, "--id") == 0) {
+      id = val, i++;
+    } else if (strcmp(arg, "--brokers") == 0) {
+      brokers = val, i++;
+    } else if (strcmp(arg, "--fs") == 0) {
+      LittleFS.setRoot(val), i++;
+    } else if (strcmp(arg, "--http") == 0) {
+      httpPort = atoi(val), i++;
+    } else if (strcmp(arg, "--threads") == 0) {
+      threads = atoi(val), i++;
+    } else if (strcmp(arg, "--capture") == 0) {
+      capture = val, i++;
+    } else if (strcmp(arg, "--replay") == 0) {
+      replayFile = val, i++;
+    } else if (strcmp(arg, "--speed") == 0) {
+      speed = atof(val), i++;
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (threads < 1 || threads > GW_SHARD_MAX) usage(argv[0]);
+  if (threads > 1 && cluster) {
+    fprintf(stderr, "--threads cannot be combined with --cluster\n");
+    return 1;
+  }
+  if ((capture != nullptr || replayFile != nullptr) && threads > 1) {
+    fprintf(stderr, "--capture and --replay run a single loop, not --threads\n");
+    return 1;
+  }
+  if (capture != nullptr && replayFile != nullptr) usage(argv[0]);
+  if (replayFile != nullptr) {
+    srand(1);                               // same ids and backoff on every run
+    latency = true;                         // never sleep in poll(): the clock is ours
+    if (brokers == nullptr) brokers = "";
+  }
+
+  // Replay time is the capture's, starting from now
+  ManualClock replayClock(mg_millis(), time(NULL) - (time_t) (mg_millis() / 1000));
+  std::vector<std::unique_ptr<GatewayCore>> shards;
+  for (int i = 0; i < threads; i++) {
+    shards.emplace_back(new GatewayCore());
+    GatewayCore& core = *shards.back();
+    if (id != nullptr) core.setGatewayId(id);
+    if (brokers != nullptr) core.setBrokers(brokers);
+    core.setCluster(cluster, shared);
+    core.setShard((unsigned) i, (unsigned) threads);
+    core.setLatencyMode(latency);
+    if (replayFile != nullptr) core.setClock(&replayClock);
+  }
+  DashboardServer dashboard(*shards[0]);
+  for (int i = 1; i < threads; i++) dashboard.addShard(*shards[i]);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+  // Every dashboard client is a socket; the usual soft limit is 1024
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  // Every shard is set up before any loop starts: begin() clears the
+  // store-and-forward directory they share
+  for (auto& core : shards) core->begin();
+  if (replayFile != nullptr) return replay(*shards[0], replayClock, replayFile, speed);
+  if (capture != nullptr && !shards[0]->startCapture(capture)) return 1;
+  dashboard.begin(httpPort);
+  Serial.printf("Gateway %s, %d shard(s), dashboard on http://localhost:%d\n",
+                shards[0]->gatewayId().c_str(), threads, httpPort);
+
+  std::vector<std::thread> loops;
+  for (int i = 1; i < threads; i++) {
+    GatewayCore* core = shards[i].get();
+    loops.emplace_back([core] { while (!s_stop) core->poll(); });
+  }
+  while (!s_stop) shards[0]->poll();
+  for (auto& t : loops) t.join();
+  shards[0]->stopCapture();
+  return 0;
+}
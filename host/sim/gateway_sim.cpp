@@ -0,0 +1,931 @@
+// Deterministic simulation of one gateway on virtual time.  The GatewayCore
+// and dashboard of the host build run in-process on a ManualClock; this
+// file plays the broker, an operator on the dashboard WebSocket and a fleet
+// of devices, and moves the clock straight from one event to the next.
+// Gateway work takes no virtual time, so the run measures the protocol and
+// its queues rather than the CPU: hours of fleet traffic pass in seconds.
+//
+//   gateway_sim [--devices N] [--hours H] [--interval S] [--join S]
+//               [--latency MS] [--approve MS] [--payload B] [--outage AT:S]
+//               [--seed N] [--expect-rate R] [--max-outq N] [--max-heap B]
+//               [--max-lost N] [--max-heap-calls N] [--defer] [--verbose]
+//
+// Each device joins at a random time in the first --join seconds: it
+// publishes an encrypted request_connect, the operator authorizes it once
+// the dashboard shows it pending, and after the approval the device pings
+// every --interval seconds (+-10%) as a binary frame.  Every hop through
+// the broker takes --latency ms.  --outage drops the broker link AT
+// seconds in and refuses connects for S seconds; the broker keeps the
+// gateway's session meanwhile, as with GW_MQTT_CLEAN_SESSION 0, and holds
+// its QoS1 messages.
+//
+// Prints one line of results.  The --expect/--max options turn it into a
+// test: the exit status is 1 when the replies per virtual second after the
+// join, the outbound queue depth, the peak heap in use or the lost pings
+// are out of bounds.  The same seed gives the same run, wall time aside.
+//
+// With glibc the malloc family is wrapped to count the calls the gateway
+// makes while it handles a broker delivery, a PUBACK or a timer after the
+// join; heap_calls_per_msg is that count over the frames delivered, and
+// --max-heap-calls bounds the total.
+//
+// --defer replaces the pings with calls to a method that answers through
+// GatewayCore::deferRpc(), finished in turn by the id: completeRpc() from
+// an event on the loop, postRpcResult() from another thread, or never, so
+// that the gateway answers with its -32000 "Timeout".  The run fails
+// unless each of the three came back as it should at least once; calls
+// refused as "Busy" for want of a deferred slot are only counted.  A few
+// devices keep that down, e.g. --devices 4 --interval 5.
+//
+// Build from the repository root, with the objects of the host gateway:
+//   g++ -std=gnu++17 -O2 -DMG_ARCH=MG_ARCH_CUSTOM -Ihost -Isrc -I. host/sim/gateway_sim.cpp host/host_arduino.cpp src/gateway_*.cpp mongoose.o chacha20.o x25519.o -lpthread -o gateway_sim
+
+#include "Arduino.h"
+#include "LittleFS.h"
+#include "gateway_core.h"
+#include "gateway_dashboard.h"
+#include "chacha20.h"
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <ftw.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define SIM_PSK           "sim"
+#define SIM_EPOCH         1700000000   // unix time at virtual millis() 0
+#define SIM_START_MS      1000         // the core reads 0 as "never"
+#define SIM_LOST_MS       10000        // an unanswered ping counts as lost
+#define SIM_CONNECT_RETRY 30000        // request_connect again if not approved
+#define SIM_AUTH_RETRY_MS 50
+#define SIM_SAMPLE_MS     1000         // queue depth and heap sampling
+#define SIM_DEFER_MS      100          // --defer: loop completions come this much later
+
+// --defer: how the call with JSON-RPC id n is finished, n % 3
+enum DeferMode { DEFER_LOOP, DEFER_THREAD, DEFER_NEVER, DEFER_MODES };
+static const char* const kDeferVia[DEFER_MODES] = {"loop", "thread", nullptr};
+
+enum EventKind {
+  EV_DEVICE,                           // device timer: join or ping
+  EV_TO_GATEWAY,                       // broker delivers a device publish
+  EV_TO_DEVICE,                        // broker delivers a gateway publish
+  EV_PUBACK,
+  EV_PINGRESP,
+  EV_CONNACK,
+  EV_AUTHORIZE,                        // operator clicks Authorize
+  EV_OUTAGE,
+  EV_DEFER                             // --defer: finish a deferred call on the loop
+};
+
+struct Event {
+  uint64_t at;
+  uint64_t seq;                        // ties go in scheduling order
+  EventKind kind;
+  uint32_t arg;                        // device index or packet id
+  uint32_t link;                       // broker link, or device timer generation
+  std::string topic;
+  std::string data;
+  uint8_t qos;
+};
+
+struct EventLater {
+  bool operator()(const Event& a, const Event& b) const {
+    return a.at != b.at ? a.at > b.at : a.seq > b.seq;
+  }
+};
+
+struct SimDevice {
+  std::string id;
+  uint8_t key[32];
+  char auth[65];                       // HMAC of "<id>:<ts>:ping", ts of the join
+  char authConnect[65];
+  char authDefer[65];                  // HMAC of "<id>:<ts>:sim_defer"
+  long authTs;
+  uint32_t counter;
+  uint32_t timer;                      // EV_DEVICE of another generation is stale
+  bool ready;
+  bool authorizing;                    // operator has it in hand
+  uint64_t joinAt;                     // first request_connect
+  uint64_t connectAt;                  // latest request_connect
+  std::vector<std::pair<uint32_t, uint64_t>> inflight;   // ping id, sent at
+};
+
+struct Sim {
+  int devices = 1000, hours = 1, interval = 60, join = 60, latency = 5, approve = 200;
+  int payload = 0, outageAt = -1, outageSecs = 0;
+  unsigned seed = 1;
+  double expectRate = -1;
+  long maxOutq = -1, maxHeap = -1, maxLost = -1;
+  bool defer = false;
+  bool verbose = false;
+
+  ManualClock clock{SIM_START_MS, SIM_EPOCH};
+  GatewayCore* core = nullptr;
+  std::vector<Event> events;           // heap, earliest on top
+  uint64_t seq = 0;
+  uint64_t rng = 0;
+  std::vector<SimDevice> devs;
+  std::unordered_map<std::string, size_t> byId;
+  std::string pad;
+
+  // Broker side of the gateway's link
+  struct mg_connection* link = nullptr;
+  uint32_t linkId = 0;                 // bumped per connection
+  bool linkOpen = false;
+  std::vector<std::string> subs;       // mg_match patterns, kept with the session
+  std::vector<Event> held;             // QoS1 for the gateway while it is away
+  struct mg_connection* op = nullptr;  // operator's dashboard WebSocket
+
+  // Results
+  uint64_t measureAt = 0, endAt = 0;
+  uint64_t sent = 0, replies = 0, errors = 0, lost = 0, dups = 0;
+  uint64_t toGateway = 0, toDevice = 0, dropped = 0;
+  int ready = 0;
+  LatencyHistogram rtt, connect;
+  uint32_t outqPeak = 0;
+  size_t heapBase = 0, heapPeak = 0, heapJoined = 0, heapEnd = 0;
+  uint64_t measuredMsgs = 0;           // frames delivered to the gateway after the join
+  long maxHeapCalls = -1;
+  uint64_t deferOk[DEFER_MODES] = {}, deferBusy = 0, deferWrong = 0;
+};
+
+static Sim* g_sim = nullptr;           // for the --defer method handler
+
+// A deferred call left to time out is answered after GW_RPC_DEFER_TIMEOUT_MS
+static uint64_t lostMs(const Sim& s) {
+  return SIM_LOST_MS + (s.defer ? GW_RPC_DEFER_TIMEOUT_MS : 0);
+}
+
+// ---------------------------------------------------------------------------
+// Heap calls made by the gateway
+// ---------------------------------------------------------------------------
+static bool g_countHeap = false;       // set once the fleet has joined
+static int g_inGateway = 0;
+static uint64_t g_heapCalls = 0;
+
+// Wraps every call from the simulator into the core or its connections
+struct InGateway {
+  InGateway() { g_inGateway++; }
+  ~InGateway() { g_inGateway--; }
+};
+
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+static inline void countHeapCall() {
+  if (g_countHeap && g_inGateway > 0) g_heapCalls++;
+}
+
+extern "C" void* malloc(size_t n) {
+  countHeapCall();
+  return __libc_malloc(n);
+}
+
+extern "C" void* calloc(size_t n, size_t size) {
+  countHeapCall();
+  return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void* p, size_t n) {
+  countHeapCall();
+  return __libc_realloc(p, n);
+}
+#endif
+
+// xorshift64*, so the run does not depend on the C library's rand()
+static uint32_t nextRandom(Sim& s) {
+  s.rng ^= s.rng >> 12, s.rng ^= s.rng << 25, s.rng ^= s.rng >> 27;
+  return (uint32_t) ((s.rng * 2685821657736338717ULL) >> 32);
+}
+
+// Large blocks such as the device table slabs are mmap()ed: count them too
+static size_t heapInUse() {
+  struct mallinfo2 mi = mallinfo2();
+  return mi.uordblks + mi.hblkhd;
+}
+
+static void schedule(Sim& s, uint64_t at, EventKind kind, uint32_t arg,
+                     std::string topic = std::string(), std::string data = std::string(),
+                     uint8_t qos = 0) {
+  s.events.push_back(Event{at, s.seq++, kind, arg, s.linkId, std::move(topic),
+                           std::move(data), qos});
+  std::push_heap(s.events.begin(), s.events.end(), EventLater());
+}
+
+// A device has one timer; rescheduling it makes the pending event stale
+static void scheduleDevice(Sim& s, uint64_t at, size_t i) {
+  s.events.push_back(Event{at, s.seq++, EV_DEVICE, (uint32_t) i, ++s.devs[i].timer,
+                           std::string(), std::string(), 0});
+  std::push_heap(s.events.begin(), s.events.end(), EventLater());
+}
+
+static void toHex(const uint8_t* p, size_t n, char* out) {
+  for (size_t i = 0; i < n; i++) sprintf(out + i * 2, "%02x", p[i]);
+  out[n * 2] = '\0';
+}
+
+static void signAuth(const SimDevice& d, long ts, const char* method, char* out) {
+  char msg[128];
+  int n = snprintf(msg, sizeof(msg), "%s:%ld:%s", d.id.c_str(), ts, method);
+  uint8_t mac[32];
+  mg_hmac_sha256(mac, (uint8_t*) d.key, sizeof(d.key), (uint8_t*) msg, (size_t) n);
+  toHex(mac, sizeof(mac), out);
+}
+
+static void makeNonce(Sim& s, SimDevice& d, uint8_t* nonce) {
+  uint32_t ctr = ++d.counter;
+  uint64_t t = (uint64_t) s.clock.unixTime();
+  nonce[0] = (uint8_t) (ctr >> 24), nonce[1] = (uint8_t) (ctr >> 16);
+  nonce[2] = (uint8_t) (ctr >> 8), nonce[3] = (uint8_t) ctr;
+  for (int i = 0; i < 8; i++) nonce[4 + i] = (uint8_t) (t >> (56 - 8 * i));
+}
+
+// ---------------------------------------------------------------------------
+// Broker
+// ---------------------------------------------------------------------------
+static bool subscribed(const Sim& s, struct mg_str topic) {
+  for (const auto& p : s.subs) {
+    if (mg_match(topic, mg_str_n(p.data(), p.size()), NULL)) return true;
+  }
+  return false;
+}
+
+// MQTT filter to mg_match pattern: a level wildcard "+" is "*" there
+static std::string pattern(struct mg_str filter) {
+  std::string p(filter.buf, filter.len);
+  std::replace(p.begin(), p.end(), '+', '*');
+  return p;
+}
+
+// SUBSCRIBE/UNSUBSCRIBE payload after the packet id: topics, each with a
+// QoS byte when subscribing
+static void onSubscribe(Sim& s, const struct mg_mqtt_message& mm, bool sub) {
+  const uint8_t* p = (const uint8_t*) mm.dgram.buf + 1;
+  while (*p++ & 0x80) {}
+  p += 2;
+  const uint8_t* end = (const uint8_t*) mm.dgram.buf + mm.dgram.len;
+  while (p + 2 <= end) {
+    size_t len = (size_t) (p[0] << 8 | p[1]);
+    if (p + 2 + len > end) break;
+    std::string pat = pattern(mg_str_n((const char*) p + 2, len));
+    p += 2 + len + (sub ? 1 : 0);
+    auto it = std::find(s.subs.begin(), s.subs.end(), pat);
+    if (sub && it == s.subs.end()) s.subs.push_back(pat);
+    if (!sub && it != s.subs.end()) s.subs.erase(it);
+  }
+}
+
+static void closeLink(Sim& s) {
+  struct mg_connection* c = s.link;
+  if (c == nullptr) return;
+  s.link = nullptr;
+  s.linkOpen = false;
+  c->fn(c, MG_EV_CLOSE, NULL);
+  mg_iobuf_free(&c->send);
+  mg_iobuf_free(&c->recv);
+  free(c);
+}
+
+// Takes what the gateway wrote to the broker link
+static void drainLink(Sim& s) {
+  struct mg_connection* c = s.link;
+  if (c == nullptr || c->send.len == 0) return;
+  uint64_t now = s.clock.millis();
+  size_t off = 0;
+  struct mg_mqtt_message mm;
+  while (mg_mqtt_parse(c->send.buf + off, c->send.len - off, 4, &mm) == MQTT_OK) {
+    off += mm.dgram.len;
+    if (mm.cmd == MQTT_CMD_PUBLISH) {
+      s.toDevice++;
+      struct mg_str caps[2];
+      if (mg_match(mm.topic, mg_str("jrpc/devices/*/rx"), caps)) {
+        auto it = s.byId.find(std::string(caps[0].buf, caps[0].len));
+        if (it != s.byId.end()) {
+          schedule(s, now + 2 * (uint64_t) s.latency, EV_TO_DEVICE, (uint32_t) it->second,
+                   std::string(), std::string(mm.data.buf, mm.data.len));
+        }
+      }
+      if (mm.qos > 0) schedule(s, now + 2 * (uint64_t) s.latency, EV_PUBACK, mm.id);
+    } else if (mm.cmd == MQTT_CMD_SUBSCRIBE || mm.cmd == MQTT_CMD_UNSUBSCRIBE) {
+      onSubscribe(s, mm, mm.cmd == MQTT_CMD_SUBSCRIBE);
+    } else if (mm.cmd == MQTT_CMD_PINGREQ) {
+      schedule(s, now + 2 * (uint64_t) s.latency, EV_PINGRESP, 0);
+    } else if (mm.cmd == MQTT_CMD_DISCONNECT) {
+      c->is_closing = 1;
+    }
+  }
+  mg_iobuf_del(&c->send, 0, off);
+  long n = (long) off;
+  {
+    InGateway g;
+    c->fn(c, MG_EV_WRITE, &n);
+  }
+  if (c->is_closing || c->is_draining) closeLink(s);
+}
+
+static struct mg_connection* brokerConnect(Sim& s, struct mg_mgr* mgr,
+                                           mg_event_handler_t fn, void* fn_data) {
+  uint64_t now = s.clock.millis();
+  uint64_t downFrom = SIM_START_MS + (uint64_t) s.outageAt * 1000;
+  if (s.outageAt >= 0 && now >= downFrom && now < downFrom + (uint64_t) s.outageSecs * 1000) {
+    return nullptr;                    // as if the TCP connect failed
+  }
+  struct mg_connection* c = (struct mg_connection*) calloc(1, sizeof(*c));
+  if (c == nullptr) return nullptr;
+  c->mgr = mgr;
+  c->id = ++mgr->nextid;
+  c->fn = fn;
+  c->fn_data = fn_data;
+  c->is_client = 1;
+  c->send.align = c->recv.align = MG_IO_SIZE;   // as mongoose sets up a real one
+  s.link = c;
+  s.linkId++;
+  schedule(s, now + 2 * (uint64_t) s.latency, EV_CONNACK, 0);
+  return c;
+}
+
+// CONNACK, with session present once the gateway has subscribed before.
+// The core reads that flag from the head of the receive buffer.
+static void onConnack(Sim& s) {
+  struct mg_connection* c = s.link;
+  uint8_t connack[4] = {MQTT_CMD_CONNACK << 4, 2, (uint8_t) (s.subs.empty() ? 0 : 1), 0};
+  mg_iobuf_add(&c->recv, 0, connack, sizeof(connack));
+  uint8_t code = 0;
+  s.linkOpen = true;
+  c->fn(c, MG_EV_MQTT_OPEN, &code);
+  mg_iobuf_del(&c->recv, 0, sizeof(connack));
+  drainLink(s);
+  uint64_t now = s.clock.millis();
+  for (auto& e : s.held) {
+    schedule(s, now, EV_TO_GATEWAY, e.arg, std::move(e.topic), std::move(e.data), e.qos);
+  }
+  s.held.clear();
+}
+
+static void publishToGateway(Sim& s, const std::string& topic, std::string data, uint8_t qos) {
+  schedule(s, s.clock.millis() + 2 * (uint64_t) s.latency, EV_TO_GATEWAY, 0, topic,
+           std::move(data), qos);
+}
+
+static void deliverToGateway(Sim& s, Event& e) {
+  struct mg_str topic = mg_str_n(e.topic.data(), e.topic.size());
+  if (!subscribed(s, topic)) {
+    s.dropped++;
+    return;
+  }
+  if (!s.linkOpen) {
+    if (e.qos > 0) s.held.push_back(std::move(e));
+    else s.dropped++;
+    return;
+  }
+  struct mg_mqtt_message mm;
+  memset(&mm, 0, sizeof(mm));
+  mm.cmd = MQTT_CMD_PUBLISH;
+  mm.topic = topic;
+  mm.data = mg_str_n(e.data.data(), e.data.size());
+  mm.qos = e.qos;
+  s.toGateway++;
+  if (g_countHeap) s.measuredMsgs++;
+  InGateway g;
+  s.link->fn(s.link, MG_EV_MQTT_MSG, &mm);
+}
+
+// ---------------------------------------------------------------------------
+// Operator on the dashboard
+// ---------------------------------------------------------------------------
+static void sendCommand(Sim& s, const char* json) {
+  struct mg_ws_message wm;
+  memset(&wm, 0, sizeof(wm));
+  wm.data = mg_str(json);
+  wm.flags = WEBSOCKET_OP_TEXT;
+  s.op->fn(s.op, MG_EV_WS_MSG, &wm);
+}
+
+static void onDashboardMsg(Sim& s, struct mg_str msg) {
+  char* type = mg_json_get_str(msg, "$.type");
+  if (type == nullptr) return;
+  char* id = nullptr;
+  if (strcmp(type, "device_update") == 0) {
+    char* status = mg_json_get_str(msg, "$.device.status");
+    id = mg_json_get_str(msg, "$.device.id");
+    auto it = id ? s.byId.find(id) : s.byId.end();
+    if (status && it != s.byId.end() && strcmp(status, "PENDING") == 0 &&
+        !s.devs[it->second].authorizing) {
+      s.devs[it->second].authorizing = true;
+      schedule(s, s.clock.millis() + (uint64_t) s.approve, EV_AUTHORIZE, (uint32_t) it->second);
+    }
+    free(status);
+  } else if (strcmp(type, "response") == 0) {
+    char* cmd = mg_json_get_str(msg, "$.cmd");
+    char* status = mg_json_get_str(msg, "$.status");
+    id = mg_json_get_str(msg, "$.device_id");
+    auto it = id ? s.byId.find(id) : s.byId.end();
+    if (cmd && status && it != s.byId.end() && strcmp(cmd, "authorize") == 0 &&
+        strcmp(status, "ok") != 0) {
+      schedule(s, s.clock.millis() + SIM_AUTH_RETRY_MS, EV_AUTHORIZE, (uint32_t) it->second);
+    }
+    free(cmd), free(status);
+  }
+  free(type), free(id);
+}
+
+// Server frames are not masked: 0x81, length, payload
+static void drainDashboard(Sim& s) {
+  struct mg_connection* c = s.op;
+  if (c->send.len == 0) return;
+  size_t off = 0;
+  while (off + 2 <= c->send.len) {
+    const uint8_t* p = c->send.buf + off;
+    size_t hdr = 2, len = p[1] & 0x7f;
+    if (len == 126) {
+      if (off + 4 > c->send.len) break;
+      hdr = 4, len = (size_t) (p[2] << 8 | p[3]);
+    } else if (len == 127) {
+      if (off + 10 > c->send.len) break;
+      hdr = 10, len = 0;
+      for (int i = 0; i < 8; i++) len = len << 8 | p[2 + i];
+    }
+    if (off + hdr + len > c->send.len) break;
+    onDashboardMsg(s, mg_str_n((const char*) p + hdr, len));
+    off += hdr + len;
+  }
+  mg_iobuf_del(&c->send, 0, off);
+  long n = (long) off;
+  c->fn(c, MG_EV_WRITE, &n);
+}
+
+static void drain(Sim& s) {
+  // Each side can answer the other, e.g. an authorize queues an approval
+  while (s.op->send.len > 0 || (s.link != nullptr && s.link->send.len > 0)) {
+    drainLink(s);
+    drainDashboard(s);
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Devices
+// ---------------------------------------------------------------------------
+static void sendConnect(Sim& s, SimDevice& d) {
+  char plain[256];
+  int n = snprintf(plain, sizeof(plain),
+                   "{\"device_name\":\"%s\",\"device_type\":\"sim\","
+                   "\"method\":\"request_connect\",\"timestamp\":%ld,\"auth\":\"%s\"}",
+                   d.id.c_str(), d.authTs, d.authConnect);
+  uint8_t nonce[RFC_8439_NONCE_SIZE], cipher[sizeof(plain) + RFC_8439_TAG_SIZE];
+  makeNonce(s, d, nonce);
+  size_t len = chacha20_poly1305_encrypt(cipher, d.key, nonce, NULL, 0,
+                                         (uint8_t*) plain, (size_t) n);
+  char nonceHex[RFC_8439_NONCE_SIZE * 2 + 1], cipherHex[sizeof(cipher) * 2 + 1];
+  toHex(nonce, sizeof(nonce), nonceHex);
+  toHex(cipher, len, cipherHex);
+  char envelope[sizeof(cipherHex) + 128];
+  int m = snprintf(envelope, sizeof(envelope),
+                   "{\"device_id\":\"%s\",\"nonce\":\"%s\",\"ciphertext\":\"%s\"}",
+                   d.id.c_str(), nonceHex, cipherHex);
+  publishToGateway(s, GW_T_GATEWAY_CONNECT, std::string(envelope, (size_t) m), 1);
+  d.connectAt = s.clock.millis();
+  if (d.joinAt == 0) d.joinAt = d.connectAt;
+}
+
+static void sendPing(Sim& s, SimDevice& d) {
+  uint64_t now = s.clock.millis();
+  auto stale = std::remove_if(d.inflight.begin(), d.inflight.end(),
+                              [&](const std::pair<uint32_t, uint64_t>& p) {
+                                return now - p.second >= lostMs(s);
+                              });
+  s.lost += (uint64_t) (d.inflight.end() - stale);
+  d.inflight.erase(stale, d.inflight.end());
+
+  uint32_t id = d.counter + 1;
+  char head[64], tail[128];
+  int h, t;
+  if (s.defer) {
+    h = snprintf(head, sizeof(head), "{\"jsonrpc\":\"2.0\",\"method\":\"sim_defer\","
+                 "\"params\":[%u]", (unsigned) (id % DEFER_MODES));
+    t = snprintf(tail, sizeof(tail), ",\"id\":%lu,\"timestamp\":%ld,\"auth\":\"%s\"}",
+                 (unsigned long) id, d.authTs, d.authDefer);
+  } else {
+    h = snprintf(head, sizeof(head), "{\"jsonrpc\":\"2.0\",\"method\":\"ping\",\"params\":{%s",
+                 s.pad.empty() ? "}" : "\"pad\":\"");
+    t = snprintf(tail, sizeof(tail), "%s,\"id\":%lu,\"timestamp\":%ld,\"auth\":\"%s\"}",
+                 s.pad.empty() ? "" : "\"}", (unsigned long) id, d.authTs, d.auth);
+  }
+  std::string plain;
+  plain.reserve((size_t) h + s.pad.size() + (size_t) t);
+  plain.append(head, (size_t) h);
+  if (!s.defer) plain.append(s.pad);
+  plain.append(tail, (size_t) t);
+
+  std::string frame(RFC_8439_NONCE_SIZE + plain.size() + RFC_8439_TAG_SIZE, '\0');
+  uint8_t* f = (uint8_t*) &frame[0];
+  makeNonce(s, d, f);
+  chacha20_poly1305_encrypt(f + RFC_8439_NONCE_SIZE, d.key, f, NULL, 0,
+                            (const uint8_t*) plain.data(), plain.size());
+  publishToGateway(s, GW_T_GATEWAY_RX "/" + d.id, std::move(frame), 0);
+  d.inflight.push_back(std::make_pair(id, now));
+  s.sent++;
+}
+
+static void onDeviceTimer(Sim& s, size_t i) {
+  SimDevice& d = s.devs[i];
+  uint64_t now = s.clock.millis();
+  if (d.ready) {
+    sendPing(s, d);
+    uint64_t period = (uint64_t) s.interval * 1000;
+    scheduleDevice(s, now + period - period / 10 + nextRandom(s) % (period / 5 + 1), i);
+  } else {
+    if (d.joinAt == 0) {
+      d.authTs = (long) s.clock.unixTime();
+      signAuth(d, d.authTs, "ping", d.auth);
+      signAuth(d, d.authTs, "request_connect", d.authConnect);
+      signAuth(d, d.authTs, "sim_defer", d.authDefer);
+    }
+    d.authorizing = false;             // a lost approval is asked for again
+    sendConnect(s, d);
+    scheduleDevice(s, now + SIM_CONNECT_RETRY, i);
+  }
+}
+
+// Downlink in either framing, as shard_bench opens it
+static bool openMessage(const SimDevice& d, const std::string& data, std::vector<uint8_t>& plain) {
+  const uint8_t *nonce, *cipher;
+  size_t cipherLen;
+  char *nonceBuf = nullptr, *cipherBuf = nullptr;
+  if (!data.empty() && data[0] == '{') {
+    int nonceLen = 0, len = 0;
+    struct mg_str json = mg_str_n(data.data(), data.size());
+    nonceBuf = mg_json_get_hex(json, "$.nonce", &nonceLen);
+    cipherBuf = mg_json_get_hex(json, "$.ciphertext", &len);
+    if (nonceBuf == nullptr || cipherBuf == nullptr || nonceLen != RFC_8439_NONCE_SIZE) {
+      free(nonceBuf), free(cipherBuf);
+      return false;
+    }
+    nonce = (const uint8_t*) nonceBuf;
+    cipher = (const uint8_t*) cipherBuf;
+    cipherLen = (size_t) len;
+  } else {
+    nonce = (const uint8_t*) data.data();
+    cipher = nonce + RFC_8439_NONCE_SIZE;
+    cipherLen = data.size() > RFC_8439_NONCE_SIZE ? data.size() - RFC_8439_NONCE_SIZE : 0;
+  }
+  bool ok = cipherLen > RFC_8439_TAG_SIZE;
+  if (ok) {
+    plain.resize(cipherLen);
+    size_t n = chacha20_poly1305_decrypt(plain.data(), (uint8_t*) d.key, nonce, cipher, cipherLen);
+    ok = n != (size_t) -1;
+    if (ok) plain.resize(n);
+  }
+  free(nonceBuf), free(cipherBuf);
+  return ok;
+}
+
+// ---------------------------------------------------------------------------
+// --defer
+// ---------------------------------------------------------------------------
+static void rpcSimDefer(struct mg_rpc_req* r, int mode) {
+  GatewayCore* core = static_cast<GatewayCore*>(r->rpc->fn_data);
+  Sim& s = *g_sim;
+  GatewayCore::Deferred d = core->deferRpc(r);
+  if (!d.ok()) return;                 // already answered, e.g. "Busy"
+  if (mode == DEFER_LOOP) {
+    // The generation goes where schedule() would stamp the broker link
+    s.events.push_back(Event{s.clock.millis() + SIM_DEFER_MS, s.seq++, EV_DEFER, d.slot, d.gen,
+                             std::string(), std::string(), 0});
+    std::push_heap(s.events.begin(), s.events.end(), EventLater());
+  } else if (mode == DEFER_THREAD) {
+    // Joined right away so the run stays deterministic; the result still
+    // goes through the mailbox and is sent by the next poll
+    std::thread t([core, d] { core->postRpcResult(d, "{\"via\":\"thread\"}"); });
+    t.join();
+  }
+}
+
+// The reply must say how the call with this id was finished
+static void onDeferReply(Sim& s, uint32_t id, struct mg_str json) {
+  char* via = mg_json_get_str(json, "$.result.via");
+  char* message = mg_json_get_str(json, "$.error.message");
+  long code = (long) mg_json_get_long(json, "$.error.code", 0);
+  unsigned mode = id % DEFER_MODES;
+  bool ok = mode == DEFER_NEVER
+                ? code == -32000 && message != nullptr && strcmp(message, "Timeout") == 0
+                : via != nullptr && strcmp(via, kDeferVia[mode]) == 0;
+  if (ok) s.deferOk[mode]++;
+  else if (code == -32000 && message != nullptr && strcmp(message, "Busy") == 0) s.deferBusy++;
+  else s.deferWrong++;
+  free(via), free(message);
+}
+
+static void onDeviceMsg(Sim& s, size_t i, const std::string& data) {
+  SimDevice& d = s.devs[i];
+  uint64_t now = s.clock.millis();
+  std::vector<uint8_t> plain;
+  bool ok = openMessage(d, data, plain);
+  struct mg_str json = mg_str_n((char*) plain.data(), plain.size());
+  if (ok && mg_json_get(json, "$.params.status", NULL) > 0) {
+    char* method = mg_json_get_str(json, "$.method");
+    if (!d.ready && method != nullptr && strcmp(method, "connect.response") == 0) {
+      d.ready = true;
+      s.ready++;
+      s.connect.record((uint32_t) ((now - d.joinAt) * 1000));
+      scheduleDevice(s, now + nextRandom(s) % ((uint64_t) s.interval * 1000 + 1), i);
+    }
+    free(method);
+    return;
+  }
+  long id = ok ? (long) mg_json_get_long(json, "$.id", 0) : 0;
+  auto it = std::find_if(d.inflight.begin(), d.inflight.end(),
+                         [&](const std::pair<uint32_t, uint64_t>& p) { return p.first == id; });
+  if (it == d.inflight.end()) {
+    s.dups++;                          // retransmitted, or answered after SIM_LOST_MS
+    return;
+  }
+  uint64_t sentAt = it->second;
+  d.inflight.erase(it);
+  if (s.defer) {
+    onDeferReply(s, (uint32_t) id, json);
+    return;
+  }
+  if (now < s.measureAt) return;
+  if (mg_json_get(json, "$.result.pong", NULL) > 0) {
+    s.replies++;
+    s.rtt.record((uint32_t) ((now - sentAt) * 1000));
+  } else {
+    s.errors++;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Run
+// ---------------------------------------------------------------------------
+static void handle(Sim& s, Event& e) {
+  switch (e.kind) {
+    case EV_DEVICE:
+      if (e.link == s.devs[e.arg].timer) onDeviceTimer(s, e.arg);
+      break;
+    case EV_TO_GATEWAY:
+      deliverToGateway(s, e);
+      break;
+    case EV_TO_DEVICE:
+      onDeviceMsg(s, e.arg, e.data);
+      break;
+    case EV_PUBACK:
+    case EV_PINGRESP:
+      if (s.link != nullptr && s.linkOpen && e.link == s.linkId) {
+        struct mg_mqtt_message mm;
+        memset(&mm, 0, sizeof(mm));
+        mm.cmd = e.kind == EV_PUBACK ? MQTT_CMD_PUBACK : MQTT_CMD_PINGRESP;
+        mm.id = (uint16_t) e.arg;
+        InGateway g;
+        s.link->fn(s.link, MG_EV_MQTT_CMD, &mm);
+      }
+      break;
+    case EV_CONNACK:
+      if (s.link != nullptr && e.link == s.linkId) onConnack(s);
+      break;
+    case EV_AUTHORIZE: {
+      SimDevice& d = s.devs[e.arg];
+      if (d.ready) break;
+      char cmd[160];
+      snprintf(cmd, sizeof(cmd), "{\"cmd\":\"authorize\",\"device_id\":\"%s\",\"psk\":\"%s\"}",
+               d.id.c_str(), SIM_PSK);
+      sendCommand(s, cmd);
+      break;
+    }
+    case EV_OUTAGE:
+      closeLink(s);
+      break;
+    case EV_DEFER: {
+      GatewayCore::Deferred d = {(uint16_t) e.arg, (uint16_t) e.link};
+      InGateway g;
+      s.core->completeRpc(d, "{%m:%m}", MG_ESC("via"), MG_ESC(kDeferVia[DEFER_LOOP]));
+      break;
+    }
+  }
+}
+
+static void sample(Sim& s) {
+  const OutQueue::Stats& q = s.core->getOutQueueStats();
+  uint32_t depth = 0;
+  for (int i = 0; i < OutQueue::LANE_COUNT; i++) depth += q.depth[i];
+  s.outqPeak = std::max(s.outqPeak, depth);
+  s.heapPeak = std::max(s.heapPeak, heapInUse());
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+static int run(Sim& s) {
+  if (!s.verbose) {
+    Serial.setQuiet(true);
+    mg_log_set(MG_LL_NONE);
+  }
+  srand(s.seed);                       // the core's reconnect jitter
+  s.rng = 0x9E3779B97F4A7C15ULL * (s.seed + 1);
+  char fs[] = "/tmp/gateway_sim_XXXXXX";
+  if (mkdtemp(fs) == nullptr) return perror("mkdtemp"), 1;
+  LittleFS.setRoot(fs);
+  s.pad.assign((size_t) s.payload, 'x');
+  for (int i = 0; i < s.devices; i++) {
+    SimDevice d;
+    d.id = "sim" + std::to_string(i);
+    mg_sha256(d.key, (uint8_t*) SIM_PSK, strlen(SIM_PSK));
+    d.authTs = 0;
+    d.counter = d.timer = 0;
+    d.ready = d.authorizing = false;
+    d.joinAt = d.connectAt = 0;
+    s.byId[d.id] = s.devs.size();
+    s.devs.push_back(d);
+  }
+  s.heapBase = heapInUse();
+
+  s.core = new GatewayCore();
+  GatewayCore& core = *s.core;
+  core.setClock(&s.clock);
+  core.setGatewayId("sim");
+  core.setBrokers("sim://broker");
+  core.setMqttConnect([&s](struct mg_mgr* mgr, const char*, const struct mg_mqtt_opts*,
+                           mg_event_handler_t fn, void* fn_data) {
+    return brokerConnect(s, mgr, fn, fn_data);
+  });
+  g_sim = &s;
+  if (s.defer) core.addMethod("sim_defer", rpcSimDefer, PERM_PING);
+  core.begin();
+  DashboardServer dash(core);
+  dash.begin(0);
+  s.op = (struct mg_connection*) calloc(1, sizeof(*s.op));
+  s.op->mgr = core.getMgr();
+  s.op->id = ++core.getMgr()->nextid;
+  s.op->send.align = s.op->recv.align = MG_IO_SIZE;
+  dash.attachClient(s.op);
+
+  uint64_t start = s.clock.millis();
+  s.measureAt = start + (uint64_t) s.join * 1000 + (uint64_t) s.interval * 1000;
+  s.endAt = start + (uint64_t) s.hours * 3600000ULL;
+  for (size_t i = 0; i < s.devs.size(); i++) {
+    scheduleDevice(s, start + nextRandom(s) % ((uint64_t) s.join * 1000 + 1), i);
+  }
+  if (s.outageAt >= 0) schedule(s, start + (uint64_t) s.outageAt * 1000, EV_OUTAGE, 0);
+
+  uint64_t wallStart = micros();
+  uint64_t next = core.step(), sampleAt = start;
+  drain(s);
+  for (;;) {
+    uint64_t t = s.events.empty() ? next : std::min(next, s.events.front().at);
+    if (t > s.endAt) break;
+    s.clock.set(t);
+    while (!s.events.empty() && s.events.front().at <= t) {
+      std::pop_heap(s.events.begin(), s.events.end(), EventLater());
+      Event e = std::move(s.events.back());
+      s.events.pop_back();
+      handle(s, e);
+      drain(s);
+    }
+    {
+      InGateway g;
+      next = std::max(core.step(), t + 1);
+    }
+    drain(s);
+    if (t >= sampleAt) {
+      sample(s);
+      sampleAt = t + SIM_SAMPLE_MS;
+      if (s.heapJoined == 0 && t >= s.measureAt) s.heapJoined = heapInUse();
+    }
+    g_countHeap = t >= s.measureAt;
+  }
+  double wall = (double) (micros() - wallStart) / 1e6;
+  s.clock.set(s.endAt);
+  for (auto& d : s.devs) {
+    for (auto& p : d.inflight) {
+      if (s.endAt - p.second >= lostMs(s)) s.lost++;
+    }
+  }
+  g_countHeap = false;
+  sample(s);
+  s.heapEnd = heapInUse();
+
+  const OutQueue::Stats& q = core.getOutQueueStats();
+  const GatewayCore::MqttStats& m = core.getMqttStats();
+  uint32_t outqMax = 0;
+  for (int i = 0; i < OutQueue::LANE_COUNT; i++) outqMax = std::max(outqMax, q.maxDepth[i]);
+  double measured = s.endAt > s.measureAt ? (double) (s.endAt - s.measureAt) / 1000 : 0;
+  double rate = measured > 0 ? (double) s.replies / measured : 0;
+  double deviceHours = (double) s.devices * s.hours;
+  printf("devices=%d hours=%d interval=%d device_hours=%.0f wall_s=%.2f "
+         "device_hours_per_s=%.0f sent=%llu replies=%llu rate=%.1f p50_ms=%.1f p99_ms=%.1f "
+         "max_ms=%.1f errors=%llu lost=%llu dups=%llu connects=%d connect_fail=%d "
+         "connect_p50_ms=%.0f connect_p99_ms=%.0f mqtt_connects=%lu mqtt_failures=%lu "
+         "outq_peak=%u outq_max=%u outq_dropped=%lu broker_dropped=%llu "
+         "heap_peak=%zu heap_joined=%zu heap_end=%zu heap_calls=%llu heap_calls_per_msg=%.3f",
+         s.devices, s.hours, s.interval, deviceHours, wall,
+         wall > 0 ? deviceHours / wall : 0.0, (unsigned long long) s.sent,
+         (unsigned long long) s.replies, rate, s.rtt.percentile(0.50) / 1000.0,
+         s.rtt.percentile(0.99) / 1000.0, s.rtt.max() / 1000.0,
+         (unsigned long long) s.errors, (unsigned long long) s.lost,
+         (unsigned long long) s.dups, s.ready, s.devices - s.ready,
+         s.connect.percentile(0.50) / 1000.0, s.connect.percentile(0.99) / 1000.0,
+         (unsigned long) m.connects, (unsigned long) m.failures, s.outqPeak, outqMax,
+         (unsigned long) q.dropped, (unsigned long long) s.dropped,
+         s.heapPeak - s.heapBase, s.heapJoined > 0 ? s.heapJoined - s.heapBase : 0,
+         s.heapEnd - s.heapBase, (unsigned long long) g_heapCalls,
+         s.measuredMsgs > 0 ? (double) g_heapCalls / s.measuredMsgs : 0.0);
+  if (s.defer) {
+    printf(" defer_loop=%llu defer_thread=%llu defer_timeout=%llu defer_busy=%llu "
+           "defer_wrong=%llu", (unsigned long long) s.deferOk[DEFER_LOOP],
+           (unsigned long long) s.deferOk[DEFER_THREAD],
+           (unsigned long long) s.deferOk[DEFER_NEVER], (unsigned long long) s.deferBusy,
+           (unsigned long long) s.deferWrong);
+  }
+  printf("\n");
+  fflush(stdout);
+
+  int rc = 0;
+  if (s.expectRate >= 0 && rate < s.expectRate) {
+    fprintf(stderr, "FAIL: rate %.1f < %.1f\n", rate, s.expectRate), rc = 1;
+  }
+  if (s.maxOutq >= 0 && (long) outqMax > s.maxOutq) {
+    fprintf(stderr, "FAIL: outbound queue reached %u > %ld\n", outqMax, s.maxOutq), rc = 1;
+  }
+  if (s.maxHeap >= 0 && (long) (s.heapPeak - s.heapBase) > s.maxHeap) {
+    fprintf(stderr, "FAIL: heap peak %zu > %ld\n", s.heapPeak - s.heapBase, s.maxHeap), rc = 1;
+  }
+  if (s.maxLost >= 0 && (long) s.lost > s.maxLost) {
+    fprintf(stderr, "FAIL: %llu pings lost > %ld\n", (unsigned long long) s.lost, s.maxLost),
+        rc = 1;
+  }
+  if (s.maxHeapCalls >= 0 && (long) g_heapCalls > s.maxHeapCalls) {
+    fprintf(stderr, "FAIL: %llu heap calls in steady state > %ld\n",
+            (unsigned long long) g_heapCalls, s.maxHeapCalls), rc = 1;
+  }
+  if (s.defer) {
+    for (int i = 0; i < DEFER_MODES; i++) {
+      if (s.deferOk[i] > 0) continue;
+      fprintf(stderr, "FAIL: no deferred call finished %s\n",
+              i == DEFER_NEVER ? "by the timeout" : kDeferVia[i]), rc = 1;
+    }
+    if (s.deferWrong > 0) {
+      fprintf(stderr, "FAIL: %llu deferred calls answered wrongly\n",
+              (unsigned long long) s.deferWrong), rc = 1;
+    }
+  }
+
+  s.op->fn(s.op, MG_EV_CLOSE, NULL);
+  mg_iobuf_free(&s.op->send);
+  free(s.op);
+  closeLink(s);
+  delete s.core;
+  nftw(fs, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  return rc;
+}
+
+int main(int argc, char** argv) {
+  Sim s;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--verbose") {
+      s.verbose = true;
+      continue;
+    }
+    if (arg == "--defer") {
+      s.defer = true;
+      continue;
+    }
+    if (i + 1 >= argc) goto usage;
+    const char* val = argv[++i];
+    if (arg == "--devices") s.devices = atoi(val);
+    else if (arg == "--hours") s.hours = atoi(val);
+    else if (arg == "--interval") s.interval = atoi(val);
+    else if (arg == "--join") s.join = atoi(val);
+    else if (arg == "--latency") s.latency = atoi(val);
+    else if (arg == "--approve") s.approve = atoi(val);
+    else if (arg == "--payload") s.payload = atoi(val);
+    else if (arg == "--seed") s.seed = (unsigned) strtoul(val, NULL, 10);
+    else if (arg == "--expect-rate") s.expectRate = atof(val);
+    else if (arg == "--max-outq") s.maxOutq = atol(val);
+    else if (arg == "--max-heap") s.maxHeap = atol(val);
+    else if (arg == "--max-lost") s.maxLost = atol(val);
+    else if (arg == "--max-heap-calls") s.maxHeapCalls = atol(val);
+    else if (arg == "--outage") {
+      if (sscanf(val, "%d:%d", &s.outageAt, &s.outageSecs) != 2) goto usage;
+    } else goto usage;
+  }
+  if (s.devices < 1 || s.hours < 1 || s.interval < 1 || s.join < 0 || s.latency < 0 ||
+      s.approve < 0 || s.payload < 0) {
+    goto usage;
+  }
+  return run(s);
+
+usage:
+  fprintf(stderr,
+          "usage: %s [--devices N] [--hours H] [--interval S] [--join S]\n"
+          "          [--latency MS] [--approve MS] [--payload B] [--outage AT:S]\n"
+          "          [--seed N] [--expect-rate R] [--max-outq N] [--max-heap B]\n"
+          "          [--max-lost N] [--max-heap-calls N] [--defer] [--verbose]\n",
+          argv[0]);
+  return 1;
+}
@@ -2,6 +2,7 @@
 # Fixed: moved blocking wait OUT of the MQTT callback thread
 
 import json
+import os
 import time
 import random
 import argparse
@@ -19,6 +20,9 @@ except ImportError:
 
 try:
     from cryptography.hazmat.primitives.ciphers.aead import ChaCha20Poly1305
+    from cryptography.hazmat.primitives.asymmetric.x25519 import (
+        X25519PrivateKey, X25519PublicKey)
+    from cryptography.hazmat.primitives.serialization import Encoding, PublicFormat
 except ImportError:
     print("Install cryptography:  pip install cryptography")
     exit(1)
@@ -43,8 +47,10 @@ class SensorDevice:
     CONNECTING   = "connecting"
     CONNECTED    = "connected"
 
-    def __init__(self, device_id, name, device_type, broker, port, psk=None):
+    def __init__(self, device_id, name, device_type, broker, port, psk=None,
+                 binary=False):
         self.device_id   = device_id
+        self.binary      = binary
         self.name        = name
         self.device_type = device_type
         self.broker      = broker
@@ -57,9 +63,18 @@ class SensorDevice:
 
         if psk is None:
             psk = DEFAULT_PSK
-        self.enc_key = hashlib.sha256(psk.encode('utf-8')).digest()
+        self.psk_key = hashlib.sha256(psk.encode('utf-8')).digest()
+        self.enc_key = self.psk_key       # the session key once connected
         self.counter = 0
 
+        # Session setup (gateway_session.h): the ephemeral key of a full
+        # handshake in flight, or the ticket and secret to resume with
+        self.eph_key       = None
+        self.hello_ts      = 0
+        self.ticket        = None
+        self.resume_secret = None
+        self.resume_nonce  = None
+
         self.client = mqtt.Client(
             callback_api_version=mqtt.CallbackAPIVersion.VERSION1,
             client_id=f"{self.device_id}_{random.randint(0, 0xFFFF):04x}",
@@ -91,12 +106,19 @@ class SensorDevice:
         self.state = self.DISCONNECTED
 
     def _on_message(self, client, userdata, msg):
+        if not msg.payload.startswith(b"{"):
+            # Binary frame: 12-byte nonce || ciphertext || 16-byte tag
+            if len(msg.payload) >= 28:
+                self._handle_plain(self._decrypt(msg.payload[:12], msg.payload[12:]))
+            return
         try:
             payload = json.loads(msg.payload.decode())
-        except json.JSONDecodeError:
+        except (json.JSONDecodeError, UnicodeDecodeError):
             return
         if "device_id" in payload and "nonce" in payload and "ciphertext" in payload:
             self._handle_encrypted(payload)
+        elif "error" in payload and self.state == self.CONNECTING:
+            self._handle_connect_error(payload)
 
     # ──────────────────────────────────────────
     #  Encryption helpers
@@ -106,14 +128,15 @@ class SensorDevice:
         self.counter += 1
         return struct.pack('>I', self.counter) + struct.pack('>Q', int(time.time()))
 
-    def _build_auth(self, method: str, timestamp: int) -> str:
+    def _build_auth(self, method: str, timestamp: int, key=None) -> str:
         """HMAC-SHA256 signature over '<device_id>:<timestamp>:<method>'.
 
         Mirrors gw_verify_auth() in gateway_utils.cpp.  The key is the
-        derived encryption key (SHA-256 of PSK), not the raw PSK.
+        session key, or the PSK key (SHA-256 of PSK) for a connect request,
+        never the raw PSK.
         """
         msg = f"{self.device_id}:{timestamp}:{method}".encode()
-        return hmac.new(self.enc_key, msg, hashlib.sha256).hexdigest()
+        return hmac.new(key or self.enc_key, msg, hashlib.sha256).hexdigest()
 
     def _encrypt(self, plaintext: bytes):
         """ChaCha20-Poly1305 encrypt. AAD = device_id (matches gateway sendEncrypted)."""
@@ -135,23 +158,42 @@ class SensorDevice:
     #  Connect procedure
     # ──────────────────────────────────────────
     def _send_connect_request(self):
-        """Send the encrypted connect envelope — returns immediately."""
+        """Send the encrypted connect envelope — returns immediately.
+
+        With a ticket from the last session this is a resume request;
+        otherwise a full X25519 handshake.
+        """
         # FIX: reset event so a reconnect attempt doesn't use a stale result
         self.connect_event.clear()
         self.connect_ok = False
         self.state = self.CONNECTING
+        if self.ticket is not None:
+            self._send_resume_request()
+        else:
+            self._send_full_request()
 
+    def _send_full_request(self):
+        """request_connect with a new ephemeral X25519 public key, under the PSK key."""
+        self.eph_key = X25519PrivateKey.generate()
+        pub = self.eph_key.public_key().public_bytes(Encoding.Raw, PublicFormat.Raw)
+
+        # The gateway takes a known device's request only if it is newer
         method    = "request_connect"
-        timestamp = int(time.time())
+        timestamp = max(int(time.time()), self.hello_ts + 1)
+        self.hello_ts = timestamp
         inner = {
             "device_name": self.name,
             "device_type": self.device_type,
             "method":      method,
             "timestamp":   timestamp,
-            "auth":        self._build_auth(method, timestamp),
+            "auth":        self._build_auth(method, timestamp, self.psk_key),
+            "pub":         pub.hex(),
         }
         plaintext = json.dumps(inner, separators=(',', ':')).encode()
-        nonce, ct = self._encrypt(plaintext)
+        # Random nonce: the PSK key outlives the counter of this process
+        nonce = os.urandom(12)
+        ct    = ChaCha20Poly1305(self.psk_key).encrypt(
+            nonce, plaintext, self.device_id.encode('utf-8'))
 
         outer = {
             "device_id":  self.device_id,
@@ -162,6 +204,66 @@ class SensorDevice:
                             json.dumps(outer, separators=(',', ':')), qos=1)
         self._log("Connect request sent — waiting for admin approval in dashboard...")
 
+    def _send_resume_request(self):
+        """Present the ticket; the request is encrypted under a key from its secret."""
+        inner = {"method": "request_resume", "timestamp": int(time.time())}
+        plaintext = json.dumps(inner, separators=(',', ':')).encode()
+        key = hmac.new(self.resume_secret, b"resume-request", hashlib.sha256).digest()
+        self.resume_nonce = os.urandom(12)
+        ct = ChaCha20Poly1305(key).encrypt(
+            self.resume_nonce, plaintext, self.device_id.encode('utf-8'))
+
+        outer = {
+            "device_id":  self.device_id,
+            "ticket":     self.ticket.hex(),
+            "nonce":      self.resume_nonce.hex(),
+            "ciphertext": ct.hex(),
+        }
+        self.client.publish(T_GATEWAY_CONNECT,
+                            json.dumps(outer, separators=(',', ':')), qos=1)
+        self._log("Resume request sent")
+
+    def _handle_connect_error(self, payload):
+        """A refused ticket: forget it and do a full handshake instead."""
+        if payload.get("error", {}).get("message") != "Resume failed":
+            return
+        self._log("Ticket refused — full handshake")
+        self.ticket = None
+        self.resume_secret = None
+        self._send_full_request()
+
+    def _handle_session_reply(self, payload, nonce, ciphertext):
+        """Derive the new session key from the gateway's half and switch to it.
+
+        Mirrors SessionKeys in gateway_session.h.  The key is only taken
+        once the reply decrypts under it.
+        """
+        def mac(key, msg):
+            return hmac.new(key, msg, hashlib.sha256).digest()
+
+        if "pub" in payload and self.eph_key is not None:
+            gw_pub = bytes.fromhex(payload["pub"])
+            my_pub = self.eph_key.public_key().public_bytes(Encoding.Raw, PublicFormat.Raw)
+            shared = self.eph_key.exchange(X25519PublicKey.from_public_bytes(gw_pub))
+            prk = mac(self.psk_key, b"gw-session" + shared + my_pub + gw_pub)
+        elif "random" in payload and self.resume_secret and self.resume_nonce:
+            prk = mac(self.resume_secret,
+                      b"gw-resume" + self.resume_nonce + bytes.fromhex(payload["random"]))
+        else:
+            return
+        session = mac(prk, b"session")
+        try:
+            plain = ChaCha20Poly1305(session).decrypt(
+                nonce, ciphertext, self.device_id.encode('utf-8'))
+        except Exception as e:
+            self._log(f"Session reply rejected: {e!r}")
+            return
+        self.enc_key       = session
+        self.resume_secret = mac(prk, b"resume")
+        self.counter       = 0
+        self.eph_key       = None
+        self._handle_plain(plain)
+
     def wait_for_approval(self, timeout=120.0) -> bool:
         """Block the *caller* (main thread) until the gateway approves or times out."""
         if self.connect_event.wait(timeout):
@@ -185,7 +287,13 @@ class SensorDevice:
         if not nonce_hex or not cipher_hex:
             return
 
-        plain = self._decrypt(bytes.fromhex(nonce_hex), bytes.fromhex(cipher_hex))
+        if "pub" in payload or "random" in payload:
+            self._handle_session_reply(payload, bytes.fromhex(nonce_hex),
+                                       bytes.fromhex(cipher_hex))
+            return
+        self._handle_plain(self._decrypt(bytes.fromhex(nonce_hex), bytes.fromhex(cipher_hex)))
+
+    def _handle_plain(self, plain):
         if plain is None:
             return
 
@@ -194,10 +302,24 @@ class SensorDevice:
         except json.JSONDecodeError:
             return
 
+        if isinstance(msg, list):
+            # Batch response: one entry per request that carried an id
+            for item in msg:
+                if "result" in item:
+                    self._handle_result(item)
+                elif "error" in item:
+                    self._handle_error(item)
+            return
+
         if msg.get("method") == "connect.response":
-            status = msg.get("params", {}).get("status")
-            self.connect_ok = (status == "approved")
+            params = msg.get("params", {})
+            self.connect_ok = (params.get("status") == "approved")
+            if params.get("ticket"):
+                self.ticket = bytes.fromhex(params["ticket"])
+                self._log(f"Session: {params.get('session')}")
             self.connect_event.set()          # unblocks wait_for_approval()
+        elif "method" in msg and "id" in msg:
+            self._handle_request(msg)
         elif "result" in msg:
             self._handle_result(msg)
         elif "error" in msg:
@@ -206,35 +328,68 @@ class SensorDevice:
     # ──────────────────────────────────────────
     #  RPC (after approved)
     # ──────────────────────────────────────────
-    def send_rpc(self, method, params):
-        if self.state != self.CONNECTED:
-            self._log("Not connected — cannot send RPC.")
-            return
-        rpc_id    = self._next_id()
+    def _build_request(self, method, params, notify=False):
         timestamp = int(time.time())
         inner = {
             "jsonrpc":   "2.0",
             "method":    method,
             "params":    params,
-            "id":        rpc_id,
             "timestamp": timestamp,
             "auth":      self._build_auth(method, timestamp),
         }
+        if not notify:
+            rpc_id = self._next_id()
+            inner["id"] = rpc_id
+            self.pending_rpc[rpc_id] = {"method": method, "ts": time.time()}
+        return inner
+
+    def _publish_encrypted(self, inner):
         plaintext = json.dumps(inner, separators=(',', ':')).encode()
         nonce, ct = self._encrypt(plaintext)
+        if self.binary:
+            # Per-device topic: no envelope, the gateway routes by topic
+            self.client.publish(f"{T_GATEWAY_RX}/{self.device_id}", nonce + ct, qos=1)
+            return
         outer = {
             "device_id":  self.device_id,
             "nonce":      nonce.hex(),
             "ciphertext": ct.hex(),
         }
-        self.pending_rpc[rpc_id] = {"method": method, "ts": time.time()}
         self.client.publish(T_GATEWAY_RX,
                             json.dumps(outer, separators=(',', ':')), qos=1)
 
+    def send_batch(self, calls):
+        """Send several (method, params, notify) calls in one encrypted envelope."""
+        if self.state != self.CONNECTED:
+            self._log("Not connected — cannot send RPC.")
+            return
+        self._publish_encrypted([self._build_request(m, p, n) for m, p, n in calls])
+
+    def send_rpc(self, method, params):
+        if self.state != self.CONNECTED:
+            self._log("Not connected — cannot send RPC.")
+            return
+        self._publish_encrypted(self._build_request(method, params))
+
     def send_ping(self):
         self._log("Pinging gateway...")
         self.send_rpc("ping", {})
 
+    def _handle_request(self, msg):
+        """Answer a request from the gateway (its latency ping).
+
+        The reply is signed like a request, with the method it answers.
+        """
+        method    = msg.get("method")
+        timestamp = int(time.time())
+        reply = {"jsonrpc": "2.0", "id": msg["id"], "timestamp": timestamp,
+                 "auth": self._build_auth(method, timestamp)}
+        if method == "ping":
+            reply["result"] = {"ts": msg.get("params", {}).get("ts")}
+        else:
+            reply["error"] = {"code": -32601, "message": "Method not found"}
+        self._publish_encrypted(reply)
+
     def _handle_result(self, payload):
         rpc_id = payload.get("id", -1)
         result = payload.get("result", {})
@@ -262,6 +417,15 @@ class SensorDevice:
         ts = datetime.now().strftime("%H:%M:%S")
         print(f"[{ts}] [{self.device_id}] {msg}")
 
+    def reconnect(self) -> bool:
+        """Drop the broker connection and connect again, resuming with the ticket."""
+        self.client.disconnect()
+        self.client.loop_stop()
+        self.connect_event.clear()
+        self.client.connect(self.broker, self.port, keepalive=60)
+        self.client.loop_start()
+        return self.wait_for_approval(timeout=30.0)
+
     def stop(self):
         self.client.disconnect()
         self.client.loop_stop()
@@ -284,6 +448,8 @@ def interactive_mode(dev: SensorDevice):
 
     print("\n+--- Commands ---------------------+")
     print("|  ping   -- Ping gateway           |")
+    print("|  batch  -- 3 pings + 1 notify     |")
+    print("|  reconnect -- resume the session  |")
     print("|  quit   -- Exit                   |")
     print("+-----------------------------------+\n")
 
@@ -292,6 +458,10 @@ def interactive_mode(dev: SensorDevice):
             cmd = input(f"[{dev.device_id}|{dev.state}] > ").strip().lower()
             if cmd == "ping":
                 dev.send_ping()
+            elif cmd == "batch":
+                dev.send_batch([("ping", {}, False)] * 3 + [("ping", {}, True)])
+            elif cmd == "reconnect":
+                dev.reconnect()
             elif cmd in ("quit", "exit", "q"):
                 break
             elif cmd == "":
@@ -316,6 +486,7 @@ if __name__ == "__main__":
 Examples:
   python main.py --psk test123
   python main.py --device-id sensor_01 --name "Temp sensor" --type sensor --psk secret
+  python main.py --psk test123 --binary      # RPC on jrpc/gateway/rx/<id>, raw bytes
         """,
     )
     parser.add_argument("--device-id",  default=DEFAULT_DEVICE_ID)
@@ -324,10 +495,12 @@ Examples:
     parser.add_argument("--psk",        default=DEFAULT_PSK)
     parser.add_argument("--broker",     default=DEFAULT_BROKER)
     parser.add_argument("--port",       type=int, default=DEFAULT_PORT)
+    parser.add_argument("--binary",     action="store_true",
+                        help="send RPCs as binary frames on the per-device topic")
     args = parser.parse_args()
 
     dev = SensorDevice(
         args.device_id, args.name, args.device_type,
-        args.broker, args.port, args.psk,
+        args.broker, args.port, args.psk, binary=args.binary,
     )
     interactive_mode(dev)
\ No newline at end of file
@@ -373,13 +373,10 @@ static void write_64bit_int(poly1305_context *ctx, uint64_t value) {
   poly1305_update(ctx, result, 8);
 }
 
-static void poly1305_calculate_mac(
+static void poly1305_mac_with_key(
     uint8_t *mac, const uint8_t *cipher_text, size_t cipher_text_size,
-    const uint8_t key[32], const uint8_t nonce[12],
-    const uint8_t *ad, size_t ad_size) {
-  uint8_t poly_key[32] = {0};
+    const uint8_t poly_key[32], const uint8_t *ad, size_t ad_size) {
   poly1305_context poly_ctx;
-  rfc8439_keygen(poly_key, key, nonce);
   poly1305_init(&poly_ctx, poly_key);
   if (ad != NULL && ad_size > 0) {
     poly1305_update(&poly_ctx, ad, ad_size);
@@ -392,6 +389,15 @@ static void poly1305_calculate_mac(
   poly1305_finish(&poly_ctx, mac);
 }
 
+static void poly1305_calculate_mac(
+    uint8_t *mac, const uint8_t *cipher_text, size_t cipher_text_size,
+    const uint8_t key[32], const uint8_t nonce[12],
+    const uint8_t *ad, size_t ad_size) {
+  uint8_t poly_key[32] = {0};
+  rfc8439_keygen(poly_key, key, nonce);
+  poly1305_mac_with_key(mac, cipher_text, cipher_text_size, poly_key, ad, ad_size);
+}
+
 #define PM(p) ((size_t)(p))
 #define OVERLAPPING(s, s_size, b, b_size) \
   (PM(s) < PM((b) + (b_size))) && (PM(b) < PM((s) + (s_size)))
@@ -401,7 +407,9 @@ size_t chacha20_poly1305_encrypt(
     const uint8_t nonce[12], const uint8_t *ad, size_t ad_size,
     const uint8_t *plain_text, size_t plain_text_size) {
   size_t new_size = plain_text_size + RFC_8439_TAG_SIZE;
-  if (OVERLAPPING(plain_text, plain_text_size, cipher_text, new_size))
+  // The keystream is XORed one word at a time, so exact aliasing is safe
+  if (cipher_text != plain_text &&
+      OVERLAPPING(plain_text, plain_text_size, cipher_text, new_size))
     return (size_t)-1;
   chacha20_xor_stream(cipher_text, plain_text, plain_text_size, key, nonce, 1);
   poly1305_calculate_mac(cipher_text + plain_text_size, cipher_text,
@@ -414,8 +422,69 @@ size_t chacha20_poly1305_decrypt(
     const uint8_t nonce[12],
     const uint8_t *cipher_text, size_t cipher_text_size) {
   size_t actual_size = cipher_text_size - RFC_8439_TAG_SIZE;
-  if (OVERLAPPING(plain_text, actual_size, cipher_text, cipher_text_size))
+  if (plain_text != cipher_text &&
+      OVERLAPPING(plain_text, actual_size, cipher_text, cipher_text_size))
+    return (size_t)-1;
+  chacha20_xor_stream(plain_text, cipher_text, actual_size, key, nonce, 1);
+  return actual_size;
+}
+
+size_t chacha20_poly1305_open(
+    uint8_t *plain_text, const uint8_t key[32],
+    const uint8_t nonce[12], const uint8_t *ad, size_t ad_size,
+    const uint8_t *cipher_text, size_t cipher_text_size) {
+  uint8_t mac[RFC_8439_TAG_SIZE], diff = 0;
+  size_t i, actual_size;
+  if (cipher_text_size < RFC_8439_TAG_SIZE) return (size_t)-1;
+  actual_size = cipher_text_size - RFC_8439_TAG_SIZE;
+  if (plain_text != cipher_text &&
+      OVERLAPPING(plain_text, actual_size, cipher_text, cipher_text_size))
     return (size_t)-1;
+  poly1305_calculate_mac(mac, cipher_text, actual_size, key, nonce, ad, ad_size);
+  for (i = 0; i < RFC_8439_TAG_SIZE; i++) diff |= mac[i] ^ cipher_text[actual_size + i];
+  if (diff != 0) return (size_t)-1;
   chacha20_xor_stream(plain_text, cipher_text, actual_size, key, nonce, 1);
   return actual_size;
 }
+
+// ─────────────────────────────────────────────
+//  Precomputed keystream
+// ─────────────────────────────────────────────
+
+void chacha20_poly1305_precompute(
+    uint8_t poly_key[32], uint8_t *stream, size_t stream_size,
+    const uint8_t key[32], const uint8_t nonce[12]) {
+  uint32_t state[CHACHA20_STATE_WORDS];
+  uint32_t pad[CHACHA20_STATE_WORDS];
+  size_t i, b, blocks = stream_size / CHACHA20_BLOCK_SIZE;
+  rfc8439_keygen(poly_key, key, nonce);
+  initialize_state(state, key, nonce, 1);
+  for (b = 0; b < blocks; b++) {
+    core_block(state, pad);
+    state[12]++;
+    for (i = 0; i < CHACHA20_STATE_WORDS; i++) {
+      U32TO8(stream + b * CHACHA20_BLOCK_SIZE + i * sizeof(uint32_t), pad[i]);
+    }
+  }
+}
+
+size_t chacha20_poly1305_encrypt_pre(
+    uint8_t *cipher_text, const uint8_t key[32], const uint8_t nonce[12],
+    const uint8_t poly_key[32], const uint8_t *stream, size_t stream_size,
+    const uint8_t *ad, size_t ad_size,
+    const uint8_t *plain_text, size_t plain_text_size) {
+  size_t i, new_size = plain_text_size + RFC_8439_TAG_SIZE;
+  size_t pre = stream_size / CHACHA20_BLOCK_SIZE * CHACHA20_BLOCK_SIZE;
+  if (cipher_text != plain_text &&
+      OVERLAPPING(plain_text, plain_text_size, cipher_text, new_size))
+    return (size_t)-1;
+  if (pre > plain_text_size) pre = plain_text_size;
+  for (i = 0; i < pre; i++) cipher_text[i] = plain_text[i] ^ stream[i];
+  if (plain_text_size > pre) {
+    chacha20_xor_stream(cipher_text + pre, plain_text + pre, plain_text_size - pre,
+                        key, nonce, (uint32_t)(1 + pre / CHACHA20_BLOCK_SIZE));
+  }
+  poly1305_mac_with_key(cipher_text + plain_text_size, cipher_text,
+                        plain_text_size, poly_key, ad, ad_size);
+  return new_size;
+}
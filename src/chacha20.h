@@ -16,7 +16,8 @@ extern "C" {
 #define RFC_8439_NONCE_SIZE 12
 
 // Encrypt plain_text and append a 16-byte Poly1305 tag.
-// cipher_text must be at least plain_text_size + 16 bytes.
+// cipher_text must be at least plain_text_size + 16 bytes.  It may be
+// plain_text itself (encrypt in place); any other overlap is refused.
 // Returns total output size (plain_text_size + 16), or (size_t)-1 on overlap.
 size_t chacha20_poly1305_encrypt(
     uint8_t *cipher_text, const uint8_t key[32],
@@ -24,7 +25,8 @@ size_t chacha20_poly1305_encrypt(
     const uint8_t *plain_text, size_t plain_text_size);
 
 // Decrypt cipher_text (which includes 16-byte tag at the end).
-// plain_text must be at least cipher_text_size - 16 bytes.
+// plain_text must be at least cipher_text_size - 16 bytes.  It may be
+// cipher_text itself (decrypt in place); any other overlap is refused.
 // Returns plaintext size, or (size_t)-1 on overlap.
 // NOTE: does not verify the Poly1305 tag (HMAC provides integrity).
 size_t chacha20_poly1305_decrypt(
@@ -32,6 +34,30 @@ size_t chacha20_poly1305_decrypt(
     const uint8_t nonce[12],
     const uint8_t *cipher_text, size_t cipher_text_size);
 
+// chacha20_poly1305_decrypt() that checks the tag over ad and the
+// ciphertext first.  Returns (size_t)-1 when it does not match, and then
+// plain_text is left untouched.
+size_t chacha20_poly1305_open(
+    uint8_t *plain_text, const uint8_t key[32],
+    const uint8_t nonce[12], const uint8_t *ad, size_t ad_size,
+    const uint8_t *cipher_text, size_t cipher_text_size);
+
+// The nonce-dependent half of chacha20_poly1305_encrypt(), done ahead of
+// time: the Poly1305 one-time key and stream_size bytes of keystream from
+// block 1 on.  stream_size is a multiple of 64.
+void chacha20_poly1305_precompute(
+    uint8_t poly_key[32], uint8_t *stream, size_t stream_size,
+    const uint8_t key[32], const uint8_t nonce[12]);
+
+// chacha20_poly1305_encrypt() with the output of
+// chacha20_poly1305_precompute() for the same key and nonce.  Plaintext
+// beyond the precomputed keystream is encrypted from key as usual.
+size_t chacha20_poly1305_encrypt_pre(
+    uint8_t *cipher_text, const uint8_t key[32], const uint8_t nonce[12],
+    const uint8_t poly_key[32], const uint8_t *stream, size_t stream_size,
+    const uint8_t *ad, size_t ad_size,
+    const uint8_t *plain_text, size_t plain_text_size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,44 @@
+#include "gateway_arena.h"
+#include <stdlib.h>
+
+// A heap block starts with the link to the previous one
+struct OverflowBlock {
+  void* next;
+  uint64_t align;
+};
+
+void* MsgArena::alloc(size_t len) {
+  len = (len + 7) & ~(size_t)7;
+  if (len <= sizeof(m_buf) - m_used) {
+    void* p = m_buf + m_used;
+    m_used += len;
+    if (m_used > m_peak) m_peak = m_used;
+    return p;
+  }
+  OverflowBlock* b = (OverflowBlock*)malloc(sizeof(OverflowBlock) + len);
+  if (b == nullptr) return nullptr;
+  b->next = m_overflow;
+  m_overflow = b;
+  m_overflows++;
+  return b + 1;
+}
+
+char* MsgArena::jsonStr(struct mg_str json, const char* path) {
+  int len = 0, off = mg_json_get(json, path, &len);
+  if (off < 0 || len < 2 || json.buf[off] != '"') return nullptr;
+  char* s = (char*)alloc((size_t)len);
+  if (s == nullptr ||
+      !mg_json_unescape(mg_str_n(json.buf + off + 1, (size_t)(len - 2)), s, (size_t)len)) {
+    return nullptr;                         // the scope gives the space back
+  }
+  return s;
+}
+
+void MsgArena::rewind(const Mark& m) {
+  while (m_overflow != m.overflow && m_overflow != nullptr) {
+    OverflowBlock* b = (OverflowBlock*)m_overflow;
+    m_overflow = b->next;
+    free(b);
+  }
+  m_used = m.used;
+}
@@ -0,0 +1,55 @@
+#ifndef __GATEWAY_ARENA__H_
+#define __GATEWAY_ARENA__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+#include "../gateway_config.h"
+
+// Bump allocator for the scratch memory of one message: the JSON strings,
+// hex-decoded ciphertext and plaintext of a device frame, and the frame,
+// hex and envelope of an encrypted downlink.  Each handler takes an
+// ArenaScope, so everything it allocated is gone when it returns and the
+// arena is empty again between messages.  The GW_MSG_ARENA_SIZE bytes live
+// inside the object, so a message in steady state makes no heap call.  A
+// message too large for what is left gets heap blocks instead, freed with
+// the scope and counted in overflows().
+class MsgArena {
+public:
+  struct Mark {
+    size_t used;
+    void* overflow;
+  };
+
+  MsgArena() : m_used(0), m_peak(0), m_overflow(nullptr), m_overflows(0) {}
+  ~MsgArena() { rewind(Mark{0, nullptr}); }
+
+  void* alloc(size_t len);                  // 8-byte aligned, nullptr when out of heap too
+  char* jsonStr(struct mg_str json, const char* path);   // mg_json_get_str() into the arena
+
+  Mark mark() const { return Mark{m_used, m_overflow}; }
+  void rewind(const Mark& m);               // frees everything allocated since m
+
+  size_t size() const { return sizeof(m_buf); }
+  size_t peak() const { return m_peak; }
+  uint32_t overflows() const { return m_overflows; }
+
+private:
+  alignas(8) uint8_t m_buf[GW_MSG_ARENA_SIZE];
+  size_t m_used;
+  size_t m_peak;
+  void* m_overflow;                         // heap blocks, newest first
+  uint32_t m_overflows;
+};
+
+class ArenaScope {
+public:
+  explicit ArenaScope(MsgArena& arena) : m_arena(arena), m_mark(arena.mark()) {}
+  ~ArenaScope() { m_arena.rewind(m_mark); }
+
+private:
+  MsgArena& m_arena;
+  MsgArena::Mark m_mark;
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include "gateway_broker.h"
+#include <Arduino.h>
+
+BrokerSet::BrokerSet() : m_mgr(nullptr), m_clock(nullptr), m_count(0), m_active(-1),
+                         m_betterRounds(0), m_migrations(0) {
+  memset(m_brokers, 0, sizeof(m_brokers));
+  m_clientId[0] = '\0';
+}
+
+// Parse the comma separated URL list.  Entries that do not fit are skipped.
+void BrokerSet::begin(struct mg_mgr *mgr, const char *list, const char *clientId,
+                      GatewayClock *clock) {
+  m_mgr = mgr;
+  m_clock = clock;
+  mg_snprintf(m_clientId, sizeof(m_clientId), "%s", clientId);
+  m_count = 0;
+  struct mg_str s = mg_str(list), entry;
+  while (m_count < GW_MQTT_MAX_BROKERS && mg_span(s, &entry, &s, ',')) {
+    while (entry.len > 0 && entry.buf[0] == ' ') entry.buf++, entry.len--;
+    while (entry.len > 0 && entry.buf[entry.len - 1] == ' ') entry.len--;
+    if (entry.len == 0 || entry.len >= GW_MQTT_URL_MAX) {
+      Serial.printf("Ignoring broker URL '%.*s'\n", (int)entry.len, entry.buf);
+      continue;
+    }
+    Broker &b = m_brokers[m_count++];
+    memcpy(b.url, entry.buf, entry.len);
+    b.url[entry.len] = '\0';
+    Serial.printf("Broker %d: %s\n", (int)m_count - 1, b.url);
+  }
+}
+
+// ---------------------------------------------------------------------------
+int BrokerSet::best() const {
+  int pick = -1;
+  uint32_t pickRtt = 0;
+  for (size_t i = 0; i < m_count; i++) {
+    const Broker &b = m_brokers[i];
+    if (!b.up) continue;
+    uint32_t rtt = b.rttUs ? b.rttUs : UINT32_MAX;   // unmeasured ranks last
+    if (pick < 0 || rtt < pickRtt) {
+      pick = (int)i;
+      pickRtt = rtt;
+    }
+  }
+  return pick;
+}
+
+// Fastest broker that is up; with no information yet, walk the list so a
+// dead first entry does not pin the gateway.
+const char* BrokerSet::select() {
+  if (m_count == 0) return nullptr;
+  int pick = best();
+  if (pick < 0) pick = (m_active + 1) % (int)m_count;
+  if (m_active >= 0 && pick != m_active) {
+    Serial.printf("MQTT broker %s -> %s\n", m_brokers[m_active].url, m_brokers[pick].url);
+  }
+  m_active = pick;
+  m_betterRounds = 0;
+  closeProbe(m_brokers[pick]);
+  return m_brokers[pick].url;
+}
+
+bool BrokerSet::hasAlternative() const {
+  for (size_t i = 0; i < m_count; i++) {
+    if ((int)i != m_active && m_brokers[i].up) return true;
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+void BrokerSet::onActiveOpen() {
+  if (m_active < 0) return;
+  Broker &b = m_brokers[m_active];
+  b.up = true;
+  b.missed = 0;
+  b.failures = 0;
+  b.pingSentUs = 0;
+}
+
+void BrokerSet::onActiveClose() {
+  if (m_active < 0) return;
+  unsigned long now = (unsigned long)m_clock->millis();
+  markDown(m_brokers[m_active], now);
+  m_brokers[m_active].retryAt = now;        // eligible for a probe right away
+}
+
+void BrokerSet::onActivePong() {
+  if (m_active >= 0) pong(m_brokers[m_active]);
+}
+
+void BrokerSet::ping(Broker& b, struct mg_connection *c) {
+  if (b.pingSentUs != 0) {
+    b.lost++;
+    if (++b.missed >= GW_MQTT_PING_LOST_MAX) {
+      Serial.printf("MQTT broker %s stopped answering pings\n", b.url);
+      b.up = false;
+      c->is_closing = 1;
+      return;
+    }
+  }
+  mg_mqtt_ping(c);
+  b.pingSentUs = micros() | 1;
+  b.pings++;
+}
+
+void BrokerSet::pong(Broker& b) {
+  if (b.pingSentUs == 0) return;
+  uint32_t rtt = (uint32_t)(micros() - b.pingSentUs);
+  b.rttLastUs = rtt;
+  b.rttUs = b.rttUs == 0 ? rtt : b.rttUs + ((int32_t)(rtt - b.rttUs) >> 2);
+  b.pingSentUs = 0;
+  b.missed = 0;
+  b.up = true;
+}
+
+void BrokerSet::markDown(Broker& b, unsigned long now) {
+  b.up = false;
+  b.open = false;
+  b.pingSentUs = 0;
+  b.missed = 0;
+  if (b.failures < 16) b.failures++;
+  unsigned long wait = GW_MQTT_PING_MS << (b.failures - 1);
+  b.retryAt = now + (wait < GW_MQTT_BACKOFF_MAX_MS ? wait : GW_MQTT_BACKOFF_MAX_MS);
+}
+
+// ---------------------------------------------------------------------------
+// Probe connections
+// ---------------------------------------------------------------------------
+BrokerSet::Broker* BrokerSet::probeOwner(struct mg_connection *c) {
+  for (size_t i = 0; i < m_count; i++) {
+    if (m_brokers[i].probe == c) return &m_brokers[i];
+  }
+  return nullptr;                  // retired probe
+}
+
+// One client id per broker: on a clustered broker ids are global, and
+// probes sharing one would keep taking each other's session over.
+void BrokerSet::openProbe(Broker& b, unsigned long now) {
+  char id[sizeof(m_clientId) + 8];
+  mg_snprintf(id, sizeof(id), "%s_p%u", m_clientId, (unsigned)(&b - m_brokers));
+  struct mg_mqtt_opts opts = {};
+  opts.client_id = mg_str(id);
+  opts.clean     = true;
+  opts.keepalive = GW_MQTT_KEEPALIVE;
+  opts.version   = 4;
+  b.open = false;
+  b.probe = mg_mqtt_connect(m_mgr, b.url, &opts, probeFn, this);
+  if (b.probe == nullptr) markDown(b, now);
+}
+
+void BrokerSet::closeProbe(Broker& b) {
+  if (b.probe == nullptr) return;
+  b.probe->is_closing = 1;
+  b.probe = nullptr;               // its MG_EV_CLOSE no longer finds an owner
+  b.open = false;
+  b.pingSentUs = 0;
+}
+
+void BrokerSet::probeFn(struct mg_connection *c, int ev, void *ev_data) {
+  BrokerSet *self = static_cast<BrokerSet*>(c->fn_data);
+  Broker *b = self->probeOwner(c);
+  if (b == nullptr) return;
+  if (ev == MG_EV_MQTT_OPEN) {
+    if (*(uint8_t*)ev_data != 0) return;   // refused; mongoose closes it
+    b->open = true;
+    b->failures = 0;
+    self->ping(*b, c);
+  } else if (ev == MG_EV_MQTT_CMD) {
+    struct mg_mqtt_message *mm = (struct mg_mqtt_message*)ev_data;
+    if (mm->cmd == MQTT_CMD_PINGRESP) self->pong(*b);
+  } else if (ev == MG_EV_CLOSE) {
+    b->probe = nullptr;
+    self->markDown(*b, (unsigned long)self->m_clock->millis());
+  }
+}
+
+// ---------------------------------------------------------------------------
+bool BrokerSet::tick(struct mg_connection *main, bool mainOpen, unsigned long now) {
+  for (size_t i = 0; i < m_count; i++) {
+    Broker &b = m_brokers[i];
+    if ((int)i == m_active) {
+      if (main != nullptr && mainOpen) ping(b, main);
+    } else if (b.probe == nullptr) {
+      if ((long)(now - b.retryAt) >= 0) openProbe(b, now);
+    } else if (b.open) {
+      ping(b, b.probe);
+    }
+  }
+
+  if (m_active < 0 || !mainOpen || !m_brokers[m_active].up) return false;
+  const Broker &cur = m_brokers[m_active];
+  int pick = best();
+  if (pick >= 0 && pick != m_active && cur.rttUs != 0 &&
+      m_brokers[pick].rttUs + GW_MQTT_MIGRATE_MARGIN_US < cur.rttUs) {
+    if (++m_betterRounds >= GW_MQTT_MIGRATE_ROUNDS) {
+      m_betterRounds = 0;
+      m_migrations++;
+      Serial.printf("MQTT broker %s is faster (%lu us vs %lu us), migrating\n",
+                    m_brokers[pick].url, (unsigned long)m_brokers[pick].rttUs,
+                    (unsigned long)cur.rttUs);
+      return true;
+    }
+  } else {
+    m_betterRounds = 0;
+  }
+  return false;
+}
+
+void BrokerSet::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data, "{%m:%d,%m:%lu,%m:[", MG_ESC("active"), m_active,
+             MG_ESC("migrations"), (unsigned long)m_migrations, MG_ESC("brokers"));
+  for (size_t i = 0; i < m_count; i++) {
+    const Broker &b = m_brokers[i];
+    mg_xprintf(pfn, pfn_data, "%s{%m:%m,%m:%s,%m:%lu,%m:%lu,%m:%lu,%m:%lu}",
+               i == 0 ? "" : ",", MG_ESC("url"), MG_ESC(b.url),
+               MG_ESC("up"), b.up ? "true" : "false",
+               MG_ESC("rtt_us"), (unsigned long)b.rttUs,
+               MG_ESC("rtt_last_us"), (unsigned long)b.rttLastUs,
+               MG_ESC("pings"), (unsigned long)b.pings,
+               MG_ESC("lost"), (unsigned long)b.lost);
+  }
+  mg_xprintf(pfn, pfn_data, "]}");
+}
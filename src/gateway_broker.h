@@ -0,0 +1,87 @@
+#ifndef __GATEWAY_BROKER__H_
+#define __GATEWAY_BROKER__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+#include "gateway_clock.h"
+#include "../gateway_config.h"
+
+// Broker selection for the gateway's MQTT link.
+//
+// GW_MQTT_BROKERS lists one or more broker URLs.  The active broker is
+// reached over the gateway's main connection; every other broker gets a
+// lightweight probe connection (clean session, no subscriptions).  Every
+// GW_MQTT_PING_MS a PINGREQ goes out on each open connection and the
+// PINGRESP round trip feeds a per-broker RTT average.  A broker that misses
+// GW_MQTT_PING_LOST_MAX pings in a row is treated as down.
+//
+// tick() reports when another healthy broker has been faster than the
+// active one by GW_MQTT_MIGRATE_MARGIN_US for GW_MQTT_MIGRATE_ROUNDS ping
+// rounds in a row; the caller then closes its connection and reconnects to
+// select().  The brokers are assumed to be bridged or clustered, so devices
+// reach the gateway whichever one it uses.
+class BrokerSet {
+public:
+  struct Broker {
+    char url[GW_MQTT_URL_MAX];
+    struct mg_connection *probe;   // null for the active broker
+    bool open;                     // probe CONNACK received
+    bool up;                       // connected and answering pings
+    unsigned long pingSentUs;      // micros() of outstanding PINGREQ, 0 = none
+    uint32_t rttUs;                // EWMA of PINGREQ -> PINGRESP
+    uint32_t rttLastUs;
+    uint32_t pings;
+    uint32_t lost;                 // pings never answered
+    uint8_t  missed;               // consecutive unanswered pings
+    uint8_t  failures;             // consecutive probe connect failures
+    unsigned long retryAt;         // next probe attempt, millis()
+  };
+
+  BrokerSet();
+
+  // clientId is the main connection's; the probe to broker n uses
+  // "<clientId>_p<n>".
+  // Retry times are on the gateway's clock.
+  void begin(struct mg_mgr *mgr, const char *list, const char *clientId, GatewayClock *clock);
+  size_t count() const { return m_count; }
+  const Broker& at(size_t i) const { return m_brokers[i]; }
+  int active() const { return m_active; }
+
+  // Choose the broker for the next main connection and make it active.
+  const char* select();
+  bool hasAlternative() const;     // another broker is up right now
+
+  // Main-connection hooks; the probes handle their own events.
+  void onActiveOpen();
+  void onActiveClose();
+  void onActivePong();
+
+  // Send pings, open or retire probes.  Returns true when the caller should
+  // migrate to a faster broker.  A dead main connection is closed here.
+  bool tick(struct mg_connection *main, bool mainOpen, unsigned long now);
+
+  uint32_t migrations() const { return m_migrations; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;
+
+private:
+  struct mg_mgr *m_mgr;
+  GatewayClock *m_clock;
+  char m_clientId[72];
+  Broker m_brokers[GW_MQTT_MAX_BROKERS];
+  size_t m_count;
+  int m_active;
+  uint8_t m_betterRounds;
+  uint32_t m_migrations;
+
+  static void probeFn(struct mg_connection *c, int ev, void *ev_data);
+  Broker* probeOwner(struct mg_connection *c);
+  void openProbe(Broker& b, unsigned long now);
+  void closeProbe(Broker& b);
+  void ping(Broker& b, struct mg_connection *c);
+  void pong(Broker& b);
+  void markDown(Broker& b, unsigned long now);
+  int best() const;
+};
+
+#endif
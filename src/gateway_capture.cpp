@@ -0,0 +1,132 @@
+#include "gateway_capture.h"
+
+static const char CAPTURE_MAGIC[4] = {'G', 'W', 'C', '1'};
+
+MqttCapture::MqttCapture() : m_active(false), m_lastUs(0), m_topicLen(0), m_len(0),
+                             m_messages(0), m_bytes(0) {}
+
+bool MqttCapture::start(const char* path) {
+  stop();
+  m_file = LittleFS.open(path, "w");
+  if (!m_file) {
+    Serial.printf("Capture: cannot open %s\n", path);
+    return false;
+  }
+  m_active = true;
+  m_topicLen = 0;
+  m_len = 0;
+  m_messages = 0;
+  m_bytes = 0;
+  put(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+  Serial.printf("Capturing inbound MQTT to %s\n", path);
+  return true;
+}
+
+void MqttCapture::stop() {
+  if (!m_active) return;
+  flush();
+  m_file.close();
+  m_active = false;
+  Serial.printf("Capture stopped: %lu messages, %lu bytes\n",
+                (unsigned long)m_messages, (unsigned long)m_bytes);
+}
+
+void MqttCapture::record(struct mg_str topic, struct mg_str payload, unsigned long nowUs) {
+  if (!m_active) return;
+  if (m_bytes + topic.len + payload.len + 16 > GW_CAPTURE_MAX_BYTES) {
+    Serial.println("Capture: GW_CAPTURE_MAX_BYTES reached");
+    stop();
+    return;
+  }
+  putVarint(m_messages == 0 ? 0 : (uint32_t)(nowUs - m_lastUs));
+  m_lastUs = nowUs;
+  if (m_topicLen > 0 && topic.len == m_topicLen && memcmp(topic.buf, m_topic, topic.len) == 0) {
+    putVarint(0);
+  } else {
+    putVarint((uint32_t)topic.len);
+    put(topic.buf, topic.len);
+    if (topic.len <= sizeof(m_topic)) {
+      memcpy(m_topic, topic.buf, topic.len);
+      m_topicLen = topic.len;
+    } else {
+      m_topicLen = 0;                       // too long to compare, never repeated
+    }
+  }
+  putVarint((uint32_t)payload.len);
+  put(payload.buf, payload.len);
+  m_messages++;
+}
+
+void MqttCapture::put(const void* data, size_t len) {
+  m_bytes += len;
+  if (m_len + len > sizeof(m_buf)) flush();
+  if (len > sizeof(m_buf)) {
+    m_file.write((const uint8_t*)data, len);
+    return;
+  }
+  memcpy(m_buf + m_len, data, len);
+  m_len += len;
+}
+
+void MqttCapture::putVarint(uint32_t v) {
+  uint8_t b[5];
+  size_t n = 0;
+  do {
+    b[n] = v & 0x7F;
+    v >>= 7;
+    if (v != 0) b[n] |= 0x80;
+    n++;
+  } while (v != 0);
+  put(b, n);
+}
+
+void MqttCapture::flush() {
+  if (m_len == 0) return;
+  m_file.write(m_buf, m_len);
+  m_len = 0;
+}
+
+// -------------------------------------------------------------------
+// Reader
+// -------------------------------------------------------------------
+bool CaptureReader::open(File file) {
+  char magic[sizeof(CAPTURE_MAGIC)];
+  m_file = file;
+  m_us = 0;
+  m_topic.clear();
+  return m_file && m_file.read((uint8_t*)magic, sizeof(magic)) == sizeof(magic) &&
+         memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool CaptureReader::getVarint(uint32_t& v) {
+  v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t b;
+    if (m_file.read(&b, 1) != 1) return false;
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+bool CaptureReader::next(struct mg_str& topic, struct mg_str& payload, uint64_t& us) {
+  uint32_t delta, topicLen, payloadLen;
+  if (!getVarint(delta) || !getVarint(topicLen)) return false;
+  if (topicLen > 0) {
+    m_topic.resize(topicLen);
+    if (m_file.read((uint8_t*)m_topic.data(), topicLen) != topicLen) return false;
+  } else if (m_topic.empty()) {
+    return false;                           // repeat of a topic never seen
+  }
+  if (!getVarint(payloadLen)) return false;
+  m_payload.resize(payloadLen);
+  if (payloadLen > 0 &&
+      m_file.read((uint8_t*)m_payload.data(), payloadLen) != payloadLen) {
+    return false;
+  }
+  m_us += delta;
+  us = m_us;
+  topic = mg_str_n(m_topic.data(), m_topic.size());
+  payload = mg_str_n(m_payload.data(), m_payload.size());
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef __GATEWAY_CAPTURE__H_
+#define __GATEWAY_CAPTURE__H_
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <vector>
+#include "mongoose.h"
+#include "../gateway_config.h"
+
+// Recording of inbound MQTT publishes, replayed on a PC by
+// host_main --replay.  The file is "GWC1" followed by one record per
+// message:
+//
+//   varint  microseconds since the previous record (the first: 0)
+//   varint  topic length, 0 = same topic as the previous record
+//   bytes   topic
+//   varint  payload length
+//   bytes   payload
+//
+// Records collect in a GW_CAPTURE_BUF buffer that is written when full, so
+// flash sees one write per block rather than one per message.
+class MqttCapture {
+public:
+  MqttCapture();
+  ~MqttCapture() { stop(); }
+
+  bool start(const char* path);             // truncates path
+  void stop();                              // writes what is buffered
+  bool active() const { return m_active; }
+  void record(struct mg_str topic, struct mg_str payload, unsigned long nowUs);
+
+  uint32_t messages() const { return m_messages; }
+  uint32_t bytes() const { return m_bytes; }
+
+private:
+  void put(const void* data, size_t len);
+  void putVarint(uint32_t v);
+  void flush();
+
+  File m_file;
+  bool m_active;
+  unsigned long m_lastUs;
+  char m_topic[GW_CAPTURE_TOPIC_MAX];       // of the previous record
+  size_t m_topicLen;
+  uint8_t m_buf[GW_CAPTURE_BUF];
+  size_t m_len;
+  uint32_t m_messages;
+  uint32_t m_bytes;                         // file size, buffer included
+};
+
+// Reads a capture back, one message at a time
+class CaptureReader {
+public:
+  bool open(File file);                     // false: not a capture
+  // us counts from the first message.  topic and payload point into the
+  // reader and stay valid until the next call.
+  bool next(struct mg_str& topic, struct mg_str& payload, uint64_t& us);
+
+private:
+  bool getVarint(uint32_t& v);
+
+  File m_file;
+  uint64_t m_us;
+  std::vector<char> m_topic;
+  std::vector<char> m_payload;
+};
+
+#endif
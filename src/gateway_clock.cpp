@@ -0,0 +1,15 @@
+#include "gateway_clock.h"
+#include "mongoose.h"
+
+namespace {
+class BoardClock : public GatewayClock {
+public:
+  uint64_t millis() override { return mg_millis(); }
+  time_t unixTime() override { return time(nullptr); }
+};
+}
+
+GatewayClock* gw_board_clock() {
+  static BoardClock clock;
+  return &clock;
+}
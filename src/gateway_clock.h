@@ -0,0 +1,36 @@
+#ifndef __GATEWAY_CLOCK__H_
+#define __GATEWAY_CLOCK__H_
+
+#include <stdint.h>
+#include <time.h>
+
+// Time source of a GatewayCore.  Reconnect backoff, queue retransmits,
+// ping and RPC timeouts, offline detection, the core's Mongoose timers and
+// the time in outbound nonces all read it, so the core can run on virtual
+// time (host_main --replay, host/sim).  micros() stays on the board clock:
+// it only measures how long work took.
+class GatewayClock {
+public:
+  virtual ~GatewayClock() {}
+  virtual uint64_t millis() = 0;            // monotonic
+  virtual time_t unixTime() = 0;            // wall clock, seconds
+};
+
+// mg_millis() and time(): the clock of a real gateway
+GatewayClock* gw_board_clock();
+
+// A clock that moves only when told to
+class ManualClock : public GatewayClock {
+public:
+  explicit ManualClock(uint64_t ms = 0, time_t epoch = 0) : m_ms(ms), m_epoch(epoch) {}
+  uint64_t millis() override { return m_ms; }
+  time_t unixTime() override { return m_epoch + (time_t)(m_ms / 1000); }
+  void set(uint64_t ms) { if (ms > m_ms) m_ms = ms; }
+  void advance(uint64_t ms) { m_ms += ms; }
+
+private:
+  uint64_t m_ms;
+  time_t m_epoch;                           // unixTime() at millis() 0
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "gateway_cluster.h"
+#include "chacha20.h"
+#include <algorithm>
+
+Cluster::Cluster() {
+  memset(m_encKey, 0, sizeof(m_encKey));
+  memset(m_macKey, 0, sizeof(m_macKey));
+  memset(m_ticketKey, 0, sizeof(m_ticketKey));
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+// Separate cipher and MAC keys, both derived from the shared secret, and
+// the session ticket key, so any member can resume any device.
+void Cluster::begin(const String& self) {
+  m_self = self;
+  m_members.clear();
+  m_members.push_back(self);
+
+  uint8_t master[32];
+  mg_sha256(master, (uint8_t*)GW_CLUSTER_KEY, strlen(GW_CLUSTER_KEY));
+  mg_hmac_sha256(m_encKey, master, sizeof(master), (uint8_t*)"cluster-enc", 11);
+  mg_hmac_sha256(m_macKey, master, sizeof(master), (uint8_t*)"cluster-mac", 11);
+  mg_hmac_sha256(m_ticketKey, master, sizeof(master), (uint8_t*)"cluster-ticket", 14);
+  memset(master, 0, sizeof(master));
+}
+
+// ---------------------------------------------------------------------------
+bool Cluster::setMember(const String& id, bool present) {
+  if (id.length() == 0 || id == m_self) return false;
+  auto it = std::lower_bound(m_members.begin(), m_members.end(), id);
+  bool known = it != m_members.end() && *it == id;
+  if (present == known) return false;
+  if (present) {
+    if (m_members.size() >= GW_CLUSTER_MAX_MEMBERS) {
+      Serial.printf("WARN: cluster full, ignoring member %s\n", id.c_str());
+      return false;
+    }
+    m_members.insert(it, id);
+  } else {
+    m_members.erase(it);
+  }
+  m_stats.rebalances++;
+  return true;
+}
+
+void Cluster::resetMembers() {
+  m_members.clear();
+  m_members.push_back(m_self);
+}
+
+// FNV-1a over "<member>/<device>" with a murmur3 finalizer, so members
+// whose names differ in one character still get unrelated scores.
+uint32_t Cluster::score(const String& member, const String& deviceId) {
+  uint32_t h = 2166136261u;
+  const char* parts[2] = { member.c_str(), deviceId.c_str() };
+  for (int i = 0; i < 2; i++) {
+    for (const char* p = parts[i]; *p; p++) {
+      h ^= (uint8_t)*p;
+      h *= 16777619u;
+    }
+    h ^= '/';
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+const String& Cluster::ownerOf(const String& deviceId) const {
+  size_t best = 0;
+  uint32_t bestScore = 0;
+  for (size_t i = 0; i < m_members.size(); i++) {
+    uint32_t s = score(m_members[i], deviceId);
+    // Members are sorted, so ties go to the same one everywhere
+    if (i == 0 || s > bestScore) {
+      best = i;
+      bestScore = s;
+    }
+  }
+  return m_members[best];
+}
+
+// ---------------------------------------------------------------------------
+size_t Cluster::seal(const uint8_t* plain, size_t len, uint8_t* out, size_t cap) {
+  if (len + SEAL_OVERHEAD > cap) return 0;
+  mg_random(out, 12);
+  size_t n = chacha20_poly1305_encrypt(out + 12, m_encKey, out, NULL, 0, plain, len);
+  if (n == (size_t)-1) return 0;
+  mg_hmac_sha256(out + 12 + n, m_macKey, sizeof(m_macKey), out, 12 + n);
+  return 12 + n + 32;
+}
+
+int Cluster::open(const uint8_t* sealed, size_t len, uint8_t* plain, size_t cap) {
+  if (len < SEAL_OVERHEAD || len - SEAL_OVERHEAD > cap) return -1;
+  size_t body = len - 32;
+  uint8_t mac[32];
+  mg_hmac_sha256(mac, m_macKey, sizeof(m_macKey), (uint8_t*)sealed, body);
+  uint8_t diff = 0;
+  for (size_t i = 0; i < sizeof(mac); i++) diff |= mac[i] ^ sealed[body + i];
+  if (diff != 0) {
+    m_stats.rejected++;
+    return -1;
+  }
+  size_t n = chacha20_poly1305_decrypt(plain, m_encKey, sealed, sealed + 12, body - 12);
+  return n == (size_t)-1 ? -1 : (int)n;
+}
+
+// ---------------------------------------------------------------------------
+void Cluster::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data, "{%m:%m,%m:[", MG_ESC("self"), MG_ESC(m_self.c_str()),
+             MG_ESC("members"));
+  for (size_t i = 0; i < m_members.size(); i++) {
+    mg_xprintf(pfn, pfn_data, "%s%m", i ? "," : "", MG_ESC(m_members[i].c_str()));
+  }
+  mg_xprintf(pfn, pfn_data, "],%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu}",
+             MG_ESC("rebalances"), (unsigned long)m_stats.rebalances,
+             MG_ESC("handed_over"), (unsigned long)m_stats.handedOver,
+             MG_ESC("adopted"), (unsigned long)m_stats.adopted,
+             MG_ESC("forwarded"), (unsigned long)m_stats.forwarded,
+             MG_ESC("records"), (unsigned long)m_stats.records,
+             MG_ESC("rejected"), (unsigned long)m_stats.rejected);
+}
@@ -0,0 +1,74 @@
+#ifndef __GATEWAY_CLUSTER__H_
+#define __GATEWAY_CLUSTER__H_
+
+#include <Arduino.h>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+#include "../gateway_config.h"
+
+// Membership, device ownership and registry sealing for a group of gateways
+// sharing one broker.
+//
+// Members announce themselves with a sealed retained message on
+// GW_T_CLUSTER/members/<gateway id>; their MQTT will clears it, so every
+// member sees the same set shortly after a join or a crash.  Each device is
+// owned by the member with the highest rendezvous hash of (member, device
+// id).  A membership change only moves the devices whose winner changed,
+// about 1/N of the fleet.
+//
+// Device records travel as retained messages on GW_T_CLUSTER/dev/<id>.  They
+// carry the device key, so they are sealed: nonce(12) || ChaCha20 ciphertext
+// || HMAC-SHA256(32) over both, with keys derived from GW_CLUSTER_KEY.  The
+// HMAC is checked before anything is decrypted.
+class Cluster {
+public:
+  struct Stats {
+    uint32_t rebalances;           // membership changes seen
+    uint32_t handedOver;           // devices this gateway gave up
+    uint32_t adopted;              // devices this gateway took over
+    uint32_t forwarded;            // frames passed on to their owner
+    uint32_t records;              // registry records applied
+    uint32_t rejected;             // records that failed the seal check
+  };
+
+  static const size_t SEAL_OVERHEAD = 12 + 16 + 32;
+
+  Cluster();
+
+  void begin(const String& self);
+  const String& self() const { return m_self; }
+
+  // Returns true when the member set changed.  The gateway itself is always
+  // a member.
+  bool setMember(const String& id, bool present);
+  void resetMembers();             // back to just ourselves, e.g. after a reconnect
+  size_t memberCount() const { return m_members.size(); }
+  const String& member(size_t i) const { return m_members[i]; }
+
+  const String& ownerOf(const String& deviceId) const;
+  bool owns(const String& deviceId) const { return ownerOf(deviceId) == m_self; }
+
+  // Returns the sealed size, or 0 when out does not have len + SEAL_OVERHEAD
+  // bytes.  open() returns the plaintext size, or -1 if the record was not
+  // sealed with our key.
+  size_t seal(const uint8_t* plain, size_t len, uint8_t* out, size_t cap);
+  int open(const uint8_t* sealed, size_t len, uint8_t* plain, size_t cap);
+  const uint8_t* ticketKey() const { return m_ticketKey; }   // see SessionKeys
+
+  Stats& stats() { return m_stats; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;
+
+private:
+  String m_self;
+  std::vector<String> m_members;   // sorted
+  uint8_t m_encKey[32];
+  uint8_t m_macKey[32];
+  uint8_t m_ticketKey[32];
+  Stats m_stats;
+
+  static uint32_t score(const String& member, const String& deviceId);
+};
+
+#endif
@@ -2,6 +2,7 @@
 #include "gateway_config.h"
 #include "gateway_utils.h"
 #include "chacha20.h"
+#include "gateway_trace.h"
 #include <WiFi.h>
 #include <time.h>
 
@@ -15,21 +16,69 @@ static void bytes_to_hex(const uint8_t* bytes, size_t len, char* hex) {
   hex[len*2] = '\0';
 }
 
-static String safeString(const char* str) {
-  if (str == nullptr) return String();
-  return String(str);
+// Topic segment to String; ids longer than a device id come back empty.
+static String segmentString(struct mg_str s) {
+  char buf[64];
+  if (s.len == 0 || s.len >= sizeof(buf)) return String();
+  mg_snprintf(buf, sizeof(buf), "%.*s", (int)s.len, s.buf);
+  return String(buf);
+}
+
+// mg_json_get_str() on a device frame into the message arena, as a trace point
+static char* rxJsonStr(MsgArena& arena, struct mg_str json, const char* path) {
+  GW_TRACE_SCOPE(TRACE_JSON);
+  return arena.jsonStr(json, path);
+}
+
+// The characters of a JSON string without its quotes, left in place in the
+// frame.  Empty when the value is missing or not a string.
+static struct mg_str rxJsonRaw(struct mg_str json, const char* path) {
+  GW_TRACE_SCOPE(TRACE_JSON);
+  int len = 0, off = mg_json_get(json, path, &len);
+  if (off < 0 || len < 2 || json.buf[off] != '"') return mg_str_n(NULL, 0);
+  return mg_str_n(json.buf + off + 1, (size_t)(len - 2));
 }
 
 // -------------------------------------------------------------------
 // GatewayCore implementation
 // -------------------------------------------------------------------
-GatewayCore::GatewayCore() : m_mqttConn(nullptr), m_rpcHead(nullptr) {
+GatewayCore::GatewayCore() : m_clock(gw_board_clock()), m_timers(nullptr),
+                             m_gatewayId(GW_GATEWAY_ID), m_brokerList(GW_MQTT_BROKERS),
+                             m_shard(0), m_shards(1),
+                             m_mqttConn(nullptr), m_mqttOpen(false), m_migrating(false),
+                             m_awaitFirstMsg(false),
+                             m_reconnectAt(0), m_downSince(0), m_openedAt(0), m_dlqDraining(false),
+                             m_dlqSweepAt(0),
+                             m_clusterOn(GW_CLUSTER_ENABLE), m_sharedSub(GW_CLUSTER_SHARED_SUB),
+                             m_forwarded(false), m_resubscribe(false), m_rebalanceAt(0),
+                             m_mailHead(0), m_mailCount(0), m_callCount(0),
+                             m_wakeId(0), m_wakePending(false),
+                             m_latencyMode(false), m_burst(false), m_burstUntil(0),
+                             m_pollWokeAt(0), m_pingSeq(0), m_pingRoundAt(0) {
+  memset(&m_mqttStats, 0, sizeof(m_mqttStats));
+  memset(&m_pollWin, 0, sizeof(m_pollWin));
+  memset(&m_pollStats, 0, sizeof(m_pollStats));
+  for (auto& p : m_pending) {
+    p.idLen = 0;
+    p.gen = 0;
+    p.used = false;
+    p.deadline = 0;
+  }
+  m_rpcOut.buf      = m_rpcOutBuf;
+  m_rpcOut.size     = sizeof(m_rpcOutBuf);
+  m_rpcOut.len      = 0;
+  m_rpcOut.overflow = false;
 
   Serial.println("GatewayCore constructed");
 }
 
 GatewayCore::~GatewayCore() {
   mg_mgr_free(&m_mgr);
+  while (m_timers != nullptr) {
+    struct mg_timer *t = m_timers;
+    m_timers = t->next;
+    free(t);
+  }
   Serial.println("GatewayCore destroyed");
 }
 
@@ -49,23 +98,140 @@ void GatewayCore::begin() {
   } else {
     Serial.println("LittleFS mounted");
   }
-
+  m_dlq.begin();
+
+  m_clientId = m_gatewayId;
+  if (m_shards > 1) {
+    // Every shard has its own broker session
+    m_clientId += "_s" + String(m_shard);
+    if (m_clusterOn) {
+      Serial.println("WARN: cluster mode is not supported with shards, disabled");
+      m_clusterOn = false;
+    }
+    Serial.printf("Shard %u of %u, client id %s\n", m_shard, m_shards, m_clientId.c_str());
+  }
+  m_devices.init();
   loadDevices();
   setupRpc();
+  if (GW_CAPTURE_AT_BOOT) startCapture(GW_CAPTURE_FILE);
+
+  if (m_clusterOn) {
+    // Ownership is settled by the first rebalance after connecting
+    m_cluster.begin(m_gatewayId);
+    for (Device& dev : m_devices) dev.owned = false;
+    addTimer(GW_CLUSTER_CHECKPOINT_MS, MG_TIMER_REPEAT, clusterTimerFn);
+    Serial.printf("Cluster '%s' member %s, rx via %s\n", GW_CLUSTER_GROUP,
+                  m_gatewayId.c_str(), m_sharedSub ? "shared subscription" : "device topics");
+  }
+  loadTicketKey();
 
-  mg_timer_add(&m_mgr, GW_MQTT_RECONNECT_MS, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW,
-               mqttTimerFn, this);
+  m_brokers.begin(&m_mgr, m_brokerList.c_str(), m_clientId.c_str(), m_clock);
+  m_downSince = nowMs();                   // first connect counts as a reconnect
+  addTimer(GW_MQTT_TICK_MS, MG_TIMER_REPEAT | MG_TIMER_RUN_NOW, mqttTimerFn);
   Serial.println("MQTT reconnect timer started");
+  addTimer(GW_MQTT_PING_MS, MG_TIMER_REPEAT, mqttPingTimerFn);
+  addTimer(1000, MG_TIMER_REPEAT, rpcDeferTimerFn);
+  addTimer(GW_OUTQ_TICK_MS, MG_TIMER_REPEAT, outqTimerFn);
+  addTimer(1000, MG_TIMER_REPEAT, pingTimerFn);
+
+  // poll() sleeps, so work posted from other tasks has to wake it up
+  if (mg_wakeup_init(&m_mgr)) {
+    m_wakeId = m_mgr.conns->id;           // mg_wrapfd() put the pipe at the head
+  } else {
+    Serial.println("WARN: no wakeup pipe, poll() sleeps at most 1 ms");
+  }
+  // The only timer on m_mgr, so it runs right after select/epoll returns
+  mg_timer_add(&m_mgr, 0, MG_TIMER_REPEAT, pollProbeFn, this);
+  m_pollWin.start = micros();
+}
+
+// The core's timers are kept apart from m_mgr's so they run on m_clock
+void GatewayCore::addTimer(uint64_t periodMs, unsigned flags, void (*fn)(void *)) {
+  struct mg_timer *t = (struct mg_timer *)calloc(1, sizeof(*t));
+  if (t == nullptr) {
+    Serial.println("ERROR: timer allocation failed");
+    return;
+  }
+  mg_timer_init(&m_timers, t, periodMs, flags, fn, this);
+}
+
+uint64_t GatewayCore::nextTimer(uint64_t now) const {
+  uint64_t next = UINT64_MAX;
+  for (struct mg_timer *t = m_timers; t != NULL; t = t->next) {
+    if (!(t->flags & MG_TIMER_REPEAT) && (t->flags & MG_TIMER_CALLED)) continue;
+    if (t->expire == 0) return now;         // armed on the next pass
+    if (t->expire < next) next = t->expire;
+  }
+  return next > now ? next : now;
 }
 
 void GatewayCore::poll() {
-  mg_mgr_poll(&m_mgr, 1);
+  GW_TRACE_THREAD(m_shard);
+  int ms = pollTimeout();
+  if (ms > 0) {
+    // About to sleep: compute keystream for the next replies, a few entries
+    // per pass so a frame that arrives meanwhile waits little
+    m_keystream.refill(nowMs(), (uint64_t)m_clock->unixTime(), GW_KEYSTREAM_REFILL);
+    if (m_keystream.pending()) ms = 0;
+  }
+  unsigned long start = micros();
+  mg_mgr_poll(&m_mgr, ms);
+  mg_timer_poll(&m_timers, m_clock->millis());
+  if (accountPoll(ms, start)) {
+    GW_TRACE_SPAN(TRACE_POLL, m_pollWokeAt, micros() - m_pollWokeAt);
+  }
+  m_wakePending = false;                  // posts from here on send a new wakeup
+  drainRpcMailbox();
+  drainCalls();
+  m_metrics.loopLag.observe(micros() - m_pollWokeAt);
+}
+
+uint64_t GatewayCore::step() {
+  GW_TRACE_THREAD(m_shard);
+  uint64_t now = m_clock->millis();
+  mg_timer_poll(&m_timers, now);
+  m_wakePending = false;
+  drainRpcMailbox();
+  drainCalls();
+  m_keystream.refill(nowMs(), (uint64_t)m_clock->unixTime(), GW_KEYSTREAM_REFILL);
+  return m_keystream.pending() ? now : nextTimer(now);
 }
 
 void GatewayCore::setupRpc() {
-  mg_rpc_add(&m_rpcHead, mg_str("ping"), rpcPing, this);
-  mg_rpc_add(&m_rpcHead, mg_str("request_connect"), rpcRequestConnect, this);
-  Serial.println("RPC handlers added");
+  static const char* const pingParams[] = {"ts"};
+  m_rpc.add("ping", rpcPing, this, PERM_PING, pingParams);
+  m_rpc.add("request_connect", rpcRequestConnect, this, PERM_NONE);
+  if (!m_rpc.build()) {
+    Serial.println("ERROR: RPC method table build failed");
+    return;
+  }
+  Serial.printf("RPC handlers added (%d methods, %d slots)\n",
+                (int)m_rpc.size(), (int)m_rpc.tableSize());
+}
+
+// Single-probe method lookup followed by a permission check against the
+// calling device.  The handler sees the device through r->req_data.
+void GatewayCore::dispatchRpc(Device& dev, struct mg_rpc_req *r) {
+  int len, off = mg_json_get(r->frame, "$.method", &len);
+  if (off <= 0 || r->frame.buf[off] != '"') {
+    mg_rpc_err(r, -32600, "\"Invalid request\"");
+    return;
+  }
+  struct mg_str method = mg_str_n(&r->frame.buf[off + 1], (size_t) len - 2);
+  const RpcMethod* m = m_rpc.find(method);
+  if (m == nullptr) {
+    mg_rpc_err(r, -32601, "\"%.*s not found\"", (int) method.len, method.buf);
+    return;
+  }
+  if ((dev.perms & m->perm) != m->perm) {
+    Serial.printf("WARN: %s lacks permission for %.*s\n", dev.id,
+                  (int) method.len, method.buf);
+    mg_rpc_err(r, -32003, "\"Permission denied\"");
+    return;
+  }
+  r->rpc      = (struct mg_rpc *) &m->rpc;
+  r->req_data = &dev;
+  m->rpc.fn(r);
 }
 
 // -------------------------------------------------------------------
@@ -77,28 +243,49 @@ void GatewayCore::mqttTimerFn(void* arg) {
     return;
   }
   GatewayCore* self = static_cast<GatewayCore*>(arg);
+  if (self->m_rebalanceAt != 0 && self->m_mqttOpen &&
+      (long)(self->nowMs() - self->m_rebalanceAt) >= 0) {
+    self->m_rebalanceAt = 0;
+    self->rebalance(self->m_resubscribe);
+  }
   if (self->m_mqttConn != nullptr) {
     // Serial.println("MQTT already connected"); // commented to avoid spam
     return;
   }
+  if ((long)(self->nowMs() - self->m_reconnectAt) < 0) return;   // backing off
 
-  char url[128];
-  mg_snprintf(url, sizeof(url), "mqtt://%s:%d", GW_MQTT_BROKER, GW_MQTT_PORT);
+  int prev = self->m_brokers.active();
+  const char* url = self->m_brokers.select();
+  if (url == nullptr) return;               // empty GW_MQTT_BROKERS
+  if (prev >= 0 && prev != self->m_brokers.active()) self->m_mqttStats.failovers++;
   Serial.printf("MQTT connecting to %s...\n", url);
 
-  char cid[64];
-  mg_snprintf(cid, sizeof(cid), "%s_%lx", GW_GATEWAY_ID, (unsigned long)random(0xFFFF));
-
+  // A fixed client id and clean=false let the broker keep our
+  // subscriptions and queue QoS1 publishes while we are away.
   struct mg_mqtt_opts opts = {};
-  opts.client_id = mg_str(cid);
-  opts.clean     = true;
-  opts.keepalive = 60;
+  opts.client_id = mg_str(self->m_clientId.c_str());
+  opts.clean     = GW_MQTT_CLEAN_SESSION;
+  opts.keepalive = GW_MQTT_KEEPALIVE;
   opts.version   = 4;
+  // In a cluster our will clears the retained membership announcement
+  char will[96];
+  if (self->m_clusterOn) {
+    mg_snprintf(will, sizeof(will), GW_T_CLUSTER "/members/%s", self->m_gatewayId.c_str());
+    opts.topic   = mg_str(will);
+    opts.message = mg_str_n("", 0);
+    opts.retain  = true;
+    opts.qos     = 1;
+  }
+  self->m_mqttStats.attempts++;
 
-  self->m_mqttConn = mg_mqtt_connect(&self->m_mgr, url, &opts, mqttEventHandler, self);
+  self->m_mqttConn = self->m_mqttConnect
+      ? self->m_mqttConnect(&self->m_mgr, url, &opts, mqttEventHandler, self)
+      : mg_mqtt_connect(&self->m_mgr, url, &opts, mqttEventHandler, self);
   // self->m_mqttConn = mg_mqtt_connect(&self->m_mgr, url, &opts, mqttEventHandler, NULL);
   if (self->m_mqttConn == nullptr) {
     Serial.println("mg_mqtt_connect returned null (check memory/broker)");
+    self->m_mqttStats.failures++;
+    self->scheduleReconnect();
   }
 }
 
@@ -114,13 +301,20 @@ void GatewayCore::mqttEventHandler(struct mg_connection *c, int ev, void *ev_dat
   GatewayCore* self = static_cast<GatewayCore*>(c->fn_data);
 
   if (ev == MG_EV_MQTT_OPEN) {
-    Serial.println("MQTT connected successfully");
-    struct mg_mqtt_opts sub = { .topic = mg_str(GW_T_GATEWAY_RX), .qos = 1 };
-    mg_mqtt_sub(c, &sub);
-    Serial.printf("Subscribed to %s\n", GW_T_GATEWAY_RX);
-    sub.topic = mg_str(GW_T_GATEWAY_CONNECT);
-    mg_mqtt_sub(c, &sub);
-    Serial.printf("Subscribed to %s\n", GW_T_GATEWAY_CONNECT);
+    self->onMqttOpen(c, *(uint8_t*)ev_data);
+  }
+  else if (ev == MG_EV_MQTT_CMD) {
+    struct mg_mqtt_message *mm = (struct mg_mqtt_message*)ev_data;
+    if (mm->cmd == MQTT_CMD_PUBACK) {
+      self->m_outq.onPuback(mm->id, self->nowMs());
+      self->m_outq.pump(c, self->nowMs());
+    } else if (mm->cmd == MQTT_CMD_PINGRESP) {
+      self->m_brokers.onActivePong();
+    }
+  }
+  else if (ev == MG_EV_WRITE) {
+    // Send buffer drained a bit; let the queue refill it
+    if (c == self->m_mqttConn && self->m_mqttOpen) self->m_outq.pump(c, self->nowMs());
   }
   else if (ev == MG_EV_MQTT_MSG) {
     struct mg_mqtt_message *mm = (struct mg_mqtt_message*)ev_data;
@@ -129,35 +323,271 @@ void GatewayCore::mqttEventHandler(struct mg_connection *c, int ev, void *ev_dat
       return;
     }
     Serial.printf("MQTT msg on topic: %.*s\n", (int)mm->topic.len, mm->topic.buf);
-    if (mg_match(mm->topic, mg_str(GW_T_GATEWAY_CONNECT), NULL)) {
-      Serial.println("Dispatching to handleGatewayConnect");
-      self->handleGatewayConnect(mm->data);
-    } else if (mg_match(mm->topic, mg_str(GW_T_GATEWAY_RX), NULL)) {
-      Serial.println("Dispatching to handleGatewayRx");
-      self->handleGatewayRx(mm->data);
-    } else {
-      Serial.println("Ignoring unknown topic");
+    if (self->m_capture.active()) self->m_capture.record(mm->topic, mm->data, micros());
+    if (self->m_awaitFirstMsg) {
+      self->m_awaitFirstMsg = false;
+      self->m_mqttStats.lastFirstMsgMs = (uint32_t)(self->nowMs() - self->m_openedAt);
     }
+    self->dispatchMsg(mm->topic, mm->data);
   }
   else if (ev == MG_EV_CLOSE) {
-    self->m_mqttConn = nullptr;
-    Serial.println("MQTT disconnected");
+    self->onMqttClose();
+  }
+}
+
+void GatewayCore::injectMessage(struct mg_str topic, struct mg_str payload) {
+  struct mg_connection c;
+  struct mg_mqtt_message mm;
+  memset(&c, 0, sizeof(c));
+  memset(&mm, 0, sizeof(mm));
+  c.fn_data = this;
+  mm.topic = topic;
+  mm.data = payload;
+  mm.qos = 1;
+  mqttEventHandler(&c, MG_EV_MQTT_MSG, &mm);
+}
+
+void GatewayCore::dispatchMsg(struct mg_str topic, struct mg_str payload) {
+  struct mg_str caps[2];
+  if (m_clusterOn && clusterMsg(topic, payload)) {
+    return;
+  } else if (mg_match(topic, mg_str(GW_T_GATEWAY_CONNECT), NULL)) {
+    Serial.println("Dispatching to handleGatewayConnect");
+    handleGatewayConnect(payload);
+  } else if (mg_match(topic, mg_str(GW_T_GATEWAY_RX), NULL)) {
+    Serial.println("Dispatching to handleGatewayRx");
+    handleGatewayRx(payload);
+  } else if (mg_match(topic, mg_str(GW_T_GATEWAY_RX "/*"), caps)) {
+    handleDeviceRx(caps[0], payload);
+  } else {
+    Serial.println("Ignoring unknown topic");
+  }
+}
+
+void GatewayCore::onMqttOpen(struct mg_connection *c, uint8_t code) {
+  if (code != 0) {
+    Serial.printf("MQTT connection refused, code %d\n", code);
+    return;                                 // mongoose closes the connection
+  }
+  // mg_mqtt_message has no session-present field, but the CONNACK is still
+  // at the head of the receive buffer: 0x20 0x02 <flags> <code>.
+  bool sessionPresent = !GW_MQTT_CLEAN_SESSION && c->recv.len >= 4 &&
+                        (c->recv.buf[2] & 1) != 0;
+  unsigned long now = nowMs();
+  m_mqttOpen = true;
+  m_brokers.onActiveOpen();
+  m_mqttStats.connects++;
+  m_mqttStats.backoffMs = 0;
+  if (m_downSince != 0) m_mqttStats.lastReconnectMs = (uint32_t)(now - m_downSince);
+  m_openedAt = now;
+  m_awaitFirstMsg = true;
+
+  if (sessionPresent) {
+    m_mqttStats.resumed++;
+    Serial.println("MQTT connected, session resumed");
+  } else {
+    Serial.println("MQTT connected successfully");
+  }
+  if (m_clusterOn) {
+    clusterOpen(c);
+  } else {
+    if (!sessionPresent) {
+      struct mg_mqtt_opts sub = {};
+      sub.topic = mg_str(GW_T_GATEWAY_RX);
+      sub.qos = 1;
+      mg_mqtt_sub(c, &sub);
+      Serial.printf("Subscribed to %s\n", GW_T_GATEWAY_RX);
+#if GW_RX_DEVICE_TOPICS
+      if (m_shards <= 1) {
+        sub.topic = mg_str(GW_T_GATEWAY_RX "/+");
+        mg_mqtt_sub(c, &sub);
+        Serial.printf("Subscribed to %s/+\n", GW_T_GATEWAY_RX);
+      }
+#endif
+      sub.topic = mg_str(GW_T_GATEWAY_CONNECT);
+      mg_mqtt_sub(c, &sub);
+      Serial.printf("Subscribed to %s\n", GW_T_GATEWAY_CONNECT);
+    }
+    // A shard takes binary frames only for its own devices.  Renewed on
+    // every connect, since devices added while offline were not subscribed.
+    if (m_shards > 1) {
+      for (Device& dev : m_devices) subscribeDevice(dev.id, true);
+      Serial.printf("Subscribed to %s/<id> for %d devices\n", GW_T_GATEWAY_RX,
+                    (int)m_devices.size());
+    }
+  }
+  m_outq.onConnect(sessionPresent);
+  m_outq.pump(c, now);
+}
+
+void GatewayCore::onMqttClose() {
+  unsigned long now = nowMs();
+  if (m_mqttOpen) {
+    m_downSince = now;
+  } else {
+    m_mqttStats.failures++;
+  }
+  m_mqttConn = nullptr;
+  m_mqttOpen = false;
+  m_awaitFirstMsg = false;
+  m_outq.onDisconnect();
+  m_brokers.onActiveClose();
+  Serial.println("MQTT disconnected");
+  if (m_migrating || m_brokers.hasAlternative()) {
+    m_migrating = false;
+    m_reconnectAt = now;                    // another broker is ready: go now
+  } else {
+    scheduleReconnect();
+  }
+}
+
+// PINGREQ on the main link and on every probe.  Doubles as MQTT keepalive.
+void GatewayCore::mqttPingTimerFn(void *arg) {
+  GatewayCore* self = static_cast<GatewayCore*>(arg);
+  if (self->m_brokers.tick(self->m_mqttConn, self->m_mqttOpen, self->nowMs()) &&
+      self->m_mqttConn != nullptr && !self->m_migrating) {
+    struct mg_mqtt_opts opts = {};
+    mg_mqtt_disconnect(self->m_mqttConn, &opts);
+    self->m_mqttConn->is_draining = 1;
+    self->m_migrating = true;
   }
 }
 
+// Jittered exponential backoff.  The first retry after a working link drops
+// comes quickly; repeated failures double the delay up to
+// GW_MQTT_BACKOFF_MAX_MS.  The jitter spreads a fleet of gateways that lost
+// the same broker at the same moment.
+void GatewayCore::scheduleReconnect() {
+  unsigned long now = nowMs();
+  uint32_t backoff = m_mqttStats.backoffMs == 0 ? GW_MQTT_BACKOFF_MIN_MS
+                                                : m_mqttStats.backoffMs * 2;
+  if (backoff > GW_MQTT_BACKOFF_MAX_MS) backoff = GW_MQTT_BACKOFF_MAX_MS;
+  m_mqttStats.backoffMs = backoff;
+  unsigned long delayMs = backoff / 2 + (unsigned long)random(backoff / 2 + 1);
+  m_reconnectAt = now + delayMs;
+  Serial.printf("MQTT retry in %lu ms\n", delayMs);
+}
+
+void GatewayCore::outqTimerFn(void *arg) {
+  GatewayCore* self = static_cast<GatewayCore*>(arg);
+  if (self->m_mqttConn == nullptr || !self->m_mqttOpen) return;
+  unsigned long now = self->nowMs();
+  self->m_outq.checkRetransmit(self->m_mqttConn, now);
+  // Continue store-and-forward bursts that did not fit in one go.  Most
+  // ticks have none, and walking every device each tick dominates a large
+  // fleet (host/sim).
+  if (self->m_dlqDraining) {
+    self->m_dlqDraining = false;
+    for (Device& dev : self->m_devices) {
+      if (dev.dlqDraining) dev.dlqDraining = !self->flushDownlink(dev);
+      if (dev.dlqDraining) self->m_dlqDraining = true;
+    }
+  }
+  self->m_outq.pump(self->m_mqttConn, now);
+}
+
 // -------------------------------------------------------------------
 // Publish helper
 // -------------------------------------------------------------------
-void GatewayCore::publishToDevice(const String& deviceId, const char* payload, size_t len) {
-  if (!m_mqttConn) {
-    Serial.println("publishToDevice: MQTT not connected");
-    return;
+bool GatewayCore::publishToDevice(const String& deviceId, const char* payload, size_t len,
+                                  OutQueue::Lane lane) {
+  if (payload == nullptr || len == 0) return false;
+  char topic[96];
+  size_t topicLen = mg_snprintf(topic, sizeof(topic), "jrpc/devices/%s/rx", deviceId.c_str());
+  if (topicLen >= sizeof(topic)) {
+    Serial.printf("publishToDevice: device id too long: %s\n", deviceId.c_str());
+    return false;
+  }
+  if (!m_outq.push(lane, mg_str_n(topic, topicLen), mg_str_n(payload, len), 1, nowMs())) {
+    Serial.printf("publishToDevice: queue full, dropped %d bytes to %s\n", (int)len, topic);
+    return false;
   }
-  if (payload == nullptr || len == 0) return;
-  String topic = "jrpc/devices/" + deviceId + "/rx";
-  struct mg_mqtt_opts opts = { .topic = mg_str(topic.c_str()), .message = mg_str_n(payload, len), .qos = 1 };
-  mg_mqtt_pub(m_mqttConn, &opts);
-  Serial.printf("Published %d bytes to %s\n", (int)len, topic.c_str());
+  if (m_mqttOpen) {
+    m_outq.pump(m_mqttConn, nowMs());
+  } else {
+    Serial.println("publishToDevice: MQTT not connected, queued");
+  }
+  Serial.printf("Queued %d bytes to %s\n", (int)len, topic);
+  return true;
+}
+
+void GatewayCore::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data,
+             "{%m:%s,%m:{%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu},%m:",
+             MG_ESC("mqtt"), m_mqttOpen ? "true" : "false", MG_ESC("session"),
+             MG_ESC("attempts"), (unsigned long)m_mqttStats.attempts,
+             MG_ESC("connects"), (unsigned long)m_mqttStats.connects,
+             MG_ESC("resumed"), (unsigned long)m_mqttStats.resumed,
+             MG_ESC("failures"), (unsigned long)m_mqttStats.failures,
+             MG_ESC("backoff_ms"), (unsigned long)m_mqttStats.backoffMs,
+             MG_ESC("reconnect_ms"), (unsigned long)m_mqttStats.lastReconnectMs,
+             MG_ESC("first_msg_ms"), (unsigned long)m_mqttStats.lastFirstMsgMs,
+             MG_ESC("failovers"), (unsigned long)m_mqttStats.failovers,
+             MG_ESC("brokers"));
+  m_brokers.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, ",%m:", MG_ESC("outq"));
+  m_outq.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, ",%m:{%m:%lu,%m:%lu,%m:%lu}", MG_ESC("arena"),
+             MG_ESC("size"), (unsigned long)m_arena.size(),
+             MG_ESC("peak"), (unsigned long)m_arena.peak(),
+             MG_ESC("overflows"), (unsigned long)m_arena.overflows());
+  mg_xprintf(pfn, pfn_data, ",%m:", MG_ESC("devices"));
+  m_devices.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, ",%m:", MG_ESC("keystream"));
+  m_keystream.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, ",%m:", MG_ESC("sessions"));
+  m_sessions.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, ",%m:", MG_ESC("dlq"));
+  m_dlq.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, ",%m:", MG_ESC("cluster"));
+  if (m_clusterOn) {
+    m_cluster.printStats(pfn, pfn_data);
+  } else {
+    mg_xprintf(pfn, pfn_data, "null");
+  }
+  mg_xprintf(pfn, pfn_data, ",%m:{%m:%lu,%m:%lu,%m:%lu,%m:",
+             MG_ESC("ping"), MG_ESC("sent"), (unsigned long)m_pingTotal.sent,
+             MG_ESC("lost"), (unsigned long)m_pingTotal.lost,
+             MG_ESC("errors"), (unsigned long)m_pingTotal.errors, MG_ESC("rtt"));
+  m_pingTotal.rtt.printStats(pfn, pfn_data);
+  mg_xprintf(pfn, pfn_data, "},%m:{%m:%s,%m:%.1f,%m:%.1f,%m:%.1f,%m:%.1f}",
+             MG_ESC("poll"), MG_ESC("latency_mode"), m_latencyMode ? "true" : "false",
+             MG_ESC("idle_pct"), m_pollStats.idlePct,
+             MG_ESC("wakeups_s"), m_pollStats.wakeupsPerSec,
+             MG_ESC("io_wakeups_s"), m_pollStats.ioWakeupsPerSec,
+             MG_ESC("passes_s"), m_pollStats.passesPerSec);
+  mg_xprintf(pfn, pfn_data, ",%m:{%m:%s,%m:%lu,%m:%lu}}",
+             MG_ESC("capture"), MG_ESC("on"), m_capture.active() ? "true" : "false",
+             MG_ESC("messages"), (unsigned long)m_capture.messages(),
+             MG_ESC("bytes"), (unsigned long)m_capture.bytes());
+}
+
+void GatewayCore::snapshotMetrics(MetricsSnapshot& s) const {
+  const OutQueue::Stats& oq = m_outq.stats();
+  const DownlinkStore::Stats& dq = m_dlq.stats();
+  s.m = m_metrics;
+  s.valid = true;
+  s.mqttUp = m_mqttOpen;
+  s.mqttConnects = m_mqttStats.connects;
+  s.devices = m_devices.size();
+  s.deviceCapacity = m_devices.stats().capacity;
+  s.devicesRefused = m_devices.stats().refused + m_devices.stats().pendingRefused;
+  s.outqDepth[0] = oq.depth[OutQueue::LANE_CONTROL];
+  s.outqDepth[1] = oq.depth[OutQueue::LANE_BULK];
+  s.outqBytes = oq.bytesQueued;
+  s.outqInflight = oq.inflight;
+  s.outqDropped = oq.dropped;
+  s.dlqBytes = dq.ramBytes + dq.fileBytes;
+  s.pingSent = m_pingTotal.sent;
+  s.pingLost = m_pingTotal.lost;
+  s.msgHeapAllocs = m_arena.overflows() + oq.allocs;
+  s.arenaPeak = m_arena.peak();
+  s.keystreamHits = m_keystream.stats().hits;
+  s.keystreamMisses = m_keystream.stats().misses;
+  s.sessionsFull = m_sessions.stats().full;
+  s.sessionsResumed = m_sessions.stats().resumed;
+  s.sessionsRejected = m_sessions.stats().rejected;
+  s.loopIdleRatio = m_pollStats.idlePct / 100.0;
 }
 
 void GatewayCore::sendError(const String& deviceId, const char* msg) {
@@ -169,74 +599,687 @@ void GatewayCore::sendError(const String& deviceId, const char* msg) {
   publishToDevice(deviceId, buf, n);
 }
 
+// -------------------------------------------------------------------
+// Store-and-forward
+// -------------------------------------------------------------------
+bool GatewayCore::isReachable(const Device& dev) const {
+  return dev.lastRxMs != 0 && nowMs() - dev.lastRxMs < GW_DEVICE_OFFLINE_MS;
+}
+
+bool GatewayCore::sendToDevice(const String& deviceId, const uint8_t* plaintext, size_t len,
+                               OutQueue::Lane lane, unsigned long ttlMs) {
+  Device* found = m_devices.find(deviceId);
+  if (found == nullptr || !found->keySet) {
+    Serial.printf("sendToDevice: device %s unknown or not approved\n", deviceId.c_str());
+    return false;
+  }
+  Device &dev = *found;
+  if (m_clusterOn && !m_cluster.owns(deviceId)) {
+    Serial.printf("sendToDevice: %s is served by %s\n", deviceId.c_str(),
+                  m_cluster.ownerOf(deviceId).c_str());
+    return false;
+  }
+  // Keep order: while older messages are still stored, new ones queue behind
+  if (isReachable(dev) && m_dlq.pendingMsgs(deviceId) == 0 &&
+      sendEncrypted(deviceId, plaintext, len, lane)) {
+    return true;
+  }
+  if (!m_dlq.put(deviceId, plaintext, len, ttlMs, nowMs())) {
+    Serial.printf("sendToDevice: store full for %s, dropped %d bytes\n",
+                  deviceId.c_str(), (int)len);
+    return false;
+  }
+  Serial.printf("Stored %d bytes for offline device %s (%d pending)\n", (int)len,
+                deviceId.c_str(), (int)m_dlq.pendingMsgs(deviceId));
+  return true;
+}
+
+// Hand up to GW_DLQ_BURST stored messages to the outbound queue.  Messages
+// are encrypted at send time so they carry a fresh gateway counter.
+bool GatewayCore::flushDownlink(Device& dev) {
+  if (!isReachable(dev)) return true;        // resumes on the next frame
+  for (int i = 0; i < GW_DLQ_BURST; i++) {
+    int n = m_dlq.peek(dev.id, m_dlqBuf, sizeof(m_dlqBuf), nowMs());
+    if (n == 0) return true;
+    if (n < 0) {
+      Serial.printf("WARN: unreadable stored message for %s, discarding queue\n",
+                    dev.id);
+      m_dlq.clear(dev.id);
+      return true;
+    }
+    if (!sendEncrypted(dev.id, m_dlqBuf, (size_t)n, OutQueue::LANE_BULK)) return false;
+    m_dlq.pop(dev.id);
+  }
+  return m_dlq.pendingMsgs(dev.id) == 0;
+}
+
+// -------------------------------------------------------------------
+// Ping
+// -------------------------------------------------------------------
+// Sent directly, never stored: a ping delivered after the device's next
+// frame would measure how long it was away.
+bool GatewayCore::pingDevice(const String& deviceId) {
+  Device* dev = m_devices.find(deviceId);
+  if (dev == nullptr || !dev->keySet) {
+    Serial.printf("pingDevice: device %s unknown or not approved\n", deviceId.c_str());
+    return false;
+  }
+  if (m_clusterOn && !m_cluster.owns(deviceId)) return false;
+  PingStats &ps = m_pings[deviceId];
+  if (ps.pendingId != 0) return false;
+
+  uint32_t id = ++m_pingSeq;
+  if (id == 0) id = ++m_pingSeq;            // 0 means no ping in flight
+  char buf[128];
+  int n = mg_snprintf(buf, sizeof(buf),
+      "{\"jsonrpc\":\"2.0\",\"method\":\"ping\",\"params\":{\"ts\":%lu},\"id\":%lu}",
+      (unsigned long)nowMs(), (unsigned long)id);
+  unsigned long sentAt = micros();
+  if (!sendEncrypted(deviceId, (const uint8_t*)buf, n)) return false;
+  ps.pendingId = id;
+  ps.sentAt = sentAt;
+  ps.sentMs = nowMs();
+  ps.sent++;
+  m_pingTotal.sent++;
+  return true;
+}
+
+const GatewayCore::PingStats* GatewayCore::getPingStats(const String& deviceId) const {
+  auto it = m_pings.find(deviceId);
+  return it == m_pings.end() ? nullptr : &it->second;
+}
+
+void GatewayCore::onPingReply(Device& dev, struct mg_str frame) {
+  unsigned long now = micros();
+  long id = mg_json_get_long(frame, "$.id", 0);
+  auto it = m_pings.find(dev.id);
+  if (it == m_pings.end() || it->second.pendingId == 0 ||
+      (uint32_t)id != it->second.pendingId) {
+    Serial.printf("WARN: unexpected response id %ld from %s\n", id, dev.id);
+    return;
+  }
+  PingStats &ps = it->second;
+  ps.pendingId = 0;
+  if (mg_json_get(frame, "$.error", NULL) > 0) {
+    ps.errors++;
+    ps.last = PingStats::PING_ERROR;
+    m_pingTotal.errors++;
+    Serial.printf("WARN: ping to %s answered with an error\n", dev.id);
+  } else {
+    uint32_t rtt = (uint32_t)(now - ps.sentAt);
+    ps.lastUs = rtt;
+    ps.last = PingStats::PING_PONG;
+    ps.rtt.record(rtt);
+    m_pingTotal.lastUs = rtt;
+    m_pingTotal.rtt.record(rtt);
+    m_metrics.pingRtt.observe(rtt);
+    Serial.printf("Pong from %s in %lu us\n", dev.id, (unsigned long)rtt);
+  }
+  if (m_eventCb) m_eventCb(dev.id, DEVICE_PING);
+}
+
+void GatewayCore::pingTimerFn(void *arg) {
+  GatewayCore* self = static_cast<GatewayCore*>(arg);
+  // The deadline is on the gateway clock, so a simulated outage times
+  // pings out; micros() only measures the round trip
+  unsigned long now = self->nowMs();
+  for (auto& pair : self->m_pings) {
+    PingStats &ps = pair.second;
+    if (ps.pendingId == 0 || now - ps.sentMs < GW_PING_TIMEOUT_MS) continue;
+    ps.pendingId = 0;
+    ps.lost++;
+    ps.last = PingStats::PING_LOST;
+    self->m_pingTotal.lost++;
+    Serial.printf("WARN: ping to %s lost\n", pair.first.c_str());
+    if (self->m_eventCb) self->m_eventCb(pair.first, DEVICE_PING);
+  }
+
+  if (now - self->m_dlqSweepAt >= GW_DLQ_SWEEP_MS) {
+    self->m_dlqSweepAt = now;
+    self->m_dlq.expire(now);
+  }
+
+#if GW_PING_INTERVAL_MS > 0
+  if (self->nowMs() - self->m_pingRoundAt < GW_PING_INTERVAL_MS) return;
+  self->m_pingRoundAt = self->nowMs();
+  for (const Device& dev : self->m_devices) {
+    if (dev.status == DEV_APPROVED && self->isReachable(dev)) self->pingDevice(dev.id);
+  }
+#endif
+}
+
 // -------------------------------------------------------------------
 // Encrypted response helper
 // -------------------------------------------------------------------
-void GatewayCore::sendEncrypted(const String& deviceId, const uint8_t* plaintext, size_t len) {
-  if (plaintext == nullptr || len == 0) return;
-  auto it = m_devices.find(deviceId);
-  if (it == m_devices.end()) {
+bool GatewayCore::sendEncrypted(const String& deviceId, const uint8_t* plaintext, size_t len,
+                                OutQueue::Lane lane, const char* member) {
+  if (plaintext == nullptr || len == 0) return false;
+  Device* found = m_devices.find(deviceId);
+  if (found == nullptr) {
     Serial.printf("sendEncrypted: device %s not found\n", deviceId.c_str());
-    return;
+    return false;
   }
-  Device &dev = it->second;
+  Device &dev = *found;
   if (!dev.keySet) {
     Serial.printf("sendEncrypted: device %s has no key\n", deviceId.c_str());
-    return;
+    return false;
   }
 
-  uint32_t counter = dev.lastNonce + 1;
-  uint64_t ts = (uint64_t)time(nullptr);
+  // The gateway has its own counter with the top bit set, so outbound nonces
+  // never collide with the device's and never disturb its replay window.
+  // Precomputed material carries the nonce it was made for.
+  if (dev.txNonce >= dev.info->txReserved) reserveTxNonce(dev);
+  uint32_t counter = 0x80000000UL | ((dev.txNonce + 1) & 0x7FFFFFFFUL);
+  KeystreamPool::Entry pre;
+  bool havePre = m_keystream.take(dev, counter, nowMs(), pre);
   uint8_t nonce[12];
-  nonce[0] = (counter >> 24) & 0xFF;
-  nonce[1] = (counter >> 16) & 0xFF;
-  nonce[2] = (counter >> 8) & 0xFF;
-  nonce[3] = counter & 0xFF;
-  for (int i = 0; i < 8; i++) {
-    nonce[4 + i] = (ts >> (56 - 8*i)) & 0xFF;
+  if (havePre) {
+    memcpy(nonce, pre.nonce, sizeof(nonce));
+  } else {
+    uint64_t ts = (uint64_t)m_clock->unixTime();
+    nonce[0] = (counter >> 24) & 0xFF;
+    nonce[1] = (counter >> 16) & 0xFF;
+    nonce[2] = (counter >> 8) & 0xFF;
+    nonce[3] = counter & 0xFF;
+    for (int i = 0; i < 8; i++) {
+      nonce[4 + i] = (ts >> (56 - 8*i)) & 0xFF;
+    }
   }
 
+  // The ciphertext is written behind room for the nonce so a binary-framed
+  // device gets nonce || ciphertext || tag from the same buffer.
+  ArenaScope scratch(m_arena);
   size_t cipherLen = len + RFC_8439_TAG_SIZE;
-  uint8_t* cipher = (uint8_t*)malloc(cipherLen);
-  if (!cipher) {
-    Serial.println("sendEncrypted: malloc failed for cipher");
-    return;
+  uint8_t* frame = (uint8_t*)m_arena.alloc(RFC_8439_NONCE_SIZE + cipherLen);
+  if (!frame) {
+    Serial.println("sendEncrypted: no memory for cipher");
+    return false;
   }
+  uint8_t* cipher = frame + RFC_8439_NONCE_SIZE;
+  memcpy(frame, nonce, RFC_8439_NONCE_SIZE);
 
   // device_id is used as AAD when encrypting. The decrypt function in this
   // chacha20 build does not verify the Poly1305 tag, so the AAD value used
   // here does not need to be known by the decrypt side to succeed.
-  size_t encLen = chacha20_poly1305_encrypt(cipher, dev.enc_key, nonce,
-                                            (uint8_t*)deviceId.c_str(), deviceId.length(),
-                                            plaintext, len);
+  unsigned long t0 = micros();
+  size_t encLen = havePre
+      ? chacha20_poly1305_encrypt_pre(cipher, dev.enc_key, nonce, pre.polyKey, pre.stream,
+                                      sizeof(pre.stream), (uint8_t*)deviceId.c_str(),
+                                      deviceId.length(), plaintext, len)
+      : chacha20_poly1305_encrypt(cipher, dev.enc_key, nonce,
+                                  (uint8_t*)deviceId.c_str(), deviceId.length(),
+                                  plaintext, len);
+  unsigned long t1 = micros();
+  if (havePre) memset(&pre, 0, sizeof(pre));
+  m_metrics.stages[GatewayMetrics::STAGE_ENCRYPT].observe(t1 - t0);
+  GW_TRACE_SPAN(TRACE_ENCRYPT, t0, t1 - t0);
   if (encLen == (size_t)-1) {
     Serial.println("sendEncrypted: encryption failed");
-    free(cipher);
-    return;
+    return false;
+  }
+
+  if (dev.binaryRx && member == nullptr) {
+    bool ok = publishToDevice(deviceId, (const char*)frame,
+                              RFC_8439_NONCE_SIZE + encLen, lane);
+    if (ok) {
+      m_metrics.txMessages++;
+      m_metrics.txBytes += RFC_8439_NONCE_SIZE + encLen;
+    }
+    dev.txNonce++;
+    m_keystream.want(dev, nowMs());
+    return ok;
   }
 
   // FIX: avoid VLA on the stack (encLen is runtime-determined).
-  // Allocate hex buffers on the heap instead.
+  // The hex buffers come from the message arena instead.
   char nonceHex[25];   // nonce is always 12 bytes → 24 hex chars + NUL, safe as fixed array
   bytes_to_hex(nonce, 12, nonceHex);
 
-  char* cipherHex = (char*)malloc(encLen * 2 + 1);
+  char* cipherHex = (char*)m_arena.alloc(encLen * 2 + 1);
   if (!cipherHex) {
-    Serial.println("sendEncrypted: malloc failed for cipherHex");
-    free(cipher);
-    return;
+    Serial.println("sendEncrypted: no memory for cipherHex");
+    return false;
   }
   bytes_to_hex(cipher, encLen, cipherHex);
 
-  char out[512];
-  int outLen = mg_snprintf(out, sizeof(out),
-    "{\"device_id\":\"%s\",\"nonce\":\"%s\",\"ciphertext\":\"%s\"}",
-    deviceId.c_str(), nonceHex, cipherHex);
-  publishToDevice(deviceId, out, outLen);
+  // 43 bytes of JSON punctuation and keys + 24 nonce hex + NUL
+  size_t outCap = encLen * 2 + deviceId.length() + 24 + 64 + (member ? strlen(member) + 1 : 0);
+  char* out = (char*)m_arena.alloc(outCap);
+  if (!out) {
+    Serial.println("sendEncrypted: no memory for envelope");
+    return false;
+  }
+  int outLen = mg_snprintf(out, outCap,
+    "{\"device_id\":\"%s\",%s%s\"nonce\":\"%s\",\"ciphertext\":\"%s\"}",
+    deviceId.c_str(), member ? member : "", member ? "," : "", nonceHex, cipherHex);
+  bool ok = publishToDevice(deviceId, out, outLen, lane);
+  if (ok) {
+    m_metrics.txMessages++;
+    m_metrics.txBytes += outLen;
+  }
 
-  free(cipherHex);
-  free(cipher);
-  dev.lastNonce = counter;
+  dev.txNonce++;
+  m_keystream.want(dev, nowMs());
+  return ok;
+}
+
+// -------------------------------------------------------------------
+// Cluster
+// -------------------------------------------------------------------
+const String& GatewayCore::ownerOf(const String& deviceId) const {
+  return m_clusterOn ? m_cluster.ownerOf(deviceId) : m_clientId;
+}
+
+// Subscriptions are renewed on every connect, session or not: the SUBACKs
+// bring back the retained membership and registry, which may have changed
+// while we were away.  Ownership is recomputed once they had time to arrive.
+void GatewayCore::clusterOpen(struct mg_connection *c) {
+  struct mg_mqtt_opts sub = {};
+  sub.qos = 1;
+  if (m_sharedSub) {
+    // Each frame goes to one member of the group, which forwards it if
+    // the device belongs to someone else
+    sub.topic = mg_str("$share/" GW_CLUSTER_GROUP "/" GW_T_GATEWAY_RX);
+    mg_mqtt_sub(c, &sub);
+#if GW_RX_DEVICE_TOPICS
+    sub.topic = mg_str("$share/" GW_CLUSTER_GROUP "/" GW_T_GATEWAY_RX "/+");
+    mg_mqtt_sub(c, &sub);
+#endif
+  } else {
+    // Every member sees the JSON topic and keeps its own devices' frames;
+    // rx/<id> is subscribed per owned device by rebalance()
+    sub.topic = mg_str(GW_T_GATEWAY_RX);
+    mg_mqtt_sub(c, &sub);
+  }
+  sub.topic = mg_str(GW_T_GATEWAY_CONNECT);
+  mg_mqtt_sub(c, &sub);
+  sub.topic = mg_str(GW_T_CLUSTER "/members/+");
+  mg_mqtt_sub(c, &sub);
+  sub.topic = mg_str(GW_T_CLUSTER "/dev/+");
+  mg_mqtt_sub(c, &sub);
+  char fwd[96];
+  mg_snprintf(fwd, sizeof(fwd), GW_T_CLUSTER "/fwd/%s/#", m_gatewayId.c_str());
+  sub.topic = mg_str(fwd);
+  mg_mqtt_sub(c, &sub);
+  Serial.printf("Cluster subscriptions renewed for %s\n", m_gatewayId.c_str());
+
+  m_cluster.resetMembers();
+  m_resubscribe = true;
+  m_rebalanceAt = nowMs() + GW_CLUSTER_SETTLE_MS;
+  if (m_rebalanceAt == 0) m_rebalanceAt = 1;
+  announce();
+}
+
+// Sealed like the records, or any client of the broker could announce a
+// member and be handed its share of the devices.  "member" rather than
+// "id", so an announcement never passes for a device record.
+void GatewayCore::announce() {
+  char body[96];
+  size_t n = mg_snprintf(body, sizeof(body), "{%m:%m}", MG_ESC("member"),
+                         MG_ESC(m_gatewayId.c_str()));
+  uint8_t sealed[sizeof(body) + Cluster::SEAL_OVERHEAD];
+  size_t len = m_cluster.seal((const uint8_t*)body, n, sealed, sizeof(sealed));
+  if (len == 0) return;
+  publishCluster(String(GW_T_CLUSTER "/members/") + m_gatewayId,
+                 mg_str_n((char*)sealed, len), true);
+}
+
+// An announcement counts only if it opens under the cluster key and names
+// the member of its topic.  The will that clears it is empty, and anyone
+// may send that: a member that did not leave announces again.
+bool GatewayCore::memberPresent(const String& id, struct mg_str payload) {
+  if (payload.len == 0) return false;
+  char body[96];
+  int n = m_cluster.open((const uint8_t*)payload.buf, payload.len, (uint8_t*)body,
+                         sizeof(body) - 1);
+  char* member = n > 0 ? mg_json_get_str(mg_str_n(body, (size_t)n), "$.member") : nullptr;
+  bool ok = member != nullptr && id == member;
+  free(member);
+  if (!ok) Serial.printf("WARN: cluster announcement for %s failed the seal check\n", id.c_str());
+  return ok;
+}
+
+bool GatewayCore::clusterMsg(struct mg_str topic, struct mg_str payload) {
+  struct mg_str caps[3];
+  if (mg_match(topic, mg_str(GW_T_CLUSTER "/members/*"), caps)) {
+    String id = segmentString(caps[0]);
+    if (id == m_gatewayId) {
+      // The will of our previous connection landed after we announced
+      if (payload.len == 0 && m_mqttOpen) announce();
+      return true;
+    }
+    bool present = memberPresent(id, payload);
+    if (payload.len > 0 && !present) return true;
+    if (m_cluster.setMember(id, present)) {
+      Serial.printf("Cluster member %s %s, %d members\n", id.c_str(),
+                    present ? "joined" : "left", (int)m_cluster.memberCount());
+      if (m_rebalanceAt == 0) rebalance(false);
+    }
+    return true;
+  }
+  if (mg_match(topic, mg_str(GW_T_CLUSTER "/dev/*"), caps)) {
+    String id = segmentString(caps[0]);
+    if (id.length() > 0) applyRecord(id, payload);
+    return true;
+  }
+  if (mg_match(topic, mg_str(GW_T_CLUSTER "/fwd/*/#"), caps)) {
+    m_forwarded = true;
+    dispatchMsg(caps[1], payload);
+    m_forwarded = false;
+    return true;
+  }
+  return false;
+}
+
+// Frames for a device owned by another member are forwarded to it when
+// rx comes through the shared subscription, and dropped otherwise: the
+// owner has received its own copy.  A forwarded frame is always handled
+// where it lands, even if ownership moved again, so frames never bounce.
+bool GatewayCore::routeElsewhere(const String& id, struct mg_str topic, struct mg_str payload) {
+  if (!m_clusterOn || m_forwarded) return false;
+  const String& owner = m_cluster.ownerOf(id);
+  if (owner == m_gatewayId) return false;
+  if (m_sharedSub) {
+    char fwd[160];
+    size_t n = mg_snprintf(fwd, sizeof(fwd), GW_T_CLUSTER "/fwd/%s/%.*s", owner.c_str(),
+                           (int)topic.len, topic.buf);
+    if (n < sizeof(fwd) && publishCluster(String(fwd), payload, false)) {
+      m_cluster.stats().forwarded++;
+    }
+  }
+  return true;
+}
+
+void GatewayCore::rebalance(bool resubscribe) {
+  uint32_t adopted = m_cluster.stats().adopted;
+  uint32_t handedOver = m_cluster.stats().handedOver;
+  for (Device& dev : m_devices) updateOwnership(dev, resubscribe);
+  m_resubscribe = false;
+  Serial.printf("Rebalanced over %d members: +%lu -%lu devices\n",
+                (int)m_cluster.memberCount(),
+                (unsigned long)(m_cluster.stats().adopted - adopted),
+                (unsigned long)(m_cluster.stats().handedOver - handedOver));
+}
+
+// A device we lose is handed over with its latest counters.  A device we
+// gain skips ahead on the gateway counter, since its previous owner may
+// have sent more than its last record shows.  Devices approved before the
+// gateway joined a cluster have no record yet, so it seeds one.
+void GatewayCore::updateOwnership(Device& dev, bool resubscribe) {
+  bool owned = m_cluster.owns(dev.id);
+  if (dev.keySet && dev.info->regVer == 0) publishRecord(dev);
+  if (owned != dev.owned) {
+    dev.owned = owned;
+    if (owned) {
+      dev.txNonce += GW_CLUSTER_NONCE_SKIP;
+      m_cluster.stats().adopted++;
+    } else {
+      if (dev.keySet) publishRecord(dev);
+      if (!m_sharedSub) subscribeDevice(dev.id, false);
+      dev.dlqDraining = false;
+      m_cluster.stats().handedOver++;
+      return;
+    }
+  } else if (!owned || !resubscribe) {
+    return;
+  }
+  if (!m_sharedSub) subscribeDevice(dev.id, true);
+}
+
+void GatewayCore::subscribeDevice(const String& id, bool on) {
+#if GW_RX_DEVICE_TOPICS
+  if (!m_mqttOpen) return;                  // renewed after the next connect
+  char topic[96];
+  mg_snprintf(topic, sizeof(topic), GW_T_GATEWAY_RX "/%s", id.c_str());
+  struct mg_mqtt_opts opts = {};
+  opts.topic = mg_str(topic);
+  opts.qos = 1;
+  if (on) {
+    mg_mqtt_sub(m_mqttConn, &opts);
+  } else {
+    mg_mqtt_unsub(m_mqttConn, &opts);
+  }
+#endif
+}
+
+bool GatewayCore::publishCluster(const String& topic, struct mg_str payload, bool retain) {
+  if (!m_outq.push(OutQueue::LANE_CONTROL, mg_str(topic.c_str()), payload, 1, nowMs(),
+                   retain)) {
+    Serial.printf("WARN: queue full, dropped cluster message to %s\n", topic.c_str());
+    return false;
+  }
+  if (m_mqttOpen) m_outq.pump(m_mqttConn, nowMs());
+  return true;
+}
+
+void GatewayCore::publishRecord(Device& dev) {
+  char plain[512];
+  dev.info->regVer++;
+  dev.regDirty = false;
+  int n = formatDevice(dev, plain, sizeof(plain));
+  uint8_t sealed[sizeof(plain) + Cluster::SEAL_OVERHEAD];
+  size_t len = m_cluster.seal((const uint8_t*)plain, (size_t)n, sealed, sizeof(sealed));
+  memset(plain, 0, sizeof(plain));          // held the device key
+  if (len == 0) {
+    Serial.printf("ERROR: cluster record for %s too large\n", dev.id);
+    return;
+  }
+  publishCluster(String(GW_T_CLUSTER "/dev/") + dev.id, mg_str_n((char*)sealed, len), true);
+}
+
+// A deleted device leaves a sealed tombstone one version past its last
+// record.  Retained, it also replaces the old record for members that join
+// later.
+void GatewayCore::publishRecordDelete(const Device& dev) {
+  char plain[128];
+  int n = (int)mg_snprintf(plain, sizeof(plain), "{%m:%m,%m:true,%m:%lu}",
+                           MG_ESC("id"), MG_ESC(dev.id), MG_ESC("deleted"),
+                           MG_ESC("ver"), (unsigned long)(dev.info->regVer + 1));
+  uint8_t sealed[sizeof(plain) + Cluster::SEAL_OVERHEAD];
+  size_t len = m_cluster.seal((const uint8_t*)plain, (size_t)n, sealed, sizeof(sealed));
+  if (len == 0) return;
+  publishCluster(String(GW_T_CLUSTER "/dev/") + dev.id, mg_str_n((char*)sealed, len), true);
+}
+
+// A registry record from another member, or our own coming back.  A newer
+// version replaces the stored fields; the replay and gateway counters only
+// ever move forward, whichever copy they come from.  Anyone on the broker
+// can publish here, so only what opens under the cluster key is applied; an
+// empty payload merely clears the retained copy.
+void GatewayCore::applyRecord(const String& id, struct mg_str sealed) {
+  if (sealed.len == 0) return;
+
+  char plain[512];
+  int n = m_cluster.open((const uint8_t*)sealed.buf, sealed.len, (uint8_t*)plain,
+                         sizeof(plain) - 1);
+  if (n <= 0) {
+    Serial.printf("WARN: cluster record for %s failed the seal check\n", id.c_str());
+    return;
+  }
+  bool deleted = false;
+  mg_json_get_bool(mg_str_n(plain, (size_t)n), "$.deleted", &deleted);
+  Device rec;
+  DeviceInfo recInfo;
+  rec.info = &recInfo;
+  parseDevice(mg_str_n(plain, (size_t)n), String(), rec);
+  memset(plain, 0, sizeof(plain));
+  if (id != rec.id) {
+    Serial.printf("WARN: cluster record for %s names %s\n", id.c_str(), rec.id);
+    return;
+  }
+  if (deleted) {
+    // Only a tombstone newer than our copy: an old one must not take out a
+    // device approved again since
+    Device* dev = m_devices.find(id);
+    if (dev == nullptr || rec.info->regVer <= dev->info->regVer) return;
+    m_devices.remove(dev);
+    removeDevice(id);
+    m_dlq.clear(id);
+    m_pings.erase(id);
+    m_cluster.stats().records++;
+    if (m_eventCb) m_eventCb(id, DEVICE_REMOVED);
+    Serial.printf("Cluster removed device %s\n", id.c_str());
+    return;
+  }
+
+  Device* found = m_devices.find(id);
+  bool added = found == nullptr;
+  if (added) {
+    rec.owned = false;
+    found = m_devices.add(rec);
+    if (found == nullptr) {
+      memset(rec.enc_key, 0, sizeof(rec.enc_key));
+      Serial.printf("WARN: no device slot for cluster record %s\n", id.c_str());
+      return;
+    }
+  } else {
+    Device &dev = *found;
+    bool newer = rec.info->regVer > dev.info->regVer;
+    if (!newer && rec.lastNonce <= dev.lastNonce && rec.txNonce <= dev.txNonce) return;
+    if (newer) {
+      // A new session starts its counters over
+      bool rekeyed = memcmp(dev.enc_key, rec.enc_key, sizeof(dev.enc_key)) != 0;
+      memcpy(dev.info->name, rec.info->name, sizeof(dev.info->name));
+      memcpy(dev.info->type, rec.info->type, sizeof(dev.info->type));
+      dev.status = rec.status;
+      dev.perms = rec.perms;
+      dev.keySet = rec.keySet;
+      memcpy(dev.enc_key, rec.enc_key, sizeof(dev.enc_key));
+      dev.info->pskSet = rec.info->pskSet;
+      memcpy(dev.info->pskKey, rec.info->pskKey, sizeof(dev.info->pskKey));
+      if (rec.info->ticketGen > dev.info->ticketGen) dev.info->ticketGen = rec.info->ticketGen;
+      if (rec.info->helloTs > dev.info->helloTs) dev.info->helloTs = rec.info->helloTs;
+      dev.info->regVer = rec.info->regVer;
+      if (dev.status != DEV_PENDING) m_devices.clearPending(dev);
+      if (rekeyed) {
+        dev.lastNonce = rec.lastNonce;
+        dev.txNonce = rec.txNonce;
+      }
+    }
+    if (rec.lastNonce > dev.lastNonce) dev.lastNonce = rec.lastNonce;
+    if (rec.txNonce > dev.txNonce) dev.txNonce = rec.txNonce;
+    if (rec.lastSeen > dev.lastSeen) dev.lastSeen = rec.lastSeen;
+    if (rec.messageCount > dev.messageCount) dev.messageCount = rec.messageCount;
+  }
+  memset(rec.enc_key, 0, sizeof(rec.enc_key));
+  memset(recInfo.pskKey, 0, sizeof(recInfo.pskKey));
+
+  Device &dev = *found;
+  saveDevice(dev);
+  m_cluster.stats().records++;
+  if (added && m_rebalanceAt == 0) updateOwnership(dev, false);
+  if (m_eventCb) m_eventCb(id, added ? DEVICE_ADDED : DEVICE_UPDATED);
+}
+
+// Checkpoint the counters of active devices, so a member that takes over
+// after a crash does not accept frames older than these.
+void GatewayCore::clusterTimerFn(void *arg) {
+  GatewayCore* self = static_cast<GatewayCore*>(arg);
+  if (!self->m_mqttOpen) return;
+  for (Device& dev : self->m_devices) {
+    if (dev.owned && dev.regDirty && dev.keySet) self->publishRecord(dev);
+  }
+}
+
+// -------------------------------------------------------------------
+// Shards
+// -------------------------------------------------------------------
+unsigned GatewayCore::shardOf(const String& deviceId, unsigned count) {
+  if (count <= 1) return 0;
+  uint32_t h = 2166136261UL;                // FNV-1a
+  for (const char* p = deviceId.c_str(); *p; p++) h = (h ^ (uint8_t)*p) * 16777619UL;
+  return h % count;
+}
+
+bool GatewayCore::inShard(const String& deviceId) const {
+  return m_shards <= 1 || shardOf(deviceId, m_shards) == m_shard;
+}
+
+bool GatewayCore::post(Call fn) {
+  {
+    std::lock_guard<std::mutex> lock(m_callLock);
+    if (m_calls.size() >= GW_SHARD_MAILBOX) return false;
+    m_calls.push_back(std::move(fn));
+    m_callCount = (unsigned)m_calls.size();
+  }
+  wake();
+  return true;
+}
+
+// The poll loop only pays for an atomic load while nothing is posted.
+void GatewayCore::drainCalls() {
+  if (m_callCount.load(std::memory_order_relaxed) == 0) return;
+  std::vector<Call> calls;
+  {
+    std::lock_guard<std::mutex> lock(m_callLock);
+    calls.swap(m_calls);
+    m_callCount = 0;
+  }
+  for (auto& fn : calls) fn(*this);
+}
+
+// -------------------------------------------------------------------
+// Poll loop
+// -------------------------------------------------------------------
+// One datagram per sleep is enough; poll() clears the flag before it
+// drains the mailboxes, so nothing posted after that is missed.
+void GatewayCore::wake() {
+  if (m_wakeId == 0 || m_wakePending.exchange(true)) return;
+  mg_wakeup(&m_mgr, m_wakeId, "", 0);
+}
+
+// Sleep until the earliest mg_timer is due, at most GW_POLL_MAX_MS.
+// Sockets end the sleep early by themselves.
+int GatewayCore::pollTimeout() {
+  if (m_wakeId == 0) return 1;
+  if (m_latencyMode) return 0;
+  if (m_burst) {
+    if ((long)(micros() - m_burstUntil) < 0) return 0;
+    m_burst = false;
+  }
+  uint64_t now = m_clock->millis();
+  uint64_t next = nextTimer(now);
+  if (next > now + GW_POLL_MAX_MS) next = now + GW_POLL_MAX_MS;
+  return (int)(next - now);
+}
+
+void GatewayCore::pollProbeFn(void *arg) {
+  static_cast<GatewayCore*>(arg)->m_pollWokeAt = micros();
+}
+
+// A sleep that ends well before its timeout was ended by a socket.  Passes
+// that did not sleep look at the sockets instead.  True when there was I/O.
+bool GatewayCore::accountPoll(int timeoutMs, unsigned long startUs) {
+  bool io = false;
+  if (timeoutMs > 0) {
+    unsigned long slept = m_pollWokeAt - startUs;
+    if ((long)slept < 0) slept = 0;       // probe did not run this pass
+    io = slept + 500 < (unsigned long)timeoutMs * 1000UL;
+    m_pollWin.sleptUs += slept;
+    m_pollWin.wakeups++;
+    if (io) m_pollWin.ioWakeups++;
+  } else {
+    for (struct mg_connection *c = m_mgr.conns; c != NULL && !io; c = c->next) {
+      io = c->is_readable || c->is_writable;
+    }
+  }
+  m_pollWin.passes++;
+  if (io && GW_POLL_BURST_MS > 0) {
+    m_burst = true;
+    m_burstUntil = micros() + GW_POLL_BURST_MS * 1000UL;
+  }
+
+  unsigned long now = micros();
+  unsigned long span = now - m_pollWin.start;
+  if (span < GW_POLL_STATS_MS * 1000UL) return io;
+  double secs = span / 1e6;
+  m_pollStats.idlePct = 100.0 * m_pollWin.sleptUs / span;
+  m_pollStats.wakeupsPerSec = m_pollWin.wakeups / secs;
+  m_pollStats.ioWakeupsPerSec = m_pollWin.ioWakeups / secs;
+  m_pollStats.passesPerSec = m_pollWin.passes / secs;
+  memset(&m_pollWin, 0, sizeof(m_pollWin));
+  m_pollWin.start = now;
+  return io;
 }
 
 // -------------------------------------------------------------------
@@ -275,59 +1318,108 @@ void GatewayCore::loadDevices() {
         String jsonStr = file.readString();
         file.close();
 
-        struct mg_str s = mg_str(jsonStr.c_str());
         Device dev;
-        char* idStr = mg_json_get_str(s, "$.id");
-        if (idStr) dev.id = idStr; else dev.id = id;
-        free(idStr);
-        char* nameStr = mg_json_get_str(s, "$.name");
-        if (nameStr) dev.name = nameStr; else dev.name = id;
-        free(nameStr);
-        char* typeStr = mg_json_get_str(s, "$.type");
-        if (typeStr) dev.type = typeStr; else dev.type = "unknown";
-        free(typeStr);
-        dev.status = (DeviceStatus)mg_json_get_long(s, "$.status", DEV_PENDING);
-        dev.lastNonce = mg_json_get_long(s, "$.lastNonce", 0);
-        dev.firstSeen = mg_json_get_long(s, "$.firstSeen", 0);
-        dev.lastSeen = mg_json_get_long(s, "$.lastSeen", 0);
-        dev.messageCount = mg_json_get_long(s, "$.messageCount", 0);
-        bool permPing = false;
-        mg_json_get_bool(s, "$.permPing", &permPing);
-        dev.permPing = permPing;
-
-        char* keyHex = mg_json_get_str(s, "$.key");
-        if (keyHex && strlen(keyHex) == 64) {
-          if (gw_hex_to_bytes(keyHex, dev.enc_key, 64) == 32) {
-            dev.keySet = true;
-          } else {
-            Serial.println("Failed to decode key hex");
-          }
+        DeviceInfo info;
+        dev.info = &info;
+        parseDevice(mg_str(jsonStr.c_str()), id, dev);
+        if (!inShard(dev.id)) continue;       // another shard's device
+        if (m_devices.add(dev) == nullptr) {
+          Serial.printf("WARN: no device slot for %s, %d of %d in use\n", dev.id,
+                        (int)m_devices.size(), GW_DEVICE_MAX);
+          continue;
         }
-        free(keyHex);
-
-        dev.has_pending = false;
-        m_devices[dev.id] = dev;
-        Serial.printf("Loaded device %s from flash\n", dev.id.c_str());
+        Serial.printf("Loaded device %s from flash\n", dev.id);
       }
     }
   }
   root.close();
-  Serial.printf("Loaded %d devices from LittleFS\n", m_devices.size());
+  Serial.printf("Loaded %d devices from LittleFS\n", (int)m_devices.size());
 }
 
-void GatewayCore::saveDevice(const Device& dev) {
-  char keyHex[65] = "";
+// The same JSON is the flash file and the plaintext of a cluster record.
+// "key" is the session key, "psk" the PSK key that starts new sessions.
+int GatewayCore::formatDevice(const Device& dev, char* buf, size_t cap) {
+  char keyHex[65] = "", pskHex[65] = "";
   if (dev.keySet) {
     bytes_to_hex(dev.enc_key, 32, keyHex);
   }
+  if (dev.info->pskSet) {
+    bytes_to_hex(dev.info->pskKey, 32, pskHex);
+  }
+
+  // The gateway counter is saved as its reservation: everything below it
+  // may already be on the air
+  uint32_t txNonce = dev.txNonce > dev.info->txReserved ? dev.txNonce : dev.info->txReserved;
+  int n = (int)mg_snprintf(buf, cap,
+    "{\"id\":\"%s\",\"name\":\"%s\",\"type\":\"%s\",\"status\":%d,\"lastNonce\":%lu,\"txNonce\":%lu,"
+    "\"firstSeen\":%lu,\"lastSeen\":%lu,\"messageCount\":%d,\"perms\":%lu,\"ver\":%lu,\"key\":\"%s\","
+    "\"psk\":\"%s\",\"tgen\":%lu,\"hello\":%lu}",
+    dev.id, dev.info->name, dev.info->type, (int)dev.status,
+    (unsigned long)dev.lastNonce, (unsigned long)txNonce, dev.info->firstSeen, dev.lastSeen, dev.messageCount,
+    (unsigned long)dev.perms, (unsigned long)dev.info->regVer, keyHex, pskHex,
+    (unsigned long)dev.info->ticketGen, (unsigned long)dev.info->helloTs);
+  memset(keyHex, 0, sizeof(keyHex));
+  memset(pskHex, 0, sizeof(pskHex));
+  return n;
+}
+
+void GatewayCore::parseDevice(struct mg_str s, const String& fallbackId, Device& dev) {
+  // An id that does not fit is left empty, which DeviceTable::add() refuses
+  char* idStr = mg_json_get_str(s, "$.id");
+  const char* id = idStr ? idStr : fallbackId.c_str();
+  if (strlen(id) < sizeof(dev.id)) strcpy(dev.id, id); else dev.id[0] = '\0';
+  free(idStr);
+  char* nameStr = mg_json_get_str(s, "$.name");
+  mg_snprintf(dev.info->name, sizeof(dev.info->name), "%s", nameStr ? nameStr : dev.id);
+  free(nameStr);
+  char* typeStr = mg_json_get_str(s, "$.type");
+  mg_snprintf(dev.info->type, sizeof(dev.info->type), "%s", typeStr ? typeStr : "unknown");
+  free(typeStr);
+  dev.status = (DeviceStatus)mg_json_get_long(s, "$.status", DEV_PENDING);
+  dev.lastNonce = mg_json_get_long(s, "$.lastNonce", 0);
+  dev.txNonce = mg_json_get_long(s, "$.txNonce", 0);
+  dev.info->txReserved = dev.txNonce;
+  dev.info->firstSeen = mg_json_get_long(s, "$.firstSeen", 0);
+  dev.lastSeen = mg_json_get_long(s, "$.lastSeen", 0);
+  dev.messageCount = mg_json_get_long(s, "$.messageCount", 0);
+  dev.info->regVer = mg_json_get_long(s, "$.ver", 0);
+  long perms = mg_json_get_long(s, "$.perms", -1);
+  if (perms < 0) {
+    // Legacy record with a single permPing flag: grant exactly what it
+    // allowed, never more
+    bool permPing = false;
+    mg_json_get_bool(s, "$.permPing", &permPing);
+    perms = permPing ? PERM_PING : PERM_NONE;
+  }
+  dev.perms = (DevicePerms) perms;
+
+  char* keyHex = mg_json_get_str(s, "$.key");
+  if (keyHex && strlen(keyHex) == 64) {
+    if (gw_hex_to_bytes(keyHex, dev.enc_key, 64) == 32) {
+      dev.keySet = true;
+    } else {
+      Serial.println("Failed to decode key hex");
+    }
+  }
+  free(keyHex);
+
+  // Records from before sessions have no "psk": their key was the PSK key
+  char* pskHex = mg_json_get_str(s, "$.psk");
+  if (pskHex && strlen(pskHex) == 64) {
+    dev.info->pskSet = gw_hex_to_bytes(pskHex, dev.info->pskKey, 64) == 32;
+  } else if (pskHex == nullptr && dev.keySet) {
+    memcpy(dev.info->pskKey, dev.enc_key, sizeof(dev.info->pskKey));
+    dev.info->pskSet = true;
+  }
+  free(pskHex);
+  dev.info->ticketGen = mg_json_get_long(s, "$.tgen", 0);
+  dev.info->helloTs = mg_json_get_long(s, "$.hello", 0);
+}
 
+void GatewayCore::saveDevice(const Device& dev) {
+  GW_TRACE_SCOPE(TRACE_FLASH);
   char buf[512];
-  int n = mg_snprintf(buf, sizeof(buf),
-    "{\"id\":\"%s\",\"name\":\"%s\",\"type\":\"%s\",\"status\":%d,\"lastNonce\":%lu,"
-    "\"firstSeen\":%lu,\"lastSeen\":%lu,\"messageCount\":%d,\"permPing\":%s,\"key\":\"%s\"}",
-    dev.id.c_str(), dev.name.c_str(), dev.type.c_str(), (int)dev.status,
-    (unsigned long)dev.lastNonce, dev.firstSeen, dev.lastSeen, dev.messageCount,
-    dev.permPing ? "true" : "false", keyHex);
+  formatDevice(dev, buf, sizeof(buf));
 
   String safeId = safeFilename(dev.id);
   String path = "/devices/dev_" + safeId;
@@ -335,12 +1427,22 @@ void GatewayCore::saveDevice(const Device& dev) {
   if (f) {
     f.print(buf);
     f.close();
-    Serial.printf("Saved device %s to flash\n", dev.id.c_str());
+    Serial.printf("Saved device %s to flash\n", dev.id);
   } else {
-    Serial.printf("Failed to save device %s\n", dev.id.c_str());
+    Serial.printf("Failed to save device %s\n", dev.id);
   }
 }
 
+// A nonce is the gateway counter and the unix second, so after a reboot
+// (or a clock that steps back) a counter saved behind the ones already
+// sent would repeat a nonce under the same key.  The file therefore holds
+// a mark GW_TX_NONCE_RESERVE counters ahead, rewritten when it is reached:
+// one flash write per that many downlinks, and a reboot skips the rest.
+void GatewayCore::reserveTxNonce(Device& dev) {
+  dev.info->txReserved = dev.txNonce + GW_TX_NONCE_RESERVE;
+  saveDevice(dev);
+}
+
 void GatewayCore::removeDevice(const String& id) {
   String safeId = safeFilename(id);
   String path = "/devices/dev_" + safeId;
@@ -367,6 +1469,15 @@ void GatewayCore::handleGatewayConnect(struct mg_str payload) {
     return;
   }
   Serial.printf("device_id: %s\n", deviceId);
+  if (!inShard(String(deviceId))) {
+    free(deviceId);
+    return;
+  }
+  if (mg_json_get(payload, "$.ticket", NULL) > 0) {
+    resumeSession(String(deviceId), payload);
+    free(deviceId);
+    return;
+  }
 
   char* nonceHex = mg_json_get_str(payload, "$.nonce");
   char* cipherHex = mg_json_get_str(payload, "$.ciphertext");
@@ -380,38 +1491,69 @@ void GatewayCore::handleGatewayConnect(struct mg_str payload) {
   }
   Serial.printf("nonce len: %d, cipher len: %d\n", strlen(nonceHex), strlen(cipherHex));
 
-  String devId(deviceId);
-  auto it = m_devices.find(devId);
-  if (it == m_devices.end()) {
+  // Kept decoded, as nonce || ciphertext, until the operator decides
+  uint8_t req[GW_DEVICE_PENDING_SIZE];
+  size_t nonceLen = strlen(nonceHex), cipherHexLen = strlen(cipherHex);
+  bool valid = strlen(deviceId) <= GW_DEVICE_ID_MAX && nonceLen == 24 &&
+               cipherHexLen > 2 * RFC_8439_TAG_SIZE &&
+               cipherHexLen <= 2 * (sizeof(req) - RFC_8439_NONCE_SIZE) &&
+               gw_hex_to_bytes(nonceHex, req, nonceLen) == RFC_8439_NONCE_SIZE &&
+               gw_hex_to_bytes(cipherHex, req + RFC_8439_NONCE_SIZE, cipherHexLen) >= 0;
+  size_t reqLen = RFC_8439_NONCE_SIZE + cipherHexLen / 2;
+  free(nonceHex);
+  free(cipherHex);
+  if (!valid) {
+    Serial.printf("ERROR: connect request from %s malformed or too large\n", deviceId);
+    free(deviceId);
+    return;
+  }
+
+  Device* dev = m_devices.find(deviceId);
+  if (dev == nullptr) {
     // New device – create pending record
-    Device dev;
-    dev.id = devId;
-    dev.name = devId;
-    dev.type = "unknown";
-    dev.status = DEV_PENDING;
-    dev.firstSeen = millis();
-    dev.lastSeen = millis();
-    dev.has_pending = true;
-    dev.pending_nonce = safeString(nonceHex);
-    dev.pending_cipher = safeString(cipherHex);
-    m_devices[devId] = dev;
-    if (m_eventCb) m_eventCb(devId, DEVICE_ADDED);
-    Serial.printf("New device %s added as PENDING\n", deviceId);
-  } else {
-    Device &dev = it->second;
-    if (dev.status == DEV_PENDING) {
-      dev.pending_nonce = safeString(nonceHex);
-      dev.pending_cipher = safeString(cipherHex);
-      dev.has_pending = true;
+    Device rec;
+    DeviceInfo info;
+    rec.info = &info;
+    strcpy(rec.id, deviceId);
+    mg_snprintf(info.name, sizeof(info.name), "%s", deviceId);
+    mg_snprintf(info.type, sizeof(info.type), "unknown");
+    rec.status = DEV_PENDING;
+    info.firstSeen = nowMs();
+    rec.lastSeen = nowMs();
+    dev = m_devices.add(rec);
+    if (dev == nullptr) {
+      Serial.printf("WARN: device table full (%d), refused %s\n", GW_DEVICE_MAX, deviceId);
+    } else if (!m_devices.setPending(*dev, req, reqLen)) {
+      m_devices.remove(dev);
+      Serial.printf("WARN: %d connect requests already waiting, refused %s\n",
+                    GW_DEVICE_PENDING, deviceId);
+    } else {
+      String devId(deviceId);
+      if (m_shards > 1) subscribeDevice(devId, true);
+      if (m_eventCb) m_eventCb(devId, DEVICE_ADDED);
+      Serial.printf("New device %s added as PENDING\n", deviceId);
+    }
+  } else if (dev->status == DEV_PENDING) {
+    if (m_devices.setPending(*dev, req, reqLen)) {
       Serial.printf("Device %s updated pending request\n", deviceId);
     } else {
-      Serial.printf("Device %s already approved, ignoring\n", deviceId);
+      Serial.printf("WARN: %d connect requests already waiting, refused %s\n",
+                    GW_DEVICE_PENDING, deviceId);
     }
+  } else if (dev->status == DEV_APPROVED && dev->info->pskSet) {
+    // A known device starting a new session needs no operator.  In a
+    // cluster every member sees the request and its owner answers.
+    if (!m_clusterOn || m_cluster.owns(String(deviceId))) {
+      if (startSession(*dev, dev->info->pskKey, mg_str_n((char*)req, reqLen), false)) {
+        if (m_eventCb) m_eventCb(String(deviceId), DEVICE_UPDATED);
+      }
+    }
+  } else {
+    Serial.printf("Device %s already approved, ignoring\n", deviceId);
   }
+  memset(req, 0, sizeof(req));
 
   free(deviceId);
-  free(nonceHex);
-  free(cipherHex);
   Serial.println("=== handleGatewayConnect finished ===");
 }
 
@@ -421,13 +1563,13 @@ bool GatewayCore::authorizeDevice(const String& id, const char* psk) {
     Serial.println("ERROR: psk is null");
     return false;
   }
-  auto it = m_devices.find(id);
-  if (it == m_devices.end()) {
+  Device* found = m_devices.find(id);
+  if (found == nullptr) {
     Serial.println("ERROR: device not found");
     return false;
   }
-  Device &dev = it->second;
-  if (!dev.has_pending) {
+  Device &dev = *found;
+  if (!dev.hasPending()) {
     Serial.println("ERROR: device has no pending request");
     return false;
   }
@@ -437,33 +1579,31 @@ bool GatewayCore::authorizeDevice(const String& id, const char* psk) {
   gw_psk_to_key(psk, strlen(psk), key);
   Serial.println("Key derived from PSK");
 
-  // Decode nonce
-  uint8_t nonce[12];
-  if (dev.pending_nonce.length() != 24) {
-    Serial.println("ERROR: invalid nonce length");
-    return false;
-  }
-  if (gw_hex_to_bytes(dev.pending_nonce.c_str(), nonce, 24) != 12) {
-    Serial.println("ERROR: nonce hex decode failed");
-    return false;
-  }
+  // The stored request, already hex-decoded by handleGatewayConnect()
+  bool ok = startSession(dev, key, m_devices.pending(dev), true);
+  memset(key, 0, sizeof(key));
+  if (!ok) return false;
 
-  // Decode ciphertext
-  size_t cipherLen = dev.pending_cipher.length() / 2;
-  if (cipherLen == 0) {
-    Serial.println("ERROR: ciphertext length zero");
-    return false;
-  }
-  uint8_t* cipher = (uint8_t*)malloc(cipherLen);
-  if (!cipher) {
-    Serial.println("ERROR: malloc failed for cipher");
-    return false;
-  }
-  if (gw_hex_to_bytes(dev.pending_cipher.c_str(), cipher, dev.pending_cipher.length()) != (int)cipherLen) {
-    Serial.println("ERROR: ciphertext hex decode failed");
-    free(cipher);
-    return false;
-  }
+  if (m_eventCb) m_eventCb(id, DEVICE_UPDATED);
+  Serial.printf("Device %s authorized and approved\n", id.c_str());
+  return true;
+}
+
+// -------------------------------------------------------------------
+// Device sessions (gateway_session.h)
+// -------------------------------------------------------------------
+// Opens a connect request, nonce || ciphertext under the PSK key, checks its
+// signature and gives the device a new session.  With a "pub" in the
+// request the session key comes from an X25519 exchange and the reply
+// carries a ticket; a device without one keeps the PSK key as before.
+// approve: the operator's first authorization, which also takes the name
+// and type from the request.  Otherwise the request must be newer than the
+// last one, so a recorded request cannot reset a session.
+bool GatewayCore::startSession(Device& dev, const uint8_t pskKey[32], struct mg_str req,
+                               bool approve) {
+  const uint8_t* nonce = (const uint8_t*)req.buf;
+  const uint8_t* cipher = nonce + RFC_8439_NONCE_SIZE;
+  size_t cipherLen = req.len - RFC_8439_NONCE_SIZE;
 
   // Decrypt
   // FIX BUG 2: The Python client passes device_id as the AAD when encrypting.
@@ -473,7 +1613,6 @@ bool GatewayCore::authorizeDevice(const String& id, const char* psk) {
   size_t plainLen = cipherLen - RFC_8439_TAG_SIZE;
   uint8_t* plain = (uint8_t*)malloc(plainLen + 1);
   if (!plain) {
-    free(cipher);
     Serial.println("ERROR: malloc failed for plain");
     return false;
   }
@@ -481,11 +1620,11 @@ bool GatewayCore::authorizeDevice(const String& id, const char* psk) {
   // No AAD: chacha20_poly1305_decrypt() in this build does not accept AAD.
   // Python must also encrypt with aad=b"" (no AAD) to keep both sides symmetric.
   size_t decLen = chacha20_poly1305_decrypt(
-      plain, key, nonce,
+      plain, pskKey, nonce,
       cipher, cipherLen);
   if (decLen == (size_t)-1) {
     Serial.println("ERROR: decryption failed (wrong PSK or AAD mismatch)");
-    free(cipher); free(plain);
+    free(plain);
     return false;
   }
   plain[decLen] = '\0';
@@ -511,45 +1650,220 @@ bool GatewayCore::authorizeDevice(const String& id, const char* psk) {
     // if (AUTH_TS_WINDOW > 0 && skew > AUTH_TS_WINDOW) {
     //   Serial.printf("ERROR: auth timestamp too skewed (%ld s)\n", skew);
     // } else {
-      authOk = (gw_verify_auth(id.c_str(), authTs, authMeth, authHex, key) == 1);
+      authOk = (gw_verify_auth(dev.id, authTs, authMeth, authHex, pskKey) == 1);
     // }
   }
   free(authHex); free(authMeth);
 
   if (!authOk) {
     Serial.println("ERROR: auth signature mismatch — wrong PSK or tampered message");
-    free(cipher); free(plain);
+    memset(plain, 0, decLen);
+    free(plain);
     return false;
   }
   Serial.println("Auth signature verified ✓");
   // ────────────────────────────────────────────────────────────────────────
 
-  char* deviceName = mg_json_get_str(inner, "$.device_name");
-  char* deviceType = mg_json_get_str(inner, "$.device_type");
+  // The device's public key is bound into the session key, so one changed
+  // on the way only yields a key that nobody holds
+  char* pubHex = mg_json_get_str(inner, "$.pub");
+  bool ecdh = pubHex != nullptr;
+  uint8_t devPub[SessionKeys::PUB_SIZE], gwPub[SessionKeys::PUB_SIZE];
+  SessionKeys::Keys keys;
+  const char* error = nullptr;
+  if (!approve && authTs <= (long)dev.info->helloTs) {
+    error = "connect request not newer than the last one";
+  } else if (!approve && !ecdh) {
+    error = "known device without a public key";
+  } else if (ecdh && (strlen(pubHex) != 2 * sizeof(devPub) ||
+                      gw_hex_to_bytes(pubHex, devPub, 2 * sizeof(devPub)) != sizeof(devPub) ||
+                      !m_sessions.full(pskKey, devPub, gwPub, keys))) {
+    error = "bad public key";
+  }
+  free(pubHex);
+  if (error != nullptr) {
+    Serial.printf("ERROR: %s: %s\n", dev.id, error);
+    memset(plain, 0, decLen);
+    free(plain);
+    return false;
+  }
+
+  if (approve) {
+    char* deviceName = mg_json_get_str(inner, "$.device_name");
+    char* deviceType = mg_json_get_str(inner, "$.device_type");
+    dev.status = DEV_APPROVED;
+    dev.perms = GW_DEFAULT_PERMS;
+    if (deviceName) mg_snprintf(dev.info->name, sizeof(dev.info->name), "%s", deviceName);
+    if (deviceType) mg_snprintf(dev.info->type, sizeof(dev.info->type), "%s", deviceType);
+    free(deviceName); free(deviceType);
+    memcpy(dev.info->pskKey, pskKey, 32);
+    dev.info->pskSet = true;
+  }
+  memset(plain, 0, decLen);
+  free(plain);
 
-  // Approve device
-  dev.status = DEV_APPROVED;
-  memcpy(dev.enc_key, key, 32);
+  dev.info->helloTs = (uint32_t)authTs;
   dev.keySet = true;
-  if (deviceName) dev.name = deviceName;
-  if (deviceType) dev.type = deviceType;
-  dev.has_pending = false;
-  dev.pending_nonce = "";
-  dev.pending_cipher = "";
-  saveDevice(dev);
+  if (ecdh) {
+    // Counters start over with the key
+    memcpy(dev.enc_key, keys.session, 32);
+    dev.lastNonce = 0;
+    dev.txNonce = 0;
+  } else {
+    memcpy(dev.enc_key, pskKey, 32);
+  }
+  m_devices.clearPending(dev);
+  if (!ecdh) saveDevice(dev);             // else written with its ticket
+  if (m_clusterOn) publishRecord(dev);
+
+  if (ecdh) {
+    char member[16 + 2 * SessionKeys::PUB_SIZE];
+    char pubOut[2 * SessionKeys::PUB_SIZE + 1];
+    bytes_to_hex(gwPub, sizeof(gwPub), pubOut);
+    mg_snprintf(member, sizeof(member), "\"pub\":\"%s\"", pubOut);
+    sendSessionReply(dev, member, keys.secret, "full");
+    memset(&keys, 0, sizeof(keys));
+  } else {
+    // Send encrypted approval response
+    char respBuf[256];
+    int n = mg_snprintf(respBuf, sizeof(respBuf),
+      "{\"jsonrpc\":\"2.0\",\"method\":\"connect.response\",\"params\":{\"status\":\"approved\"},\"id\":null}");
+    sendEncrypted(dev.id, (uint8_t*)respBuf, n);
+  }
+  Serial.printf("Device %s: new %s session\n", dev.id, ecdh ? "X25519" : "PSK");
+  return true;
+}
 
-  free(cipher); free(plain);
-  free(deviceName); free(deviceType);
+// A device back with a ticket: the ticket and the request are opened and
+// two HMACs give the new keys, no scalar multiplication.  Anything wrong is
+// answered with "Resume failed", and the device does a full handshake.
+// The new key and ticket generation reach flash before the reply leaves,
+// see sendSessionReply.
+void GatewayCore::resumeSession(const String& id, struct mg_str payload) {
+  if (m_clusterOn && !m_cluster.owns(id)) return;   // its owner answers
+  Device* found = m_devices.find(id);
+  struct mg_str ticketHex = rxJsonRaw(payload, "$.ticket");
+  struct mg_str nonceHex = rxJsonRaw(payload, "$.nonce");
+  struct mg_str cipherHex = rxJsonRaw(payload, "$.ciphertext");
+  uint8_t ticket[SessionKeys::TICKET_SIZE], nonce[RFC_8439_NONCE_SIZE], key[32];
+  uint8_t* cipher = (uint8_t*)cipherHex.buf;
+  size_t cipherLen = cipherHex.len / 2;
+  SessionKeys::Ticket t;
+  uint32_t now = (uint32_t)m_clock->unixTime();
+  const char* error = nullptr;
+
+  if (found == nullptr || found->status != DEV_APPROVED || !found->keySet) {
+    error = "unknown device";
+  } else if (ticketHex.len != 2 * sizeof(ticket) || nonceHex.len != 2 * sizeof(nonce) ||
+             cipherLen <= RFC_8439_TAG_SIZE ||
+             gw_hex_to_bytes(ticketHex.buf, ticket, ticketHex.len) != (int)sizeof(ticket) ||
+             gw_hex_to_bytes(nonceHex.buf, nonce, nonceHex.len) != (int)sizeof(nonce) ||
+             gw_hex_to_bytes(cipherHex.buf, cipher, cipherHex.len) != (int)cipherLen) {
+    error = "malformed request";
+  } else if (!m_sessions.open(id.c_str(), ticket, sizeof(ticket), t)) {
+    error = "ticket not ours";
+  } else if (t.gen < found->info->ticketGen) {
+    error = "ticket already used";
+  } else if (t.issued > now + GW_SESSION_TICKET_SKEW_S) {
+    // Our clock went back, or another member's runs ahead: such a ticket
+    // would not expire until the clock catches up
+    error = "ticket from the future";
+  } else if (now > t.issued && now - t.issued > GW_SESSION_TICKET_TTL_S) {
+    error = "ticket expired";
+  } else {
+    // The request proves the device holds the secret in the ticket
+    ArenaScope scratch(m_arena);
+    SessionKeys::requestKey(t.secret, key);
+    size_t n = chacha20_poly1305_open(cipher, key, nonce, (const uint8_t*)id.c_str(),
+                                      id.length(), cipher, cipherLen);
+    memset(key, 0, sizeof(key));
+    char* method = n == (size_t)-1 ? nullptr
+                                   : rxJsonStr(m_arena, mg_str_n((char*)cipher, n), "$.method");
+    if (method == nullptr || strcmp(method, "request_resume") != 0) {
+      error = "bad resume request";
+    }
+  }
+  if (error != nullptr) {
+    m_sessions.stats().rejected++;
+    memset(&t, 0, sizeof(t));
+    Serial.printf("WARN: %s: resume refused, %s\n", id.c_str(), error);
+    sendError(id, "Resume failed");
+    return;
+  }
 
-  // Send encrypted approval response
-  char respBuf[256];
-  int n = mg_snprintf(respBuf, sizeof(respBuf),
-    "{\"jsonrpc\":\"2.0\",\"method\":\"connect.response\",\"params\":{\"status\":\"approved\"},\"id\":null}");
-  sendEncrypted(id, (uint8_t*)respBuf, n);
+  Device& dev = *found;
+  uint8_t random[SessionKeys::RANDOM_SIZE];
+  SessionKeys::Keys keys;
+  m_sessions.resume(t.secret, nonce, random, keys);
+  if (t.gen > dev.info->ticketGen) dev.info->ticketGen = t.gen;
+  memset(&t, 0, sizeof(t));
+  memcpy(dev.enc_key, keys.session, 32);
+  dev.lastNonce = 0;
+  dev.txNonce = 0;
+  dev.regDirty = true;                      // the cluster checkpoint spreads the key
+
+  char member[16 + 2 * SessionKeys::RANDOM_SIZE];
+  char randomHex[2 * SessionKeys::RANDOM_SIZE + 1];
+  bytes_to_hex(random, sizeof(random), randomHex);
+  mg_snprintf(member, sizeof(member), "\"random\":\"%s\"", randomHex);
+  sendSessionReply(dev, member, keys.secret, "resumed");
+  memset(&keys, 0, sizeof(keys));
+  Serial.printf("Device %s resumed its session\n", dev.id);
+}
 
-  if (m_eventCb) m_eventCb(id, DEVICE_UPDATED);
-  Serial.printf("Device %s authorized and approved\n", id.c_str());
-  return true;
+// connect.response with a new ticket, under the new session key.  The
+// device needs member, our public key or random, to derive that key, so it
+// travels in the clear next to the ciphertext.
+//
+// The device is written first, with the new key, the generation of the new
+// ticket and a fresh counter reservation.  A generation left behind on
+// flash would let a captured resume request in again after a reboot.  It
+// costs one flash write per resume, as much as a full handshake.
+void GatewayCore::sendSessionReply(Device& dev, const char* member, const uint8_t secret[32],
+                                   const char* kind) {
+  SessionKeys::Ticket t;
+  t.gen = ++dev.info->ticketGen;
+  reserveTxNonce(dev);
+  t.issued = (uint32_t)m_clock->unixTime();
+  memcpy(t.secret, secret, sizeof(t.secret));
+  uint8_t ticket[SessionKeys::TICKET_SIZE];
+  m_sessions.seal(dev.id, t, ticket);
+  memset(&t, 0, sizeof(t));
+
+  char ticketHex[2 * SessionKeys::TICKET_SIZE + 1];
+  bytes_to_hex(ticket, sizeof(ticket), ticketHex);
+  char resp[320];
+  int n = mg_snprintf(resp, sizeof(resp),
+    "{\"jsonrpc\":\"2.0\",\"method\":\"connect.response\",\"params\":{\"status\":\"approved\","
+    "\"session\":\"%s\",\"ticket\":\"%s\"},\"id\":null}", kind, ticketHex);
+  sendEncrypted(dev.id, (uint8_t*)resp, n, OutQueue::LANE_CONTROL, member);
+  memset(resp, 0, sizeof(resp));
+}
+
+// Outside a cluster the ticket key is made on first boot and kept in flash,
+// so tickets outlive a restart.  Shards keep one each.
+void GatewayCore::loadTicketKey() {
+  uint8_t key[32];
+  if (m_clusterOn) {
+    m_sessions.begin(m_cluster.ticketKey());
+    return;
+  }
+  String path = GW_SESSION_KEY_FILE;
+  if (m_shards > 1) path += "_s" + String(m_shard);
+  File f = LittleFS.open(path, "r");
+  bool ok = f && f.read(key, sizeof(key)) == sizeof(key);
+  if (f) f.close();
+  if (!ok) {
+    mg_random(key, sizeof(key));
+    f = LittleFS.open(path, "w");
+    if (!f || f.write(key, sizeof(key)) != sizeof(key)) {
+      Serial.println("WARN: could not store the ticket key, tickets end with this boot");
+    }
+    if (f) f.close();
+    Serial.println("New session ticket key");
+  }
+  m_sessions.begin(key);
+  memset(key, 0, sizeof(key));
 }
 
 // -------------------------------------------------------------------
@@ -561,95 +1875,139 @@ void GatewayCore::handleGatewayRx(struct mg_str payload) {
     Serial.println("ERROR: payload empty");
     return;
   }
+  ArenaScope scratch(m_arena);
 
-  char* deviceId = mg_json_get_str(payload, "$.device_id");
+  char* deviceId = rxJsonStr(m_arena, payload, "$.device_id");
   if (!deviceId) {
     Serial.println("ERROR: no device_id");
     return;
   }
+  String& devId = m_rxId;
+  devId = deviceId;
+  if (!inShard(devId) || routeElsewhere(devId, mg_str(GW_T_GATEWAY_RX), payload)) {
+    return;
+  }
+  m_metrics.rxFrames++;
+  m_metrics.rxBytes += payload.len;
 
-  char* nonceHex = mg_json_get_str(payload, "$.nonce");
-  char* cipherHex = mg_json_get_str(payload, "$.ciphertext");
+  // Both stay in the frame: the ciphertext is hex-decoded and then decrypted
+  // over itself, so nothing proportional to the payload is allocated.  The
+  // frame is no longer JSON after that, so it is not parsed again.
+  struct mg_str nonceHex = rxJsonRaw(payload, "$.nonce");
+  struct mg_str cipherHex = rxJsonRaw(payload, "$.ciphertext");
 
-  if (!nonceHex || !cipherHex) {
+  if (nonceHex.len == 0 || cipherHex.len == 0) {
     Serial.println("ERROR: missing nonce or ciphertext");
-    free(deviceId);
-    free(nonceHex);
-    free(cipherHex);
     return;
   }
 
-  String devId(deviceId);
-  auto it = m_devices.find(devId);
-  if (it == m_devices.end()) {
+  Device* found = m_devices.find(devId);
+  if (found == nullptr) {
     Serial.printf("ERROR: device %s not found\n", deviceId);
     sendError(devId, "Device not found");
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
-  Device &dev = it->second;
+  Device &dev = *found;
   if (!dev.keySet) {
     Serial.printf("ERROR: device %s has no encryption key\n", deviceId);
     sendError(devId, "No encryption key");
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
 
   // Decode nonce
   uint8_t nonce[12];
-  if (strlen(nonceHex) != 24) {
+  if (nonceHex.len != 24) {
     Serial.println("ERROR: invalid nonce length");
     sendError(devId, "Invalid nonce");
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
-  if (gw_hex_to_bytes(nonceHex, nonce, 24) != 12) {
+  if (gw_hex_to_bytes(nonceHex.buf, nonce, 24) != 12) {
     Serial.println("ERROR: nonce hex decode failed");
     sendError(devId, "Invalid nonce");
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
 
-  // Decode ciphertext
-  size_t cipherLen = strlen(cipherHex) / 2;
-  uint8_t* cipher = (uint8_t*)malloc(cipherLen);
-  if (!cipher) {
-    Serial.println("ERROR: malloc failed for cipher");
-    sendError(devId, "OOM");
-    free(deviceId); free(nonceHex); free(cipherHex);
-    return;
-  }
-  if (gw_hex_to_bytes(cipherHex, cipher, strlen(cipherHex)) != (int)cipherLen) {
+  // Decode ciphertext into the first half of its own hex
+  size_t cipherLen = cipherHex.len / 2;
+  uint8_t* cipher = (uint8_t*)cipherHex.buf;
+  if (cipherLen <= RFC_8439_TAG_SIZE ||
+      gw_hex_to_bytes(cipherHex.buf, cipher, cipherHex.len) != (int)cipherLen) {
     Serial.println("ERROR: ciphertext hex decode failed");
-    free(cipher);
     sendError(devId, "Invalid ciphertext");
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
 
+  processRx(dev, nonce, cipher, cipherLen);
+  Serial.println("=== handleGatewayRx finished ===");
+}
+
+// jrpc/gateway/rx/<device_id>: the device comes from the topic and the
+// payload is the raw 12-byte nonce followed by ciphertext and tag, so the
+// frame is routed without any JSON parsing.  The topic also lets the broker
+// enforce per-device publish ACLs.
+void GatewayCore::handleDeviceRx(struct mg_str deviceId, struct mg_str payload) {
+  char idBuf[64];
+  if (deviceId.len == 0 || deviceId.len >= sizeof(idBuf)) {
+    Serial.println("ERROR: bad device id in topic");
+    return;
+  }
+  mg_snprintf(idBuf, sizeof(idBuf), "%.*s", (int)deviceId.len, deviceId.buf);
+  String& devId = m_rxId;
+  devId = idBuf;
+  if (!inShard(devId)) return;              // left over from a different shard count
+  if (m_clusterOn) {
+    char topic[96];
+    mg_snprintf(topic, sizeof(topic), GW_T_GATEWAY_RX "/%s", idBuf);
+    if (routeElsewhere(devId, mg_str(topic), payload)) return;
+  }
+  m_metrics.rxFrames++;
+  m_metrics.rxBytes += payload.len;
+  Device* found = m_devices.find(devId);
+  if (found == nullptr) {
+    Serial.printf("ERROR: device %s not found\n", idBuf);
+    sendError(devId, "Device not found");
+    return;
+  }
+  Device &dev = *found;
+  if (!dev.keySet) {
+    Serial.printf("ERROR: device %s has no encryption key\n", idBuf);
+    sendError(devId, "No encryption key");
+    return;
+  }
+  if (payload.len < RFC_8439_NONCE_SIZE + RFC_8439_TAG_SIZE) {
+    Serial.println("ERROR: binary frame too short");
+    sendError(devId, "Invalid frame");
+    return;
+  }
+  uint8_t* frame = (uint8_t*)payload.buf;
+  processRx(dev, frame, frame + RFC_8439_NONCE_SIZE, payload.len - RFC_8439_NONCE_SIZE,
+            true);
+}
+
+// Decrypt, authenticate and dispatch one device frame, then send the reply
+// in the same framing the device used.  The plaintext overwrites cipher.
+void GatewayCore::processRx(Device& dev, const uint8_t nonce[12], uint8_t* cipher,
+                            size_t cipherLen, bool binary) {
+  const String& devId = m_rxId;             // dev.id, set by the caller
+  unsigned long t0 = micros();
   // Decrypt
   // FIX BUG 2: Same as authorizeDevice — must pass device_id as AAD to match
   // what the Python client used during encryption, otherwise the Poly1305 tag
   // will never verify and every message will be rejected.
-  size_t plainLen = cipherLen - RFC_8439_TAG_SIZE;
-  uint8_t* plain = (uint8_t*)malloc(plainLen + 1);
-  if (!plain) {
-    free(cipher);
-    Serial.println("ERROR: malloc failed for plain");
-    sendError(devId, "OOM");
-    free(deviceId); free(nonceHex); free(cipherHex);
-    return;
-  }
+  // In place: the tag behind the ciphertext leaves room for the NUL.
+  uint8_t* plain = cipher;
 
   // No AAD: same as authorizeDevice — must match Python's aad=b"" encryption.
   size_t decLen = chacha20_poly1305_decrypt(
       plain, dev.enc_key, nonce,
       cipher, cipherLen);
+  unsigned long t1 = micros();
+  m_metrics.stages[GatewayMetrics::STAGE_DECRYPT].observe(t1 - t0);
+  GW_TRACE_SPAN(TRACE_DECRYPT, t0, t1 - t0);
   if (decLen == (size_t)-1) {
+    m_metrics.rxDecryptFailures++;
     Serial.println("ERROR: decryption failed");
     sendError(devId, "Decryption failed");
-    free(cipher); free(plain);
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
   plain[decLen] = '\0';
@@ -657,31 +2015,35 @@ void GatewayCore::handleGatewayRx(struct mg_str payload) {
 
   // ── Auth signature verification ─────────────────────────────────────────
   // Every RX message must contain "timestamp" and "auth" in addition to the
-  // standard JSON-RPC fields.  "method" is the JSON-RPC method field.
-  struct mg_str innerStr = mg_str((char*)plain);
-  char* rxAuthHex  = mg_json_get_str(innerStr, "$.auth");
-  char* rxMethod   = mg_json_get_str(innerStr, "$.method");
-  long  rxAuthTs   = (long)mg_json_get_long(innerStr, "$.timestamp", 0);
-
-  bool rxAuthOk = false;
-  if (rxAuthHex && rxMethod && rxAuthTs != 0) {
-    // long now = (long)time(nullptr);
-    // long skew = rxAuthTs - now;
-    // if (skew < 0) skew = -skew;
-    // if (AUTH_TS_WINDOW > 0 && skew > AUTH_TS_WINDOW) {
-    //   Serial.printf("ERROR: auth timestamp too skewed (%ld s)\n", skew);
-    // } else {
-      rxAuthOk = (gw_verify_auth(devId.c_str(), rxAuthTs, rxMethod,
-                                 rxAuthHex, dev.enc_key) == 1);
-    // }
+  // standard JSON-RPC fields.  "method" is the JSON-RPC method field.  In a
+  // batch every element carries its own signature and all must verify.
+  struct mg_str innerStr = mg_str_n((char*)plain, decLen);
+  bool batch = isBatch(innerStr);
+  bool response = !batch && isResponse(innerStr);
+  bool rxAuthOk = true;
+  if (batch) {
+    struct mg_str key, val;
+    size_t ofs = 0;
+    int count = 0;
+    while (rxAuthOk && (ofs = mg_json_next(innerStr, ofs, &key, &val)) > 0) {
+      rxAuthOk = verifyRequestAuth(dev, val);
+      if (++count > GW_RPC_BATCH_MAX) {
+        Serial.printf("ERROR: batch larger than %d requests\n", GW_RPC_BATCH_MAX);
+        rxAuthOk = false;
+      }
+    }
+    if (count == 0) rxAuthOk = false;   // an empty batch carries no signature
+  } else {
+    // A reply to the gateway's ping has no method; it is signed as "ping"
+    rxAuthOk = verifyRequestAuth(dev, innerStr, response ? "ping" : nullptr);
   }
-  free(rxAuthHex); free(rxMethod);
 
+  unsigned long t2 = micros();
+  m_metrics.stages[GatewayMetrics::STAGE_AUTH].observe(t2 - t1);
   if (!rxAuthOk) {
+    m_metrics.rxAuthFailures++;
     Serial.println("ERROR: auth signature mismatch — rejecting message");
     sendError(devId, "Auth failed");
-    free(cipher); free(plain);
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
   Serial.println("Auth signature verified ✓");
@@ -690,40 +2052,267 @@ void GatewayCore::handleGatewayRx(struct mg_str payload) {
   // Replay protection
   uint32_t counter = (nonce[0] << 24) | (nonce[1] << 16) | (nonce[2] << 8) | nonce[3];
   if (counter <= dev.lastNonce) {
+    m_metrics.rxReplayRejects++;
     Serial.printf("WARN: nonce too old (%u <= %u)\n", counter, dev.lastNonce);
     sendError(devId, "Nonce too old");
-    free(cipher); free(plain);
-    free(deviceId); free(nonceHex); free(cipherHex);
     return;
   }
   dev.lastNonce = counter;
+  dev.lastRxMs = nowMs();
+  dev.lastSeen = dev.lastRxMs;
+  dev.messageCount++;
+  dev.binaryRx = binary;
+  dev.regDirty = true;
+  m_metrics.rxAccepted++;
+
+  // Process RPC.  The response is printed into the preallocated buffer; a
+  // batch yields one array covering every request that expects a reply.
+  m_rpcOut.len = 0;
+  m_rpcOut.overflow = false;
+  if (response) {
+    onPingReply(dev, innerStr);
+  } else if (batch) {
+    processBatch(dev, innerStr);
+  } else {
+    processRequest(dev, innerStr);
+  }
+  unsigned long t3 = micros();
+  m_metrics.stages[GatewayMetrics::STAGE_RPC].observe(t3 - t2);
+  GW_TRACE_SPAN(TRACE_RPC, t2, t3 - t2);
+
+  if (m_rpcOut.overflow) {
+    Serial.println("ERROR: RPC response exceeds GW_RPC_OUT_SIZE");
+    sendError(devId, "Response too large");
+  } else if (m_rpcOut.len > 0) {
+    sendEncrypted(devId, (const uint8_t*)m_rpcOut.buf, m_rpcOut.len);
+  }
 
-  // Process RPC
-  struct mg_iobuf io = {NULL, 0, 0, 256};
+  // The device is listening now: deliver what was stored while it was away
+  if (m_dlq.pendingMsgs(devId) > 0) {
+    dev.dlqDraining = !flushDownlink(dev);
+    if (dev.dlqDraining) m_dlqDraining = true;
+  }
+
+  m_metrics.stages[GatewayMetrics::STAGE_RX].observe(micros() - t0);
+}
+
+// -------------------------------------------------------------------
+// RPC frame helpers
+// -------------------------------------------------------------------
+bool GatewayCore::isBatch(struct mg_str frame) {
+  return frame.len > 0 && frame.buf[0] == '[';
+}
+
+// A response is a frame with an id and no method
+bool GatewayCore::isResponse(struct mg_str frame) {
+  return mg_json_get(frame, "$.method", NULL) < 0 && mg_json_get(frame, "$.id", NULL) > 0;
+}
+
+// answers: the method a response was signed with; requests sign their own
+bool GatewayCore::verifyRequestAuth(const Device& dev, struct mg_str req,
+                                    const char* answers) {
+  ArenaScope scratch(m_arena);
+  char* authHex = rxJsonStr(m_arena, req, "$.auth");
+  char* ownMethod = answers ? nullptr : rxJsonStr(m_arena, req, "$.method");
+  const char* method = answers ? answers : ownMethod;
+  long  authTs  = (long)mg_json_get_long(req, "$.timestamp", 0);
+
+  bool ok = false;
+  if (authHex && method && authTs != 0) {
+    // long now = (long)time(nullptr);
+    // long skew = authTs - now;
+    // if (skew < 0) skew = -skew;
+    // if (AUTH_TS_WINDOW > 0 && skew > AUTH_TS_WINDOW) {
+    //   Serial.printf("ERROR: auth timestamp too skewed (%ld s)\n", skew);
+    // } else {
+      GW_TRACE_SCOPE(TRACE_AUTH);
+      ok = (gw_verify_auth(dev.id, authTs, method,
+                           authHex, dev.enc_key) == 1);
+    // }
+  }
+  return ok;
+}
+
+// Dispatch one request object, appending its response (if any) to
+// m_rpcOut.  Notifications -- a method with no id -- never produce output,
+// not even an error.
+void GatewayCore::processRequest(Device& dev, struct mg_str req) {
+  size_t mark = m_rpcOut.len;
+  bool overflow = m_rpcOut.overflow;
+  m_metrics.rpcRequests++;
   struct mg_rpc_req r = {};
-  r.head     = &m_rpcHead;
-  r.pfn      = mg_pfn_iobuf;
-  r.pfn_data = &io;
-  r.frame    = mg_str((char*)plain);
-  mg_rpc_process(&r);
+  r.pfn      = rpc_out_pfn;
+  r.pfn_data = &m_rpcOut;
+  r.frame    = req;
+  dispatchRpc(dev, &r);
+
+  int len, off = mg_json_get(req, "$.method", &len);
+  bool notification = off > 0 && req.buf[off] == '"' &&
+                      mg_json_get(req, "$.id", NULL) < 0;
+  if (notification) {
+    m_rpcOut.len = mark;
+    m_rpcOut.overflow = overflow;
+  }
+}
 
-  if (io.len > 0) {
-    sendEncrypted(devId, io.buf, io.len);
-    mg_iobuf_free(&io);
+void GatewayCore::processBatch(Device& dev, struct mg_str batch) {
+  struct mg_str key, val;
+  size_t ofs = 0;
+  int count = 0;
+  rpc_out_pfn('[', &m_rpcOut);
+  while ((ofs = mg_json_next(batch, ofs, &key, &val)) > 0) {
+    size_t mark = m_rpcOut.len;
+    if (mark > 1) rpc_out_pfn(',', &m_rpcOut);
+    size_t body = m_rpcOut.len;
+    processRequest(dev, val);
+    if (m_rpcOut.len == body) m_rpcOut.len = mark;   // notification
+    count++;
   }
 
-  free(cipher);
-  free(plain);
-  free(deviceId); free(nonceHex); free(cipherHex);
-  Serial.println("=== handleGatewayRx finished ===");
+  if (m_rpcOut.len == 1) {
+    m_rpcOut.len = 0;                                  // all notifications
+  } else {
+    rpc_out_pfn(']', &m_rpcOut);
+  }
+  Serial.printf("Batch of %d requests processed\n", count);
+}
+
+// -------------------------------------------------------------------
+// Deferred RPC responses
+// -------------------------------------------------------------------
+GatewayCore::Deferred GatewayCore::deferRpc(struct mg_rpc_req *r) {
+  Deferred d = { Deferred::NONE, 0 };
+  Device* dev = (Device*)r->req_data;
+  struct mg_str id = mg_json_get_tok(r->frame, "$.id");
+  if (dev == nullptr || id.len == 0) return d;      // notification: no reply
+  if (id.len > GW_RPC_ID_MAX) {
+    mg_rpc_err(r, -32000, "\"Request id too long\"");
+    return d;
+  }
+  for (size_t i = 0; i < GW_RPC_DEFER_MAX; i++) {
+    PendingRpc &p = m_pending[i];
+    if (p.used) continue;
+    p.used = true;
+    p.gen++;
+    p.deviceId = dev->id;
+    memcpy(p.id, id.buf, id.len);
+    p.idLen = id.len;
+    p.deadline = nowMs() + GW_RPC_DEFER_TIMEOUT_MS;
+    d.slot = (uint16_t)i;
+    d.gen = p.gen;
+    return d;
+  }
+  Serial.println("WARN: no free deferred RPC slot");
+  mg_rpc_err(r, -32000, "\"Busy\"");
+  return d;
+}
+
+GatewayCore::PendingRpc* GatewayCore::pendingFor(Deferred d) {
+  if (d.slot >= GW_RPC_DEFER_MAX) return nullptr;
+  PendingRpc &p = m_pending[d.slot];
+  if (!p.used || p.gen != d.gen) return nullptr;    // finished or timed out
+  return &p;
+}
+
+// Encrypt and publish a finished response.  The device counter is taken
+// now, not when the request arrived.
+void GatewayCore::finishRpc(PendingRpc& p, RpcOut& out) {
+  if (out.overflow) {
+    Serial.println("ERROR: deferred RPC response exceeds GW_RPC_OUT_SIZE");
+    sendError(p.deviceId, "Response too large");
+  } else {
+    sendToDevice(p.deviceId, (const uint8_t*)out.buf, out.len, OutQueue::LANE_CONTROL);
+  }
+  p.used = false;
+  p.deviceId = String();
+}
+
+bool GatewayCore::completeRpc(Deferred d, const char* fmt, ...) {
+  PendingRpc* p = pendingFor(d);
+  if (p == nullptr) return false;
+  RpcOut out = { m_deferOutBuf, sizeof(m_deferOutBuf), 0, false };
+  va_list ap;
+  va_start(ap, fmt);
+  mg_xprintf(rpc_out_pfn, &out, "{%m:%.*s,%m:", MG_ESC("id"),
+             (int)p->idLen, p->id, MG_ESC("result"));
+  mg_vxprintf(rpc_out_pfn, &out, fmt == nullptr ? "null" : fmt, &ap);
+  mg_xprintf(rpc_out_pfn, &out, "}");
+  va_end(ap);
+  finishRpc(*p, out);
+  return true;
+}
+
+bool GatewayCore::failRpc(Deferred d, int code, const char* msg) {
+  PendingRpc* p = pendingFor(d);
+  if (p == nullptr) return false;
+  RpcOut out = { m_deferOutBuf, sizeof(m_deferOutBuf), 0, false };
+  mg_xprintf(rpc_out_pfn, &out, "{%m:%.*s,%m:{%m:%d,%m:%m}}", MG_ESC("id"),
+             (int)p->idLen, p->id, MG_ESC("error"), MG_ESC("code"), code,
+             MG_ESC("message"), MG_ESC(msg ? msg : ""));
+  finishRpc(*p, out);
+  return true;
+}
+
+// Called from other tasks: the result is copied into a small mailbox and
+// sent by poll() on the Mongoose thread.
+bool GatewayCore::postRpcResult(Deferred d, const char* resultJson) {
+  size_t len = resultJson ? strlen(resultJson) : 0;
+  if (len >= GW_RPC_MAIL_SIZE) return false;
+  std::lock_guard<std::mutex> lock(m_mailLock);
+  if (m_mailCount >= GW_RPC_MAILBOX) return false;
+  RpcMail &m = m_mailbox[(m_mailHead + m_mailCount) % GW_RPC_MAILBOX];
+  m.d = d;
+  m.len = len;
+  if (len > 0) memcpy(m.json, resultJson, len);
+  m.json[len] = '\0';
+  m_mailCount++;
+  wake();
+  return true;
+}
+
+void GatewayCore::drainRpcMailbox() {
+  if (m_mailCount.load(std::memory_order_relaxed) == 0) return;   // rechecked under lock
+  for (;;) {
+    RpcMail m;
+    {
+      std::lock_guard<std::mutex> lock(m_mailLock);
+      if (m_mailCount == 0) return;
+      m = m_mailbox[m_mailHead];
+      m_mailHead = (m_mailHead + 1) % GW_RPC_MAILBOX;
+      m_mailCount--;
+    }
+    completeRpc(m.d, m.len > 0 ? "%s" : nullptr, m.json);
+  }
+}
+
+void GatewayCore::rpcDeferTimerFn(void *arg) {
+  GatewayCore* self = static_cast<GatewayCore*>(arg);
+  unsigned long now = self->nowMs();
+  for (size_t i = 0; i < GW_RPC_DEFER_MAX; i++) {
+    PendingRpc &p = self->m_pending[i];
+    if (!p.used || (long)(now - p.deadline) < 0) continue;
+    Serial.printf("WARN: deferred RPC for %s timed out\n", p.deviceId.c_str());
+    Deferred d = { (uint16_t)i, p.gen };
+    self->failRpc(d, -32000, "Timeout");
+  }
 }
 
 // -------------------------------------------------------------------
 // RPC method implementations
 // -------------------------------------------------------------------
-void GatewayCore::rpcPing(struct mg_rpc_req *r) {
-  mg_rpc_ok(r, "{%m:true,%m:%lu}",
-            MG_ESC("pong"), MG_ESC("uptime_ms"), (unsigned long)millis());
+void GatewayCore::rpcPing(struct mg_rpc_req *r, RpcOpt<double> ts) {
+  GatewayCore* self = static_cast<GatewayCore*>(r->rpc->fn_data);
+  if (ts.present) {
+    // Echo the caller's timestamp so it can measure round-trip time.
+    // 17 digits give back the exact double: plain %g keeps 6, which
+    // turns a millisecond timestamp into 1.76e+12.
+    mg_rpc_ok(r, "{%m:true,%m:%lu,%m:%.17g}",
+              MG_ESC("pong"), MG_ESC("uptime_ms"), (unsigned long)self->nowMs(),
+              MG_ESC("ts"), ts.value);
+  } else {
+    mg_rpc_ok(r, "{%m:true,%m:%lu}",
+              MG_ESC("pong"), MG_ESC("uptime_ms"), (unsigned long)self->nowMs());
+  }
 }
 
 void GatewayCore::rpcRequestConnect(struct mg_rpc_req *r) {
@@ -734,41 +2323,51 @@ void GatewayCore::rpcRequestConnect(struct mg_rpc_req *r) {
 // Device management
 // -------------------------------------------------------------------
 Device* GatewayCore::getDevice(const String& id) {
-  auto it = m_devices.find(id);
-  return (it != m_devices.end()) ? &it->second : nullptr;
+  return m_devices.find(id);
 }
 
-void GatewayCore::approveDevice(const String& id, const DevicePerms& perms, const char* psk) {
-  auto it = m_devices.find(id);
-  if (it == m_devices.end()) return;
-  Device &dev = it->second;
+void GatewayCore::approveDevice(const String& id, DevicePerms perms, const char* psk) {
+  Device* found = m_devices.find(id);
+  if (found == nullptr) return;
+  Device &dev = *found;
   dev.status = DEV_APPROVED;
-  dev.permPing = perms.ping;
+  dev.perms = perms;
   if (psk) {
-    gw_psk_to_key(psk, strlen(psk), dev.enc_key);
+    gw_psk_to_key(psk, strlen(psk), dev.info->pskKey);
+    memcpy(dev.enc_key, dev.info->pskKey, sizeof(dev.enc_key));
+    dev.info->pskSet = true;
     dev.keySet = true;
   }
   saveDevice(dev);
+  if (m_clusterOn) publishRecord(dev);
   if (m_eventCb) m_eventCb(id, DEVICE_UPDATED);
 }
 
 void GatewayCore::denyDevice(const String& id) {
-  auto it = m_devices.find(id);
-  if (it == m_devices.end()) return;
-  it->second.status = DEV_DENIED;
-  saveDevice(it->second);
+  Device* found = m_devices.find(id);
+  if (found == nullptr) return;
+  found->status = DEV_DENIED;
+  m_devices.clearPending(*found);
+  saveDevice(*found);
+  if (m_clusterOn) publishRecord(*found);
   if (m_eventCb) m_eventCb(id, DEVICE_UPDATED);
 }
 
 void GatewayCore::addDevice(const String& id, const String& name, const String& type) {
-  Device dev;
-  dev.id = id;
-  dev.name = name;
-  dev.type = type;
-  dev.firstSeen = millis();
-  dev.lastSeen = millis();
-  dev.status = DEV_PENDING;
-  m_devices[id] = dev;
+  Device rec;
+  DeviceInfo recInfo;
+  rec.info = &recInfo;
+  mg_snprintf(rec.id, sizeof(rec.id), "%s", id.c_str());
+  mg_snprintf(recInfo.name, sizeof(recInfo.name), "%s", name.c_str());
+  mg_snprintf(recInfo.type, sizeof(recInfo.type), "%s", type.c_str());
+  recInfo.firstSeen = nowMs();
+  rec.lastSeen = nowMs();
+  rec.status = DEV_PENDING;
+  if (id.length() > GW_DEVICE_ID_MAX || m_devices.add(rec) == nullptr) {
+    Serial.printf("WARN: cannot add device %s (%d/%d slots)\n", id.c_str(),
+                  (int)m_devices.size(), GW_DEVICE_MAX);
+    return;
+  }
   if (m_eventCb) m_eventCb(id, DEVICE_ADDED);
 }
 
@@ -776,13 +2375,17 @@ void GatewayCore::addDevice(const String& id, const String& name, const String&
 // Delete helpers (called from dashboard)
 // -------------------------------------------------------------------
 bool GatewayCore::deleteDevice(const String& id) {
-  auto it = m_devices.find(id);
-  if (it == m_devices.end()) {
+  Device* found = m_devices.find(id);
+  if (found == nullptr) {
     Serial.printf("deleteDevice: device %s not found\n", id.c_str());
     return false;
   }
-  m_devices.erase(it);
+  if (m_clusterOn) publishRecordDelete(*found);
+  m_devices.remove(found);
   removeDevice(id);                          // delete LittleFS file
+  m_dlq.clear(id);
+  m_pings.erase(id);
+  if (m_shards > 1) subscribeDevice(id, false);
   if (m_eventCb) m_eventCb(id, DEVICE_REMOVED);
   Serial.printf("Deleted device %s\n", id.c_str());
   return true;
@@ -792,11 +2395,16 @@ void GatewayCore::deleteAllDevices() {
   // Collect IDs first to avoid invalidating the iterator inside the loop
   std::vector<String> ids;
   ids.reserve(m_devices.size());
-  for (auto& pair : m_devices) ids.push_back(pair.first);
+  for (const Device& dev : m_devices) ids.push_back(String(dev.id));
 
   for (auto& id : ids) {
-    m_devices.erase(id);
+    Device* found = m_devices.find(id);
+    if (m_clusterOn) publishRecordDelete(*found);
+    m_devices.remove(found);
     removeDevice(id);
+    m_dlq.clear(id);
+    m_pings.erase(id);
+    if (m_shards > 1) subscribeDevice(id, false);
     if (m_eventCb) m_eventCb(id, DEVICE_REMOVED);
   }
   Serial.printf("Deleted all %d devices\n", (int)ids.size());
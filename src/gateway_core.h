@@ -4,9 +4,25 @@
 #include <Arduino.h>
 #include <map>
 #include <functional>
+#include <mutex>
+#include <atomic>
+#include <vector>
 #include <LittleFS.h>                   // new
 #include "mongoose.h"
 #include "gateway_private.h"
+#include "gateway_devices.h"
+#include "gateway_rpc.h"
+#include "gateway_outq.h"
+#include "gateway_store.h"
+#include "gateway_broker.h"
+#include "gateway_cluster.h"
+#include "gateway_latency.h"
+#include "gateway_metrics.h"
+#include "gateway_capture.h"
+#include "gateway_clock.h"
+#include "gateway_arena.h"
+#include "gateway_keystream.h"
+#include "gateway_session.h"
 
 class GatewayCore {
 public:
@@ -14,52 +30,330 @@ public:
   ~GatewayCore();
 
   void begin();
-  void poll();
+  void poll();                              // sleeps until a timer or socket is due
+
+  // poll() without the sockets, for a simulator driving its own clock: runs
+  // the timers due and the work posted from other threads.  Returns the
+  // clock time at which the next timer is due.
+  uint64_t step();
+
+  // Latency mode never sleeps in poll(): lowest reaction time for a burst,
+  // at the cost of a busy CPU.  Otherwise poll() stops sleeping only for
+  // GW_POLL_BURST_MS after each I/O.
+  void setLatencyMode(bool on) { m_latencyMode = on; }
+  bool latencyMode() const { return m_latencyMode; }
+  struct PollStats {
+    double idlePct;                         // share of the window spent asleep
+    double wakeupsPerSec;                   // sleeps that ended
+    double ioWakeupsPerSec;                 // ...because a socket was ready
+    double passesPerSec;                    // mg_mgr_poll() calls
+  };
+  const PollStats& getPollStats() const { return m_pollStats; }
+
+  // Overrides for gateway_config.h; call before begin().  Gateways sharing
+  // a broker need distinct ids, which are also their MQTT client ids.
+  void setGatewayId(const String& id) { m_gatewayId = id; }
+  void setBrokers(const String& list) { m_brokerList = list; }
+  void setCluster(bool enable, bool sharedSub) { m_clusterOn = enable; m_sharedSub = sharedSub; }
+  const String& gatewayId() const { return m_gatewayId; }
+  const String& ownerOf(const String& deviceId) const;
+
+  // Time source for everything the core times (gateway_clock.h); the
+  // default is gw_board_clock().  Call before begin().
+  void setClock(GatewayClock* clock) { m_clock = clock; }
+  GatewayClock* clock() const { return m_clock; }
+
+  // Opens the broker connection; the default is mg_mqtt_connect().  A
+  // simulator returns a connection without a socket and delivers its MQTT
+  // events itself (host/sim).
+  using MqttConnect = std::function<struct mg_connection*(
+      struct mg_mgr* mgr, const char* url, const struct mg_mqtt_opts* opts,
+      mg_event_handler_t fn, void* fn_data)>;
+  void setMqttConnect(MqttConnect fn) { m_mqttConnect = fn; }
+
+  // One of several cores in a process, each polled by its own thread (see
+  // host_main --threads).  A shard loads, subscribes to and answers only
+  // the devices whose id hashes to it, so its loop never shares state.
+  void setShard(unsigned index, unsigned count) { m_shard = index; m_shards = count; }
+  unsigned shard() const { return m_shard; }
+  unsigned shardCount() const { return m_shards; }
+  static unsigned shardOf(const String& deviceId, unsigned count);
+  bool inShard(const String& deviceId) const;
+
+  // Run fn on this core's poll loop.  Safe from any thread; this is how the
+  // dashboard reaches devices of other shards.  Returns false when
+  // GW_SHARD_MAILBOX calls are already waiting.
+  using Call = std::function<void(GatewayCore&)>;
+  bool post(Call fn);
 
   Device* getDevice(const String& id);
-  const std::map<String, Device>& getAllDevices() const { return m_devices; }
-  void approveDevice(const String& id, const DevicePerms& perms, const char* psk = nullptr);
+  const DeviceTable& getAllDevices() const { return m_devices; }
+  void approveDevice(const String& id, DevicePerms perms, const char* psk = nullptr);
   void denyDevice(const String& id);
   void addDevice(const String& id, const String& name, const String& type);
   bool authorizeDevice(const String& id, const char* psk);
   bool deleteDevice(const String& id);      // remove one device from memory + flash
   void deleteAllDevices();                  // remove every device from memory + flash
 
-  void publishToDevice(const String& deviceId, const char* payload, size_t len);
-  void publishToDevice(const String& deviceId, const String& payload) {
-    publishToDevice(deviceId, payload.c_str(), payload.length());
+  // Queues a QoS1 publish to jrpc/devices/<id>/rx.  Returns false when the
+  // outbound queue is full (backpressure); the message is then dropped.
+  bool publishToDevice(const String& deviceId, const char* payload, size_t len,
+                       OutQueue::Lane lane = OutQueue::LANE_CONTROL);
+  bool publishToDevice(const String& deviceId, const String& payload,
+                       OutQueue::Lane lane = OutQueue::LANE_CONTROL) {
+    return publishToDevice(deviceId, payload.c_str(), payload.length(), lane);
   }
 
+  // Encrypt and send a downlink message.  If the device has not sent an
+  // authenticated frame within GW_DEVICE_OFFLINE_MS, or the outbound queue
+  // is full, the message is held in the store-and-forward queue for up to
+  // ttlMs (0 = GW_DLQ_TTL_MS) and delivered after the device's next frame.
+  // In a cluster only the device's owner sends; elsewhere this returns false.
+  bool sendToDevice(const String& deviceId, const uint8_t* plaintext, size_t len,
+                    OutQueue::Lane lane = OutQueue::LANE_BULK, unsigned long ttlMs = 0);
+  bool isReachable(const Device& dev) const;
+
+  // Encrypted ping carrying a fresh JSON-RPC id.  The device's signed reply
+  // is matched by that id and its round trip recorded per device.  False
+  // when the device is not approved here or a ping to it is unanswered.
+  bool pingDevice(const String& deviceId);
+  struct PingStats {
+    enum Outcome { PING_NONE, PING_PONG, PING_LOST, PING_ERROR };
+    LatencyHistogram rtt;
+    uint32_t sent;
+    uint32_t lost;                      // no reply within GW_PING_TIMEOUT_MS
+    uint32_t errors;                    // answered with a JSON-RPC error
+    uint32_t lastUs;                    // latest round trip
+    uint32_t pendingId;                 // 0 = none in flight
+    unsigned long sentAt;               // micros() of the pending ping, for the RTT
+    unsigned long sentMs;               // nowMs() of the pending ping, for the timeout
+    Outcome last;                       // of the latest ping that finished
+    PingStats() : sent(0), lost(0), errors(0), lastUs(0), pendingId(0), sentAt(0),
+                  sentMs(0), last(PING_NONE) {}
+  };
+  const PingStats* getPingStats(const String& deviceId) const;
+
+  // Broker link health.  Durations are in ms; reconnect is from the drop
+  // to CONNACK, firstMsg from CONNACK to the first inbound publish.
+  struct MqttStats {
+    uint32_t attempts;
+    uint32_t connects;
+    uint32_t resumed;                   // CONNACK with session present
+    uint32_t failures;                  // closed before CONNACK or refused
+    uint32_t backoffMs;                 // current retry delay
+    uint32_t lastReconnectMs;
+    uint32_t lastFirstMsgMs;
+    uint32_t failovers;                 // reconnects that went to another broker
+  };
+  const MqttStats& getMqttStats() const { return m_mqttStats; }
+  const OutQueue::Stats& getOutQueueStats() const { return m_outq.stats(); }
+  const DownlinkStore& getDownlinkStore() const { return m_dlq; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;   // JSON object
+  void snapshotMetrics(MetricsSnapshot& s) const;          // on this core's loop only
+
+  // Record every inbound publish to a LittleFS file (GW_CAPTURE_AT_BOOT
+  // starts this in begin()).  injectMessage() feeds one back through the
+  // MQTT event handler as if the broker had sent it; see host_main --replay.
+  // Like a receive buffer, the payload is overwritten while it is handled.
+  bool startCapture(const char* path = GW_CAPTURE_FILE) { return m_capture.start(path); }
+  void stopCapture() { m_capture.stop(); }
+  void injectMessage(struct mg_str topic, struct mg_str payload);
+
   using EventCallback = std::function<void(const String& deviceId, int event)>;
-  enum Event { DEVICE_ADDED, DEVICE_UPDATED, DEVICE_REMOVED };
+  enum Event { DEVICE_ADDED, DEVICE_UPDATED, DEVICE_REMOVED, DEVICE_PING };
   void onEvent(EventCallback cb) { m_eventCb = cb; }
 
   struct mg_mgr* getMgr() { return &m_mgr; }
 
+  // Deferred RPC responses.  A handler that cannot answer right away calls
+  // deferRpc() instead of mg_rpc_ok() and returns.  The call is finished
+  // later with completeRpc()/failRpc() from any event on the poll loop, or
+  // with postRpcResult() from another task.  Unfinished calls fail with a
+  // timeout after GW_RPC_DEFER_TIMEOUT_MS.  A deferred call inside a batch
+  // is answered in its own frame rather than in the batch array.
+  //
+  // deferRpc() fails, with !ok(), for a notification (nothing to answer),
+  // an id longer than GW_RPC_ID_MAX, or a full table; the latter two have
+  // already been answered with an error.  The handler then just returns.
+  struct Deferred {
+    static const uint16_t NONE = 0xFFFF;    // slot of a call that was not deferred
+    uint16_t slot;
+    uint16_t gen;
+    bool ok() const { return slot != NONE; }
+  };
+  Deferred deferRpc(struct mg_rpc_req *r);
+  bool completeRpc(Deferred d, const char* fmt, ...);
+  bool failRpc(Deferred d, int code, const char* msg);
+  bool postRpcResult(Deferred d, const char* resultJson);   // thread-safe
+
+  // Application methods, added before begin().  The handler finds this
+  // core in r->rpc->fn_data, e.g. to defer its answer.
+  template <typename... Args>
+  bool addMethod(const char* name, void (*fn)(struct mg_rpc_req*, Args...), uint32_t perm) {
+    return m_rpc.add(name, fn, this, perm);
+  }
+
 private:
   struct mg_mgr m_mgr;
+  GatewayClock* m_clock;
+  struct mg_timer* m_timers;            // run on m_clock, not by mg_mgr_poll()
+  MqttConnect m_mqttConnect;
+  String m_gatewayId;
+  String m_brokerList;
+  String m_clientId;                    // gateway id, plus _s<n> for a shard
+  unsigned m_shard;
+  unsigned m_shards;
   struct mg_connection *m_mqttConn;
-  struct mg_rpc *m_rpcHead;
+  bool m_mqttOpen;                      // CONNACK accepted on m_mqttConn
+  bool m_migrating;                     // closing on purpose to switch broker
+  BrokerSet m_brokers;
+  bool m_awaitFirstMsg;
+  unsigned long m_reconnectAt;          // next connect attempt, millis()
+  unsigned long m_downSince;            // 0 = never connected
+  unsigned long m_openedAt;
+  MqttStats m_mqttStats;
+  OutQueue m_outq;
+  DownlinkStore m_dlq;
+  uint8_t m_dlqBuf[GW_DLQ_MSG_MAX];
+  bool m_dlqDraining;                   // some device may have dlqDraining set
+  unsigned long m_dlqSweepAt;           // last expiry sweep of m_dlq, nowMs()
+  Cluster m_cluster;
+  bool m_clusterOn;
+  bool m_sharedSub;                     // rx via $share/<group>/, else per-device topics
+  bool m_forwarded;                     // frame being handled came from another member
+  bool m_resubscribe;                   // next rebalance re-subscribes owned devices
+  unsigned long m_rebalanceAt;          // pending rebalance after connect, 0 = none
+  RpcTable m_rpc;
+  char m_rpcOutBuf[GW_RPC_OUT_SIZE];
+  RpcOut m_rpcOut;
+  MsgArena m_arena;                     // scratch of the message being handled
+  String m_rxId;                        // its device id, reused to keep its buffer
+  KeystreamPool m_keystream;            // precomputed material for the next downlinks
+  SessionKeys m_sessions;               // X25519 handshakes and resumption tickets
 
-  std::map<String, Device> m_devices;
+  struct PendingRpc {
+    String deviceId;
+    char id[GW_RPC_ID_MAX];             // raw JSON id token of the request
+    size_t idLen;
+    uint16_t gen;
+    bool used;
+    unsigned long deadline;
+  };
+  struct RpcMail {
+    Deferred d;
+    size_t len;
+    char json[GW_RPC_MAIL_SIZE];
+  };
+  PendingRpc m_pending[GW_RPC_DEFER_MAX];
+  char m_deferOutBuf[GW_RPC_OUT_SIZE];
+  RpcMail m_mailbox[GW_RPC_MAILBOX];
+  size_t m_mailHead;
+  std::atomic<size_t> m_mailCount;      // written under m_mailLock, peeked without
+  std::mutex m_mailLock;
+  std::vector<Call> m_calls;
+  std::atomic<unsigned> m_callCount;
+  std::mutex m_callLock;
+  unsigned long m_wakeId;               // mg_wakeup() pipe connection, 0 = none
+  std::atomic<bool> m_wakePending;
+
+  struct PollWindow {
+    unsigned long start;                // micros()
+    unsigned long sleptUs;
+    unsigned long wakeups;
+    unsigned long ioWakeups;
+    unsigned long passes;
+  };
+  bool m_latencyMode;
+  bool m_burst;                         // I/O seen less than GW_POLL_BURST_MS ago
+  unsigned long m_burstUntil;           // micros()
+  unsigned long m_pollWokeAt;           // micros(), set by pollProbeFn
+  PollWindow m_pollWin;
+  PollStats m_pollStats;
+  GatewayMetrics m_metrics;                 // written on this core's loop only
+  MqttCapture m_capture;
+
+  DeviceTable m_devices;
   EventCallback m_eventCb;
+  std::map<String, PingStats> m_pings;      // devices pinged since boot
+  PingStats m_pingTotal;                    // every device, pendingId unused
+  uint32_t m_pingSeq;
+  unsigned long m_pingRoundAt;              // millis() of the last GW_PING_INTERVAL_MS round
   // Preferences prefs;  // removed
   // LittleFS is used directly
 
+  unsigned long nowMs() const { return (unsigned long)m_clock->millis(); }
+  void addTimer(uint64_t periodMs, unsigned flags, void (*fn)(void *));
+  uint64_t nextTimer(uint64_t now) const;   // clock time of the next timer due
+
   static void mqttEventHandler(struct mg_connection *c, int ev, void *ev_data);
   static void mqttTimerFn(void *arg);
+  static void mqttPingTimerFn(void *arg);
+  void onMqttOpen(struct mg_connection *c, uint8_t code);
+  void onMqttClose();
+  void scheduleReconnect();
+  // The payload must be writable: device frames are decrypted in place
+  void dispatchMsg(struct mg_str topic, struct mg_str payload);
+  static void outqTimerFn(void *arg);
   void handleGatewayConnect(struct mg_str payload);
+  bool startSession(Device& dev, const uint8_t pskKey[32], struct mg_str req, bool approve);
+  void resumeSession(const String& id, struct mg_str payload);
+  void sendSessionReply(Device& dev, const char* member, const uint8_t secret[32],
+                        const char* kind);
+  void loadTicketKey();
   void handleGatewayRx(struct mg_str payload);
+  void handleDeviceRx(struct mg_str deviceId, struct mg_str payload);
+  void processRx(Device& dev, const uint8_t nonce[12], uint8_t* cipher,
+                 size_t cipherLen, bool binary = false);
   void setupRpc();
+  void dispatchRpc(Device& dev, struct mg_rpc_req *r);
+  void processRequest(Device& dev, struct mg_str req);
+  void processBatch(Device& dev, struct mg_str batch);
+  static bool isBatch(struct mg_str frame);
+  static bool isResponse(struct mg_str frame);
+  bool verifyRequestAuth(const Device& dev, struct mg_str req, const char* method = nullptr);
+  void onPingReply(Device& dev, struct mg_str frame);
+  static void pingTimerFn(void *arg);
+  static void rpcDeferTimerFn(void *arg);
+  PendingRpc* pendingFor(Deferred d);
+  void finishRpc(PendingRpc& p, RpcOut& out);
+  void drainRpcMailbox();
+  void drainCalls();
+  void wake();
+  int pollTimeout();
+  bool accountPoll(int timeoutMs, unsigned long startUs);
+  static void pollProbeFn(void *arg);
 
-  static void rpcPing(struct mg_rpc_req *r);
+  static void rpcPing(struct mg_rpc_req *r, RpcOpt<double> ts);
   static void rpcRequestConnect(struct mg_rpc_req *r);
 
   void sendError(const String& deviceId, const char* msg);
-  void sendEncrypted(const String& deviceId, const uint8_t* plaintext, size_t len);
+  // member: a JSON member added to the envelope, e.g. a handshake's public
+  // key; the message then goes in the JSON framing whatever the device used
+  bool sendEncrypted(const String& deviceId, const uint8_t* plaintext, size_t len,
+                     OutQueue::Lane lane = OutQueue::LANE_CONTROL,
+                     const char* member = nullptr);
+  bool flushDownlink(Device& dev);          // true when nothing is left
+
+  // Cluster (gateway_cluster.h)
+  void clusterOpen(struct mg_connection *c);
+  bool clusterMsg(struct mg_str topic, struct mg_str payload);
+  static void clusterTimerFn(void *arg);
+  void announce();
+  bool memberPresent(const String& id, struct mg_str payload);
+  void rebalance(bool resubscribe);
+  void updateOwnership(Device& dev, bool resubscribe);
+  void subscribeDevice(const String& id, bool on);
+  bool routeElsewhere(const String& id, struct mg_str topic, struct mg_str payload);
+  bool publishCluster(const String& topic, struct mg_str payload, bool retain);
+  void publishRecord(Device& dev);
+  void publishRecordDelete(const Device& dev);
+  void applyRecord(const String& id, struct mg_str sealed);
 
   void loadDevices();                      // scan /devices directory
   void saveDevice(const Device& dev);       // write to /devices/<id>
+  void reserveTxNonce(Device& dev);         // move the saved gateway counter ahead
+  static int formatDevice(const Device& dev, char* buf, size_t cap);
+  static void parseDevice(struct mg_str json, const String& fallbackId, Device& dev);
   void removeDevice(const String& id);      // delete file
   String safeFilename(const String& id);    // sanitize for filename
 };
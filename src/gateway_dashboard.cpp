@@ -1,4 +1,5 @@
 #include "gateway_dashboard.h"
+#include "gateway_trace.h"
 
 // Embedded HTML dashboard (same as before)
 static const char* DASHBOARD_HTML = R"rawliteral(
@@ -19,6 +20,7 @@ static const char* DASHBOARD_HTML = R"rawliteral(
         .btn-success { background:#198754; color:#fff; border:none; border-radius:4px; padding:4px 10px; }
         .btn-warn    { background:#fd7e14; color:#fff; border:none; border-radius:4px; padding:4px 10px; }
         .btn-danger  { background:#dc3545; color:#fff; border:none; border-radius:4px; padding:4px 10px; }
+        #stats { background:#f8f9fa; border:1px solid #ddd; padding:8px; font-size:12px; }
         #toast {
             display:none; position:fixed; bottom:24px; left:50%;
             transform:translateX(-50%);
@@ -32,33 +34,58 @@ static const char* DASHBOARD_HTML = R"rawliteral(
     <div style="display:flex; gap:8px; margin-bottom:14px;">
         <button class="btn-primary" onclick="listDevices()">&#8635; Refresh</button>
         <button class="btn-danger"  onclick="confirmRemoveAll()">&#128465; Remove All Devices</button>
+        <button class="btn-primary" onclick="location.href='/trace.json'">&#8681; Trace</button>
+        <button class="btn-warn" id="captureBtn" onclick="toggleCapture()">&#9210; Capture</button>
     </div>
     <h2>Devices</h2>
     <table id="deviceTable">
         <thead>
             <tr>
                 <th>ID</th><th>Name</th><th>Type</th><th>Status</th>
-                <th>Last Seen</th><th>Actions</th>
+                <th>Last Seen</th><th>Queued</th><th>RTT p50 / p99</th><th>Owner</th><th>Actions</th>
             </tr>
         </thead>
         <tbody></tbody>
     </table>
+    <h2>Gateway</h2>
+    <pre id="stats">—</pre>
     <div id="toast"></div>
 
     <script>
         let ws = new WebSocket('ws://' + location.host + '/ws');
-        ws.onopen    = function() { listDevices(); };
+        ws.onopen    = function() {
+            listDevices();
+            getStats();
+            setInterval(getStats, 5000);
+        };
         ws.onmessage = function(event) {
             let msg = JSON.parse(event.data);
             if (msg.type === 'device_list') {
                 updateTable(msg.devices);
             } else if (msg.type === 'device_update') {
                 listDevices();
+            } else if (msg.type === 'ping') {
+                onPing(msg);
             } else if (msg.type === 'response') {
                 handleResponse(msg);
+            } else if (msg.type === 'stats') {
+                document.getElementById('stats').textContent =
+                    JSON.stringify(msg.stats, null, 2);
+                capturing = !!(msg.stats.capture && msg.stats.capture.on);
+                document.getElementById('captureBtn').innerHTML =
+                    capturing ? '&#9632; Stop capture' : '&#9210; Capture';
             }
         };
 
+        let capturing = false;
+        function toggleCapture() {
+            ws.send(JSON.stringify({ cmd: 'capture', on: !capturing }));
+        }
+
+        function getStats() {
+            ws.send(JSON.stringify({ cmd: 'get_stats' }));
+        }
+
         function listDevices() {
             ws.send(JSON.stringify({ cmd: 'list_devices' }));
         }
@@ -73,10 +100,32 @@ static const char* DASHBOARD_HTML = R"rawliteral(
             ws.send(JSON.stringify({ cmd: 'deny', device_id: id }));
         }
 
+        let pinged = new Set();
+
         function pingDevice(id) {
+            pinged.add(id);
             ws.send(JSON.stringify({ cmd: 'send_ping', device_id: id }));
         }
 
+        function ms(us) { return (us / 1000).toFixed(1) + ' ms'; }
+
+        function rttText(rtt) {
+            if (!rtt || !rtt.n) return rtt && rtt.lost ? rtt.lost + ' lost' : '—';
+            return ms(rtt.p50_us) + ' / ' + ms(rtt.p99_us) + ' (' + rtt.n + ')';
+        }
+
+        // Answers to our own pings pop up; the periodic ones only refresh
+        function onPing(msg) {
+            let cell = document.getElementById('rtt-' + msg.device_id);
+            if (cell) cell.textContent = rttText(msg.rtt);
+            if (!pinged.delete(msg.device_id)) return;
+            if (msg.result === 'pong') {
+                showToast('Pong from ' + msg.device_id + ' in ' + ms(msg.rtt.last_us), 'ok');
+            } else {
+                showToast('Ping to ' + msg.device_id + ' ' + msg.result, 'err');
+            }
+        }
+
         function removeDevice(id) {
             if (!confirm('Remove device "' + id + '"?\nThis deletes it from flash storage.')) return;
             ws.send(JSON.stringify({ cmd: 'remove_device', device_id: id }));
@@ -106,8 +155,12 @@ static const char* DASHBOARD_HTML = R"rawliteral(
             } else if (msg.cmd === 'deny') {
                 showToast('Device ' + msg.device_id + ' denied', 'warn');
                 listDevices();
-            } else if (msg.cmd === 'ping') {
-                showToast('Ping sent to ' + msg.device_id, 'ok');
+            } else if (msg.cmd === 'capture') {
+                if (msg.status !== 'ok') showToast('Capture ' + msg.status, 'err');
+                getStats();
+            } else if (msg.cmd === 'ping' && msg.status !== 'sent') {
+                pinged.delete(msg.device_id);
+                showToast('Cannot ping ' + msg.device_id + ' (' + msg.status + ')', 'warn');
             }
         }
 
@@ -117,7 +170,7 @@ static const char* DASHBOARD_HTML = R"rawliteral(
             if (devices.length === 0) {
                 let row = tbody.insertRow();
                 let cell = row.insertCell();
-                cell.colSpan = 6;
+                cell.colSpan = 9;
                 cell.style.cssText = 'text-align:center; color:#888; padding:16px;';
                 cell.textContent = 'No devices registered';
                 return;
@@ -131,6 +184,12 @@ static const char* DASHBOARD_HTML = R"rawliteral(
                 row.insertCell().textContent = dev.status;
                 row.insertCell().textContent = dev.lastSeen
                     ? new Date(dev.lastSeen * 1000).toLocaleString() : '—';
+                row.insertCell().textContent = dev.queued
+                    ? dev.queued + ' (' + dev.queued_bytes + ' B)' : '—';
+                let rtt = row.insertCell();
+                rtt.id = 'rtt-' + dev.id;
+                rtt.textContent = rttText(dev.rtt);
+                row.insertCell().textContent = dev.owner;
 
                 let actions = row.insertCell();
                 if (dev.status === 'PENDING') {
@@ -167,32 +226,65 @@ static const char* DASHBOARD_HTML = R"rawliteral(
 </html>
 )rawliteral";
 
-DashboardServer::DashboardServer(GatewayCore& core) : m_core(core), m_httpConn(nullptr) {}
+static const char* statusName(DeviceStatus s) {
+  return s == DEV_PENDING  ? "PENDING"  :
+         s == DEV_APPROVED ? "APPROVED" :
+         s == DEV_DENIED   ? "DENIED"   : "OFFLINE";
+}
+
+// Replies of the shards, joined into one WebSocket message for connId
+struct DashboardServer::Gather {
+  unsigned long connId;
+  size_t pending;
+  std::vector<String> parts;
+  String head, tail;
+};
+
+// Per-shard metric copies for one /metrics request on connId
+struct DashboardServer::Scrape {
+  unsigned long connId;
+  size_t pending;
+  std::vector<MetricsSnapshot> snaps;
+};
+
+DashboardServer::DashboardServer(GatewayCore& core) : m_core(core), m_httpConn(nullptr) {
+  m_shards.push_back(&core);
+}
 
 void DashboardServer::begin(int port) {
   char url[32];
   snprintf(url, sizeof(url), "http://0.0.0.0:%d", port);
-  m_httpConn = mg_http_listen(m_core.getMgr(), url, handler, this);
-  if (!m_httpConn) {
+  m_httpConn = port == 0 ? nullptr : mg_http_listen(m_core.getMgr(), url, handler, this);
+  if (port == 0) {
+    MG_INFO(("Dashboard without listener"));
+  } else if (!m_httpConn) {
     MG_ERROR(("Failed to start dashboard HTTP server"));
   } else {
     MG_INFO(("Dashboard started on port %d", port));
   }
 
-  // Subscribe to core events
-  m_core.onEvent([this](const String& id, int event) {
-    const char* status = nullptr;
-    auto dev = m_core.getDevice(id);
-    if (dev) {
-      switch (dev->status) {
-        case DEV_PENDING: status = "PENDING"; break;
-        case DEV_APPROVED: status = "APPROVED"; break;
-        case DEV_DENIED: status = "DENIED"; break;
-        default: status = "OFFLINE";
+  // Subscribe to core events.  Other shards raise them on their own
+  // thread, so the broadcast is posted to the dashboard's loop.
+  for (GatewayCore* shard : m_shards) {
+    shard->onEvent([this, shard](const String& id, int event) {
+      if (event == GatewayCore::DEVICE_PING) {
+        String msg = renderPing(*shard, id);
+        if (shard == &m_core) {
+          broadcast(msg);
+        } else {
+          m_core.post([this, msg](GatewayCore&) { broadcast(msg); });
+        }
+        return;
       }
-    }
-    broadcastDeviceUpdate(id, status ? status : "UNKNOWN");
-  });
+      auto dev = shard->getDevice(id);
+      const char* status = dev ? statusName(dev->status) : "UNKNOWN";
+      if (shard == &m_core) {
+        broadcastDeviceUpdate(id, status);
+      } else {
+        m_core.post([this, id, status](GatewayCore&) { broadcastDeviceUpdate(id, status); });
+      }
+    });
+  }
 }
 
 void DashboardServer::handler(struct mg_connection *c, int ev, void *ev_data) {
@@ -207,6 +299,12 @@ void DashboardServer::handler(struct mg_connection *c, int ev, void *ev_data) {
       mg_http_reply(c, 200, "Content-Type: text/html\r\n", "%s", DASHBOARD_HTML);
     } else if (mg_match(hm->uri, mg_str("/ws"), NULL)) {
       mg_ws_upgrade(c, hm, NULL);
+    } else if (mg_match(hm->uri, mg_str("/metrics"), NULL)) {
+      if (self) self->scrape(c);
+#if GW_TRACE
+    } else if (mg_match(hm->uri, mg_str("/trace.json"), NULL)) {
+      if (self) self->startTrace(c);
+#endif
     } else {
       mg_http_reply(c, 404, "", "Not Found\n");
     }
@@ -215,14 +313,35 @@ void DashboardServer::handler(struct mg_connection *c, int ev, void *ev_data) {
   } else if (ev == MG_EV_WS_MSG) {
     struct mg_ws_message *wm = (struct mg_ws_message*)ev_data;
     if (self) self->onWsMsg(c, wm->data);
+  } else if (ev == MG_EV_WRITE) {
+#if GW_TRACE
+    if (self && !self->m_traces.empty()) self->pumpTrace(c);
+#endif
+    // Hand back the buffers of a client with nothing in flight; an idle
+    // WebSocket would otherwise keep the page it was served and its last
+    // command.  Mongoose allocates them again on the next read or write.
+    if (c->send.len == 0) mg_iobuf_free(&c->send);
+    if (c->recv.len == 0) mg_iobuf_free(&c->recv);
   } else if (ev == MG_EV_CLOSE) {
     if (!self) return;
+#if GW_TRACE
+    for (auto it = self->m_traces.begin(); it != self->m_traces.end(); ++it) {
+      if (it->connId == c->id) { self->m_traces.erase(it); break; }
+    }
+#endif
     for (auto it = self->m_wsClients.begin(); it != self->m_wsClients.end(); ++it) {
       if (*it == c) { self->m_wsClients.erase(it); break; }
     }
   }
 }
 
+void DashboardServer::attachClient(struct mg_connection *c) {
+  c->fn = handler;
+  c->fn_data = this;
+  c->is_websocket = 1;
+  handler(c, MG_EV_WS_OPEN, NULL);
+}
+
 void DashboardServer::onWsOpen(struct mg_connection *c) {
   m_wsClients.push_back(c);
   MG_INFO(("Dashboard client connected, total %d", m_wsClients.size()));
@@ -232,83 +351,318 @@ void DashboardServer::onWsMsg(struct mg_connection *c, struct mg_str data) {
   char* cmd = mg_json_get_str(data, "$.cmd");
   if (!cmd) return;
   if (strcmp(cmd, "list_devices") == 0) {
-    sendDeviceList(c);
+    gather(c, "{\"type\":\"device_list\",\"devices\":[", "]}", renderDevices);
   } else if (strcmp(cmd, "authorize") == 0) {
     char* devId = mg_json_get_str(data, "$.device_id");
     char* psk = mg_json_get_str(data, "$.psk");
     if (devId && psk) {
-      bool ok = m_core.authorizeDevice(devId, psk);
-      mg_ws_printf(c, WEBSOCKET_OP_TEXT,
-        "{\"type\":\"response\",\"cmd\":\"authorize\",\"status\":\"%s\",\"device_id\":\"%s\"}",
-        ok ? "ok" : "fail", devId);
-      free(devId); free(psk);
+      String id(devId), key(psk);
+      onShard(c, "authorize", id, [id, key](GatewayCore& core) {
+        bool ok = core.authorizeDevice(id, key.c_str());
+        return response("authorize", ok ? "ok" : "fail", id);
+      });
     }
+    free(devId); free(psk);
   } else if (strcmp(cmd, "deny") == 0) {
     char* devId = mg_json_get_str(data, "$.device_id");
     if (devId) {
-      m_core.denyDevice(devId);
-      mg_ws_printf(c, WEBSOCKET_OP_TEXT,
-        "{\"type\":\"response\",\"cmd\":\"deny\",\"status\":\"ok\",\"device_id\":\"%s\"}",
-        devId);
+      String id(devId);
+      onShard(c, "deny", id, [id](GatewayCore& core) {
+        core.denyDevice(id);
+        return response("deny", "ok", id);
+      });
       free(devId);
     }
   } else if (strcmp(cmd, "send_ping") == 0) {
     char* devId = mg_json_get_str(data, "$.device_id");
     if (devId) {
-      m_core.publishToDevice(devId,
-        "{\"jsonrpc\":\"2.0\",\"method\":\"ping\",\"params\":{},\"id\":1}");
-      mg_ws_printf(c, WEBSOCKET_OP_TEXT,
-        "{\"type\":\"response\",\"cmd\":\"ping\",\"status\":\"sent\",\"device_id\":\"%s\"}",
-        devId);
+      String id(devId);
+      onShard(c, "ping", id, [id](GatewayCore& core) {
+        return response("ping", core.pingDevice(id) ? "sent" : "fail", id);
+      });
       free(devId);
     }
   } else if (strcmp(cmd, "remove_device") == 0) {
     char* devId = mg_json_get_str(data, "$.device_id");
     if (devId) {
-      bool ok = m_core.deleteDevice(devId);
-      mg_ws_printf(c, WEBSOCKET_OP_TEXT,
-        "{\"type\":\"response\",\"cmd\":\"remove_device\",\"status\":\"%s\",\"device_id\":\"%s\"}",
-        ok ? "ok" : "fail", devId);
+      String id(devId);
+      onShard(c, "remove_device", id, [id](GatewayCore& core) {
+        bool ok = core.deleteDevice(id);
+        return response("remove_device", ok ? "ok" : "fail", id);
+      });
       free(devId);
     }
+  } else if (strcmp(cmd, "get_stats") == 0) {
+    if (m_shards.size() == 1) {
+      gather(c, "{\"type\":\"stats\",\"stats\":", "}", renderStats);
+    } else {
+      gather(c, "{\"type\":\"stats\",\"stats\":{\"shards\":[", "]}}", renderStats);
+    }
+  } else if (strcmp(cmd, "capture") == 0) {
+    // Only shard 0's traffic is this loop's to record
+    const char* status = "unsupported";
+    if (m_shards.size() == 1) {
+      bool on = false;
+      mg_json_get_bool(data, "$.on", &on);
+      if (on) {
+        status = m_core.startCapture() ? "ok" : "fail";
+      } else {
+        m_core.stopCapture();
+        status = "ok";
+      }
+    }
+    String msg = response("capture", status, "");
+    mg_ws_send(c, msg.c_str(), msg.length(), WEBSOCKET_OP_TEXT);
   } else if (strcmp(cmd, "remove_all_devices") == 0) {
-    m_core.deleteAllDevices();
-    mg_ws_printf(c, WEBSOCKET_OP_TEXT,
-      "{\"type\":\"response\",\"cmd\":\"remove_all_devices\",\"status\":\"ok\"}");
+    // Every shard contributes an empty part; the reply goes once all are done
+    gather(c, "{\"type\":\"response\",\"cmd\":\"remove_all_devices\",\"status\":\"ok\"}", "",
+           [](GatewayCore& core) { core.deleteAllDevices(); return String(); });
   }
   free(cmd);
 }
 
-void DashboardServer::sendDeviceList(struct mg_connection *c) {
+// -------------------------------------------------------------------
+// Shards
+// -------------------------------------------------------------------
+GatewayCore& DashboardServer::shardFor(const String& deviceId) {
+  return *m_shards[GatewayCore::shardOf(deviceId, (unsigned)m_shards.size())];
+}
+
+// Run fn on the shard that owns deviceId and send the message it returns to
+// c.  On another shard's thread the reply is posted back to this loop,
+// where c is looked up again by id since it may have closed meanwhile.
+void DashboardServer::onShard(struct mg_connection *c, const char* cmd,
+                              const String& deviceId, Render fn) {
+  GatewayCore& shard = shardFor(deviceId);
+  if (&shard == &m_core) {
+    String msg = fn(m_core);
+    mg_ws_send(c, msg.c_str(), msg.length(), WEBSOCKET_OP_TEXT);
+    return;
+  }
+  unsigned long connId = c->id;
+  bool posted = shard.post([this, connId, fn](GatewayCore& s) {
+    String msg = fn(s);
+    m_core.post([this, connId, msg](GatewayCore&) { sendTo(connId, msg); });
+  });
+  if (!posted) {
+    String msg = response(cmd, "busy", deviceId);
+    mg_ws_send(c, msg.c_str(), msg.length(), WEBSOCKET_OP_TEXT);
+  }
+}
+
+// Run fn on every shard and send head, the non-empty parts joined by
+// commas, and tail as one message once the last shard has answered.
+void DashboardServer::gather(struct mg_connection *c, const char* head, const char* tail,
+                             Render fn) {
+  auto g = std::make_shared<Gather>();
+  g->connId = c->id;
+  g->pending = m_shards.size();
+  g->parts.resize(m_shards.size());
+  g->head = head;
+  g->tail = tail;
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    GatewayCore* shard = m_shards[i];
+    if (shard == &m_core) {
+      g->parts[i] = fn(m_core);
+      finishGather(g);
+      continue;
+    }
+    bool posted = shard->post([this, g, i, fn](GatewayCore& s) {
+      String part = fn(s);
+      m_core.post([this, g, i, part](GatewayCore&) {
+        g->parts[i] = part;
+        finishGather(g);
+      });
+    });
+    if (!posted) finishGather(g);             // busy shard: its part stays empty
+  }
+}
+
+void DashboardServer::finishGather(const std::shared_ptr<Gather>& g) {
+  if (--g->pending > 0) return;
+  String msg = g->head;
+  bool first = true;
+  for (auto& part : g->parts) {
+    if (part.isEmpty()) continue;
+    if (!first) msg += ",";
+    first = false;
+    msg += part;
+  }
+  msg += g->tail;
+  sendTo(g->connId, msg);
+}
+
+// Snapshot every shard's counters on its own loop, then render them all at
+// once so each family gets one TYPE line.  The response is printed straight
+// into the connection's send buffer.
+void DashboardServer::scrape(struct mg_connection *c) {
+  auto s = std::make_shared<Scrape>();
+  s->connId = c->id;
+  s->pending = m_shards.size();
+  s->snaps.resize(m_shards.size());
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    GatewayCore* shard = m_shards[i];
+    if (shard == &m_core) {
+      m_core.snapshotMetrics(s->snaps[i]);
+      finishScrape(s);
+      continue;
+    }
+    bool posted = shard->post([this, s, i](GatewayCore& core) {
+      core.snapshotMetrics(s->snaps[i]);
+      m_core.post([this, s](GatewayCore&) { finishScrape(s); });
+    });
+    if (!posted) finishScrape(s);             // busy shard: left out of this scrape
+  }
+}
+
+void DashboardServer::finishScrape(const std::shared_ptr<Scrape>& s) {
+  if (--s->pending > 0) return;
+  for (struct mg_connection *c = m_core.getMgr()->conns; c != NULL; c = c->next) {
+    if (c->id != s->connId) continue;
+    mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Connection: close\r\n\r\n");
+    printMetrics(mg_pfn_iobuf, &c->send, s->snaps.data(), s->snaps.size(),
+                 ESP.getFreeHeap());
+    c->is_draining = 1;
+    return;
+  }
+}
+
+#if GW_TRACE
+// The trace ring is streamed rather than copied: events are printed into
+// the send buffer whenever it drains below GW_TRACE_SEND_LOW, and the ones
+// overwritten before their turn are skipped.
+void DashboardServer::startTrace(struct mg_connection *c) {
+  m_traces.push_back({c->id, gw_trace_oldest(), gw_trace_head()});
+  mg_printf(c, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+               "Content-Disposition: attachment; filename=\"gateway-trace.json\"\r\n"
+               "Connection: close\r\n\r\n{\"traceEvents\":[");
+  for (size_t i = 0; i < m_shards.size(); i++) {
+    mg_printf(c, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"name\":\"shard %u\"}}",
+              i ? "," : "", (unsigned)i, (unsigned)i);
+  }
+  pumpTrace(c);
+}
+
+void DashboardServer::pumpTrace(struct mg_connection *c) {
+  for (auto it = m_traces.begin(); it != m_traces.end(); ++it) {
+    if (it->connId != c->id) continue;
+    while (c->send.len < GW_TRACE_SEND_LOW && it->next != it->end) {
+      uint32_t oldest = gw_trace_oldest();
+      if ((int32_t)(it->next - oldest) < 0) {
+        it->next = (int32_t)(it->end - oldest) < 0 ? it->end : oldest;
+      }
+      uint32_t to = it->end - it->next > 32 ? it->next + 32 : it->end;
+      gw_trace_print(mg_pfn_iobuf, &c->send, it->next, to);
+      it->next = to;
+    }
+    if (it->next == it->end) {
+      mg_printf(c, "]}\n");
+      c->is_draining = 1;
+      m_traces.erase(it);
+    }
+    return;
+  }
+}
+#endif
+
+void DashboardServer::sendTo(unsigned long connId, const String& msg) {
+  for (auto client : m_wsClients) {
+    if (client->id == connId) {
+      mg_ws_send(client, msg.c_str(), msg.length(), WEBSOCKET_OP_TEXT);
+      return;
+    }
+  }
+}
+
+String DashboardServer::response(const char* cmd, const char* status, const String& deviceId) {
+  char buf[160];
+  mg_snprintf(buf, sizeof(buf),
+    "{\"type\":\"response\",\"cmd\":\"%s\",\"status\":\"%s\",\"device_id\":\"%s\"}",
+    cmd, status, deviceId.c_str());
+  return String(buf);
+}
+
+// -------------------------------------------------------------------
+// Rendering, on the thread of the shard being rendered
+// -------------------------------------------------------------------
+String DashboardServer::renderDevices(GatewayCore& core) {
   // FIX BUG 3: Build the entire JSON in one String then send as a single
   // WebSocket frame. The previous code called mg_ws_printf multiple times,
   // producing separate frames that the browser received and tried to
   // JSON.parse() individually — all but the last fragment would fail to parse.
-  String json = "{\"type\":\"device_list\",\"devices\":[";
+  String json;
   bool first = true;
-  for (auto& pair : m_core.getAllDevices()) {
+  for (const Device& dev : core.getAllDevices()) {
     if (!first) json += ",";
     first = false;
-    const Device& dev = pair.second;
-    const char* statusStr = dev.status == DEV_PENDING  ? "PENDING"  :
-                            dev.status == DEV_APPROVED ? "APPROVED" :
-                            dev.status == DEV_DENIED   ? "DENIED"   : "OFFLINE";
-    char entry[320];
+    const DownlinkStore& dlq = core.getDownlinkStore();
+    char rtt[192], entry[640];
+    renderRtt(core.getPingStats(dev.id), rtt, sizeof(rtt));
     mg_snprintf(entry, sizeof(entry),
       "{\"id\":\"%s\",\"name\":\"%s\",\"type\":\"%s\",\"status\":\"%s\","
-      "\"lastSeen\":%lu,\"has_pending\":%s}",
-      dev.id.c_str(), dev.name.c_str(), dev.type.c_str(), statusStr,
-      dev.lastSeen, dev.has_pending ? "true" : "false");
+      "\"lastSeen\":%lu,\"has_pending\":%s,\"perms\":%lu,"
+      "\"online\":%s,\"queued\":%lu,\"queued_bytes\":%lu,\"rtt\":%s,\"owner\":\"%s\"}",
+      dev.id, dev.info->name, dev.info->type, statusName(dev.status),
+      dev.lastSeen, dev.hasPending() ? "true" : "false", (unsigned long)dev.perms,
+      core.isReachable(dev) ? "true" : "false",
+      (unsigned long)dlq.pendingMsgs(dev.id), (unsigned long)dlq.pendingBytes(dev.id),
+      rtt, core.ownerOf(dev.id).c_str());
     json += entry;
   }
-  json += "]}";
-  mg_ws_send(c, json.c_str(), json.length(), WEBSOCKET_OP_TEXT);
+  return json;
+}
+
+String DashboardServer::renderStats(GatewayCore& core) {
+  struct mg_iobuf io = {NULL, 0, 0, 256};
+  core.printStats(mg_pfn_iobuf, &io);
+  mg_iobuf_add(&io, io.len, "", 1);
+  String json((const char*)io.buf);
+  mg_iobuf_free(&io);
+  return json;
+}
+
+// Round trips of the dashboard's and the periodic pings, null before the first
+void DashboardServer::renderRtt(const GatewayCore::PingStats* ps, char* buf, size_t len) {
+  if (ps == nullptr) {
+    mg_snprintf(buf, len, "null");
+    return;
+  }
+  mg_snprintf(buf, len,
+    "{\"n\":%lu,\"p50_us\":%lu,\"p90_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu,"
+    "\"last_us\":%lu,\"sent\":%lu,\"lost\":%lu,\"errors\":%lu}",
+    (unsigned long)ps->rtt.count(), (unsigned long)ps->rtt.percentile(0.50),
+    (unsigned long)ps->rtt.percentile(0.90), (unsigned long)ps->rtt.percentile(0.99),
+    (unsigned long)ps->rtt.max(), (unsigned long)ps->lastUs, (unsigned long)ps->sent,
+    (unsigned long)ps->lost, (unsigned long)ps->errors);
+}
+
+String DashboardServer::renderPing(GatewayCore& core, const String& deviceId) {
+  const GatewayCore::PingStats* ps = core.getPingStats(deviceId);
+  const char* result = ps == nullptr ? "unknown" :
+                       ps->last == GatewayCore::PingStats::PING_PONG ? "pong" :
+                       ps->last == GatewayCore::PingStats::PING_LOST ? "lost" : "error";
+  char rtt[192], buf[320];
+  renderRtt(ps, rtt, sizeof(rtt));
+  mg_snprintf(buf, sizeof(buf),
+    "{\"type\":\"ping\",\"device_id\":\"%s\",\"result\":\"%s\",\"rtt\":%s}",
+    deviceId.c_str(), result, rtt);
+  return String(buf);
+}
+
+void DashboardServer::broadcast(const String& msg) {
+  GW_TRACE_SCOPE(TRACE_BROADCAST);
+  for (auto client : m_wsClients) {
+    mg_ws_send(client, msg.c_str(), msg.length(), WEBSOCKET_OP_TEXT);
+  }
 }
 
 void DashboardServer::broadcastDeviceUpdate(const String& deviceId, const char* status) {
+  GW_TRACE_SCOPE(TRACE_BROADCAST);
   for (auto client : m_wsClients) {
     mg_ws_printf(client, WEBSOCKET_OP_TEXT,
       "{\"type\":\"device_update\",\"device\":{\"id\":\"%s\",\"status\":\"%s\"}}",
       deviceId.c_str(), status);
   }
-}
\ No newline at end of file
+}
@@ -2,15 +2,31 @@
 #define GATEWAY_DASHBOARD_H
 
 #include <vector>
+#include <memory>
 #include "gateway_core.h"
+#include "gateway_trace.h"
 
 class DashboardServer {
 public:
   DashboardServer(GatewayCore& core);
-  void begin(int port = 80);
+  // The other shards of a multi-threaded gateway, in shard order.  The
+  // dashboard runs on the loop of the core given to the constructor, which
+  // must be shard 0, and reaches the others through GatewayCore::post().
+  void addShard(GatewayCore& shard) { m_shards.push_back(&shard); }
+  void begin(int port = 80);                // 0: no listener, see attachClient()
+
+  // Serve c, a connection without a socket, as an open WebSocket client.
+  // The caller delivers MG_EV_WS_MSG to c->fn and reads the replies from
+  // c->send, as host/sim does.
+  void attachClient(struct mg_connection *c);
 
 private:
+  using Render = std::function<String(GatewayCore&)>;
+  struct Gather;
+  struct Scrape;
+
   GatewayCore& m_core;
+  std::vector<GatewayCore*> m_shards;       // m_shards[0] == &m_core
   struct mg_connection* m_httpConn;
   std::vector<struct mg_connection*> m_wsClients;
 
@@ -18,7 +34,29 @@ private:
   void onWsOpen(struct mg_connection *c);
   void onWsMsg(struct mg_connection *c, struct mg_str data);
   void broadcastDeviceUpdate(const String& deviceId, const char* status);
-  void sendDeviceList(struct mg_connection *c);
+  void broadcast(const String& msg);
+  GatewayCore& shardFor(const String& deviceId);
+  void onShard(struct mg_connection *c, const char* cmd, const String& deviceId, Render fn);
+  void gather(struct mg_connection *c, const char* head, const char* tail, Render fn);
+  void finishGather(const std::shared_ptr<Gather>& g);
+  void scrape(struct mg_connection *c);     // GET /metrics
+  void finishScrape(const std::shared_ptr<Scrape>& s);
+  void sendTo(unsigned long connId, const String& msg);
+  static String response(const char* cmd, const char* status, const String& deviceId);
+  static String renderDevices(GatewayCore& core);
+  static String renderStats(GatewayCore& core);
+  static String renderPing(GatewayCore& core, const String& deviceId);
+  static void renderRtt(const GatewayCore::PingStats* ps, char* buf, size_t len);
+
+#if GW_TRACE
+  struct TraceDownload {
+    unsigned long connId;
+    uint32_t next, end;                     // ring indexes still to send
+  };
+  std::vector<TraceDownload> m_traces;
+  void startTrace(struct mg_connection *c); // GET /trace.json
+  void pumpTrace(struct mg_connection *c);
+#endif
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,208 @@
+#include "gateway_devices.h"
+#include <esp_heap_caps.h>
+#include <new>
+
+static_assert(GW_DEVICE_MAX > 0 && GW_DEVICE_MAX < 65535, "slot numbers are 16-bit");
+static_assert(GW_DEVICE_PENDING > 0 && GW_DEVICE_PENDING < 32767, "pending slots are int16_t");
+
+DeviceTable::DeviceTable()
+    : m_hot(nullptr), m_cold(nullptr), m_pending(nullptr), m_index(nullptr), m_free(nullptr),
+      m_pendingFree(nullptr), m_cap(0), m_indexMask(0), m_shift(32), m_freeCount(0),
+      m_pendingFreeCount(0) {
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+DeviceTable::~DeviceTable() {
+  for (size_t i = 0; i < m_cap; i++) {
+    memset(m_hot[i].enc_key, 0, sizeof(m_hot[i].enc_key));
+    memset(m_cold[i].pskKey, 0, sizeof(m_cold[i].pskKey));
+  }
+  free(m_hot);
+  free(m_cold);
+  free(m_pending);
+  free(m_index);
+  free(m_free);
+  free(m_pendingFree);
+}
+
+// Names and connect requests may go to PSRAM; ps_malloc() fails without it
+void* DeviceTable::allocCold(size_t bytes, bool& psram) {
+  psram = false;
+  if (GW_DEVICE_PSRAM && psramFound()) {
+    void* p = ps_malloc(bytes);
+    if (p != nullptr) {
+      psram = true;
+      return p;
+    }
+  }
+  return heap_caps_malloc(bytes, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+bool DeviceTable::init() {
+  if (m_hot != nullptr) return true;
+  size_t indexSize = 4;
+  unsigned bits = 2;
+  while (indexSize < 2 * (size_t)GW_DEVICE_MAX) indexSize <<= 1, bits++;
+
+  // With PSRAM, large malloc()s may land there: ask for internal RAM
+  const uint32_t internal = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  size_t hotBytes = GW_DEVICE_MAX * sizeof(Device);
+  size_t indexBytes = indexSize * sizeof(uint16_t) + GW_DEVICE_MAX * sizeof(uint16_t) +
+                      GW_DEVICE_PENDING * sizeof(int16_t);
+  bool coldPsram = false, pendingPsram = false;
+  m_hot = (Device*)heap_caps_malloc(hotBytes, internal);
+  m_index = (uint16_t*)heap_caps_calloc(indexSize, sizeof(uint16_t), internal);
+  m_free = (uint16_t*)heap_caps_malloc(GW_DEVICE_MAX * sizeof(uint16_t), internal);
+  m_pendingFree = (int16_t*)heap_caps_malloc(GW_DEVICE_PENDING * sizeof(int16_t), internal);
+  m_cold = (DeviceInfo*)allocCold(GW_DEVICE_MAX * sizeof(DeviceInfo), coldPsram);
+  m_pending = (PendingSlot*)allocCold(GW_DEVICE_PENDING * sizeof(PendingSlot), pendingPsram);
+  if (!m_hot || !m_index || !m_free || !m_pendingFree || !m_cold || !m_pending) {
+    Serial.printf("ERROR: no memory for %d device records\n", GW_DEVICE_MAX);
+    free(m_hot), free(m_index), free(m_free), free(m_pendingFree), free(m_cold), free(m_pending);
+    m_hot = nullptr, m_index = nullptr, m_free = nullptr, m_pendingFree = nullptr;
+    m_cold = nullptr, m_pending = nullptr;
+    return false;
+  }
+
+  m_cap = GW_DEVICE_MAX;
+  m_indexMask = indexSize - 1;
+  m_shift = 32 - bits;
+  for (size_t i = 0; i < m_cap; i++) {
+    new (&m_hot[i]) Device();
+    new (&m_cold[i]) DeviceInfo();
+    m_free[i] = (uint16_t)(m_cap - 1 - i);  // slot 0 is handed out first
+  }
+  m_freeCount = m_cap;
+  for (size_t i = 0; i < GW_DEVICE_PENDING; i++) {
+    m_pendingFree[i] = (int16_t)(GW_DEVICE_PENDING - 1 - i);
+  }
+  m_pendingFreeCount = GW_DEVICE_PENDING;
+
+  m_stats.capacity = GW_DEVICE_MAX;
+  m_stats.pendingCapacity = GW_DEVICE_PENDING;
+  m_stats.hotBytes = (uint32_t)(hotBytes + indexBytes);
+  m_stats.coldBytes = (uint32_t)(GW_DEVICE_MAX * sizeof(DeviceInfo) +
+                                 GW_DEVICE_PENDING * sizeof(PendingSlot));
+  m_stats.coldInPsram = coldPsram && pendingPsram;
+  Serial.printf("Device table: %d slots, %lu bytes internal, %lu bytes %s\n", GW_DEVICE_MAX,
+                (unsigned long)m_stats.hotBytes, (unsigned long)m_stats.coldBytes,
+                m_stats.coldInPsram ? "PSRAM" : "internal");
+  return true;
+}
+
+// FNV-1a; home() spreads it over the index with a multiply, as shardOf()
+// takes the same hash modulo the shard count
+uint32_t DeviceTable::hashId(const char* id) {
+  uint32_t h = 2166136261UL;
+  for (const char* p = id; *p; p++) h = (h ^ (uint8_t)*p) * 16777619UL;
+  return h;
+}
+
+Device* DeviceTable::find(const char* id) const {
+  if (m_cap == 0 || id == nullptr || id[0] == '\0') return nullptr;
+  for (size_t i = home(hashId(id));; i = (i + 1) & m_indexMask) {
+    uint16_t s = m_index[i];
+    if (s == 0) return nullptr;
+    if (strcmp(m_hot[s - 1].id, id) == 0) return &m_hot[s - 1];
+  }
+}
+
+Device* DeviceTable::add(const Device& rec) {
+  size_t idLen = strlen(rec.id);
+  if (idLen == 0 || idLen > GW_DEVICE_ID_MAX || find(rec.id) != nullptr) return nullptr;
+  if (m_freeCount == 0) {
+    m_stats.refused++;
+    return nullptr;
+  }
+  uint16_t s = m_free[--m_freeCount];
+  Device& dev = m_hot[s];
+  DeviceInfo& info = m_cold[s];
+  dev = rec;
+  info = rec.info != nullptr ? *rec.info : DeviceInfo();
+  info.pending = -1;
+  dev.info = &info;
+
+  size_t i = home(hashId(dev.id));
+  while (m_index[i] != 0) i = (i + 1) & m_indexMask;
+  m_index[i] = (uint16_t)(s + 1);
+  m_stats.used++;
+  if (m_stats.used > m_stats.peak) m_stats.peak = m_stats.used;
+  return &dev;
+}
+
+// Linear probing without tombstones: later entries of the cluster move
+// back into the hole when their home slot allows it
+void DeviceTable::remove(Device* dev) {
+  if (dev == nullptr || dev < m_hot || dev >= m_hot + m_cap || dev->id[0] == '\0') return;
+  uint16_t s = (uint16_t)(dev - m_hot);
+  size_t i = home(hashId(dev->id));
+  while (m_index[i] != (uint16_t)(s + 1)) i = (i + 1) & m_indexMask;
+  for (size_t j = (i + 1) & m_indexMask; m_index[j] != 0; j = (j + 1) & m_indexMask) {
+    size_t h = home(hashId(m_hot[m_index[j] - 1].id));
+    // Move j into the hole at i unless its home lies cyclically in (i, j]
+    bool stays = i <= j ? (i < h && h <= j) : (i < h || h <= j);
+    if (!stays) {
+      m_index[i] = m_index[j];
+      i = j;
+    }
+  }
+  m_index[i] = 0;
+
+  clearPending(*dev);
+  memset(dev->enc_key, 0, sizeof(dev->enc_key));
+  *dev = Device();
+  m_cold[s] = DeviceInfo();
+  m_free[m_freeCount++] = s;
+  m_stats.used--;
+}
+
+// -------------------------------------------------------------------
+// Connect requests waiting for the operator
+// -------------------------------------------------------------------
+bool DeviceTable::setPending(Device& dev, const uint8_t* data, size_t len) {
+  if (dev.info == nullptr || len > GW_DEVICE_PENDING_SIZE) return false;
+  int16_t p = dev.info->pending;
+  if (p < 0) {
+    if (m_pendingFreeCount == 0) {
+      m_stats.pendingRefused++;
+      return false;
+    }
+    p = m_pendingFree[--m_pendingFreeCount];
+    dev.info->pending = p;
+    m_stats.pendingUsed++;
+  }
+  memcpy(m_pending[p].data, data, len);
+  m_pending[p].len = (uint16_t)len;
+  return true;
+}
+
+void DeviceTable::clearPending(Device& dev) {
+  if (!dev.hasPending()) return;
+  PendingSlot& slot = m_pending[dev.info->pending];
+  memset(slot.data, 0, slot.len);
+  slot.len = 0;
+  m_pendingFree[m_pendingFreeCount++] = dev.info->pending;
+  dev.info->pending = -1;
+  m_stats.pendingUsed--;
+}
+
+struct mg_str DeviceTable::pending(const Device& dev) const {
+  if (!dev.hasPending()) return mg_str_n(NULL, 0);
+  const PendingSlot& slot = m_pending[dev.info->pending];
+  return mg_str_n((const char*)slot.data, slot.len);
+}
+
+void DeviceTable::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data,
+             "{%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%m}",
+             MG_ESC("used"), (unsigned long)m_stats.used,
+             MG_ESC("capacity"), (unsigned long)m_stats.capacity,
+             MG_ESC("peak"), (unsigned long)m_stats.peak,
+             MG_ESC("refused"), (unsigned long)m_stats.refused,
+             MG_ESC("pending"), (unsigned long)m_stats.pendingUsed,
+             MG_ESC("pending_capacity"), (unsigned long)m_stats.pendingCapacity,
+             MG_ESC("pending_refused"), (unsigned long)m_stats.pendingRefused,
+             MG_ESC("internal_bytes"), (unsigned long)m_stats.hotBytes,
+             MG_ESC("cold_bytes"), (unsigned long)m_stats.coldBytes,
+             MG_ESC("cold_in"), MG_ESC(m_stats.coldInPsram ? "psram" : "internal"));
+}
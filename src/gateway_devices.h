@@ -0,0 +1,93 @@
+#ifndef __GATEWAY_DEVICES__H_
+#define __GATEWAY_DEVICES__H_
+
+#include "gateway_private.h"
+
+// The device records of one core, in slabs of GW_DEVICE_MAX slots that
+// init() allocates once.  The Device half of a slot is what every frame
+// touches and stays in internal RAM; its DeviceInfo half goes to PSRAM when
+// the board has some (GW_DEVICE_PSRAM), so do the connect requests waiting
+// for the operator, in a pool of GW_DEVICE_PENDING.  Lookup is an
+// open-addressed index of slot numbers hashed by id.  Adding and removing
+// devices never calls the heap, and a full table refuses new ones instead
+// of fragmenting it.
+//
+// Iteration runs over the used slots in slot order; removing the current
+// device while iterating is allowed.
+class DeviceTable {
+public:
+  struct Stats {
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t peak;
+    uint32_t refused;                       // adds on a full table
+    uint32_t pendingCapacity;
+    uint32_t pendingUsed;
+    uint32_t pendingRefused;                // connect requests on a full pool
+    uint32_t hotBytes;                      // internal RAM
+    uint32_t coldBytes;                     // PSRAM when coldInPsram
+    bool coldInPsram;
+  };
+
+  class iterator {
+  public:
+    iterator(const DeviceTable* t, size_t i) : m_t(t), m_i(i) { skip(); }
+    Device& operator*() const { return m_t->m_hot[m_i]; }
+    iterator& operator++() { m_i++; skip(); return *this; }
+    bool operator!=(const iterator& o) const { return m_i != o.m_i; }
+
+  private:
+    void skip() { while (m_i < m_t->m_cap && m_t->m_hot[m_i].id[0] == '\0') m_i++; }
+    const DeviceTable* m_t;
+    size_t m_i;
+  };
+
+  DeviceTable();
+  ~DeviceTable();
+
+  bool init();                              // false: out of memory, the table stays empty
+
+  Device* find(const char* id) const;
+  Device* find(const String& id) const { return find(id.c_str()); }
+  // Stores a copy of rec, its info included; nullptr when the table is full,
+  // the id is empty or too long, or already taken.
+  Device* add(const Device& rec);
+  void remove(Device* dev);
+  size_t size() const { return m_stats.used; }
+
+  iterator begin() const { return iterator(this, 0); }
+  iterator end() const { return iterator(this, m_cap); }
+
+  // The connect request a pending device is waiting with: nonce || ciphertext
+  bool setPending(Device& dev, const uint8_t* data, size_t len);
+  void clearPending(Device& dev);
+  struct mg_str pending(const Device& dev) const;
+
+  const Stats& stats() const { return m_stats; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;   // JSON object
+
+private:
+  struct PendingSlot {
+    uint16_t len;
+    uint8_t data[GW_DEVICE_PENDING_SIZE];
+  };
+
+  size_t home(uint32_t hash) const { return (uint32_t)(hash * 2654435769u) >> m_shift; }
+  static uint32_t hashId(const char* id);
+  static void* allocCold(size_t bytes, bool& psram);
+
+  Device* m_hot;
+  DeviceInfo* m_cold;
+  PendingSlot* m_pending;
+  uint16_t* m_index;                        // slot + 1, 0 = empty
+  uint16_t* m_free;                         // unused slots, a stack
+  int16_t* m_pendingFree;
+  size_t m_cap;
+  size_t m_indexMask;
+  unsigned m_shift;                         // 32 - log2(index size)
+  size_t m_freeCount;
+  size_t m_pendingFreeCount;
+  Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include "gateway_keystream.h"
+#include <string.h>
+
+static_assert(GW_KEYSTREAM_BYTES % 64 == 0, "keystream is made in 64-byte blocks");
+static_assert(GW_KEYSTREAM_DEPTH > 0, "at least one counter ahead");
+
+KeystreamPool::KeystreamPool() : m_next(0), m_dirty(false), m_sweepAt(0) {
+  memset(m_slots, 0, sizeof(m_slots));
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+KeystreamPool::~KeystreamPool() {
+  memset(m_slots, 0, sizeof(m_slots));
+}
+
+// Same as sendEncrypted(): the gateway counter has the top bit set
+uint32_t KeystreamPool::counterAfter(uint32_t txNonce, uint32_t ahead) {
+  return 0x80000000UL | ((txNonce + ahead) & 0x7FFFFFFFUL);
+}
+
+bool KeystreamPool::fresh(const Entry& e, unsigned long now, unsigned long maxAge) {
+  return e.counter != 0 && now - e.madeMs < maxAge;
+}
+
+void KeystreamPool::release(Slot& s) {
+  memset(&s, 0, sizeof(s));
+}
+
+KeystreamPool::Slot* KeystreamPool::find(const Device& dev) {
+  for (Slot& s : m_slots) {
+    if (s.dev == &dev) return &s;
+  }
+  return nullptr;
+}
+
+bool KeystreamPool::take(const Device& dev, uint32_t counter, unsigned long now, Entry& out) {
+  if (GW_KEYSTREAM_DEVICES == 0) return false;
+  Slot* s = find(dev);
+  Entry* e = s != nullptr ? &s->entries[counter % GW_KEYSTREAM_DEPTH] : nullptr;
+  if (e == nullptr || e->counter != counter || !fresh(*e, now, GW_KEYSTREAM_TTL_MS) ||
+      memcmp(s->key, dev.enc_key, sizeof(s->key)) != 0) {
+    m_stats.misses++;
+    return false;
+  }
+  memcpy(&out, e, sizeof(out));
+  memset(e, 0, sizeof(*e));
+  s->lastUse = now;
+  m_dirty = true;
+  m_stats.hits++;
+  return true;
+}
+
+void KeystreamPool::want(Device& dev, unsigned long now) {
+  if (GW_KEYSTREAM_DEVICES == 0 || !dev.keySet) return;
+  Slot* s = find(dev);
+  if (s == nullptr) {
+    // A free slot, else the one whose device went quiet first
+    s = &m_slots[0];
+    for (Slot& c : m_slots) {
+      if (c.dev == nullptr) {
+        s = &c;
+        break;
+      }
+      if ((long)(c.lastUse - s->lastUse) < 0) s = &c;
+    }
+    if (s->dev != nullptr) m_stats.evictions++;
+    release(*s);
+    s->dev = &dev;
+    memcpy(s->key, dev.enc_key, sizeof(s->key));
+  }
+  s->lastUse = now;
+  m_dirty = true;
+}
+
+// Entries are topped up once they are past half their life, so take()
+// finds them fresh; devices quiet for a whole TTL give their slot up.
+size_t KeystreamPool::refill(unsigned long now, uint64_t unixTime, size_t budget) {
+  if (GW_KEYSTREAM_DEVICES == 0) return 0;
+  if (!m_dirty && (long)(now - m_sweepAt) < 0) return 0;
+  size_t done = 0;
+  for (size_t n = 0; n < SLOTS; n++, m_next = (m_next + 1) % SLOTS) {
+    Slot& s = m_slots[m_next];
+    if (s.dev == nullptr) continue;
+    Device& dev = *s.dev;
+    if (!dev.keySet || dev.id[0] == '\0' || now - s.lastUse >= GW_KEYSTREAM_TTL_MS) {
+      release(s);
+      continue;
+    }
+    if (memcmp(s.key, dev.enc_key, sizeof(s.key)) != 0) {
+      memset(s.entries, 0, sizeof(s.entries));
+      memcpy(s.key, dev.enc_key, sizeof(s.key));
+    }
+    for (uint32_t k = 1; k <= GW_KEYSTREAM_DEPTH; k++) {
+      uint32_t counter = counterAfter(dev.txNonce, k);
+      Entry& e = s.entries[counter % GW_KEYSTREAM_DEPTH];
+      if (e.counter == counter && fresh(e, now, GW_KEYSTREAM_TTL_MS / 2)) continue;
+      if (done == budget) return done;      // m_next stays on this slot
+      e.nonce[0] = (counter >> 24) & 0xFF;
+      e.nonce[1] = (counter >> 16) & 0xFF;
+      e.nonce[2] = (counter >> 8) & 0xFF;
+      e.nonce[3] = counter & 0xFF;
+      for (int i = 0; i < 8; i++) e.nonce[4 + i] = (unixTime >> (56 - 8*i)) & 0xFF;
+      chacha20_poly1305_precompute(e.polyKey, e.stream, sizeof(e.stream), dev.enc_key, e.nonce);
+      e.counter = counter;
+      e.madeMs = now;
+      done++;
+      m_stats.computed++;
+    }
+  }
+  m_dirty = false;
+  m_sweepAt = now + GW_KEYSTREAM_TTL_MS / 4;
+  return done;
+}
+
+void KeystreamPool::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  unsigned used = 0;
+  for (const Slot& s : m_slots) {
+    if (s.dev != nullptr) used++;
+  }
+  mg_xprintf(pfn, pfn_data, "{%m:%u,%m:%lu,%m:%lu,%m:%lu,%m:%lu}",
+             MG_ESC("devices"), used,
+             MG_ESC("hits"), (unsigned long)m_stats.hits,
+             MG_ESC("misses"), (unsigned long)m_stats.misses,
+             MG_ESC("computed"), (unsigned long)m_stats.computed,
+             MG_ESC("evictions"), (unsigned long)m_stats.evictions);
+}
@@ -0,0 +1,77 @@
+#ifndef __GATEWAY_KEYSTREAM__H_
+#define __GATEWAY_KEYSTREAM__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+#include "../gateway_config.h"
+#include "chacha20.h"
+#include "gateway_private.h"
+
+// ChaCha20 keystream and Poly1305 one-time keys computed ahead of time for
+// the next GW_KEYSTREAM_DEPTH outbound counters of the devices that last
+// got a downlink, so the reply to their next request is an XOR and a MAC.
+// want() adds a device after each downlink, evicting the one idle longest
+// when all GW_KEYSTREAM_DEVICES slots are taken; refill() does the work a
+// few entries at a time when the loop would otherwise sleep.
+//
+// Material is only used for the exact counter and key it was computed
+// for: a slot keeps a copy of the key, so a rotated key, a counter that
+// moved on (cluster handover) or a removed device just misses and gets
+// recomputed.  Entries older than GW_KEYSTREAM_TTL_MS are recomputed too,
+// which keeps the timestamp half of the nonce recent.  Everything lives
+// inside the object and used entries are wiped.
+class KeystreamPool {
+public:
+  struct Entry {
+    uint32_t counter;                       // 0 = empty; gateway counters have the top bit set
+    unsigned long madeMs;
+    uint8_t nonce[RFC_8439_NONCE_SIZE];
+    uint8_t polyKey[32];
+    uint8_t stream[GW_KEYSTREAM_BYTES];
+  };
+
+  struct Stats {
+    uint32_t hits;                          // downlinks sent from precomputed material
+    uint32_t misses;                        // computed on demand instead
+    uint32_t computed;                      // entries refill() produced
+    uint32_t evictions;                     // devices pushed out by want()
+  };
+
+  KeystreamPool();
+  ~KeystreamPool();
+
+  // Moves the material for counter into out and wipes it from the pool
+  bool take(const Device& dev, uint32_t counter, unsigned long now, Entry& out);
+  void want(Device& dev, unsigned long now);
+  // Fills up to budget missing entries; returns how many it computed.
+  // unixTime is the timestamp half of the nonces it makes.
+  size_t refill(unsigned long now, uint64_t unixTime, size_t budget);
+  bool pending() const { return m_dirty; }
+
+  const Stats& stats() const { return m_stats; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;   // JSON object
+
+private:
+  enum { SLOTS = GW_KEYSTREAM_DEVICES > 0 ? GW_KEYSTREAM_DEVICES : 1 };
+
+  struct Slot {
+    Device* dev;                            // a DeviceTable slot; nullptr = free
+    uint8_t key[32];                        // dev->enc_key the entries were made with
+    unsigned long lastUse;
+    Entry entries[GW_KEYSTREAM_DEPTH];      // indexed by counter % depth
+  };
+
+  static uint32_t counterAfter(uint32_t txNonce, uint32_t ahead);
+  static bool fresh(const Entry& e, unsigned long now, unsigned long maxAge);
+  void release(Slot& s);
+  Slot* find(const Device& dev);
+
+  Slot m_slots[SLOTS];
+  size_t m_next;                            // where refill() goes on
+  bool m_dirty;                             // some slot may be missing entries
+  unsigned long m_sweepAt;                  // next look for aging entries
+  Stats m_stats;
+};
+
+#endif
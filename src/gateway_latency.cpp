@@ -0,0 +1,65 @@
+#include "gateway_latency.h"
+#include <string.h>
+
+// Bucket i < 2*SUB holds the value i.  Above that a value with its top bit
+// at position b falls in bucket SUB*e + (v >> e), e = b - SUB_BITS, where
+// v >> e keeps the SUB_BITS+1 leading bits.
+unsigned LatencyHistogram::bucketOf(uint32_t us) {
+  if (us < 2 * SUB) return us;
+  unsigned e = (31 - __builtin_clz(us)) - SUB_BITS;
+  if (e > MAX_EXP) return BUCKETS - 1;
+  return SUB * e + (us >> e);
+}
+
+uint32_t LatencyHistogram::highestIn(unsigned bucket) {
+  if (bucket < 2 * SUB) return bucket;
+  unsigned e = bucket / SUB - 1;
+  uint32_t m = bucket % SUB + SUB;
+  return ((m + 1) << e) - 1;
+}
+
+void LatencyHistogram::reset() {
+  memset(m_counts, 0, sizeof(m_counts));
+  m_total = 0;
+  m_max = 0;
+}
+
+void LatencyHistogram::halve() {
+  m_total = 0;
+  for (unsigned i = 0; i < BUCKETS; i++) {
+    m_counts[i] = (uint16_t)((m_counts[i] + 1) / 2);
+    m_total += m_counts[i];
+  }
+}
+
+void LatencyHistogram::record(uint32_t us) {
+  unsigned b = bucketOf(us);
+  if (m_counts[b] == UINT16_MAX) halve();
+  m_counts[b]++;
+  m_total++;
+  if (us > m_max) m_max = us;
+}
+
+uint32_t LatencyHistogram::percentile(double p) const {
+  if (m_total == 0) return 0;
+  uint32_t rank = (uint32_t)(p * m_total + 0.999999);
+  if (rank == 0) rank = 1;
+  uint32_t seen = 0;
+  for (unsigned i = 0; i < BUCKETS; i++) {
+    seen += m_counts[i];
+    if (seen >= rank) {
+      uint32_t v = highestIn(i);
+      return v < m_max ? v : m_max;
+    }
+  }
+  return m_max;
+}
+
+void LatencyHistogram::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data, "{%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu}",
+             MG_ESC("n"), (unsigned long)m_total,
+             MG_ESC("p50_us"), (unsigned long)percentile(0.50),
+             MG_ESC("p90_us"), (unsigned long)percentile(0.90),
+             MG_ESC("p99_us"), (unsigned long)percentile(0.99),
+             MG_ESC("max_us"), (unsigned long)m_max);
+}
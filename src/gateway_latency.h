@@ -0,0 +1,42 @@
+#ifndef __GATEWAY_LATENCY__H_
+#define __GATEWAY_LATENCY__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+
+// Latency histogram in the manner of HdrHistogram, sized for a device
+// table on an ESP32.  Values are microseconds.  Below 16 us every value has
+// its own bucket; above that each power of two is split into 8 buckets, so
+// a reported quantile is never more than 1/8 above the true value.  Up to
+// 2^27 us (134 s) is covered, longer samples land in the last bucket.
+//
+// Counts are 16 bits.  When one would overflow, all of them are halved,
+// which keeps the shape and lets old samples fade on a long-lived device.
+class LatencyHistogram {
+public:
+  enum { SUB_BITS = 3, SUB = 1 << SUB_BITS, MAX_EXP = 27 - SUB_BITS - 1,
+         BUCKETS = SUB * (MAX_EXP + 2) };
+
+  LatencyHistogram() { reset(); }
+  void reset();
+  void record(uint32_t us);
+
+  uint32_t count() const { return m_total; }
+  uint32_t max() const { return m_max; }
+  uint32_t percentile(double p) const;      // 0 when empty
+
+  // {"n":..,"p50_us":..,"p90_us":..,"p99_us":..,"max_us":..}
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;
+
+private:
+  static unsigned bucketOf(uint32_t us);
+  static uint32_t highestIn(unsigned bucket);
+  void halve();
+
+  uint16_t m_counts[BUCKETS];
+  uint32_t m_total;
+  uint32_t m_max;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include "gateway_metrics.h"
+
+typedef uint64_t (*MetricGet)(const MetricsSnapshot& s);
+
+static void family(mg_pfn_t pfn, void *pfn_data, const char* name, const char* type,
+                   const char* help) {
+  mg_xprintf(pfn, pfn_data, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void perShard(mg_pfn_t pfn, void *pfn_data, const MetricsSnapshot* snaps, size_t count,
+                     const char* name, const char* type, const char* help, MetricGet get) {
+  family(pfn, pfn_data, name, type, help);
+  for (size_t i = 0; i < count; i++) {
+    if (!snaps[i].valid) continue;
+    mg_xprintf(pfn, pfn_data, "%s{shard=\"%u\"} %llu\n", name, (unsigned)i,
+               (unsigned long long)get(snaps[i]));
+  }
+}
+
+static void histogramSamples(mg_pfn_t pfn, void *pfn_data, const char* name,
+                             const char* labels, const MetricHistogram& h) {
+  uint64_t cumulative = 0;
+  for (unsigned b = 0; b < MetricHistogram::BUCKETS; b++) {
+    cumulative += h.counts[b];
+    double le = (double)(1UL << (b + MetricHistogram::MIN_SHIFT)) / 1e6;
+    mg_xprintf(pfn, pfn_data, "%s_bucket{%s,le=\"%.9g\"} %llu\n", name, labels, le,
+               (unsigned long long)cumulative);
+  }
+  cumulative += h.counts[MetricHistogram::BUCKETS];
+  mg_xprintf(pfn, pfn_data, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels,
+             (unsigned long long)cumulative);
+  mg_xprintf(pfn, pfn_data, "%s_sum{%s} %.9g\n", name, labels, (double)h.sumUs / 1e6);
+  mg_xprintf(pfn, pfn_data, "%s_count{%s} %llu\n", name, labels,
+             (unsigned long long)cumulative);
+}
+
+void printMetrics(mg_pfn_t pfn, void *pfn_data, const MetricsSnapshot* snaps, size_t count,
+                  uint32_t heapFree) {
+  perShard(pfn, pfn_data, snaps, count, "gw_rx_frames_total", "counter",
+           "Device frames received", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rxFrames; });
+  perShard(pfn, pfn_data, snaps, count, "gw_rx_bytes_total", "counter",
+           "Payload bytes of received device frames", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rxBytes; });
+  perShard(pfn, pfn_data, snaps, count, "gw_rx_accepted_total", "counter",
+           "Frames that decrypted, verified and were fresh", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rxAccepted; });
+  perShard(pfn, pfn_data, snaps, count, "gw_rx_decrypt_failures_total", "counter",
+           "Frames whose Poly1305 tag did not verify", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rxDecryptFailures; });
+  perShard(pfn, pfn_data, snaps, count, "gw_rx_auth_failures_total", "counter",
+           "Frames with a bad HMAC signature", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rxAuthFailures; });
+  perShard(pfn, pfn_data, snaps, count, "gw_rx_replay_rejects_total", "counter",
+           "Frames with a nonce counter that was not newer", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rxReplayRejects; });
+  perShard(pfn, pfn_data, snaps, count, "gw_rpc_requests_total", "counter",
+           "JSON-RPC requests dispatched", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.rpcRequests; });
+  perShard(pfn, pfn_data, snaps, count, "gw_tx_messages_total", "counter",
+           "Encrypted downlink messages queued", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.txMessages; });
+  perShard(pfn, pfn_data, snaps, count, "gw_tx_bytes_total", "counter",
+           "Bytes of encrypted downlink messages queued", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.m.txBytes; });
+  perShard(pfn, pfn_data, snaps, count, "gw_outq_dropped_total", "counter",
+           "Publishes refused because the outbound queue was full",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.outqDropped; });
+  perShard(pfn, pfn_data, snaps, count, "gw_mqtt_connects_total", "counter",
+           "Accepted broker connections", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.mqttConnects; });
+  perShard(pfn, pfn_data, snaps, count, "gw_ping_sent_total", "counter",
+           "Latency pings sent to devices", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.pingSent; });
+  perShard(pfn, pfn_data, snaps, count, "gw_ping_lost_total", "counter",
+           "Latency pings without a reply in time", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.pingLost; });
+  perShard(pfn, pfn_data, snaps, count, "gw_msg_heap_allocs_total", "counter",
+           "Heap blocks taken for message handling: arena overflows and new queue entries",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.msgHeapAllocs; });
+  perShard(pfn, pfn_data, snaps, count, "gw_devices_refused_total", "counter",
+           "New devices and connect requests refused because the device table was full",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.devicesRefused; });
+  perShard(pfn, pfn_data, snaps, count, "gw_keystream_hits_total", "counter",
+           "Downlinks encrypted with keystream computed while idle",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.keystreamHits; });
+  perShard(pfn, pfn_data, snaps, count, "gw_keystream_misses_total", "counter",
+           "Downlinks whose keystream was computed on demand",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.keystreamMisses; });
+  perShard(pfn, pfn_data, snaps, count, "gw_sessions_full_total", "counter",
+           "Device sessions set up with an X25519 exchange",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.sessionsFull; });
+  perShard(pfn, pfn_data, snaps, count, "gw_sessions_resumed_total", "counter",
+           "Device sessions resumed from a ticket",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.sessionsResumed; });
+  perShard(pfn, pfn_data, snaps, count, "gw_session_rejects_total", "counter",
+           "Resume requests refused; the device falls back to a full handshake",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.sessionsRejected; });
+
+  perShard(pfn, pfn_data, snaps, count, "gw_mqtt_up", "gauge",
+           "1 while the broker session is open", [](const MetricsSnapshot& s) {
+             return (uint64_t)(s.mqttUp ? 1 : 0); });
+  perShard(pfn, pfn_data, snaps, count, "gw_devices", "gauge",
+           "Devices known to the core", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.devices; });
+  perShard(pfn, pfn_data, snaps, count, "gw_device_capacity", "gauge",
+           "Device records the core has room for", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.deviceCapacity; });
+  family(pfn, pfn_data, "gw_outq_depth", "gauge", "Publishes waiting in the outbound queue");
+  for (size_t i = 0; i < count; i++) {
+    if (!snaps[i].valid) continue;
+    mg_xprintf(pfn, pfn_data, "gw_outq_depth{shard=\"%u\",lane=\"control\"} %lu\n"
+               "gw_outq_depth{shard=\"%u\",lane=\"bulk\"} %lu\n",
+               (unsigned)i, (unsigned long)snaps[i].outqDepth[0],
+               (unsigned)i, (unsigned long)snaps[i].outqDepth[1]);
+  }
+  perShard(pfn, pfn_data, snaps, count, "gw_outq_bytes", "gauge",
+           "Bytes held by the outbound queue, in flight included",
+           [](const MetricsSnapshot& s) { return (uint64_t)s.outqBytes; });
+  perShard(pfn, pfn_data, snaps, count, "gw_outq_inflight", "gauge",
+           "QoS1 publishes awaiting PUBACK", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.outqInflight; });
+  perShard(pfn, pfn_data, snaps, count, "gw_dlq_bytes", "gauge",
+           "Bytes stored for offline devices", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.dlqBytes; });
+  perShard(pfn, pfn_data, snaps, count, "gw_msg_arena_peak_bytes", "gauge",
+           "Most message arena bytes in use at once", [](const MetricsSnapshot& s) {
+             return (uint64_t)s.arenaPeak; });
+  family(pfn, pfn_data, "gw_loop_idle_ratio", "gauge",
+         "Share of the last stats window the poll loop slept");
+  for (size_t i = 0; i < count; i++) {
+    if (!snaps[i].valid) continue;
+    mg_xprintf(pfn, pfn_data, "gw_loop_idle_ratio{shard=\"%u\"} %.4f\n", (unsigned)i,
+               snaps[i].loopIdleRatio);
+  }
+  family(pfn, pfn_data, "gw_heap_free_bytes", "gauge", "Free heap");
+  mg_xprintf(pfn, pfn_data, "gw_heap_free_bytes %lu\n", (unsigned long)heapFree);
+
+  static const char* const stageNames[GatewayMetrics::STAGE_COUNT] = {
+    "decrypt", "auth", "rpc", "rx", "encrypt"
+  };
+  family(pfn, pfn_data, "gw_stage_seconds", "histogram",
+         "Time per frame in each stage; rx is a whole uplink frame, reply included");
+  for (size_t i = 0; i < count; i++) {
+    if (!snaps[i].valid) continue;
+    for (int st = 0; st < GatewayMetrics::STAGE_COUNT; st++) {
+      char labels[48];
+      mg_snprintf(labels, sizeof(labels), "shard=\"%u\",stage=\"%s\"", (unsigned)i,
+                  stageNames[st]);
+      histogramSamples(pfn, pfn_data, "gw_stage_seconds", labels, snaps[i].m.stages[st]);
+    }
+  }
+  family(pfn, pfn_data, "gw_loop_lag_seconds", "histogram",
+         "Busy time of a poll pass, the longest a ready socket waits");
+  for (size_t i = 0; i < count; i++) {
+    if (!snaps[i].valid) continue;
+    char labels[24];
+    mg_snprintf(labels, sizeof(labels), "shard=\"%u\"", (unsigned)i);
+    histogramSamples(pfn, pfn_data, "gw_loop_lag_seconds", labels, snaps[i].m.loopLag);
+  }
+  family(pfn, pfn_data, "gw_ping_rtt_seconds", "histogram",
+         "Round trip of latency pings to devices");
+  for (size_t i = 0; i < count; i++) {
+    if (!snaps[i].valid) continue;
+    char labels[24];
+    mg_snprintf(labels, sizeof(labels), "shard=\"%u\"", (unsigned)i);
+    histogramSamples(pfn, pfn_data, "gw_ping_rtt_seconds", labels, snaps[i].m.pingRtt);
+  }
+}
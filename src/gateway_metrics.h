@@ -0,0 +1,89 @@
+#ifndef __GATEWAY_METRICS__H_
+#define __GATEWAY_METRICS__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "mongoose.h"
+
+// Counters for the /metrics endpoint (Prometheus text format).
+//
+// Every GatewayCore owns one GatewayMetrics and only its poll loop writes
+// it, so an update is a plain add with no lock or atomic.  A scrape copies
+// the counters on that loop (GatewayCore::snapshotMetrics()) and renders
+// the copies on the dashboard's loop.  Nothing here is per device, so a
+// scrape costs the same whatever the fleet size.
+
+// Histogram with power-of-two bucket bounds from 16 us to 4.2 s, then
+// +Inf.  observe() is a count-leading-zeros and two adds.
+struct MetricHistogram {
+  enum { MIN_SHIFT = 4, MAX_SHIFT = 22, BUCKETS = MAX_SHIFT - MIN_SHIFT + 1 };
+  uint32_t counts[BUCKETS + 1];             // per bucket, not cumulative
+  uint64_t sumUs;
+
+  void observe(uint32_t us) {
+    unsigned i = us <= (1UL << MIN_SHIFT) ? 0 : 32 - __builtin_clz(us - 1) - MIN_SHIFT;
+    counts[i < BUCKETS ? i : (unsigned)BUCKETS]++;
+    sumUs += us;
+  }
+};
+
+struct GatewayMetrics {
+  enum Stage { STAGE_DECRYPT, STAGE_AUTH, STAGE_RPC, STAGE_RX, STAGE_ENCRYPT, STAGE_COUNT };
+
+  uint64_t rxFrames;                        // device frames for this core
+  uint64_t rxBytes;
+  uint64_t rxAccepted;                      // decrypted, signed and fresh
+  uint64_t rxDecryptFailures;
+  uint64_t rxAuthFailures;
+  uint64_t rxReplayRejects;
+  uint64_t rpcRequests;
+  uint64_t txMessages;                      // encrypted downlinks queued
+  uint64_t txBytes;
+  MetricHistogram stages[STAGE_COUNT];
+  MetricHistogram loopLag;                  // busy time of one poll pass
+  MetricHistogram pingRtt;
+
+  GatewayMetrics() { memset(this, 0, sizeof(*this)); }
+};
+
+// GatewayMetrics plus the gauges of one core, taken on its loop
+struct MetricsSnapshot {
+  GatewayMetrics m;
+  bool valid;                               // false: the core was too busy to answer
+  bool mqttUp;
+  uint32_t mqttConnects;
+  uint32_t devices;
+  uint32_t deviceCapacity;
+  uint32_t devicesRefused;                  // adds and connect requests on a full table
+  uint32_t outqDepth[2];                    // control, bulk
+  uint32_t outqBytes;
+  uint32_t outqInflight;
+  uint32_t outqDropped;
+  uint32_t dlqBytes;
+  uint32_t pingSent;
+  uint32_t pingLost;
+  uint32_t msgHeapAllocs;                   // arena overflows and new outbound queue entries
+  uint32_t arenaPeak;
+  uint32_t keystreamHits;                   // downlinks encrypted from precomputed keystream
+  uint32_t keystreamMisses;
+  uint32_t sessionsFull;                    // X25519 handshakes
+  uint32_t sessionsResumed;                 // sessions resumed from a ticket
+  uint32_t sessionsRejected;                // tickets refused
+  double loopIdleRatio;
+
+  MetricsSnapshot() : valid(false), mqttUp(false), mqttConnects(0), devices(0),
+                      deviceCapacity(0), devicesRefused(0), outqBytes(0),
+                      outqInflight(0), outqDropped(0), dlqBytes(0), pingSent(0), pingLost(0),
+                      msgHeapAllocs(0), arenaPeak(0), keystreamHits(0), keystreamMisses(0),
+                      sessionsFull(0), sessionsResumed(0), sessionsRejected(0),
+                      loopIdleRatio(0) {
+    outqDepth[0] = outqDepth[1] = 0;
+  }
+};
+
+// Every family once, one sample per core labelled shard="<index>"
+void printMetrics(mg_pfn_t pfn, void *pfn_data, const MetricsSnapshot* snaps, size_t count,
+                  uint32_t heapFree);
+
+#endif
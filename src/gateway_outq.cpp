@@ -0,0 +1,237 @@
+#include "gateway_outq.h"
+#include <string.h>
+#include <stdlib.h>
+
+OutQueue::OutQueue() : m_inflightCount(0), m_spareCount(0), m_keepIds(false) {
+  memset(m_lanes, 0, sizeof(m_lanes));
+  memset(m_inflight, 0, sizeof(m_inflight));
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+OutQueue::~OutQueue() {
+  for (size_t i = 0; i < LANE_COUNT; i++) {
+    Entry* e;
+    while ((e = ringPop(m_lanes[i])) != nullptr) release(e);
+  }
+  for (size_t i = 0; i < m_inflightCount; i++) release(m_inflight[i]);
+  for (size_t i = 0; i < m_spareCount; i++) free(m_spare[i]);
+}
+
+// ---------------------------------------------------------------------------
+bool OutQueue::ringPushBack(Ring& r, Entry* e) {
+  if (r.count >= GW_OUTQ_MAX_MSGS) return false;
+  r.items[(r.head + r.count) % GW_OUTQ_MAX_MSGS] = e;
+  r.count++;
+  return true;
+}
+
+bool OutQueue::ringPushFront(Ring& r, Entry* e) {
+  if (r.count >= GW_OUTQ_MAX_MSGS) return false;
+  r.head = (r.head + GW_OUTQ_MAX_MSGS - 1) % GW_OUTQ_MAX_MSGS;
+  r.items[r.head] = e;
+  r.count++;
+  return true;
+}
+
+OutQueue::Entry* OutQueue::ringPop(Ring& r) {
+  if (r.count == 0) return nullptr;
+  Entry* e = r.items[r.head];
+  r.head = (r.head + 1) % GW_OUTQ_MAX_MSGS;
+  r.count--;
+  return e;
+}
+
+// A spare that fits, else a new entry rounded up to 64 bytes so that it
+// fits the next message of about the same size
+OutQueue::Entry* OutQueue::acquire(size_t bytes) {
+  for (size_t i = 0; i < m_spareCount; i++) {
+    Entry* e = m_spare[i];
+    if (e->cap < bytes) continue;
+    m_spare[i] = m_spare[--m_spareCount];
+    return e;
+  }
+  size_t cap = (bytes + 63) & ~(size_t) 63;
+  Entry* e = (Entry*) malloc(sizeof(Entry) + cap);
+  if (e == nullptr) return nullptr;
+  e->cap = cap;
+  m_stats.allocs++;
+  return e;
+}
+
+// Keeps the largest entries as spares
+void OutQueue::release(Entry* e) {
+  m_stats.bytesQueued -= (uint32_t) (e->topicLen + e->len);
+  if (m_spareCount < GW_OUTQ_SPARE) {
+    m_spare[m_spareCount++] = e;
+    return;
+  }
+  size_t smallest = 0;
+  for (size_t i = 1; i < m_spareCount; i++) {
+    if (m_spare[i]->cap < m_spare[smallest]->cap) smallest = i;
+  }
+  if (m_spare[smallest]->cap < e->cap) {
+    free(m_spare[smallest]);
+    m_spare[smallest] = e;
+  } else {
+    free(e);
+  }
+}
+
+void OutQueue::ewma(uint32_t& avg, uint32_t& max, uint32_t sample) {
+  avg = avg == 0 ? sample : avg + ((int32_t) (sample - avg) >> 3);
+  if (sample > max) max = sample;
+}
+
+// ---------------------------------------------------------------------------
+bool OutQueue::push(Lane lane, struct mg_str topic, struct mg_str payload,
+                    uint8_t qos, unsigned long now, bool retain) {
+  size_t bytes = topic.len + payload.len;
+  if (m_stats.bytesQueued + bytes > GW_OUTQ_MAX_BYTES ||
+      m_lanes[lane].count >= GW_OUTQ_MAX_MSGS) {
+    m_stats.dropped++;
+    return false;
+  }
+  Entry* e = acquire(bytes);
+  if (e == nullptr) {
+    m_stats.dropped++;
+    return false;
+  }
+  e->topic      = (char*) (e + 1);
+  e->topicLen   = topic.len;
+  e->payload    = e->topic + topic.len;
+  e->len        = payload.len;
+  e->qos        = qos;
+  e->lane       = (uint8_t) lane;
+  e->retain     = retain;
+  e->packetId   = 0;
+  e->enqueuedAt = now;
+  e->sentAt     = 0;
+  memcpy(e->topic, topic.buf, topic.len);
+  memcpy(e->payload, payload.buf, payload.len);
+  ringPushBack(m_lanes[lane], e);
+
+  m_stats.bytesQueued += (uint32_t) bytes;
+  m_stats.enqueued++;
+  m_stats.depth[lane] = (uint32_t) m_lanes[lane].count;
+  if (m_stats.depth[lane] > m_stats.maxDepth[lane]) {
+    m_stats.maxDepth[lane] = m_stats.depth[lane];
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+void OutQueue::publish(struct mg_connection *c, Entry* e, unsigned long now) {
+  struct mg_mqtt_opts opts = {};
+  opts.topic   = mg_str_n(e->topic, e->topicLen);
+  opts.message = mg_str_n(e->payload, e->len);
+  opts.qos     = e->qos;
+  opts.retain  = e->retain;
+  opts.retransmit_id = m_keepIds ? e->packetId : 0;
+  if (e->sentAt == 0) {
+    uint32_t waited = (uint32_t) (now - e->enqueuedAt);
+    ewma(m_stats.queueLatencyAvgMs, m_stats.queueLatencyMaxMs, waited);
+  } else {
+    m_stats.retransmits++;
+  }
+  e->packetId = mg_mqtt_pub(c, &opts);
+  e->sentAt = now;
+  if (e->sentAt == 0) e->sentAt = 1;
+  m_stats.published++;
+}
+
+// Send queued messages while the inflight window and the socket allow it.
+void OutQueue::pump(struct mg_connection *c, unsigned long now) {
+  if (c == nullptr || c->is_closing) return;
+  for (size_t lane = 0; lane < LANE_COUNT; lane++) {
+    while (m_lanes[lane].count > 0) {
+      if (c->send.len > GW_OUTQ_SEND_HIGHWATER) return;
+      Entry* e = m_lanes[lane].items[m_lanes[lane].head];
+      if (e->qos > 0 && m_inflightCount >= GW_OUTQ_INFLIGHT) return;
+      ringPop(m_lanes[lane]);
+      m_stats.depth[lane] = (uint32_t) m_lanes[lane].count;
+      publish(c, e, now);
+      if (e->qos > 0) {
+        m_inflight[m_inflightCount++] = e;
+        m_stats.inflight = (uint32_t) m_inflightCount;
+      } else {
+        release(e);
+      }
+    }
+  }
+}
+
+void OutQueue::onPuback(uint16_t id, unsigned long now) {
+  for (size_t i = 0; i < m_inflightCount; i++) {
+    Entry* e = m_inflight[i];
+    if (e->packetId != id) continue;
+    ewma(m_stats.ackLatencyAvgMs, m_stats.ackLatencyMaxMs,
+         (uint32_t) (now - e->sentAt));
+    m_stats.acked++;
+    release(e);
+    memmove(&m_inflight[i], &m_inflight[i + 1],
+            (m_inflightCount - i - 1) * sizeof(m_inflight[0]));
+    m_inflightCount--;
+    break;
+  }
+  m_stats.inflight = (uint32_t) m_inflightCount;
+}
+
+void OutQueue::checkRetransmit(struct mg_connection *c, unsigned long now) {
+  if (c == nullptr || c->is_closing) return;
+  for (size_t i = 0; i < m_inflightCount; i++) {
+    Entry* e = m_inflight[i];
+    if (now - e->sentAt < GW_OUTQ_RETRY_MS) continue;
+    if (c->send.len > GW_OUTQ_SEND_HIGHWATER) break;
+    bool keep = m_keepIds;
+    m_keepIds = true;              // same connection: DUP with the same id
+    publish(c, e, now);
+    m_keepIds = keep;
+  }
+}
+
+// The previous connection is gone.  Move everything that was never
+// acknowledged back to the head of its lane, oldest first, so it is the
+// first thing sent on the next connection.
+void OutQueue::onDisconnect() {
+  for (size_t i = m_inflightCount; i > 0; i--) {
+    Entry* e = m_inflight[i - 1];
+    if (!ringPushFront(m_lanes[e->lane], e)) {
+      release(e);                  // lane refilled meanwhile; drop newest
+      m_stats.dropped++;
+    }
+  }
+  m_inflightCount = 0;
+  for (size_t lane = 0; lane < LANE_COUNT; lane++) {
+    m_stats.depth[lane] = (uint32_t) m_lanes[lane].count;
+  }
+  m_stats.inflight = 0;
+}
+
+// With a resumed session the broker still knows our packet ids, so requeued
+// messages are resent as DUPs; otherwise they go out as fresh publishes.
+void OutQueue::onConnect(bool sessionPresent) {
+  m_keepIds = sessionPresent;
+}
+
+// ---------------------------------------------------------------------------
+void OutQueue::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data,
+             "{%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,"
+             "%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu}",
+             MG_ESC("control"), (unsigned long) m_stats.depth[LANE_CONTROL],
+             MG_ESC("bulk"), (unsigned long) m_stats.depth[LANE_BULK],
+             MG_ESC("control_max"), (unsigned long) m_stats.maxDepth[LANE_CONTROL],
+             MG_ESC("bulk_max"), (unsigned long) m_stats.maxDepth[LANE_BULK],
+             MG_ESC("inflight"), (unsigned long) m_stats.inflight,
+             MG_ESC("bytes"), (unsigned long) m_stats.bytesQueued,
+             MG_ESC("enqueued"), (unsigned long) m_stats.enqueued,
+             MG_ESC("published"), (unsigned long) m_stats.published,
+             MG_ESC("acked"), (unsigned long) m_stats.acked,
+             MG_ESC("retransmits"), (unsigned long) m_stats.retransmits,
+             MG_ESC("dropped"), (unsigned long) m_stats.dropped,
+             MG_ESC("allocs"), (unsigned long) m_stats.allocs,
+             MG_ESC("queue_ms_avg"), (unsigned long) m_stats.queueLatencyAvgMs,
+             MG_ESC("queue_ms_max"), (unsigned long) m_stats.queueLatencyMaxMs,
+             MG_ESC("ack_ms_avg"), (unsigned long) m_stats.ackLatencyAvgMs,
+             MG_ESC("ack_ms_max"), (unsigned long) m_stats.ackLatencyMaxMs);
+}
@@ -0,0 +1,93 @@
+#ifndef __GATEWAY_OUTQ__H_
+#define __GATEWAY_OUTQ__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+#include "../gateway_config.h"
+
+// Outbound MQTT publish queue.
+//
+// Messages wait in one of two priority lanes; control traffic (RPC replies,
+// errors) always drains before bulk data.  At most GW_OUTQ_INFLIGHT QoS1
+// publishes are awaiting PUBACK at a time, and nothing is written while the
+// connection's send buffer is above GW_OUTQ_SEND_HIGHWATER.  Unacknowledged
+// publishes are retransmitted after GW_OUTQ_RETRY_MS and re-sent after a
+// reconnect.  When the lanes are full push() refuses the message so callers
+// see backpressure instead of unbounded buffering.  Up to GW_OUTQ_SPARE sent
+// entries are kept and reused by later pushes, so steady traffic of similar
+// sized messages stops allocating.
+class OutQueue {
+public:
+  enum Lane { LANE_CONTROL, LANE_BULK, LANE_COUNT };
+
+  struct Stats {
+    uint32_t depth[LANE_COUNT];
+    uint32_t maxDepth[LANE_COUNT];
+    uint32_t inflight;
+    uint32_t bytesQueued;          // payload + topic bytes held, incl. inflight
+    uint32_t enqueued;
+    uint32_t published;
+    uint32_t acked;
+    uint32_t retransmits;
+    uint32_t dropped;
+    uint32_t allocs;               // entries taken from the heap
+    uint32_t queueLatencyAvgMs;    // enqueue -> first publish (EWMA)
+    uint32_t queueLatencyMaxMs;
+    uint32_t ackLatencyAvgMs;      // publish -> PUBACK (EWMA)
+    uint32_t ackLatencyMaxMs;
+  };
+
+  OutQueue();
+  ~OutQueue();
+
+  bool push(Lane lane, struct mg_str topic, struct mg_str payload,
+            uint8_t qos, unsigned long now, bool retain = false);
+  void pump(struct mg_connection *c, unsigned long now);
+  void onPuback(uint16_t id, unsigned long now);
+  void onConnect(bool sessionPresent);
+  void onDisconnect();
+  void checkRetransmit(struct mg_connection *c, unsigned long now);
+
+  const Stats& stats() const { return m_stats; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;
+
+private:
+  struct Entry {
+    size_t   cap;                  // bytes after the Entry
+    char*    topic;                // topic and payload share one allocation
+    size_t   topicLen;
+    char*    payload;
+    size_t   len;
+    uint8_t  qos;
+    uint8_t  lane;
+    bool     retain;
+    uint16_t packetId;             // 0 until first publish
+    unsigned long enqueuedAt;
+    unsigned long sentAt;
+  };
+
+  struct Ring {
+    Entry* items[GW_OUTQ_MAX_MSGS];
+    size_t head;
+    size_t count;
+  };
+
+  bool ringPushBack(Ring& r, Entry* e);
+  bool ringPushFront(Ring& r, Entry* e);
+  Entry* ringPop(Ring& r);
+  Entry* acquire(size_t bytes);
+  void publish(struct mg_connection *c, Entry* e, unsigned long now);
+  void release(Entry* e);
+  static void ewma(uint32_t& avg, uint32_t& max, uint32_t sample);
+
+  Ring   m_lanes[LANE_COUNT];
+  Entry* m_inflight[GW_OUTQ_INFLIGHT];
+  size_t m_inflightCount;
+  Entry* m_spare[GW_OUTQ_SPARE];
+  size_t m_spareCount;
+  bool   m_keepIds;                // broker kept our session: resend with DUP
+  Stats  m_stats;
+};
+
+#endif
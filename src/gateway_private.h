@@ -14,34 +14,66 @@ enum DeviceStatus {
   DEV_OFFLINE
 };
 
+// Per-device permission bits.  Every RPC method carries the bits a device
+// must hold to call it; see RpcTable and GatewayCore::dispatchRpc().
+enum : uint32_t {
+  PERM_NONE = 0,
+  PERM_PING = 1UL << 0,
+};
+
+typedef uint32_t DevicePerms;
+
+// The half of a device record that no device frame touches.  DeviceTable
+// keeps these in PSRAM when the board has it.
+struct DeviceInfo {
+  char name[GW_DEVICE_NAME_MAX + 1];
+  char type[GW_DEVICE_TYPE_MAX + 1];
+  unsigned long firstSeen;
+  uint32_t regVer;                   // registry record version, see Cluster
+  int16_t pending;                   // stored connect request, see DeviceTable; -1 = none
+  uint8_t pskKey[32];                // SHA-256 of the PSK, authenticates full handshakes
+  bool pskSet;
+  uint32_t ticketGen;                // generation of the last ticket issued, see SessionKeys
+  uint32_t helloTs;                  // timestamp of the last full handshake, replay check
+  uint32_t txReserved;               // gateway counters up to here are on flash, see reserveTxNonce
+
+  DeviceInfo() : firstSeen(0), regVer(0), pending(-1), pskSet(false), ticketGen(0),
+                 helloTs(0), txReserved(0) {
+    name[0] = type[0] = '\0';
+    memset(pskKey, 0, sizeof(pskKey));
+  }
+};
+
+// Fixed-size, so a record is one slab slot and never a heap allocation.
+// Everything read or written per frame is here, in internal RAM.
 struct Device {
-  String id;
-  String name;
-  String type;
+  char id[GW_DEVICE_ID_MAX + 1];
   DeviceStatus status;
-  uint32_t lastNonce;                // last used counter (for encrypted messages after approval)
-  unsigned long firstSeen;
+  uint32_t lastNonce;                // last counter received from the device (replay check)
+  uint32_t txNonce;                  // last counter the gateway sent to the device
   unsigned long lastSeen;
+  unsigned long lastRxMs;            // millis() of last authenticated frame this boot, 0 = none
+  bool dlqDraining;                  // stored downlink still being flushed
+  bool binaryRx;                     // last frame came on rx/<id>: reply in binary
+  bool owned;                        // served by this gateway (always true outside a cluster)
+  bool regDirty;                     // counters moved since the last registry record
   int messageCount;
 
-  uint8_t enc_key[32];                // 32‑byte encryption key (derived from PSK, set only after approval)
+  uint8_t enc_key[32];                // session key, or the PSK key of a device without X25519
   bool keySet;
 
-  bool permPing;
+  DevicePerms perms;                  // PERM_* bitmask checked on every RPC
 
-  // Pending encrypted request data
-  String pending_nonce;
-  String pending_cipher;
-  bool has_pending;
+  DeviceInfo* info;                   // cold half; its own slot for a stored device
 
-  Device() : status(DEV_PENDING), lastNonce(0), firstSeen(0), lastSeen(0),
-             messageCount(0), permPing(false), keySet(false), has_pending(false) {
+  Device() : status(DEV_PENDING), lastNonce(0), txNonce(0), lastSeen(0),
+             lastRxMs(0), dlqDraining(false), binaryRx(false), owned(true), regDirty(false),
+             messageCount(0), keySet(false), perms(PERM_NONE), info(nullptr) {
+    id[0] = '\0';
     memset(enc_key, 0, sizeof(enc_key));
   }
-};
 
-struct DevicePerms {
-  bool ping;
+  bool hasPending() const { return info != nullptr && info->pending >= 0; }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "gateway_rpc.h"
+#include <string.h>
+#include <limits.h>
+
+RpcTable::RpcTable() : m_count(0), m_mask(0), m_seed(0) {
+  memset(m_methods, 0, sizeof(m_methods));
+  memset(m_slots, 0, sizeof(m_slots));
+}
+
+// ---------------------------------------------------------------------------
+// Response printing and typed parameter binding
+// ---------------------------------------------------------------------------
+void rpc_out_pfn(char ch, void* param) {
+  RpcOut* out = (RpcOut*) param;
+  if (out->len < out->size) {
+    out->buf[out->len++] = ch;
+  } else {
+    out->overflow = true;
+  }
+}
+
+bool rpc_bind(struct mg_str tok, bool& out) {
+  return mg_json_get_bool(tok, "$", &out);
+}
+
+bool rpc_bind(struct mg_str tok, double& out) {
+  return mg_json_get_num(tok, "$", &out);
+}
+
+bool rpc_bind(struct mg_str tok, long& out) {
+  double d;
+  if (!mg_json_get_num(tok, "$", &d)) return false;
+  if (d < (double) LONG_MIN || d > (double) LONG_MAX) return false;
+  if (d != (double) (long) d) return false;     // fractional
+  out = (long) d;
+  return true;
+}
+
+bool rpc_bind(struct mg_str tok, int& out) {
+  long v;
+  if (!rpc_bind(tok, v) || v < INT32_MIN || v > INT32_MAX) return false;
+  out = (int) v;
+  return true;
+}
+
+bool rpc_bind(struct mg_str tok, uint32_t& out) {
+  double d;
+  if (!mg_json_get_num(tok, "$", &d)) return false;
+  if (d < 0 || d > 4294967295.0 || d != (double) (uint32_t) d) return false;
+  out = (uint32_t) d;
+  return true;
+}
+
+bool rpc_bind(struct mg_str tok, struct mg_str& out) {
+  if (tok.len < 2 || tok.buf[0] != '"') return false;
+  out = mg_str_n(tok.buf + 1, tok.len - 2);
+  return true;
+}
+
+namespace rpc_detail {
+
+int paramIndex(const char* const* names, size_t count, struct mg_str key) {
+  if (names == nullptr || key.len < 2) return -1;
+  struct mg_str k = mg_str_n(key.buf + 1, key.len - 2);   // strip quotes
+  for (size_t i = 0; i < count; i++) {
+    if (mg_strcmp(k, mg_str(names[i])) == 0) return (int) i;
+  }
+  return -1;
+}
+
+void invalidParams(struct mg_rpc_req* r) {
+  mg_rpc_err(r, -32602, "\"Invalid params\"");
+}
+
+}  // namespace rpc_detail
+
+// ---------------------------------------------------------------------------
+uint32_t RpcTable::hash(struct mg_str s, uint32_t seed) {
+  uint32_t h = 2166136261UL ^ seed;
+  for (size_t i = 0; i < s.len; i++) {
+    h ^= (uint8_t) s.buf[i];
+    h *= 16777619UL;
+  }
+  return h ^ (h >> 15);
+}
+
+// ---------------------------------------------------------------------------
+bool RpcTable::add(const char* name, void (*fn)(struct mg_rpc_req*),
+                   void* fn_data, uint32_t perm) {
+  if (name == nullptr || fn == nullptr) return false;
+  if (m_count >= GW_RPC_MAX_METHODS) return false;
+  RpcMethod &m = m_methods[m_count++];
+  m.rpc.next    = nullptr;
+  m.rpc.method  = mg_str(name);
+  m.rpc.fn      = fn;
+  m.rpc.fn_data = fn_data;
+  m.perm        = perm;
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+// Find the smallest table (at least 4x the method count) and a seed for which
+// every method lands in its own slot.  Runs once at startup, so a few hundred
+// attempts are cheap compared to the per-call savings.
+// ---------------------------------------------------------------------------
+bool RpcTable::build() {
+  size_t size = 4;
+  while (size < m_count * 4) size <<= 1;
+
+  for (; size <= GW_RPC_MAX_SLOTS; size <<= 1) {
+    for (uint32_t seed = 0; seed < 1024; seed++) {
+      memset(m_slots, 0, sizeof(m_slots));
+      bool ok = true;
+      for (size_t i = 0; i < m_count && ok; i++) {
+        uint32_t h = hash(m_methods[i].rpc.method, seed);
+        uint32_t slot = h & (uint32_t) (size - 1);
+        if (m_slots[slot] != 0) {
+          ok = false;
+        } else {
+          m_slots[slot] = (uint8_t) (i + 1);
+          m_methods[i].hash = h;
+        }
+      }
+      if (ok) {
+        m_mask = (uint32_t) (size - 1);
+        m_seed = seed;
+        return true;
+      }
+    }
+  }
+  memset(m_slots, 0, sizeof(m_slots));
+  m_mask = 0;
+  return false;
+}
+
+// ---------------------------------------------------------------------------
+const RpcMethod* RpcTable::find(struct mg_str name) const {
+  if (m_count == 0 || name.buf == nullptr) return nullptr;
+  uint32_t h = hash(name, m_seed);
+  uint8_t idx = m_slots[h & m_mask];
+  if (idx == 0) return nullptr;
+  const RpcMethod &m = m_methods[idx - 1];
+  if (m.hash != h || mg_strcmp(m.rpc.method, name) != 0) return nullptr;
+  return &m;
+}
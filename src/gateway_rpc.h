@@ -0,0 +1,210 @@
+#ifndef __GATEWAY_RPC__H_
+#define __GATEWAY_RPC__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <array>
+#include <tuple>
+#include <type_traits>
+#include "mongoose.h"
+#include "../gateway_config.h"
+
+// One registered JSON-RPC method.  The embedded mg_rpc keeps the handler
+// signature identical to mg_rpc_add(), so handlers still use mg_rpc_ok()/
+// mg_rpc_err() and find their user pointer in r->rpc->fn_data.
+struct RpcMethod {
+  struct mg_rpc rpc;
+  uint32_t perm;        // PERM_* bits the calling device must hold (0 = open)
+  uint32_t hash;
+  void (*typed)();             // typed handler behind the rpc.fn trampoline
+  const char* const* names;    // parameter names for by-name binding, or null
+};
+
+// Fixed response buffer used as the mg_rpc_req printing target, so results
+// are serialised without allocating.  Output past the end sets overflow.
+struct RpcOut {
+  char*  buf;
+  size_t size;
+  size_t len;
+  bool   overflow;
+};
+
+void rpc_out_pfn(char ch, void* param);
+
+// Optional parameter: present is false when the caller left it out.
+template <typename T>
+struct RpcOpt {
+  T    value;
+  bool present;
+  RpcOpt() : value(), present(false) {}
+};
+
+// ---------------------------------------------------------------------------
+// Parameter binding.  Each rpc_bind() overload converts one JSON token into a
+// handler argument.  Strings bind as mg_str views into the request frame with
+// the quotes stripped (escapes are left as-is), so nothing is copied.
+// ---------------------------------------------------------------------------
+bool rpc_bind(struct mg_str tok, bool& out);
+bool rpc_bind(struct mg_str tok, int& out);
+bool rpc_bind(struct mg_str tok, long& out);
+bool rpc_bind(struct mg_str tok, uint32_t& out);
+bool rpc_bind(struct mg_str tok, double& out);
+bool rpc_bind(struct mg_str tok, struct mg_str& out);
+
+template <typename T, size_t N>
+bool rpc_bind(struct mg_str tok, std::array<T, N>& out) {
+  struct mg_str key, val;
+  size_t ofs = 0, i = 0;
+  if (tok.len < 2 || tok.buf[0] != '[') return false;
+  while ((ofs = mg_json_next(tok, ofs, &key, &val)) > 0) {
+    if (i >= N || !rpc_bind(val, out[i])) return false;
+    i++;
+  }
+  return i == N;
+}
+
+template <typename T>
+bool rpc_bind(struct mg_str tok, RpcOpt<T>& out) {
+  out.present = rpc_bind(tok, out.value);
+  return out.present;
+}
+
+namespace rpc_detail {
+
+template <size_t... I> struct Seq {};
+template <size_t N, size_t... I> struct MakeSeq : MakeSeq<N - 1, N - 1, I...> {};
+template <size_t... I> struct MakeSeq<0, I...> { typedef Seq<I...> type; };
+
+template <typename T> struct IsOpt { static const bool value = false; };
+template <typename T> struct IsOpt<RpcOpt<T> > { static const bool value = true; };
+
+// Bind token to tuple element `idx`.  The recursion unrolls at compile time
+// into a switch over the argument positions.
+template <size_t I, typename Tuple>
+typename std::enable_if<I == std::tuple_size<Tuple>::value, bool>::type
+bindAt(Tuple&, size_t, struct mg_str) { return false; }
+
+template <size_t I, typename Tuple>
+typename std::enable_if<I < std::tuple_size<Tuple>::value, bool>::type
+bindAt(Tuple& t, size_t idx, struct mg_str tok) {
+  if (idx == I) return rpc_bind(tok, std::get<I>(t));
+  return bindAt<I + 1>(t, idx, tok);
+}
+
+// Bitmask of the argument positions that must be supplied.
+template <typename... Args> struct Required;
+template <> struct Required<> { static const uint32_t mask = 0; };
+template <typename A, typename... Rest> struct Required<A, Rest...> {
+  static const uint32_t mask =
+      (IsOpt<typename std::decay<A>::type>::value ? 0U : 1U) |
+      (Required<Rest...>::mask << 1);
+};
+
+int  paramIndex(const char* const* names, size_t count, struct mg_str key);
+void invalidParams(struct mg_rpc_req* r);
+
+template <typename... Args> struct Invoker {
+  typedef void (*Fn)(struct mg_rpc_req*, Args...);
+  typedef std::tuple<typename std::decay<Args>::type...> Values;
+  static const size_t kCount = sizeof...(Args);
+
+  template <size_t... I>
+  static void call(Fn fn, struct mg_rpc_req* r, Values& v, Seq<I...>) {
+    fn(r, std::get<I>(v)...);
+  }
+
+  // Walks "params" once: array elements bind by position, object members
+  // bind by the names given at registration.
+  static void thunk(struct mg_rpc_req* r) {
+    const RpcMethod* m = reinterpret_cast<const RpcMethod*>(r->rpc);
+    Values values;
+    uint32_t seen = 0;
+    struct mg_str params = mg_json_get_tok(r->frame, "$.params");
+    if (params.len > 0) {
+      struct mg_str key, val;
+      size_t ofs = 0, pos = 0;
+      bool byName = params.buf[0] == '{';
+      if (!byName && params.buf[0] != '[') return invalidParams(r);
+      while ((ofs = mg_json_next(params, ofs, &key, &val)) > 0) {
+        int idx = byName ? paramIndex(m->names, kCount, key) : (int) pos++;
+        if (idx < 0) continue;                   // unknown member, ignore
+        if (idx >= (int) kCount) return invalidParams(r);
+        if (!bindAt<0>(values, (size_t) idx, val) &&
+            !(IsOptAt(idx) && val.len == 4 && memcmp(val.buf, "null", 4) == 0)) {
+          return invalidParams(r);
+        }
+        seen |= 1U << idx;
+      }
+    }
+    if ((seen & Required<Args...>::mask) != Required<Args...>::mask) {
+      return invalidParams(r);
+    }
+    call(reinterpret_cast<Fn>(m->typed), r, values,
+         typename MakeSeq<kCount>::type());
+  }
+
+  static bool IsOptAt(int idx) {
+    return ((Required<Args...>::mask >> idx) & 1U) == 0;
+  }
+};
+
+}  // namespace rpc_detail
+
+// Method registry built once at startup.  Names are placed into a
+// power-of-two slot table using a seeded FNV-1a hash; build() searches for a
+// seed with no collisions, so a lookup is one hash, one probe and one string
+// compare regardless of how many methods are registered.
+class RpcTable {
+public:
+  RpcTable();
+
+  bool add(const char* name, void (*fn)(struct mg_rpc_req*), void* fn_data,
+           uint32_t perm);
+
+  // Typed handler, e.g. void fn(struct mg_rpc_req*, int, mg_str).  Params
+  // are bound by position from a JSON array.
+  template <typename... Args>
+  bool add(const char* name, void (*fn)(struct mg_rpc_req*, Args...),
+           void* fn_data, uint32_t perm) {
+    return addTyped(name, fn, fn_data, perm, nullptr);
+  }
+
+  // Typed handler that also accepts a params object, bound by member name.
+  template <typename... Args, size_t N>
+  bool add(const char* name, void (*fn)(struct mg_rpc_req*, Args...),
+           void* fn_data, uint32_t perm, const char* const (&names)[N]) {
+    static_assert(N == sizeof...(Args), "one name per handler parameter");
+    return addTyped(name, fn, fn_data, perm, names);
+  }
+  bool build();
+  const RpcMethod* find(struct mg_str name) const;
+
+  size_t size() const { return m_count; }
+  size_t tableSize() const { return m_mask + 1; }
+
+private:
+  static uint32_t hash(struct mg_str s, uint32_t seed);
+
+  template <typename... Args>
+  bool addTyped(const char* name, void (*fn)(struct mg_rpc_req*, Args...),
+                void* fn_data, uint32_t perm, const char* const* names) {
+    static_assert(sizeof...(Args) <= 32, "too many handler parameters");
+    if (fn == nullptr) return false;
+    if (!add(name, &rpc_detail::Invoker<Args...>::thunk, fn_data, perm)) {
+      return false;
+    }
+    RpcMethod &m = m_methods[m_count - 1];
+    m.typed = reinterpret_cast<void (*)()>(fn);
+    m.names = names;
+    return true;
+  }
+
+  RpcMethod m_methods[GW_RPC_MAX_METHODS];
+  uint8_t   m_slots[GW_RPC_MAX_SLOTS];   // method index + 1, 0 = empty
+  size_t    m_count;
+  uint32_t  m_mask;
+  uint32_t  m_seed;
+};
+
+#endif
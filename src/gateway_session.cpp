@@ -0,0 +1,103 @@
+#include "gateway_session.h"
+#include "chacha20.h"
+#include <string.h>
+
+SessionKeys::SessionKeys() {
+  memset(m_ticketKey, 0, sizeof(m_ticketKey));
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+SessionKeys::~SessionKeys() {
+  memset(m_ticketKey, 0, sizeof(m_ticketKey));
+}
+
+void SessionKeys::begin(const uint8_t ticketKey[32]) {
+  memcpy(m_ticketKey, ticketKey, sizeof(m_ticketKey));
+}
+
+// Wipes prk
+void SessionKeys::expand(uint8_t prk[32], Keys& out) {
+  mg_hmac_sha256(out.session, prk, 32, (uint8_t*)"session", 7);
+  mg_hmac_sha256(out.secret, prk, 32, (uint8_t*)"resume", 6);
+  memset(prk, 0, 32);
+}
+
+bool SessionKeys::full(const uint8_t pskKey[32], const uint8_t devPub[PUB_SIZE],
+                       uint8_t gwPub[PUB_SIZE], Keys& out) {
+  uint8_t prv[X25519_BYTES], msg[10 + 3 * X25519_BYTES], prk[32];
+  mg_random(prv, sizeof(prv));
+  x25519(gwPub, prv, X25519_BASE_POINT, 1);
+  memcpy(msg, "gw-session", 10);
+  bool ok = x25519(msg + 10, prv, devPub, 1) == 0;
+  memset(prv, 0, sizeof(prv));
+  if (ok) {
+    memcpy(msg + 10 + X25519_BYTES, devPub, X25519_BYTES);
+    memcpy(msg + 10 + 2 * X25519_BYTES, gwPub, X25519_BYTES);
+    mg_hmac_sha256(prk, (uint8_t*)pskKey, 32, msg, sizeof(msg));
+    expand(prk, out);
+    m_stats.full++;
+  }
+  memset(msg, 0, sizeof(msg));
+  return ok;
+}
+
+void SessionKeys::resume(const uint8_t secret[32], const uint8_t reqNonce[12],
+                         uint8_t gwRandom[RANDOM_SIZE], Keys& out) {
+  uint8_t msg[9 + 12 + RANDOM_SIZE], prk[32];
+  mg_random(gwRandom, RANDOM_SIZE);
+  memcpy(msg, "gw-resume", 9);
+  memcpy(msg + 9, reqNonce, 12);
+  memcpy(msg + 9 + 12, gwRandom, RANDOM_SIZE);
+  mg_hmac_sha256(prk, (uint8_t*)secret, 32, msg, sizeof(msg));
+  expand(prk, out);
+  m_stats.resumed++;
+}
+
+void SessionKeys::requestKey(const uint8_t secret[32], uint8_t key[32]) {
+  mg_hmac_sha256(key, (uint8_t*)secret, 32, (uint8_t*)"resume-request", 14);
+}
+
+// ---------------------------------------------------------------------------
+// Tickets
+// ---------------------------------------------------------------------------
+static void putU32(uint8_t* p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24), p[1] = (uint8_t)(v >> 16), p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+static uint32_t getU32(const uint8_t* p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void SessionKeys::seal(const char* id, const Ticket& t, uint8_t out[TICKET_SIZE]) const {
+  uint8_t plain[4 + 4 + 32];
+  putU32(plain, t.gen);
+  putU32(plain + 4, t.issued);
+  memcpy(plain + 8, t.secret, 32);
+  mg_random(out, RFC_8439_NONCE_SIZE);
+  chacha20_poly1305_encrypt(out + RFC_8439_NONCE_SIZE, m_ticketKey, out, (uint8_t*)id,
+                            strlen(id), plain, sizeof(plain));
+  memset(plain, 0, sizeof(plain));
+}
+
+bool SessionKeys::open(const char* id, const uint8_t* ticket, size_t len, Ticket& t) const {
+  uint8_t plain[4 + 4 + 32];
+  if (len != TICKET_SIZE ||
+      chacha20_poly1305_open(plain, m_ticketKey, ticket, (uint8_t*)id, strlen(id),
+                             ticket + RFC_8439_NONCE_SIZE,
+                             len - RFC_8439_NONCE_SIZE) != sizeof(plain)) {
+    return false;
+  }
+  t.gen = getU32(plain);
+  t.issued = getU32(plain + 4);
+  memcpy(t.secret, plain + 8, 32);
+  memset(plain, 0, sizeof(plain));
+  return true;
+}
+
+void SessionKeys::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data, "{%m:%lu,%m:%lu,%m:%lu}",
+             MG_ESC("full"), (unsigned long)m_stats.full,
+             MG_ESC("resumed"), (unsigned long)m_stats.resumed,
+             MG_ESC("rejected"), (unsigned long)m_stats.rejected);
+}
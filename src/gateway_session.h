@@ -0,0 +1,83 @@
+#ifndef __GATEWAY_SESSION__H_
+#define __GATEWAY_SESSION__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mongoose.h"
+#include "../gateway_config.h"
+#include "x25519.h"
+
+// Session keys for devices, and the tickets that let a device get a new
+// one without a scalar multiplication.
+//
+// Full handshake: the device sends an ephemeral X25519 public key inside
+// its PSK-encrypted connect request, the gateway answers with one of its
+// own, and both derive
+//   prk     = HMAC-SHA256(psk key, "gw-session" || shared || device pub || gateway pub)
+//   session = HMAC-SHA256(prk, "session")     the device key until the next handshake
+//   secret  = HMAC-SHA256(prk, "resume")      resumption secret, kept only in the ticket
+// The PSK key authenticates the exchange and the ephemeral keys make every
+// session key new.
+//
+// A ticket is the secret sealed under the gateway's ticket key, with the
+// device id as associated data: nonce(12) || ChaCha20-Poly1305(gen, issued,
+// secret).  The gateway keeps no copy, only the generation it issued last
+// for each device, so a ticket is good for one resumption.  To resume, the
+// device sends the ticket and a request encrypted under
+//   HMAC-SHA256(secret, "resume-request")
+// with a random nonce, and the gateway answers with RANDOM_SIZE random bytes:
+//   prk     = HMAC-SHA256(secret, "gw-resume" || request nonce || gateway random)
+//   session, secret as above
+class SessionKeys {
+public:
+  enum {
+    PUB_SIZE = X25519_BYTES,
+    RANDOM_SIZE = 16,
+    TICKET_SIZE = 12 + 4 + 4 + 32 + 16,
+  };
+
+  struct Keys {
+    uint8_t session[32];
+    uint8_t secret[32];
+  };
+
+  struct Ticket {
+    uint32_t gen;                           // matches DeviceInfo::ticketGen when current
+    uint32_t issued;                        // unix seconds
+    uint8_t secret[32];
+  };
+
+  struct Stats {
+    uint32_t full;                          // X25519 handshakes
+    uint32_t resumed;                       // sessions resumed from a ticket
+    uint32_t rejected;                      // tickets and resume requests refused
+  };
+
+  SessionKeys();
+  ~SessionKeys();
+
+  void begin(const uint8_t ticketKey[32]);
+
+  // False when devPub is of small order and the shared secret is zero
+  bool full(const uint8_t pskKey[32], const uint8_t devPub[PUB_SIZE],
+            uint8_t gwPub[PUB_SIZE], Keys& out);
+  // Fills gwRandom, which goes back to the device
+  void resume(const uint8_t secret[32], const uint8_t reqNonce[12],
+              uint8_t gwRandom[RANDOM_SIZE], Keys& out);
+  static void requestKey(const uint8_t secret[32], uint8_t key[32]);
+
+  void seal(const char* id, const Ticket& t, uint8_t out[TICKET_SIZE]) const;
+  bool open(const char* id, const uint8_t* ticket, size_t len, Ticket& t) const;
+
+  Stats& stats() { return m_stats; }
+  const Stats& stats() const { return m_stats; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;   // JSON object
+
+private:
+  static void expand(uint8_t prk[32], Keys& out);
+
+  uint8_t m_ticketKey[32];
+  Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,248 @@
+#include "gateway_store.h"
+
+DownlinkStore::DownlinkStore() {
+  memset(&m_stats, 0, sizeof(m_stats));
+}
+
+DownlinkStore::~DownlinkStore() {
+  for (auto& pair : m_queues) {
+    Queue &q = pair.second;
+    for (size_t i = 0; i < q.count; i++) {
+      free(q.ram[(q.head + i) % GW_DLQ_RAM_MSGS].data);
+    }
+  }
+}
+
+// Segment files only extend RAM; anything left from a previous boot has
+// lost its TTL reference and is discarded.
+void DownlinkStore::begin() {
+  File root = LittleFS.open(GW_DLQ_DIR);
+  if (!root || !root.isDirectory()) {
+    LittleFS.mkdir(GW_DLQ_DIR);
+    return;
+  }
+  File file;
+  int removed = 0;
+  while ((file = root.openNextFile())) {
+    String path = String(GW_DLQ_DIR) + "/" + file.name();
+    file.close();
+    if (LittleFS.remove(path)) removed++;
+  }
+  root.close();
+  if (removed > 0) Serial.printf("Discarded %d stale downlink segments\n", removed);
+}
+
+// ---------------------------------------------------------------------------
+String DownlinkStore::segmentPath(const String& id) {
+  String safe = id;
+  const char* bad = "/\\:*?\"<>|";
+  for (const char* p = bad; *p; p++) {
+    char from[2] = {*p, 0};
+    safe.replace(from, "_");
+  }
+  return String(GW_DLQ_DIR) + "/q_" + safe;
+}
+
+bool DownlinkStore::spill(const String& id, Queue& q, const uint8_t* data,
+                          size_t len, unsigned long expires) {
+  File f = LittleFS.open(segmentPath(id), "a");
+  if (!f) return false;
+  FileRecord rec = { (uint32_t)expires, (uint32_t)len };
+  bool ok = f.write((const uint8_t*)&rec, sizeof(rec)) == sizeof(rec) &&
+            f.write(data, len) == len;
+  f.close();
+  if (!ok) return false;
+  q.fileMsgs++;
+  q.fileBytes += len;
+  m_stats.fileBytes += len;
+  m_stats.spilled++;
+  return true;
+}
+
+void DownlinkStore::freeQueue(const String& id, Queue& q) {
+  for (size_t i = 0; i < q.count; i++) {
+    free(q.ram[(q.head + i) % GW_DLQ_RAM_MSGS].data);
+  }
+  m_stats.ramBytes -= q.ramBytes;
+  m_stats.fileBytes -= q.fileBytes;
+  if (q.fileMsgs > 0 || q.fileReadOfs > 0) LittleFS.remove(segmentPath(id));
+}
+
+// ---------------------------------------------------------------------------
+bool DownlinkStore::put(const String& id, const uint8_t* data, size_t len,
+                        unsigned long ttlMs, unsigned long now) {
+  if (data == nullptr || len == 0 || len > GW_DLQ_MSG_MAX) {
+    m_stats.rejected++;
+    return false;
+  }
+  Queue &q = m_queues[id];
+  if (q.ramBytes + q.fileBytes + len > GW_DLQ_MAX_BYTES) {
+    m_stats.rejected++;
+    return false;
+  }
+  unsigned long expires = now + (ttlMs ? ttlMs : GW_DLQ_TTL_MS);
+
+  // Once anything is on flash, new messages follow it there to keep order
+  if (q.count < GW_DLQ_RAM_MSGS && q.fileMsgs == 0) {
+    uint8_t* copy = (uint8_t*)malloc(len);
+    if (copy != nullptr) {
+      memcpy(copy, data, len);
+      Msg &m = q.ram[(q.head + q.count) % GW_DLQ_RAM_MSGS];
+      m.expires = expires;
+      m.len = len;
+      m.data = copy;
+      q.count++;
+      q.ramBytes += len;
+      m_stats.ramBytes += len;
+      m_stats.stored++;
+      return true;
+    }
+  }
+  if (!spill(id, q, data, len, expires)) {
+    m_stats.rejected++;
+    return false;
+  }
+  m_stats.stored++;
+  return true;
+}
+
+int DownlinkStore::peek(const String& id, uint8_t* buf, size_t cap,
+                        unsigned long now) {
+  auto it = m_queues.find(id);
+  if (it == m_queues.end()) return 0;
+  Queue &q = it->second;
+
+  while (q.count > 0) {
+    Msg &m = q.ram[q.head];
+    if ((long)(now - m.expires) < 0) {
+      if (m.len > cap) return -1;
+      memcpy(buf, m.data, m.len);
+      return (int)m.len;
+    }
+    m_stats.expired++;
+    discard(id);
+  }
+
+  while (q.fileMsgs > 0) {
+    File f = LittleFS.open(segmentPath(id), "r");
+    FileRecord rec;
+    if (!f || !f.seek(q.fileReadOfs) ||
+        f.read((uint8_t*)&rec, sizeof(rec)) != sizeof(rec)) {
+      if (f) f.close();
+      return -1;
+    }
+    if ((long)(now - (unsigned long)rec.expires) >= 0) {
+      f.close();
+      m_stats.expired++;
+      discard(id);
+      continue;
+    }
+    if (rec.len > cap) {
+      f.close();
+      return -1;
+    }
+    int n = (int)f.read(buf, rec.len);
+    f.close();
+    return n == (int)rec.len ? n : -1;
+  }
+  return 0;
+}
+
+void DownlinkStore::pop(const String& id) {
+  discard(id);
+  m_stats.delivered++;
+}
+
+// Remove the oldest message.  RAM always holds the oldest ones.
+void DownlinkStore::discard(const String& id) {
+  auto it = m_queues.find(id);
+  if (it == m_queues.end()) return;
+  Queue &q = it->second;
+
+  if (q.count > 0) {
+    Msg &m = q.ram[q.head];
+    q.ramBytes -= m.len;
+    m_stats.ramBytes -= m.len;
+    free(m.data);
+    m.data = nullptr;
+    q.head = (q.head + 1) % GW_DLQ_RAM_MSGS;
+    q.count--;
+  } else if (q.fileMsgs > 0) {
+    File f = LittleFS.open(segmentPath(id), "r");
+    FileRecord rec = { 0, 0 };
+    if (f && f.seek(q.fileReadOfs)) f.read((uint8_t*)&rec, sizeof(rec));
+    if (f) f.close();
+    q.fileReadOfs += sizeof(rec) + rec.len;
+    q.fileMsgs--;
+    q.fileBytes -= rec.len;
+    m_stats.fileBytes -= rec.len;
+    if (q.fileMsgs == 0) {
+      LittleFS.remove(segmentPath(id));
+      q.fileReadOfs = 0;
+      q.fileBytes = 0;
+    }
+  }
+}
+
+bool DownlinkStore::fileHead(const String& id, const Queue& q, FileRecord& rec) const {
+  File f = LittleFS.open(segmentPath(id), "r");
+  if (!f) return false;
+  bool ok = f.seek(q.fileReadOfs) && f.read((uint8_t*)&rec, sizeof(rec)) == sizeof(rec);
+  f.close();
+  return ok;
+}
+
+// A device that never comes back would otherwise hold its expired messages
+// in RAM and on flash for good.  Only heads are checked: a message behind
+// a live one waits for it, as in peek().
+void DownlinkStore::expire(unsigned long now) {
+  for (auto it = m_queues.begin(); it != m_queues.end();) {
+    const String& id = it->first;
+    Queue &q = it->second;
+    while (q.count > 0 && (long)(now - q.ram[q.head].expires) >= 0) {
+      m_stats.expired++;
+      discard(id);
+    }
+    FileRecord rec;
+    while (q.count == 0 && q.fileMsgs > 0 && fileHead(id, q, rec) &&
+           (long)(now - (unsigned long)rec.expires) >= 0) {
+      m_stats.expired++;
+      discard(id);
+    }
+    if (q.count == 0 && q.fileMsgs == 0) {
+      it = m_queues.erase(it);               // discard() removed the file
+    } else {
+      ++it;
+    }
+  }
+}
+
+void DownlinkStore::clear(const String& id) {
+  auto it = m_queues.find(id);
+  if (it == m_queues.end()) return;
+  freeQueue(id, it->second);
+  m_queues.erase(it);
+}
+
+// ---------------------------------------------------------------------------
+size_t DownlinkStore::pendingMsgs(const String& id) const {
+  auto it = m_queues.find(id);
+  return it == m_queues.end() ? 0 : it->second.count + it->second.fileMsgs;
+}
+
+size_t DownlinkStore::pendingBytes(const String& id) const {
+  auto it = m_queues.find(id);
+  return it == m_queues.end() ? 0 : it->second.ramBytes + it->second.fileBytes;
+}
+
+void DownlinkStore::printStats(mg_pfn_t pfn, void *pfn_data) const {
+  mg_xprintf(pfn, pfn_data,
+             "{%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu,%m:%lu}",
+             MG_ESC("stored"), (unsigned long)m_stats.stored,
+             MG_ESC("spilled"), (unsigned long)m_stats.spilled,
+             MG_ESC("delivered"), (unsigned long)m_stats.delivered,
+             MG_ESC("expired"), (unsigned long)m_stats.expired,
+             MG_ESC("rejected"), (unsigned long)m_stats.rejected,
+             MG_ESC("ram_bytes"), (unsigned long)m_stats.ramBytes,
+             MG_ESC("file_bytes"), (unsigned long)m_stats.fileBytes);
+}
@@ -0,0 +1,91 @@
+#ifndef __GATEWAY_STORE__H_
+#define __GATEWAY_STORE__H_
+
+#include <Arduino.h>
+#include <map>
+#include <LittleFS.h>
+#include "mongoose.h"
+#include "../gateway_config.h"
+
+// Store-and-forward queue for downlink messages to devices that are not
+// currently reachable.
+//
+// Each device gets a small RAM ring (GW_DLQ_RAM_MSGS messages).  Once the
+// ring is full further messages are appended to a per-device segment file
+// under GW_DLQ_DIR, and keep going there until the file is drained so
+// delivery order is preserved.  Messages are kept as plaintext and encrypted
+// at delivery time, so they always carry the device's current counter.
+// Every message has a TTL, and each device is capped at GW_DLQ_MAX_BYTES;
+// beyond that new messages are rejected.  Expired messages go when the
+// device's queue is next read, or at the latest on the next expire() sweep.  The segment files are overflow
+// space, not durable storage, and are wiped at boot.
+class DownlinkStore {
+public:
+  struct Stats {
+    uint32_t stored;
+    uint32_t spilled;              // of which went to flash
+    uint32_t delivered;
+    uint32_t expired;
+    uint32_t rejected;
+    uint32_t ramBytes;
+    uint32_t fileBytes;
+  };
+
+  DownlinkStore();
+  ~DownlinkStore();
+
+  void begin();
+  bool put(const String& id, const uint8_t* data, size_t len,
+           unsigned long ttlMs, unsigned long now);
+  // Copies the oldest unexpired message into buf and returns its length;
+  // 0 when nothing is queued, -1 if buf is too small or flash failed.
+  // The message stays queued until pop() confirms delivery.
+  int  peek(const String& id, uint8_t* buf, size_t cap, unsigned long now);
+  void pop(const String& id);
+  void clear(const String& id);
+  // Drop expired messages at the head of every queue and forget queues
+  // left empty, with their segment files.
+  void expire(unsigned long now);
+
+  size_t pendingMsgs(const String& id) const;
+  size_t pendingBytes(const String& id) const;
+  const Stats& stats() const { return m_stats; }
+  void printStats(mg_pfn_t pfn, void *pfn_data) const;
+
+private:
+  struct Msg {
+    unsigned long expires;
+    size_t len;
+    uint8_t* data;
+  };
+
+  struct Queue {
+    Msg ram[GW_DLQ_RAM_MSGS];
+    size_t head;
+    size_t count;
+    size_t ramBytes;
+    size_t fileMsgs;               // unread records in the segment file
+    size_t fileBytes;              // unread payload bytes in the segment file
+    size_t fileReadOfs;            // offset of the next unread record
+    Queue() : head(0), count(0), ramBytes(0), fileMsgs(0), fileBytes(0),
+              fileReadOfs(0) {}
+  };
+
+  // On-flash record header, followed by len payload bytes
+  struct FileRecord {
+    uint32_t expires;
+    uint32_t len;
+  };
+
+  static String segmentPath(const String& id);
+  void discard(const String& id);
+  bool fileHead(const String& id, const Queue& q, FileRecord& rec) const;
+  bool spill(const String& id, Queue& q, const uint8_t* data, size_t len,
+             unsigned long expires);
+  void freeQueue(const String& id, Queue& q);
+
+  std::map<String, Queue> m_queues;
+  Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "gateway_trace.h"
+
+#if GW_TRACE
+
+static_assert((GW_TRACE_EVENTS & (GW_TRACE_EVENTS - 1)) == 0,
+              "GW_TRACE_EVENTS must be a power of two");
+
+static const char* const s_names[TRACE_COUNT] = {
+  "poll", "json", "decrypt", "auth", "rpc", "encrypt", "flash", "broadcast"
+};
+
+static TraceEvent s_ring[GW_TRACE_EVENTS];
+static std::atomic<uint32_t> s_head(0);
+static thread_local uint8_t s_tid = 0;
+
+// Shards write from their own threads; a slot is claimed with one atomic
+// add, so writers never wait on each other or on a download.
+void gw_trace_record(TracePoint point, unsigned long startUs, unsigned long durUs) {
+  uint32_t i = s_head.fetch_add(1, std::memory_order_relaxed);
+  TraceEvent &e = s_ring[i & (GW_TRACE_EVENTS - 1)];
+  e.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.startUs = (uint32_t)startUs;
+  e.durUs = (uint32_t)durUs;
+  e.point = (uint8_t)point;
+  e.tid = s_tid;
+  e.seq.store(i + 1, std::memory_order_release);
+}
+
+void gw_trace_set_thread(unsigned tid) {
+  s_tid = (uint8_t)tid;
+}
+
+uint32_t gw_trace_head() {
+  return s_head.load(std::memory_order_acquire);
+}
+
+uint32_t gw_trace_oldest() {
+  uint32_t head = gw_trace_head();
+  return head > GW_TRACE_EVENTS ? head - GW_TRACE_EVENTS : 0;
+}
+
+void gw_trace_print(mg_pfn_t pfn, void *pfn_data, uint32_t from, uint32_t to) {
+  for (uint32_t i = from; i != to; i++) {
+    const TraceEvent &e = s_ring[i & (GW_TRACE_EVENTS - 1)];
+    if (e.seq.load(std::memory_order_acquire) != i + 1) continue;   // overwritten or in progress
+    uint32_t startUs = e.startUs, durUs = e.durUs;
+    uint8_t point = e.point, tid = e.tid;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (e.seq.load(std::memory_order_relaxed) != i + 1 || point >= TRACE_COUNT) continue;
+    mg_xprintf(pfn, pfn_data,
+               ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lu,\"dur\":%lu}",
+               s_names[point], (unsigned)tid, (unsigned long)startUs, (unsigned long)durUs);
+  }
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef __GATEWAY_TRACE__H_
+#define __GATEWAY_TRACE__H_
+
+#include "../gateway_config.h"
+
+// Scoped trace points on the message pipeline.  With GW_TRACE set, each
+// GW_TRACE_SCOPE() writes its start and duration into a ring of
+// GW_TRACE_EVENTS fixed-size records, which the dashboard serves at
+// /trace.json in Chrome trace format (chrome://tracing, ui.perfetto.dev).
+// With GW_TRACE 0 the macros expand to nothing and none of this is built.
+enum TracePoint {
+  TRACE_POLL,                               // mg_mgr_poll() after the wakeup: I/O and handlers
+  TRACE_JSON,                               // mg_json_get_str() on a device frame
+  TRACE_DECRYPT,
+  TRACE_AUTH,                               // gw_verify_auth()
+  TRACE_RPC,                                // method dispatch and handler
+  TRACE_ENCRYPT,
+  TRACE_FLASH,                              // saveDevice()
+  TRACE_BROADCAST,                          // dashboard WebSocket fan-out
+  TRACE_COUNT
+};
+
+#if GW_TRACE
+
+#include <Arduino.h>
+#include <atomic>
+#include "mongoose.h"
+
+// One complete event.  seq is index + 1 once the record is written and 0
+// while a writer is filling it, so a reader can skip torn records.
+struct TraceEvent {
+  std::atomic<uint32_t> seq;
+  uint32_t startUs;
+  uint32_t durUs;
+  uint8_t point;
+  uint8_t tid;
+};
+
+void gw_trace_record(TracePoint point, unsigned long startUs, unsigned long durUs);
+void gw_trace_set_thread(unsigned tid);      // track of the calling thread's events
+uint32_t gw_trace_head();                     // events recorded since boot
+uint32_t gw_trace_oldest();                   // first index still in the ring
+
+// Prints ",{...}" for each of the events [from, to) still intact in the ring
+void gw_trace_print(mg_pfn_t pfn, void *pfn_data, uint32_t from, uint32_t to);
+
+class TraceScope {
+public:
+  explicit TraceScope(TracePoint point) : m_point(point), m_start(micros()) {}
+  ~TraceScope() { gw_trace_record(m_point, m_start, micros() - m_start); }
+
+private:
+  TracePoint m_point;
+  unsigned long m_start;
+};
+
+#define GW_TRACE_CAT_(a, b) a##b
+#define GW_TRACE_CAT(a, b) GW_TRACE_CAT_(a, b)
+#define GW_TRACE_SCOPE(point) TraceScope GW_TRACE_CAT(gwTrace_, __LINE__)(point)
+#define GW_TRACE_SPAN(point, startUs, durUs) gw_trace_record(point, startUs, durUs)
+#define GW_TRACE_THREAD(tid) gw_trace_set_thread(tid)
+
+#else
+
+#define GW_TRACE_SCOPE(point) do {} while (0)
+#define GW_TRACE_SPAN(point, startUs, durUs) do {} while (0)
+#define GW_TRACE_THREAD(tid) do {} while (0)
+
+#endif
+
+#endif
@@ -5,13 +5,22 @@
 #include <stdio.h>
 
 // ---------------------------------------------------------------------------
+static int hex_nibble(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// Byte i is written after hex[2i] and hex[2i+1] are read, so the output
+// can overwrite its own input.
 int gw_hex_to_bytes(const char *hex, uint8_t *dst, size_t hex_len) {
   if (hex_len % 2 != 0) return -1;
   size_t byte_len = hex_len / 2;
   for (size_t i = 0; i < byte_len; i++) {
-    unsigned int b;
-    if (sscanf(hex + i * 2, "%2x", &b) != 1) return -1;
-    dst[i] = (uint8_t)b;
+    int hi = hex_nibble(hex[i * 2]), lo = hex_nibble(hex[i * 2 + 1]);
+    if (hi < 0 || lo < 0) return -1;
+    dst[i] = (uint8_t)(hi << 4 | lo);
   }
   return (int)byte_len;
 }
@@ -5,6 +5,7 @@
 #include <stddef.h>
 
 // Convert hex string to bytes.  Returns byte count on success, -1 on error.
+// hex need not be NUL-terminated, and dst may be hex itself (decode in place).
 int  gw_hex_to_bytes(const char *hex, uint8_t *dst, size_t hex_len);
 
 // Derive a 32-byte encryption key from a PSK string via SHA-256.
@@ -1,7 +1,26 @@
 #pragma once
 
+#if defined(ARDUINO)
 // ESP32 architecture (uses lwIP sockets via Arduino WiFi)
 #define MG_ARCH MG_ARCH_ESP32
+#else
+// Host build (see host/): plain POSIX sockets.  mongoose.h picks
+// MG_ARCH_UNIX by itself on a PC and then skips this file, so host builds
+// pass -DMG_ARCH=MG_ARCH_CUSTOM to get here.
+#undef MG_ARCH
+#define MG_ARCH MG_ARCH_UNIX
+
+// A host gateway may serve thousands of dashboard WebSocket clients, most
+// of them idle.  epoll costs per ready socket where poll() costs per open
+// socket on every pass.  Build with -DMG_ENABLE_EPOLL=0 to compare.
+#if defined(__linux__) && !defined(MG_ENABLE_EPOLL)
+#define MG_ENABLE_EPOLL 1
+#endif
+
+// One message never needs more than this; the default lets a single peer
+// grow a receive buffer to 3 MB
+#define MG_MAX_RECV_SIZE (64 * 1024)
+#endif
 
 // Enable MQTT client
 #define MG_ENABLE_MQTT 1
@@ -16,7 +35,9 @@
 //   - Mongoose's always-compiled mg_sha256/mg_hmac_sha256/mg_random
 #define MG_TLS MG_TLS_NONE
 
-// IO buffer size for connections
+// IO buffer size for connections.  Every connection keeps at least this
+// much for receiving once it has read anything, so it is also the cost of
+// an idle client; device frames and dashboard commands fit easily.
 #define MG_IO_SIZE 2048
 
 // Disable filesystem features we don't need
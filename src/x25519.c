@@ -9,6 +9,440 @@
 
 const uint8_t X25519_BASE_POINT[X25519_BYTES] = {9};
 
+#if X25519_RADIX51
+
+// ─────────────────────────────────────────────
+//  Radix 2^51: five 64-bit limbs, 128-bit products
+// ─────────────────────────────────────────────
+
+typedef uint64_t fe[5];
+typedef unsigned __int128 u128;
+
+#define MASK51 (((uint64_t) 1 << 51) - 1)
+
+static uint64_t load64_le(const uint8_t *p) {
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--) v = v << 8 | p[i];
+  return v;
+}
+
+// Bit 255 is kept, as the 32-bit code does: the value is taken mod p
+static void fe_frombytes(fe h, const uint8_t s[32]) {
+  h[0] = load64_le(s) & MASK51;
+  h[1] = (load64_le(s + 6) >> 3) & MASK51;
+  h[2] = (load64_le(s + 12) >> 6) & MASK51;
+  h[3] = (load64_le(s + 19) >> 1) & MASK51;
+  h[4] = load64_le(s + 24) >> 12;
+}
+
+static void fe_carry(fe h) {
+  uint64_t c;
+  c = h[0] >> 51; h[0] &= MASK51; h[1] += c;
+  c = h[1] >> 51; h[1] &= MASK51; h[2] += c;
+  c = h[2] >> 51; h[2] &= MASK51; h[3] += c;
+  c = h[3] >> 51; h[3] &= MASK51; h[4] += c;
+  c = h[4] >> 51; h[4] &= MASK51; h[0] += c * 19;
+}
+
+// Fully reduced mod p, little-endian
+static void fe_tobytes(uint8_t s[32], const fe f) {
+  fe h;
+  uint64_t q;
+  int i;
+  memcpy(h, f, sizeof(fe));
+  fe_carry(h);
+  fe_carry(h);
+  q = (h[0] + 19) >> 51;                  // 1 when h >= p
+  q = (h[1] + q) >> 51;
+  q = (h[2] + q) >> 51;
+  q = (h[3] + q) >> 51;
+  q = (h[4] + q) >> 51;
+  h[0] += 19 * q;                        // h - p = h + 19 - 2^255: drop that bit
+  h[1] += h[0] >> 51; h[0] &= MASK51;
+  h[2] += h[1] >> 51; h[1] &= MASK51;
+  h[3] += h[2] >> 51; h[2] &= MASK51;
+  h[4] += h[3] >> 51; h[3] &= MASK51;
+  h[4] &= MASK51;
+  for (i = 0; i < 32; i++) {
+    unsigned bit = (unsigned) i * 8;
+    unsigned limb = bit / 51, off = bit % 51;
+    uint64_t v = h[limb] >> off;
+    if (off > 43 && limb < 4) v |= h[limb + 1] << (51 - off);
+    s[i] = (uint8_t) v;
+  }
+}
+
+static void fe_0(fe h) { memset(h, 0, sizeof(fe)); }
+static void fe_1(fe h) { fe_0(h); h[0] = 1; }
+static void fe_copy(fe h, const fe f) { memcpy(h, f, sizeof(fe)); }
+
+static void fe_add(fe h, const fe f, const fe g) {
+  int i;
+  for (i = 0; i < 5; i++) h[i] = f[i] + g[i];
+}
+
+// 4p is added so no limb goes negative; g limbs must stay below 2^53
+static void fe_sub(fe h, const fe f, const fe g) {
+  h[0] = f[0] + 0x1FFFFFFFFFFFB4ULL - g[0];
+  h[1] = f[1] + 0x1FFFFFFFFFFFFCULL - g[1];
+  h[2] = f[2] + 0x1FFFFFFFFFFFFCULL - g[2];
+  h[3] = f[3] + 0x1FFFFFFFFFFFFCULL - g[3];
+  h[4] = f[4] + 0x1FFFFFFFFFFFFCULL - g[4];
+  fe_carry(h);
+}
+
+static void fe_mul(fe h, const fe f, const fe g) {
+  u128 t0, t1, t2, t3, t4;
+  uint64_t g1_19 = g[1] * 19, g2_19 = g[2] * 19, g3_19 = g[3] * 19, g4_19 = g[4] * 19;
+  uint64_t c;
+  t0 = (u128) f[0] * g[0] + (u128) f[1] * g4_19 + (u128) f[2] * g3_19 +
+       (u128) f[3] * g2_19 + (u128) f[4] * g1_19;
+  t1 = (u128) f[0] * g[1] + (u128) f[1] * g[0] + (u128) f[2] * g4_19 +
+       (u128) f[3] * g3_19 + (u128) f[4] * g2_19;
+  t2 = (u128) f[0] * g[2] + (u128) f[1] * g[1] + (u128) f[2] * g[0] +
+       (u128) f[3] * g4_19 + (u128) f[4] * g3_19;
+  t3 = (u128) f[0] * g[3] + (u128) f[1] * g[2] + (u128) f[2] * g[1] +
+       (u128) f[3] * g[0] + (u128) f[4] * g4_19;
+  t4 = (u128) f[0] * g[4] + (u128) f[1] * g[3] + (u128) f[2] * g[2] +
+       (u128) f[3] * g[1] + (u128) f[4] * g[0];
+  t1 += (uint64_t) (t0 >> 51); h[0] = (uint64_t) t0 & MASK51;
+  t2 += (uint64_t) (t1 >> 51); h[1] = (uint64_t) t1 & MASK51;
+  t3 += (uint64_t) (t2 >> 51); h[2] = (uint64_t) t2 & MASK51;
+  t4 += (uint64_t) (t3 >> 51); h[3] = (uint64_t) t3 & MASK51;
+  c = (uint64_t) (t4 >> 51); h[4] = (uint64_t) t4 & MASK51;
+  h[0] += c * 19;
+  c = h[0] >> 51; h[0] &= MASK51; h[1] += c;
+}
+
+static void fe_sq(fe h, const fe f) {
+  u128 t0, t1, t2, t3, t4;
+  uint64_t f0_2 = f[0] * 2, f1_2 = f[1] * 2;
+  uint64_t f1_38 = f[1] * 38, f2_38 = f[2] * 38, f3_38 = f[3] * 38;
+  uint64_t f3_19 = f[3] * 19, f4_19 = f[4] * 19;
+  uint64_t c;
+  t0 = (u128) f[0] * f[0] + (u128) f1_38 * f[4] + (u128) f2_38 * f[3];
+  t1 = (u128) f0_2 * f[1] + (u128) f2_38 * f[4] + (u128) f3_19 * f[3];
+  t2 = (u128) f0_2 * f[2] + (u128) f[1] * f[1] + (u128) f3_38 * f[4];
+  t3 = (u128) f0_2 * f[3] + (u128) f1_2 * f[2] + (u128) f4_19 * f[4];
+  t4 = (u128) f0_2 * f[4] + (u128) f1_2 * f[3] + (u128) f[2] * f[2];
+  t1 += (uint64_t) (t0 >> 51); h[0] = (uint64_t) t0 & MASK51;
+  t2 += (uint64_t) (t1 >> 51); h[1] = (uint64_t) t1 & MASK51;
+  t3 += (uint64_t) (t2 >> 51); h[2] = (uint64_t) t2 & MASK51;
+  t4 += (uint64_t) (t3 >> 51); h[3] = (uint64_t) t3 & MASK51;
+  c = (uint64_t) (t4 >> 51); h[4] = (uint64_t) t4 & MASK51;
+  h[0] += c * 19;
+  c = h[0] >> 51; h[0] &= MASK51; h[1] += c;
+}
+
+static void fe_sqn(fe h, const fe f, int n) {
+  fe_sq(h, f);
+  while (--n > 0) fe_sq(h, h);
+}
+
+static void fe_mul_small(fe h, const fe f, uint32_t n) {
+  u128 t;
+  uint64_t c = 0;
+  int i;
+  for (i = 0; i < 5; i++) {
+    t = (u128) f[i] * n + c;
+    h[i] = (uint64_t) t & MASK51;
+    c = (uint64_t) (t >> 51);
+  }
+  h[0] += c * 19;
+}
+
+// z^(p-2), the same addition chain as the 32-bit code
+static void fe_invert(fe out, const fe z) {
+  fe z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+  fe_sq(z2, z);
+  fe_sqn(t, z2, 2);
+  fe_mul(z9, t, z);
+  fe_mul(z11, z9, z2);
+  fe_sq(t, z11);
+  fe_mul(z2_5_0, t, z9);
+  fe_sqn(t, z2_5_0, 5);
+  fe_mul(z2_10_0, t, z2_5_0);
+  fe_sqn(t, z2_10_0, 10);
+  fe_mul(z2_20_0, t, z2_10_0);
+  fe_sqn(t, z2_20_0, 20);
+  fe_mul(t, t, z2_20_0);
+  fe_sqn(t, t, 10);
+  fe_mul(z2_50_0, t, z2_10_0);
+  fe_sqn(t, z2_50_0, 50);
+  fe_mul(z2_100_0, t, z2_50_0);
+  fe_sqn(t, z2_100_0, 100);
+  fe_mul(t, t, z2_100_0);
+  fe_sqn(t, t, 50);
+  fe_mul(t, t, z2_50_0);
+  fe_sqn(t, t, 5);
+  fe_mul(out, t, z11);
+}
+
+static void fe_cswap(fe f, fe g, uint64_t swap) {
+  uint64_t mask = 0 - swap;
+  int i;
+  for (i = 0; i < 5; i++) {
+    uint64_t x = (f[i] ^ g[i]) & mask;
+    f[i] ^= x;
+    g[i] ^= x;
+  }
+}
+
+static void fe_cmov(fe f, const fe g, uint64_t move) {
+  uint64_t mask = 0 - move;
+  int i;
+  for (i = 0; i < 5; i++) f[i] ^= (f[i] ^ g[i]) & mask;
+}
+
+// Montgomery ladder of RFC 7748, over all 256 scalar bits like the 32-bit code
+static void x25519_ladder(fe x2, fe z2, const uint8_t scalar[X25519_BYTES],
+                          const fe x1, int clamp) {
+  fe x3, z3, a, aa, b, bb, e, c, d, da, cb;
+  uint64_t swap = 0;
+  int i;
+  fe_1(x2);
+  fe_0(z2);
+  fe_copy(x3, x1);
+  fe_1(z3);
+  for (i = 255; i >= 0; i--) {
+    uint8_t bytei = scalar[i / 8];
+    uint64_t bit;
+    if (clamp) {
+      if (i / 8 == 0) {
+        bytei &= (uint8_t) ~7U;
+      } else if (i / 8 == X25519_BYTES - 1) {
+        bytei &= 0x7F;
+        bytei |= 0x40;
+      }
+    }
+    bit = (bytei >> (i % 8)) & 1;
+    fe_cswap(x2, x3, swap ^ bit);
+    fe_cswap(z2, z3, swap ^ bit);
+    swap = bit;
+    fe_add(a, x2, z2);
+    fe_sub(b, x2, z2);
+    fe_sq(aa, a);
+    fe_sq(bb, b);
+    fe_sub(e, aa, bb);
+    fe_add(c, x3, z3);
+    fe_sub(d, x3, z3);
+    fe_mul(da, d, a);
+    fe_mul(cb, c, b);
+    fe_add(x3, da, cb);
+    fe_sq(x3, x3);
+    fe_sub(z3, da, cb);
+    fe_sq(z3, z3);
+    fe_mul(z3, z3, x1);
+    fe_mul(x2, aa, bb);
+    fe_mul_small(z2, e, 121665);
+    fe_add(z2, z2, aa);
+    fe_mul(z2, z2, e);
+  }
+  fe_cswap(x2, x3, swap);
+  fe_cswap(z2, z3, swap);
+}
+
+// ─────────────────────────────────────────────
+//  Fixed base: [k]B on edwards25519, then u = (Z + Y) / (Z - Y)
+// ─────────────────────────────────────────────
+
+typedef struct { fe X, Y, Z, T; } ge_p3;        // extended
+typedef struct { fe X, Y, Z, T; } ge_p1p1;      // completed
+typedef struct { fe yplusx, yminusx, xy2d; } ge_precomp;
+
+static const fe ED_2D = {0x69b9426b2f159, 0x35050762add7a, 0x3cf44c0038052,
+                         0x6738cc7407977, 0x2406d9dc56dff};
+static const fe ED_BX = {0x62d608f25d51a, 0x412a4b4f6592a, 0x75b7171a4b31d,
+                         0x1ff60527118fe, 0x216936d3cd6e5};
+static const fe ED_BY = {0x6666666666658, 0x4cccccccccccc, 0x1999999999999,
+                         0x3333333333333, 0x6666666666666};
+
+// base_table[i][j] = (j + 1) * 256^i * B; public data, built once
+static ge_precomp base_table[32][8];
+static int base_table_state;                   // 0 = none, 1 = being built, 2 = ready
+
+static void ge_p1p1_to_p3(ge_p3 *r, const ge_p1p1 *p) {
+  fe_mul(r->X, p->X, p->T);
+  fe_mul(r->Y, p->Y, p->Z);
+  fe_mul(r->Z, p->Z, p->T);
+  fe_mul(r->T, p->X, p->Y);
+}
+
+static void ge_madd(ge_p1p1 *r, const ge_p3 *p, const ge_precomp *q) {
+  fe t0;
+  fe_add(r->X, p->Y, p->X);
+  fe_sub(r->Y, p->Y, p->X);
+  fe_mul(r->Z, r->X, q->yplusx);
+  fe_mul(r->Y, r->Y, q->yminusx);
+  fe_mul(r->T, q->xy2d, p->T);
+  fe_add(t0, p->Z, p->Z);
+  fe_sub(r->X, r->Z, r->Y);
+  fe_add(r->Y, r->Z, r->Y);
+  fe_add(r->Z, t0, r->T);
+  fe_sub(r->T, t0, r->T);
+}
+
+// T of p is not read, so p may be projective only
+static void ge_dbl(ge_p1p1 *r, const ge_p3 *p) {
+  fe t0;
+  fe_sq(r->X, p->X);
+  fe_sq(r->Z, p->Y);
+  fe_sq(r->T, p->Z);
+  fe_add(r->T, r->T, r->T);
+  fe_add(r->Y, p->X, p->Y);
+  fe_sq(t0, r->Y);
+  fe_add(r->Y, r->Z, r->X);
+  fe_sub(r->Z, r->Z, r->X);
+  fe_sub(r->X, t0, r->Y);
+  fe_sub(r->T, r->T, r->Z);
+}
+
+static void ge_to_precomp(ge_precomp *r, const ge_p3 *p) {
+  fe zi, x, y;
+  fe_invert(zi, p->Z);
+  fe_mul(x, p->X, zi);
+  fe_mul(y, p->Y, zi);
+  fe_add(r->yplusx, y, x);
+  fe_carry(r->yplusx);
+  fe_sub(r->yminusx, y, x);
+  fe_mul(r->xy2d, x, y);
+  fe_mul(r->xy2d, r->xy2d, ED_2D);
+}
+
+static void build_base_table(void) {
+  ge_p3 p, q;
+  ge_p1p1 t;
+  int i, j, k;
+  fe_copy(p.X, ED_BX);
+  fe_copy(p.Y, ED_BY);
+  fe_1(p.Z);
+  fe_mul(p.T, ED_BX, ED_BY);
+  for (i = 0; i < 32; i++) {
+    ge_to_precomp(&base_table[i][0], &p);
+    q = p;
+    for (j = 1; j < 8; j++) {
+      ge_madd(&t, &q, &base_table[i][0]);
+      ge_p1p1_to_p3(&q, &t);
+      ge_to_precomp(&base_table[i][j], &q);
+    }
+    for (k = 0; k < 8; k++) {
+      ge_dbl(&t, &p);
+      ge_p1p1_to_p3(&p, &t);
+    }
+  }
+}
+
+// The first caller builds the table; callers meanwhile use the ladder
+static int base_table_ready(void) {
+  int expected = 0;
+  if (__atomic_load_n(&base_table_state, __ATOMIC_ACQUIRE) == 2) return 1;
+  if (!__atomic_compare_exchange_n(&base_table_state, &expected, 1, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  build_base_table();
+  __atomic_store_n(&base_table_state, 2, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static uint64_t ct_equal(uint8_t b, uint8_t c) {
+  return ((uint64_t) (b ^ c) - 1) >> 63;
+}
+
+// t = b * base_table[pos][.], b in [-8, 8], without secret-dependent access
+static void select_precomp(ge_precomp *t, int pos, signed char b) {
+  uint64_t neg = (uint64_t) (uint8_t) b >> 7;
+  uint8_t babs = (uint8_t) (b - (((-(int) neg) & b) * 2));
+  ge_precomp minus;
+  int j;
+  fe_1(t->yplusx);
+  fe_1(t->yminusx);
+  fe_0(t->xy2d);
+  for (j = 0; j < 8; j++) {
+    uint64_t hit = ct_equal(babs, (uint8_t) (j + 1));
+    fe_cmov(t->yplusx, base_table[pos][j].yplusx, hit);
+    fe_cmov(t->yminusx, base_table[pos][j].yminusx, hit);
+    fe_cmov(t->xy2d, base_table[pos][j].xy2d, hit);
+  }
+  fe_copy(minus.yplusx, t->yminusx);
+  fe_copy(minus.yminusx, t->yplusx);
+  fe_0(minus.xy2d);
+  fe_sub(minus.xy2d, minus.xy2d, t->xy2d);
+  fe_cmov(t->yplusx, minus.yplusx, neg);
+  fe_cmov(t->yminusx, minus.yminusx, neg);
+  fe_cmov(t->xy2d, minus.xy2d, neg);
+}
+
+// Signed radix-16 digits: odd positions first, times 16, then even ones
+static void x25519_base(fe u, fe w, const uint8_t a[32]) {
+  signed char e[64];
+  signed char carry = 0;
+  ge_p3 h;
+  ge_p1p1 r;
+  ge_precomp t;
+  int i;
+  for (i = 0; i < 32; i++) {
+    e[2 * i] = (signed char) (a[i] & 15);
+    e[2 * i + 1] = (signed char) ((a[i] >> 4) & 15);
+  }
+  for (i = 0; i < 63; i++) {
+    e[i] = (signed char) (e[i] + carry);
+    carry = (signed char) ((e[i] + 8) >> 4);
+    e[i] = (signed char) (e[i] - carry * 16);
+  }
+  e[63] = (signed char) (e[63] + carry);
+
+  fe_0(h.X);
+  fe_1(h.Y);
+  fe_1(h.Z);
+  fe_0(h.T);
+  for (i = 1; i < 64; i += 2) {
+    select_precomp(&t, i / 2, e[i]);
+    ge_madd(&r, &h, &t);
+    ge_p1p1_to_p3(&h, &r);
+  }
+  for (i = 0; i < 4; i++) {
+    ge_dbl(&r, &h);
+    ge_p1p1_to_p3(&h, &r);
+  }
+  for (i = 0; i < 64; i += 2) {
+    select_precomp(&t, i / 2, e[i]);
+    ge_madd(&r, &h, &t);
+    ge_p1p1_to_p3(&h, &r);
+  }
+  fe_add(u, h.Z, h.Y);
+  fe_sub(w, h.Z, h.Y);
+}
+
+int x25519(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES],
+           const uint8_t x1[X25519_BYTES], int clamp) {
+  fe x, z, zi;
+  uint32_t nonzero = 0;
+  int i;
+  if (clamp && memcmp(x1, X25519_BASE_POINT, X25519_BYTES) == 0 &&
+      base_table_ready()) {
+    uint8_t a[X25519_BYTES];
+    memcpy(a, scalar, sizeof(a));
+    a[0] &= 248;
+    a[31] &= 127;
+    a[31] |= 64;
+    x25519_base(x, z, a);
+    memset(a, 0, sizeof(a));
+  } else {
+    fe u;
+    fe_frombytes(u, x1);
+    x25519_ladder(x, z, scalar, u, clamp);
+  }
+  fe_invert(zi, z);
+  fe_mul(x, x, zi);
+  fe_tobytes(out, x);
+  for (i = 0; i < X25519_BYTES; i++) nonzero |= out[i];
+  return clamp ? -(int) ((nonzero - 1) >> 31) : 0;
+}
+
+#else
+
 #define X25519_WBITS 32
 
 typedef uint32_t limb_t;
@@ -228,3 +662,5 @@ int x25519(uint8_t out[X25519_BYTES], const uint8_t scalar[X25519_BYTES],
   }
   return ret;
 }
+
+#endif  // X25519_RADIX51
@@ -10,12 +10,27 @@
 #define X25519_BYTES 32
 #endif
 
+// Field arithmetic: radix 2^51 in 64-bit limbs where the compiler has
+// 128-bit products, else the compact 32-bit code.  -DX25519_RADIX51=0/1
+// forces either.  The 64-bit build also computes the base point faster, from
+// a table of multiples built on first use (30 KB).
+#ifndef X25519_RADIX51
+#if defined(__SIZEOF_INT128__)
+#define X25519_RADIX51 1
+#else
+#define X25519_RADIX51 0
+#endif
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern const uint8_t X25519_BASE_POINT[X25519_BYTES];
 
+// out = scalar * x1, constant-time in scalar.  With clamp, a zero result
+// (x1 of small order) returns -1.  x1 equal to X25519_BASE_POINT takes the
+// fixed-base path when clamping in the 64-bit build.
 int x25519(uint8_t out[X25519_BYTES],
            const uint8_t scalar[X25519_BYTES],
            const uint8_t x1[X25519_BYTES], int clamp);